@@ -3,6 +3,7 @@
 #include "esp_err.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 
 #define BUZZER_TIMER     LEDC_TIMER_0
 #define BUZZER_MODE      LEDC_LOW_SPEED_MODE
@@ -11,13 +12,21 @@
 #define BUZZER_DUTY      128                       // 50 %
 #define BUZZER_CLK       LEDC_AUTO_CLK
 #define BUZZER_DEF_FREQ  4000                      // Default frequency 4 kHz
+#define BUZZER_QUEUE_LEN 4
+#define BUZZER_PENDING   4                         // Melodies waiting behind the current one
+#define NOTE_GAP_MS      10                        // Small pause between notes
 
 typedef struct {
-    uint16_t freq;
-    uint16_t ms;
-} note_t;
+    const buzzer_note_t *notes; // NULL plays tone
+    uint8_t              len;
+    uint8_t              priority;
+    buzzer_note_t        tone;
+} melody_t;
 
 static bool g_ready = false;
+static QueueHandle_t g_queue = NULL;
+
+static void buzzer_task(void *arg);
 
 void buzzer_init(gpio_num_t pin) {
     ledc_timer_config_t tcfg = {
@@ -39,6 +48,10 @@ void buzzer_init(gpio_num_t pin) {
     };
     ledc_channel_config(&ccfg);
 
+    g_queue = xQueueCreate(BUZZER_QUEUE_LEN, sizeof(melody_t));
+    if (g_queue == NULL || xTaskCreate(buzzer_task, "Buzzer", 2048, NULL, 6, NULL) != pdPASS) {
+        return;
+    }
     g_ready = true;
 }
 
@@ -60,52 +73,142 @@ static inline void buzzer_off(void) {
     }
 }
 
-void buzzer_tone(uint32_t freq_hz, uint16_t duration_ms) {
-    if (!g_ready) return;
-    set_freq(freq_hz);
-    buzzer_on();
-    vTaskDelay(pdMS_TO_TICKS(duration_ms));
-    buzzer_off();
+static void note_start(const buzzer_note_t *note) {
+    if (note->freq) {
+        set_freq(note->freq);
+        buzzer_on();
+    } else {
+        buzzer_off();
+    }
+}
+
+// Remove the oldest of the highest priority pending melodies into *out
+static bool pending_pop(melody_t *pending, size_t *count, melody_t *out) {
+    if (*count == 0) {
+        return false;
+    }
+    size_t best = 0;
+    for (size_t i = 1; i < *count; i++) {
+        if (pending[i].priority > pending[best].priority) {
+            best = i;
+        }
+    }
+    *out = pending[best];
+    for (size_t i = best; i + 1 < *count; i++) {
+        pending[i] = pending[i + 1];
+    }
+    (*count)--;
+    return true;
 }
 
-static void play_melody(const note_t *mel, size_t len) {
-    for (size_t i = 0; i < len; ++i) {
-        if (mel[i].freq) {
-            buzzer_tone(mel[i].freq, mel[i].ms);
-        } else {
-            vTaskDelay(pdMS_TO_TICKS(mel[i].ms));  // pause
+// Plays one melody at a time. While a note sounds the task waits on the queue, so a higher
+// priority melody cuts in right away and anything else is kept for later.
+static void buzzer_task(void *arg) {
+    melody_t   pending[BUZZER_PENDING];
+    size_t     pending_count = 0;
+    melody_t   current;
+    bool       playing = false;
+    bool       in_gap  = false;
+    size_t     index   = 0;
+    TickType_t deadline = 0;
+
+    while (1) {
+        if (!playing) {
+            if (!pending_pop(pending, &pending_count, &current)) {
+                xQueueReceive(g_queue, &current, portMAX_DELAY);
+            }
+            const buzzer_note_t *first = current.notes ? &current.notes[0] : &current.tone;
+            playing  = true;
+            in_gap   = false;
+            index    = 0;
+            note_start(first);
+            deadline = xTaskGetTickCount() + pdMS_TO_TICKS(first->ms);
+        }
+
+        TickType_t now       = xTaskGetTickCount();
+        TickType_t remaining = (int32_t) (deadline - now) > 0 ? deadline - now : 0;
+        melody_t   request;
+        if (xQueueReceive(g_queue, &request, remaining) == pdTRUE) {
+            if (request.priority > current.priority) {
+                // Drop the rest of the current melody; the request goes first among its priority
+                buzzer_off();
+                playing = false;
+                if (pending_count == BUZZER_PENDING) {
+                    pending_count--;
+                }
+                for (size_t i = pending_count; i > 0; i--) {
+                    pending[i] = pending[i - 1];
+                }
+                pending[0] = request;
+                pending_count++;
+            } else if (pending_count < BUZZER_PENDING) {
+                pending[pending_count++] = request;
+            }
+            continue;
+        }
+
+        // The current note or gap is over
+        if (!in_gap) {
+            buzzer_off();
+            in_gap   = true;
+            deadline = xTaskGetTickCount() + pdMS_TO_TICKS(NOTE_GAP_MS);
+            continue;
         }
-        vTaskDelay(pdMS_TO_TICKS(10)); // small pause between notes
+        in_gap = false;
+        if (current.notes == NULL || ++index >= current.len) {
+            playing = false;
+            continue;
+        }
+        note_start(&current.notes[index]);
+        deadline = xTaskGetTickCount() + pdMS_TO_TICKS(current.notes[index].ms);
     }
 }
 
+static void enqueue(const melody_t *melody) {
+    if (!g_ready) return;
+    // Never block the caller; a full queue drops the feedback
+    xQueueSend(g_queue, melody, 0);
+}
+
+void buzzer_play(const buzzer_note_t *notes, size_t len, buzzer_priority_t priority) {
+    if (len == 0) return;
+    melody_t melody = {.notes = notes, .len = len > UINT8_MAX ? UINT8_MAX : len, .priority = priority};
+    enqueue(&melody);
+}
+
+void buzzer_tone(uint32_t freq_hz, uint16_t duration_ms) {
+    melody_t melody = {.notes = NULL, .len = 1, .priority = BUZZER_PRIORITY_LOW,
+                       .tone = {.freq = freq_hz, .ms = duration_ms}};
+    enqueue(&melody);
+}
+
 
 
 /*--------------------------------------------------------------------*/
 void buzzer_short_beep(void) {
-    static const note_t short_beep[] = {
+    static const buzzer_note_t short_beep[] = {
         { 1000, 100 }, { 0, 50 }, { 1000, 100 },
     };
-    play_melody(short_beep, sizeof short_beep / sizeof short_beep[0]);
+    buzzer_play(short_beep, sizeof short_beep / sizeof short_beep[0], BUZZER_PRIORITY_PROMPT);
 }
 
 void buzzer_long_beep(void) {
-    static const note_t long_beep[] = {
+    static const buzzer_note_t long_beep[] = {
         { 1000, 500 },
     };
-    play_melody(long_beep, sizeof long_beep / sizeof long_beep[0]);
+    buzzer_play(long_beep, sizeof long_beep / sizeof long_beep[0], BUZZER_PRIORITY_PROMPT);
 }
 
 void buzzer_success_chime(void){
-    static const note_t ok[] = {
+    static const buzzer_note_t ok[] = {
         { 1500, 120 }, { 2000, 150 }, { 2500, 180 },
     };
-    play_melody(ok, sizeof ok / sizeof ok[0]);
+    buzzer_play(ok, sizeof ok / sizeof ok[0], BUZZER_PRIORITY_RESULT);
 }
 
 void buzzer_error_honk(void) {
-    static const note_t err[] = {
+    static const buzzer_note_t err[] = {
         {  800, 400 }, { 0, 80 }, { 800, 150 }, { 0, 60 }, { 800, 150 },
     };
-    play_melody(err, sizeof err / sizeof err[0]);
+    buzzer_play(err, sizeof err / sizeof err[0], BUZZER_PRIORITY_RESULT);
 }
@@ -2,10 +2,27 @@
 #define _BUZZER_H_
 
 #include <stdint.h>
+#include <stddef.h>
 #include "driver/gpio.h"
 
+// A note with freq 0 is a pause
+typedef struct {
+    uint16_t freq;
+    uint16_t ms;
+} buzzer_note_t;
+
+// A melody preempts one of lower priority; otherwise it waits for the current one to finish
+typedef enum {
+    BUZZER_PRIORITY_LOW = 0,
+    BUZZER_PRIORITY_PROMPT, // Beeps guiding the user, e.g. during enrollment
+    BUZZER_PRIORITY_RESULT, // Outcome of an attempt
+} buzzer_priority_t;
 
 void buzzer_init(gpio_num_t pin);
+
+// All playback is queued to the buzzer task and returns immediately.
+// notes must stay valid until played; keep them static.
+void buzzer_play(const buzzer_note_t *notes, size_t len, buzzer_priority_t priority);
 void buzzer_tone(uint32_t freq_hz, uint16_t duration_ms);
 void buzzer_short_beep();
 void buzzer_long_beep();
@@ -13,4 +30,4 @@ void buzzer_success_chime();
 void buzzer_error_honk();
 
 
-#endif
\ No newline at end of file
+#endif
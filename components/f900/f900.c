@@ -6,7 +6,9 @@
 #include "driver/uart.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 static const char* TAG = "F900";
 
@@ -19,8 +21,33 @@ static uint32_t current_baudrate = F900_DEFAULT_BAUDRATE;
 
 static f900_config_t f900_config;
 
+// Power reference counting; the mutex also serializes power transitions and guards the
+// duty cycle state below
+static SemaphoreHandle_t power_mutex = NULL;
+static uint32_t power_refs = 0;
+static bool power_ready = false;
+static bool powered = false;
+static bool standby = false;
+static int64_t standby_deadline_ms = 0;
+static TaskHandle_t power_task_handle = NULL;
+
+// Duty cycle accounting, in ms of esp_timer time
+static int64_t duty_credit_ms = F900_DUTY_BUDGET_MS;
+static int64_t duty_updated_ms = 0;
+static int64_t power_on_ms = 0;
+static bool budget_warned = false;
+static int64_t session_starts_ms[F900_STANDBY_SESSIONS] = {0};
+static uint32_t session_count = 0;
+static uint64_t wake_total_ms = 0;
+static f900_power_stats_t power_stats = {0};
+
+static void power_task(void* arg);
+
 void f900_init(f900_config_t config) {
     f900_config = config;
+    power_mutex = xSemaphoreCreateMutex();
+    duty_updated_ms = esp_timer_get_time() / 1000;
+    xTaskCreate(power_task, "F900 Power", 3072, NULL, 3, &power_task_handle);
     // Configure UART
     uart_config_t uart_config = {
         .baud_rate = F900_DEFAULT_BAUDRATE,
@@ -45,8 +72,8 @@ void f900_init(f900_config_t config) {
     };
     gpio_config(&io_conf);
 
-    // Enable module
-    // gpio_set_level(f900_config.en_pin, 1);
+    // The module stays off until f900_power_acquire()
+    gpio_set_level(f900_config.en_pin, 0);
 }
 
 static uint8_t calculate_parity(const uint8_t* data, uint16_t size) {
@@ -446,6 +473,191 @@ void f900_set_enable(bool enable) {
     gpio_set_level(f900_config.en_pin, enable ? 1 : 0);
 }
 
+bool f900_wait_ready(uint32_t timeout_ms) {
+    TickType_t start_ticks = xTaskGetTickCount();
+    const TickType_t timeout_ticks = pdMS_TO_TICKS(timeout_ms);
+    f900_message_t msg;
+
+    while ((xTaskGetTickCount() - start_ticks) < timeout_ticks) {
+        // The module is silent while booting; don't spin on receive timeouts
+        size_t buffered = 0;
+        uart_get_buffered_data_len(f900_config.uart_num, &buffered);
+        if (buffered == 0) {
+            vTaskDelay(pdMS_TO_TICKS(10));
+            continue;
+        }
+
+        if (f900_receive_message(&msg) && msg.msg_id == MID_NOTE && msg.size >= 1 && msg.data[0] == NID_READY) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static int64_t now_ms(void) {
+    return esp_timer_get_time() / 1000;
+}
+
+// Refill the credit for the time since the last update and drain it for the time powered.
+// Caller holds power_mutex.
+static void duty_update(int64_t now) {
+    int64_t elapsed = now - duty_updated_ms;
+    duty_updated_ms = now;
+    duty_credit_ms += elapsed * F900_DUTY_BUDGET_MS / F900_DUTY_WINDOW_MS;
+    if (powered) {
+        duty_credit_ms -= elapsed;
+    }
+    if (duty_credit_ms > F900_DUTY_BUDGET_MS) {
+        duty_credit_ms = F900_DUTY_BUDGET_MS;
+    } else if (duty_credit_ms < 0) {
+        duty_credit_ms = 0;
+    }
+}
+
+// Caller holds power_mutex.
+static void power_on(int64_t now, uint32_t ready_timeout_ms) {
+    // Drop anything left from before the power cycle so the READY note is the next message
+    uart_flush_input(f900_config.uart_num);
+    f900_set_enable(true);
+    powered = true;
+    power_on_ms = now;
+    budget_warned = false;
+    power_stats.cold_wakes++;
+
+    power_ready = f900_wait_ready(ready_timeout_ms);
+    if (!power_ready) {
+        power_stats.ready_timeouts++;
+        ESP_LOGW(TAG, "Module not ready %lu ms after power on", (unsigned long)ready_timeout_ms);
+        return;
+    }
+    uint32_t wake_ms = (uint32_t)(now_ms() - now);
+    wake_total_ms += wake_ms;
+    power_stats.wake_last_ms = wake_ms;
+    if (wake_ms > power_stats.wake_max_ms) {
+        power_stats.wake_max_ms = wake_ms;
+    }
+}
+
+// Caller holds power_mutex.
+static void power_off(void) {
+    duty_update(now_ms());
+    // The module writes its log on MID_POWERDOWN; wait for the reply and 100 ms before cutting power
+    if (power_ready && f900_power_down()) {
+        f900_message_t msg;
+        f900_receive_message(&msg);
+        vTaskDelay(pdMS_TO_TICKS(100));
+    }
+    power_stats.on_time_ms += (uint64_t)(now_ms() - power_on_ms);
+    f900_set_enable(false);
+    powered = false;
+    power_ready = false;
+    standby = false;
+}
+
+// Keep the module warm only if sessions come often and the budget can afford it.
+// Caller holds power_mutex.
+static bool traffic_busy(int64_t now) {
+    if (session_count < F900_STANDBY_SESSIONS) {
+        return false;
+    }
+    int64_t oldest = session_starts_ms[session_count % F900_STANDBY_SESSIONS];
+    return now - oldest <= F900_STANDBY_TRAFFIC_MS &&
+           duty_credit_ms >= F900_STANDBY_MS + F900_DUTY_RESERVE_MS;
+}
+
+bool f900_power_acquire(uint32_t ready_timeout_ms) {
+    xSemaphoreTake(power_mutex, portMAX_DELAY);
+    if (power_refs++ == 0) {
+        int64_t now = now_ms();
+        duty_update(now);
+        power_stats.sessions++;
+        session_starts_ms[session_count++ % F900_STANDBY_SESSIONS] = now;
+
+        if (standby) {
+            standby = false;
+            power_stats.warm_hits++;
+        } else if (duty_credit_ms < F900_DUTY_RESERVE_MS) {
+            power_stats.budget_denials++;
+            ESP_LOGW(TAG, "Duty budget used up, %lld ms left; module stays off", (long long)duty_credit_ms);
+        } else {
+            power_on(now, ready_timeout_ms);
+        }
+    }
+    bool ready = power_ready;
+    xSemaphoreGive(power_mutex);
+    return ready;
+}
+
+void f900_power_release(void) {
+    xSemaphoreTake(power_mutex, portMAX_DELAY);
+    if (power_refs > 0 && --power_refs == 0 && powered) {
+        int64_t now = now_ms();
+        duty_update(now);
+        if (power_ready && traffic_busy(now)) {
+            standby = true;
+            standby_deadline_ms = now + F900_STANDBY_MS;
+            xTaskNotifyGive(power_task_handle);
+        } else {
+            power_off();
+        }
+    }
+    xSemaphoreGive(power_mutex);
+}
+
+// Ends warm standby and enforces the budget on a module left powered
+static void power_task(void* arg) {
+    while (1) {
+        TickType_t wait = portMAX_DELAY;
+
+        xSemaphoreTake(power_mutex, portMAX_DELAY);
+        if (powered) {
+            int64_t now = now_ms();
+            duty_update(now);
+            if (standby && (now >= standby_deadline_ms || duty_credit_ms < F900_DUTY_RESERVE_MS)) {
+                ESP_LOGI(TAG, "Standby over; powering down");
+                power_off();
+            } else if (standby) {
+                wait = pdMS_TO_TICKS((uint32_t)(standby_deadline_ms - now));
+            } else {
+                if (duty_credit_ms == 0 && !budget_warned) {
+                    // Never cut power under a caller; the next cold wake will be refused instead
+                    ESP_LOGW(TAG, "Duty budget exceeded by a session still in progress");
+                    budget_warned = true;
+                }
+                wait = pdMS_TO_TICKS(1000);
+            }
+        }
+        xSemaphoreGive(power_mutex);
+
+        ulTaskNotifyTake(pdTRUE, wait);
+    }
+}
+
+bool f900_is_ready(void) {
+    return power_ready;
+}
+
+bool f900_is_powered(void) {
+    return powered;
+}
+
+void f900_get_power_stats(f900_power_stats_t* stats) {
+    xSemaphoreTake(power_mutex, portMAX_DELAY);
+    int64_t now = now_ms();
+    duty_update(now);
+    *stats = power_stats;
+    stats->powered = powered;
+    stats->standby = standby;
+    stats->duty_credit_ms = (uint32_t)duty_credit_ms;
+    if (powered) {
+        stats->on_time_ms += (uint64_t)(now - power_on_ms);
+    }
+    uint32_t good_wakes = power_stats.cold_wakes - power_stats.ready_timeouts;
+    stats->wake_avg_ms = good_wakes > 0 ? (uint32_t)(wake_total_ms / good_wakes) : 0;
+    xSemaphoreGive(power_mutex);
+}
+
 bool f900_capture_images(uint8_t image_count, uint8_t start_number) {
     uint8_t data[2] = {image_count, start_number};
     return f900_send_message(MID_SNAPIMAGE, data, sizeof(data));
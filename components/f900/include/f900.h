@@ -10,6 +10,21 @@
 #define F900_MAX_DATA_SIZE 4000
 #define F900_USER_NAME_SIZE 32
 #define F900_DEFAULT_BAUDRATE 115200
+// Power on to NID_READY; the datasheet quotes under 1.4 s from cold start to recognition
+#define F900_READY_TIMEOUT_MS 3000
+
+// Thermal duty cycle: the module may be powered for at most F900_DUTY_BUDGET_MS of every
+// F900_DUTY_WINDOW_MS. On-time drains a credit that refills at budget/window.
+#define F900_DUTY_WINDOW_MS 600000
+#define F900_DUTY_BUDGET_MS 180000
+// A cold wake is refused with less credit than this left, enough for one verify
+#define F900_DUTY_RESERVE_MS 10000
+// After the last release the module stays in warm standby this long when traffic is busy,
+// i.e. F900_STANDBY_SESSIONS sessions started within F900_STANDBY_TRAFFIC_MS. Otherwise it
+// is powered off right away.
+#define F900_STANDBY_MS 20000
+#define F900_STANDBY_SESSIONS 3
+#define F900_STANDBY_TRAFFIC_MS 120000
 
 #ifdef __cplusplus
 extern "C" {
@@ -71,6 +86,15 @@ typedef enum {
     MR_FAILED4_NO_ENCRYPT = 21
 } f900_result_t;
 
+// NOTE message types (first data byte of MID_NOTE)
+typedef enum {
+    NID_READY = 0,
+    NID_FACE_STATE = 1,
+    NID_UNKNOWNERROR = 2,
+    NID_OTA_DONE = 3,
+    NID_EYE_STATE = 4
+} f900_note_id_t;
+
 // Face directions
 typedef enum {
     FACE_DIRECTION_UP = 0x10,
@@ -160,6 +184,35 @@ bool f900_get_all_user_ids(uint16_t* user_ids, uint16_t* count);
 // Enable/disable function
 void f900_set_enable(bool enable);
 
+// Wait for the NID_READY note the module sends once it has booted
+bool f900_wait_ready(uint32_t timeout_ms);
+
+// Reference counted power control. The module is powered on by the first acquire, which waits
+// for NID_READY, and powered down by the last release. Every acquire must be released, even
+// when it returned false because the module did not become ready in time.
+// A cold wake is refused, without powering the module, when the duty budget is used up.
+bool f900_power_acquire(uint32_t ready_timeout_ms);
+void f900_power_release(void);
+bool f900_is_ready(void);
+bool f900_is_powered(void);
+
+typedef struct {
+    bool     powered;             // Enable pin is high
+    bool     standby;             // Powered with no references, waiting for traffic
+    uint32_t sessions;            // Acquires that found the module without references
+    uint32_t cold_wakes;          // Sessions that had to power the module on
+    uint32_t warm_hits;           // Sessions served from warm standby
+    uint32_t budget_denials;      // Cold wakes refused by the duty budget
+    uint32_t ready_timeouts;      // Cold wakes without NID_READY in time
+    uint64_t on_time_ms;          // Cumulative powered time, including the current session
+    uint32_t duty_credit_ms;      // On-time left in the duty budget
+    uint32_t wake_last_ms;        // Power on to NID_READY of the last successful cold wake
+    uint32_t wake_avg_ms;
+    uint32_t wake_max_ms;
+} f900_power_stats_t;
+
+void f900_get_power_stats(f900_power_stats_t* stats);
+
 // Set security threshold levels
 bool f900_set_threshold_level(uint8_t verify_level, uint8_t liveness_level);
 
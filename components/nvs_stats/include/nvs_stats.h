@@ -0,0 +1,61 @@
+#ifndef _NVS_STATS_H_
+#define _NVS_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "nvs.h"
+
+// Namespaces and open handles that can be tracked at the same time.
+#define NVS_STATS_MAX_NAMESPACES 8
+#define NVS_STATS_MAX_HANDLES 8
+
+// Latency buckets: < 250 us, < 1 ms, < 4 ms, < 16 ms, < 64 ms, < 256 ms, and longer.
+#define NVS_STATS_LATENCY_BUCKETS 7
+
+typedef struct {
+    uint32_t count[NVS_STATS_LATENCY_BUCKETS];
+    uint32_t max_us;
+    uint64_t total_us;
+} nvs_stats_latency_t;
+
+// Counters of one namespace since boot (or nvs_stats_reset).
+typedef struct {
+    char                namespace[NVS_KEY_NAME_MAX_SIZE];
+    uint32_t            reads;
+    uint32_t            writes;        // nvs_stats_set_blob calls
+    uint64_t            bytes_written; // Payload bytes passed to nvs_stats_set_blob
+    uint64_t            entry_bytes;   // Flash bytes of the 32 byte entries those writes occupy
+    uint32_t            erases;
+    uint32_t            commits;
+    uint32_t            errors;
+    size_t              used_entries; // Entries held by the namespace, from nvs_get_used_entry_count
+    nvs_stats_latency_t write_latency; // Sets and erases
+    nvs_stats_latency_t commit_latency;
+} nvs_stats_namespace_t;
+
+// Entry usage of the default NVS partition, from nvs_get_stats.
+typedef struct {
+    size_t used_entries;
+    size_t free_entries;
+    size_t total_entries;
+    size_t namespace_count;
+} nvs_stats_partition_t;
+
+// Drop-in replacements for the nvs_* calls that count and time each operation.
+esp_err_t nvs_stats_open(const char *namespace, nvs_open_mode_t mode, nvs_handle_t *handle);
+void nvs_stats_close(nvs_handle_t handle);
+esp_err_t nvs_stats_get_blob(nvs_handle_t handle, const char *key, void *data, size_t *size);
+esp_err_t nvs_stats_set_blob(nvs_handle_t handle, const char *key, const void *data, size_t size);
+esp_err_t nvs_stats_erase_key(nvs_handle_t handle, const char *key);
+esp_err_t nvs_stats_erase_all(nvs_handle_t handle);
+esp_err_t nvs_stats_commit(nvs_handle_t handle);
+
+// Copy the counters of up to max tracked namespaces; count receives how many were copied.
+esp_err_t nvs_stats_get(nvs_stats_namespace_t *out, size_t max, size_t *count);
+esp_err_t nvs_stats_get_partition(nvs_stats_partition_t *out);
+// Upper bound of a latency bucket in microseconds, 0 for the open-ended last bucket.
+uint32_t nvs_stats_bucket_limit_us(size_t bucket);
+void nvs_stats_reset(void);
+
+#endif /* _NVS_STATS_H_ */
@@ -0,0 +1,229 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "nvs_stats.h"
+
+// NVS stores data in 32 byte entries; every blob chunk also needs a header entry.
+#define NVS_ENTRY_SIZE 32
+
+typedef struct {
+    nvs_handle_t           handle;
+    nvs_stats_namespace_t *ns;
+} handle_slot_t;
+
+static const uint32_t bucket_limits_us[NVS_STATS_LATENCY_BUCKETS - 1] = {250, 1000, 4000, 16000, 64000, 256000};
+
+static nvs_stats_namespace_t g_namespaces[NVS_STATS_MAX_NAMESPACES];
+static size_t g_namespace_count = 0;
+static handle_slot_t g_handles[NVS_STATS_MAX_HANDLES];
+static portMUX_TYPE g_stats_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Caller holds g_stats_lock.
+static nvs_stats_namespace_t *find_namespace(nvs_handle_t handle) {
+    for (size_t i = 0; i < NVS_STATS_MAX_HANDLES; i++) {
+        if (g_handles[i].ns != NULL && g_handles[i].handle == handle) {
+            return g_handles[i].ns;
+        }
+    }
+    return NULL;
+}
+
+static void latency_add(nvs_stats_latency_t *latency, uint32_t us) {
+    size_t bucket = 0;
+    while (bucket < NVS_STATS_LATENCY_BUCKETS - 1 && us >= bucket_limits_us[bucket]) {
+        bucket++;
+    }
+    latency->count[bucket]++;
+    latency->total_us += us;
+    if (us > latency->max_us) {
+        latency->max_us = us;
+    }
+}
+
+typedef enum {
+    OP_READ,
+    OP_WRITE,
+    OP_ERASE,
+    OP_COMMIT,
+} nvs_op_t;
+
+static void record(nvs_handle_t handle, nvs_op_t op, int64_t start_us, size_t size, esp_err_t err) {
+    uint32_t us = (uint32_t) (esp_timer_get_time() - start_us);
+
+    portENTER_CRITICAL(&g_stats_lock);
+    nvs_stats_namespace_t *ns = find_namespace(handle);
+    if (ns != NULL) {
+        switch (op) {
+            case OP_READ:
+                ns->reads++;
+                break;
+            case OP_WRITE:
+                ns->writes++;
+                ns->bytes_written += size;
+                ns->entry_bytes += NVS_ENTRY_SIZE * (1 + (size + NVS_ENTRY_SIZE - 1) / NVS_ENTRY_SIZE);
+                latency_add(&ns->write_latency, us);
+                break;
+            case OP_ERASE:
+                ns->erases++;
+                latency_add(&ns->write_latency, us);
+                break;
+            case OP_COMMIT:
+                ns->commits++;
+                latency_add(&ns->commit_latency, us);
+                break;
+        }
+        // A missing key on read or erase is an answer, not a failure.
+        if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+            ns->errors++;
+        }
+    }
+    portEXIT_CRITICAL(&g_stats_lock);
+}
+
+/*
+ * @brief Open an NVS namespace like nvs_open() and track its operations.
+ *
+ * Handles beyond NVS_STATS_MAX_HANDLES, or namespaces beyond NVS_STATS_MAX_NAMESPACES,
+ * work normally but are not counted.
+ */
+esp_err_t nvs_stats_open(const char *namespace, nvs_open_mode_t mode, nvs_handle_t *handle) {
+    esp_err_t err = nvs_open(namespace, mode, handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    portENTER_CRITICAL(&g_stats_lock);
+    nvs_stats_namespace_t *ns = NULL;
+    for (size_t i = 0; i < g_namespace_count; i++) {
+        if (strncmp(g_namespaces[i].namespace, namespace, sizeof(g_namespaces[i].namespace)) == 0) {
+            ns = &g_namespaces[i];
+            break;
+        }
+    }
+    if (ns == NULL && g_namespace_count < NVS_STATS_MAX_NAMESPACES) {
+        ns = &g_namespaces[g_namespace_count++];
+        strncpy(ns->namespace, namespace, sizeof(ns->namespace) - 1);
+    }
+    for (size_t i = 0; ns != NULL && i < NVS_STATS_MAX_HANDLES; i++) {
+        if (g_handles[i].ns == NULL) {
+            g_handles[i].handle = *handle;
+            g_handles[i].ns     = ns;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&g_stats_lock);
+    return ESP_OK;
+}
+
+void nvs_stats_close(nvs_handle_t handle) {
+    portENTER_CRITICAL(&g_stats_lock);
+    for (size_t i = 0; i < NVS_STATS_MAX_HANDLES; i++) {
+        if (g_handles[i].ns != NULL && g_handles[i].handle == handle) {
+            g_handles[i].ns = NULL;
+        }
+    }
+    portEXIT_CRITICAL(&g_stats_lock);
+    nvs_close(handle);
+}
+
+esp_err_t nvs_stats_get_blob(nvs_handle_t handle, const char *key, void *data, size_t *size) {
+    int64_t   start = esp_timer_get_time();
+    esp_err_t err   = nvs_get_blob(handle, key, data, size);
+    record(handle, OP_READ, start, 0, err);
+    return err;
+}
+
+esp_err_t nvs_stats_set_blob(nvs_handle_t handle, const char *key, const void *data, size_t size) {
+    int64_t   start = esp_timer_get_time();
+    esp_err_t err   = nvs_set_blob(handle, key, data, size);
+    record(handle, OP_WRITE, start, size, err);
+    return err;
+}
+
+esp_err_t nvs_stats_erase_key(nvs_handle_t handle, const char *key) {
+    int64_t   start = esp_timer_get_time();
+    esp_err_t err   = nvs_erase_key(handle, key);
+    record(handle, OP_ERASE, start, 0, err);
+    return err;
+}
+
+esp_err_t nvs_stats_erase_all(nvs_handle_t handle) {
+    int64_t   start = esp_timer_get_time();
+    esp_err_t err   = nvs_erase_all(handle);
+    record(handle, OP_ERASE, start, 0, err);
+    return err;
+}
+
+esp_err_t nvs_stats_commit(nvs_handle_t handle) {
+    int64_t   start = esp_timer_get_time();
+    esp_err_t err   = nvs_commit(handle);
+    record(handle, OP_COMMIT, start, 0, err);
+    return err;
+}
+
+/*
+ * @brief Copy the counters of the tracked namespaces.
+ *
+ * used_entries is refreshed from NVS for namespaces that have an open handle.
+ */
+esp_err_t nvs_stats_get(nvs_stats_namespace_t *out, size_t max, size_t *count) {
+    // nvs_get_used_entry_count may block, so query outside the spinlock.
+    nvs_handle_t handles[NVS_STATS_MAX_HANDLES];
+    nvs_stats_namespace_t *owners[NVS_STATS_MAX_HANDLES];
+    size_t handle_count = 0;
+
+    portENTER_CRITICAL(&g_stats_lock);
+    for (size_t i = 0; i < NVS_STATS_MAX_HANDLES; i++) {
+        if (g_handles[i].ns != NULL) {
+            handles[handle_count] = g_handles[i].handle;
+            owners[handle_count++] = g_handles[i].ns;
+        }
+    }
+    portEXIT_CRITICAL(&g_stats_lock);
+
+    for (size_t i = 0; i < handle_count; i++) {
+        size_t used;
+        if (nvs_get_used_entry_count(handles[i], &used) == ESP_OK) {
+            portENTER_CRITICAL(&g_stats_lock);
+            owners[i]->used_entries = used;
+            portEXIT_CRITICAL(&g_stats_lock);
+        }
+    }
+
+    portENTER_CRITICAL(&g_stats_lock);
+    size_t n = g_namespace_count < max ? g_namespace_count : max;
+    memcpy(out, g_namespaces, n * sizeof(nvs_stats_namespace_t));
+    portEXIT_CRITICAL(&g_stats_lock);
+    *count = n;
+    return ESP_OK;
+}
+
+esp_err_t nvs_stats_get_partition(nvs_stats_partition_t *out) {
+    nvs_stats_t stats;
+    esp_err_t   err = nvs_get_stats(NULL, &stats);
+    if (err != ESP_OK) {
+        return err;
+    }
+    out->used_entries    = stats.used_entries;
+    out->free_entries    = stats.free_entries;
+    out->total_entries   = stats.total_entries;
+    out->namespace_count = stats.namespace_count;
+    return ESP_OK;
+}
+
+uint32_t nvs_stats_bucket_limit_us(size_t bucket) {
+    return bucket < NVS_STATS_LATENCY_BUCKETS - 1 ? bucket_limits_us[bucket] : 0;
+}
+
+// Zero all counters; tracked namespaces and handles stay registered.
+void nvs_stats_reset(void) {
+    portENTER_CRITICAL(&g_stats_lock);
+    for (size_t i = 0; i < g_namespace_count; i++) {
+        nvs_stats_namespace_t *ns = &g_namespaces[i];
+        char name[sizeof(ns->namespace)];
+        memcpy(name, ns->namespace, sizeof(name));
+        memset(ns, 0, sizeof(nvs_stats_namespace_t));
+        memcpy(ns->namespace, name, sizeof(name));
+    }
+    portEXIT_CRITICAL(&g_stats_lock);
+}
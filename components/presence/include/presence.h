@@ -0,0 +1,90 @@
+#ifndef _PRESENCE_H_
+#define _PRESENCE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Presence detection state machine fed with timestamped ToF distance samples.
+// It has no FreeRTOS or driver dependencies so it also builds on the host (see tools/presence_replay).
+
+typedef enum {
+    // Waiting for the user to approach (i.e., be within the distance threshold)
+    PRESENCE_STATE_WAITING_FOR_USER = 0,
+    // User detected continuously (access granted; latched for min_active_ms)
+    PRESENCE_STATE_USER_CONFIRMED,
+    // After the minimum period, monitoring the user’s presence; if absent for removal_ms, access is revoked
+    PRESENCE_STATE_USER_MONITORING,
+    // Cooldown period after access is revoked, delaying new detection for cooldown_ms
+    PRESENCE_STATE_COOLDOWN,
+    PRESENCE_STATE_COUNT
+} presence_state_t;
+
+typedef enum {
+    PRESENCE_EVENT_NONE = 0,
+    PRESENCE_EVENT_DETECTED, // User confirmed, start an authentication attempt
+    PRESENCE_EVENT_CLEARED,  // User left or the active period expired
+    PRESENCE_EVENT_APPROACHING, // Someone is heading for the sensor, detection is likely soon
+    PRESENCE_EVENT_RECEDED,     // An approach ended without a detection
+} presence_event_t;
+
+typedef struct {
+    uint16_t threshold_mm;       // Distance below which a user is present
+    uint32_t detection_ms;       // How long the user must stay within the threshold
+    uint32_t min_active_ms;      // After detection, do not clear even if the user leaves
+    uint32_t removal_ms;         // Absence needed to clear after min_active_ms
+    uint32_t max_active_ms;      // Clear after this even if the user is present
+    uint32_t cooldown_ms;        // No new detection for this long after clearing
+    uint16_t outer_zone_factor;  // Range fast once something is within threshold * factor
+    uint16_t idle_interval_ms;   // Measurement period while nobody is near
+    uint16_t active_interval_ms; // Measurement period while approaching or monitoring
+    uint16_t approach_speed_mm_s; // Filtered closing speed that signals an approach in the outer zone
+    uint32_t recede_ms;          // Time outside the outer zone that ends an approach
+} presence_config_t;
+
+#define PRESENCE_CONFIG_DEFAULT                                                                    \
+    {                                                                                              \
+        .threshold_mm = 500, .detection_ms = 1000, .min_active_ms = 10000, .removal_ms = 3000,     \
+        .max_active_ms = 60000, .cooldown_ms = 10000, .outer_zone_factor = 2,                      \
+        .idle_interval_ms = 500, .active_interval_ms = 100, .approach_speed_mm_s = 150,            \
+        .recede_ms = 3000,                                                                         \
+    }
+
+typedef struct {
+    presence_state_t state;
+    uint32_t         state_start_ms;    // When the current state was entered
+    bool             detecting;         // Readings are below the threshold (waiting state)
+    uint32_t         detection_start_ms;
+    bool             absent;            // Readings are above the threshold (monitoring state)
+    uint32_t         absent_start_ms;
+    uint32_t         active_start_ms;   // When the user was confirmed
+
+    // Distance filter: median of the last three samples, then an EMA
+    uint16_t         raw_mm[3];
+    uint8_t          raw_count;
+    int32_t          filtered_mm;
+    int32_t          velocity_mm_s;     // EMA of the filtered distance change; negative = closing in
+    uint32_t         last_sample_ms;
+    bool             approaching;       // APPROACHING was raised and not yet ended
+    bool             outside;           // Filtered distance is beyond the outer zone
+    uint32_t         outside_start_ms;
+} presence_t;
+
+typedef struct {
+    presence_event_t event;
+    uint32_t         presence_start_ms; // For PRESENCE_EVENT_DETECTED: first sample in range
+    uint16_t         interval_ms;       // Measurement period wanted for the next sample
+    int32_t          filtered_mm;
+    int32_t          velocity_mm_s;
+} presence_output_t;
+
+void presence_init(presence_t *presence, uint32_t now_ms);
+
+/*
+ * @brief Feed one distance sample. Timestamps are monotonic milliseconds and may wrap.
+ */
+presence_output_t presence_update(presence_t *presence, const presence_config_t *config,
+                                  uint32_t now_ms, uint16_t distance_mm);
+
+const char *presence_state_name(presence_state_t state);
+
+#endif /* _PRESENCE_H_ */
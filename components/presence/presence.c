@@ -0,0 +1,173 @@
+#include "presence.h"
+
+static const char *state_names[PRESENCE_STATE_COUNT] = {"waiting", "confirmed", "monitoring",
+                                                        "cooldown"};
+
+// Readings beyond this are clamped so "nothing in range" does not look like a huge jump
+#define FAR_MM 2000
+
+static uint16_t median3(uint16_t a, uint16_t b, uint16_t c) {
+    if (a > b) {
+        uint16_t t = a;
+        a          = b;
+        b          = t;
+    }
+    return c < a ? a : c > b ? b : c;
+}
+
+// Update the filtered distance and closing speed with a new sample
+static void filter_update(presence_t *presence, uint32_t now_ms, uint16_t distance_mm) {
+    uint16_t raw = distance_mm > FAR_MM ? FAR_MM : distance_mm;
+
+    if (presence->raw_count == 0) {
+        presence->raw_mm[0] = presence->raw_mm[1] = presence->raw_mm[2] = raw;
+        presence->raw_count      = 1;
+        presence->filtered_mm    = raw;
+        presence->velocity_mm_s  = 0;
+        presence->last_sample_ms = now_ms;
+        return;
+    }
+
+    presence->raw_mm[0] = presence->raw_mm[1];
+    presence->raw_mm[1] = presence->raw_mm[2];
+    presence->raw_mm[2] = raw;
+    int32_t median = median3(presence->raw_mm[0], presence->raw_mm[1], presence->raw_mm[2]);
+
+    // EMA with alpha = 1/2 for both distance and speed
+    int32_t  previous = presence->filtered_mm;
+    uint32_t dt_ms    = now_ms - presence->last_sample_ms;
+    presence->filtered_mm    = (presence->filtered_mm + median) / 2;
+    presence->last_sample_ms = now_ms;
+    if (dt_ms > 0) {
+        int32_t speed = (presence->filtered_mm - previous) * 1000 / (int32_t) dt_ms;
+        presence->velocity_mm_s = (presence->velocity_mm_s + speed) / 2;
+    }
+}
+
+// Raise APPROACHING once per approach and RECEDED when it fizzles out (waiting state only)
+static presence_event_t approach_update(presence_t *presence, const presence_config_t *config,
+                                        uint32_t now_ms) {
+    uint32_t outer_mm = (uint32_t) config->threshold_mm * config->outer_zone_factor;
+
+    if (presence->filtered_mm >= (int32_t) outer_mm) {
+        if (!presence->outside) {
+            presence->outside          = true;
+            presence->outside_start_ms = now_ms;
+        }
+        if (presence->approaching && now_ms - presence->outside_start_ms >= config->recede_ms) {
+            presence->approaching = false;
+            return PRESENCE_EVENT_RECEDED;
+        }
+        return PRESENCE_EVENT_NONE;
+    }
+
+    presence->outside = false;
+    if (!presence->approaching &&
+        (presence->filtered_mm < config->threshold_mm ||
+         presence->velocity_mm_s <= -(int32_t) config->approach_speed_mm_s)) {
+        presence->approaching = true;
+        return PRESENCE_EVENT_APPROACHING;
+    }
+    return PRESENCE_EVENT_NONE;
+}
+
+static void enter_state(presence_t *presence, presence_state_t state, uint32_t now_ms) {
+    presence->state          = state;
+    presence->state_start_ms = now_ms;
+}
+
+void presence_init(presence_t *presence, uint32_t now_ms) {
+    *presence = (presence_t){0};
+    enter_state(presence, PRESENCE_STATE_WAITING_FOR_USER, now_ms);
+}
+
+presence_output_t presence_update(presence_t *presence, const presence_config_t *config,
+                                  uint32_t now_ms, uint16_t distance_mm) {
+    presence_output_t out = {.event = PRESENCE_EVENT_NONE, .interval_ms = config->idle_interval_ms};
+
+    filter_update(presence, now_ms, distance_mm);
+    out.filtered_mm   = presence->filtered_mm;
+    out.velocity_mm_s = presence->velocity_mm_s;
+
+    switch (presence->state) {
+    case PRESENCE_STATE_WAITING_FOR_USER:
+        // Track how long the distance has stayed below the threshold
+        if (distance_mm < config->threshold_mm) {
+            if (!presence->detecting) {
+                presence->detecting          = true;
+                presence->detection_start_ms = now_ms;
+            }
+        } else {
+            presence->detecting = false;
+        }
+        // Range fast while someone is approaching so confirmation is not delayed by the idle period
+        if (distance_mm < (uint32_t) config->threshold_mm * config->outer_zone_factor) {
+            out.interval_ms = config->active_interval_ms;
+        }
+        out.event = approach_update(presence, config, now_ms);
+        // If the condition holds for the trigger time, the user is confirmed
+        if (presence->detecting && now_ms - presence->detection_start_ms >= config->detection_ms) {
+            out.event             = PRESENCE_EVENT_DETECTED;
+            out.presence_start_ms = presence->detection_start_ms;
+            out.interval_ms       = config->idle_interval_ms;
+            presence->detecting       = false;
+            presence->approaching     = false;
+            presence->active_start_ms = now_ms;
+            enter_state(presence, PRESENCE_STATE_USER_CONFIRMED, now_ms);
+        }
+        break;
+
+    case PRESENCE_STATE_USER_CONFIRMED:
+        // During the minimum active period, do not clear even if the user leaves
+        if (now_ms - presence->active_start_ms >= config->min_active_ms) {
+            presence->absent = false;
+            out.interval_ms  = config->active_interval_ms;
+            enter_state(presence, PRESENCE_STATE_USER_MONITORING, now_ms);
+        }
+        // If the maximum active time is reached, clear
+        if (now_ms - presence->active_start_ms >= config->max_active_ms) {
+            out.event       = PRESENCE_EVENT_CLEARED;
+            out.interval_ms = config->idle_interval_ms;
+            enter_state(presence, PRESENCE_STATE_COOLDOWN, now_ms);
+        }
+        break;
+
+    case PRESENCE_STATE_USER_MONITORING:
+        out.interval_ms = config->active_interval_ms;
+        // If the measured distance is greater than the threshold, track how long the user is absent
+        if (distance_mm > config->threshold_mm) {
+            if (!presence->absent) {
+                presence->absent          = true;
+                presence->absent_start_ms = now_ms;
+            }
+        } else {
+            presence->absent = false;
+        }
+        // Clear once the user is absent long enough, or the maximum active time is reached
+        if ((presence->absent && now_ms - presence->absent_start_ms >= config->removal_ms) ||
+            now_ms - presence->active_start_ms >= config->max_active_ms) {
+            out.event       = PRESENCE_EVENT_CLEARED;
+            out.interval_ms = config->idle_interval_ms;
+            enter_state(presence, PRESENCE_STATE_COOLDOWN, now_ms);
+        }
+        break;
+
+    case PRESENCE_STATE_COOLDOWN:
+        // After the cooldown, new detection is allowed
+        if (now_ms - presence->state_start_ms >= config->cooldown_ms) {
+            presence->detecting = false;
+            enter_state(presence, PRESENCE_STATE_WAITING_FOR_USER, now_ms);
+        }
+        break;
+
+    default:
+        enter_state(presence, PRESENCE_STATE_WAITING_FOR_USER, now_ms);
+        break;
+    }
+
+    return out;
+}
+
+const char *presence_state_name(presence_state_t state) {
+    return state < PRESENCE_STATE_COUNT ? state_names[state] : "unknown";
+}
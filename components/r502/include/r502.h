@@ -9,13 +9,20 @@
 #define R502_DEFAULT_ADDRESS 0xFFFFFFFF
 #define R502_DEFAULT_TIMEOUT_MS 5000
 #define R502_DEFAULT_BAUD_RATE 57600
+#define R502_MAX_BAUD_RATE 115200
 
 #define R502_HEADER_SIZE 9
 
+// Template library index table: ReadIndexTable returns 32 bytes (256 slots) per page
+#define R502_INDEX_PAGE_SLOTS 256
+#define R502_INDEX_PAGES 4
+#define R502_MAX_TEMPLATES (R502_INDEX_PAGE_SLOTS * R502_INDEX_PAGES)
+
 // Command packet sizes (including checksum)
 #define R502_AURALED_PACKET_SIZE 16
 #define R502_GENIMG_PACKET_SIZE 12
 #define R502_SEARCH_PACKET_SIZE 17
+#define R502_MATCH_PACKET_SIZE 12
 #define R502_VFYPWD_PACKET_SIZE 16
 #define R502_IMG2TZ_PACKET_SIZE 13
 #define R502_TEMPLATENUM_PACKET_SIZE 12
@@ -28,6 +35,13 @@
 #define R502_READINDEXTABLE_PACKET_SIZE 13
 #define R502_READ_SYS_PARA_PACKET_SIZE 12
 #define R502_SET_SYS_PARA_PACKET_SIZE 14
+#define R502_CANCEL_PACKET_SIZE 12
+#define R502_LOADCHAR_PACKET_SIZE 15
+#define R502_UPCHAR_PACKET_SIZE 13
+#define R502_DOWNCHAR_PACKET_SIZE 13
+
+// Size of one template (character file) as moved by UpChar/DownChar
+#define R502_TEMPLATE_SIZE 768
 
 typedef struct {
     uart_port_t uart_num;
@@ -38,6 +52,9 @@ typedef struct {
     uint32_t address;
 } r502_config_t;
 
+// One fingerprint reader; see r502_init
+typedef struct r502_dev *r502_handle_t;
+
 typedef struct {
     uint8_t conf_code;
 } r502_generic_reply;
@@ -53,6 +70,11 @@ typedef struct {
     uint16_t match_score;
 } r502_search_reply;
 
+typedef struct {
+    uint8_t conf_code;
+    uint16_t match_score;
+} r502_match_reply;
+
 typedef struct {
     uint8_t conf_code;
     uint8_t index_page[32];
@@ -82,37 +104,116 @@ typedef struct {
     R502_PARAM_PACKET_SIZE = 6     // Data package length (0=32,1=64,2=128,3=256 bytes)
  } r502_param_num_t;
 
-/* Callback function type */
-typedef void (*r502_irq_callback)(void);
-
-// Initialization
-void r502_init(r502_config_t config);
-
-void r502_set_timeout(uint32_t timeout_ms);
-void r502_set_enable(bool enable);
-bool r502_is_enabled(void);
-
-void r502_add_irq_callback(r502_irq_callback callback);
-void r502_remove_irq_callback(r502_irq_callback callback);
-void r502_clear_irq_callbacks();
+typedef struct {
+    uint32_t frames;            // Valid frames received
+    uint32_t resyncs;           // Times the parser hunted for the next header
+    uint32_t discarded_bytes;   // Stray bytes dropped while hunting
+    uint32_t checksum_errors;
+    uint32_t length_errors;
+    uint32_t unexpected_frames; // Valid frames with no command waiting
+    uint32_t late_frames;       // Frames dropped while waiting out the reply of a timed-out command
+    uint32_t retries;           // Idempotent commands sent again after a corrupted reply
+    uint32_t timeouts;          // Commands without any reply
+    uint32_t overflows;         // UART buffer overflows
+    uint32_t baud_rate;
+    uint16_t data_packet_size;  // Bytes per data package in template transfers
+} r502_link_stats_t;
 
-esp_err_t r502_get_status(r502_status_t *status);
+typedef struct {
+    uint8_t  command;           // Instruction code
+    uint32_t count;
+    uint32_t avg_us;            // Command sent until the reply was parsed
+    uint32_t max_us;
+    uint32_t last_us;
+} r502_command_rtt_t;
+
+// Receives template data as it arrives; a non-ESP_OK return aborts the transfer
+typedef esp_err_t (*r502_data_sink)(const uint8_t *data, size_t len, void *ctx);
+
+/* Callback function type, called from the ISR with the arg given on registration */
+typedef void (*r502_irq_callback)(void *arg);
+
+/*
+ * @brief Set up a reader on its own UART and start its RX task.
+ *
+ * Every reader has its own command lock, so readers on different UARTs can be driven from
+ * separate tasks concurrently. Commands to one reader may also come from several tasks; they
+ * are serialised per reader.
+ */
+esp_err_t r502_init(r502_config_t config, r502_handle_t *handle);
+// Stop the RX task and release the UART. The reader must be idle.
+void r502_deinit(r502_handle_t dev);
+
+/*
+ * @brief Hold the reader across a command sequence that leaves state in its image or char
+ * buffers, e.g. Img2Tz then Search or LoadChar then UpChar. Single commands need no lock.
+ * Recursive, so the holder's own commands go through; every lock needs an unlock.
+ */
+void r502_lock(r502_handle_t dev);
+void r502_unlock(r502_handle_t dev);
+
+void r502_set_timeout(r502_handle_t dev, uint32_t timeout_ms);
+void r502_set_enable(r502_handle_t dev, bool enable);
+bool r502_is_enabled(r502_handle_t dev);
+
+void r502_add_irq_callback(r502_handle_t dev, r502_irq_callback callback, void *arg);
+void r502_remove_irq_callback(r502_handle_t dev, r502_irq_callback callback, void *arg);
+void r502_clear_irq_callbacks(r502_handle_t dev);
+
+// Touch detection on the IRQ pin
+bool r502_has_touch_irq(r502_handle_t dev);
+bool r502_wait_touch(r502_handle_t dev, uint32_t timeout_ms);
+void r502_clear_touch(r502_handle_t dev);
+int64_t r502_get_touch_time(r502_handle_t dev);
+
+// UART link health since init
+void r502_get_link_stats(r502_handle_t dev, r502_link_stats_t *stats);
+
+// Link speed. Negotiation runs before any other command, typically right after power on.
+esp_err_t r502_negotiate_link(r502_handle_t dev, uint32_t max_baud, uint16_t packet_size);
+uint32_t r502_get_baud_rate(r502_handle_t dev);
+uint16_t r502_get_data_packet_size(r502_handle_t dev);
+// Round-trip times per command since the last baud rate change; returns the entries copied
+size_t r502_get_command_rtt(r502_handle_t dev, r502_command_rtt_t *out, size_t max);
+// The same table as it stood at the rate before that change; baud_rate is 0 if there is none
+size_t r502_get_previous_command_rtt(r502_handle_t dev, uint32_t *baud_rate, r502_command_rtt_t *out, size_t max);
+
+esp_err_t r502_get_status(r502_handle_t dev, r502_status_t *status);
 
 // Module commands
-esp_err_t r502_setsyspara(r502_param_num_t param_num, uint8_t value, r502_generic_reply *reply);
-esp_err_t r502_readsyspara(r502_syspara_reply *reply);
-esp_err_t r502_auraledconfig(uint8_t control, uint8_t speed, uint8_t color, uint8_t times, r502_generic_reply *reply);
-esp_err_t r502_genimg(r502_generic_reply *reply);
-esp_err_t r502_img2tz(uint8_t buffer, r502_generic_reply *reply);
-esp_err_t r502_search(uint8_t buffer, uint16_t start, uint16_t count, r502_search_reply *reply);
-esp_err_t r502_vfypwd(uint32_t password, r502_generic_reply *reply);
-esp_err_t r502_templatenum(r502_templatenum_reply *reply);
-esp_err_t r502_regmodel(r502_generic_reply *reply);
-esp_err_t r502_store(uint8_t buffer, uint16_t index, r502_generic_reply *reply);
-esp_err_t r502_handshake(r502_generic_reply *reply);
-esp_err_t r502_setpwd(uint32_t new_password, r502_generic_reply *reply);
-esp_err_t r502_deletechar(uint16_t start, uint16_t count, r502_generic_reply *reply);
-esp_err_t r502_empty(r502_generic_reply *reply);
-esp_err_t r502_readindextable(uint8_t page, r502_indextable_reply *reply);
+esp_err_t r502_setsyspara(r502_handle_t dev, r502_param_num_t param_num, uint8_t value, r502_generic_reply *reply);
+esp_err_t r502_readsyspara(r502_handle_t dev, r502_syspara_reply *reply);
+esp_err_t r502_auraledconfig(r502_handle_t dev, uint8_t control, uint8_t speed, uint8_t color, uint8_t times, r502_generic_reply *reply);
+esp_err_t r502_genimg(r502_handle_t dev, r502_generic_reply *reply);
+esp_err_t r502_img2tz(r502_handle_t dev, uint8_t buffer, r502_generic_reply *reply);
+esp_err_t r502_search(r502_handle_t dev, uint8_t buffer, uint16_t start, uint16_t count, r502_search_reply *reply);
+// 1:1 comparison of CharBuffer1 and CharBuffer2, e.g. against a template fetched with r502_loadchar
+esp_err_t r502_match(r502_handle_t dev, r502_match_reply *reply);
+esp_err_t r502_vfypwd(r502_handle_t dev, uint32_t password, r502_generic_reply *reply);
+esp_err_t r502_templatenum(r502_handle_t dev, r502_templatenum_reply *reply);
+esp_err_t r502_regmodel(r502_handle_t dev, r502_generic_reply *reply);
+esp_err_t r502_store(r502_handle_t dev, uint8_t buffer, uint16_t index, r502_generic_reply *reply);
+esp_err_t r502_handshake(r502_handle_t dev, r502_generic_reply *reply);
+esp_err_t r502_setpwd(r502_handle_t dev, uint32_t new_password, r502_generic_reply *reply);
+esp_err_t r502_deletechar(r502_handle_t dev, uint16_t start, uint16_t count, r502_generic_reply *reply);
+esp_err_t r502_empty(r502_handle_t dev, r502_generic_reply *reply);
+esp_err_t r502_readindextable(r502_handle_t dev, uint8_t page, r502_indextable_reply *reply);
+esp_err_t r502_cancel(r502_handle_t dev, r502_generic_reply *reply);
+
+// Template transfer between the library, a char buffer and the host
+esp_err_t r502_loadchar(r502_handle_t dev, uint8_t buffer, uint16_t index, r502_generic_reply *reply);
+esp_err_t r502_upchar(r502_handle_t dev, uint8_t buffer, r502_data_sink sink, void *ctx, r502_generic_reply *reply);
+esp_err_t r502_downchar(r502_handle_t dev, uint8_t buffer, const uint8_t *data, size_t len, r502_generic_reply *reply);
+
+// Template library occupancy, cached from the index table. The cache is loaded on first use
+// (or explicitly) and kept up to date by r502_store, r502_deletechar and r502_empty.
+esp_err_t r502_load_index(r502_handle_t dev);
+void r502_invalidate_index(r502_handle_t dev);
+bool r502_is_occupied(r502_handle_t dev, uint16_t index);
+uint16_t r502_template_count(r502_handle_t dev);
+// First free slot, without UART traffic once the cache is loaded. ESP_ERR_NOT_FOUND when full.
+esp_err_t r502_alloc_slot(r502_handle_t dev, uint16_t *index);
+// Lowest occupied slot and the slot count up to the highest one; count is 0 for an empty library
+esp_err_t r502_occupied_span(r502_handle_t dev, uint16_t *start, uint16_t *count);
 
 #endif // __R502_H__
@@ -0,0 +1,75 @@
+#ifndef __R502_PARSER_H__
+#define __R502_PARSER_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Incremental parser for R502 packets read from the UART, byte by byte or in any fragments.
+// Free of ESP-IDF dependencies so it can be fed recorded byte streams on the host.
+
+#define R502_FRAME_HEADER_SIZE 9   // 0xEF01, address[4], package identifier, length[2]
+#define R502_FRAME_MAX_DATA 256    // Largest data package the module can be configured for
+#define R502_FRAME_MAX_SIZE (R502_FRAME_HEADER_SIZE + R502_FRAME_MAX_DATA + 2)
+
+// Package identifiers
+#define R502_PID_COMMAND 0x01
+#define R502_PID_DATA 0x02
+#define R502_PID_ACK 0x07
+#define R502_PID_END_DATA 0x08
+
+typedef enum {
+    R502_FRAME_OK = 0,
+    R502_FRAME_BAD_CHECKSUM, // Whole frame received, checksum mismatch
+    R502_FRAME_BAD_LENGTH,   // Header announced a length no package can have
+} r502_frame_status_t;
+
+// frame is the whole package including header and checksum. For errors it holds what was
+// received of the broken frame.
+typedef void (*r502_frame_callback)(r502_frame_status_t status, const uint8_t *frame, size_t len, void *ctx);
+
+typedef struct {
+    uint32_t frames;          // Valid frames delivered
+    uint32_t resyncs;         // Times the parser had to hunt for the next 0xEF01 header
+    uint32_t discarded_bytes; // Bytes dropped while hunting
+    uint32_t checksum_errors;
+    uint32_t length_errors;
+} r502_parser_stats_t;
+
+typedef struct {
+    uint32_t            address;
+    uint8_t             state;
+    bool                hunting; // Inside a run of discarded bytes
+    uint16_t            pos;
+    uint16_t            length;  // Package length field: payload plus checksum
+    uint16_t            sum;
+    uint8_t             frame[R502_FRAME_MAX_SIZE];
+    r502_parser_stats_t stats;
+} r502_parser_t;
+
+// After a command timed out its acknowledge may still arrive, and an acknowledge does not say
+// which command it answers: arriving after the next command was sent, it would complete that one.
+// The guard closes the link on a timeout and keeps it closed until no frame has arrived for the
+// quiet time; frames in between are late replies. Times are in microseconds, any monotonic clock.
+typedef struct {
+    int64_t quiet_us;
+    int64_t closed_until_us; // 0 while the link is open
+} r502_link_guard_t;
+
+// Only frames from address are accepted
+void r502_parser_init(r502_parser_t *parser, uint32_t address);
+// Drop a partially received frame, e.g. after the UART input was flushed. Stats are kept.
+void r502_parser_reset(r502_parser_t *parser);
+// Frames are reported through callback in stream order
+void r502_parser_feed(r502_parser_t *parser, const uint8_t *data, size_t len, r502_frame_callback callback, void *ctx);
+
+// The command in flight got no reply by now_us; hold the next one back for at least quiet_us
+void r502_link_guard_close(r502_link_guard_t *guard, int64_t now_us, int64_t quiet_us);
+// Open the link right away, e.g. after a baud rate change made anything still on the way unreadable
+void r502_link_guard_open(r502_link_guard_t *guard);
+// A frame arrived at now_us. Returns false for a late reply, which must be dropped.
+bool r502_link_guard_accept(r502_link_guard_t *guard, int64_t now_us);
+// Time the next command still has to wait, 0 once the link has been quiet long enough
+int64_t r502_link_guard_wait(r502_link_guard_t *guard, int64_t now_us);
+
+#endif // __R502_PARSER_H__
@@ -1,27 +1,139 @@
 #include "r502.h"
+#include "r502_parser.h"
 #include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include "driver/uart.h"
 #include "driver/gpio.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 
 #define MAX_CALLBACKS 8
+#define UART_EVENT_QUEUE_LEN 20
+// Commands answered with a corrupted frame are sent again this many times, if idempotent
+#define COMMAND_RETRIES 2
+// After a timeout the next command waits until no frame arrived for the timed-out command's
+// timeout, but at most this long; a reply later than that is taken as lost
+#define LATE_REPLY_QUIET_MS 1000
+// Distinct command codes tracked for round-trip times
+#define RTT_SLOTS 16
+// Per candidate rate while probing for the module's baud rate
+#define PROBE_TIMEOUT_MS 200
+// Handshakes that must all succeed before a new baud rate counts as stable
+#define STABLE_HANDSHAKES 5
 
 static const char *TAG = "R502";
-static r502_config_t g_config;
-static uint32_t g_uart_timeout = R502_DEFAULT_TIMEOUT_MS;
-
-static r502_irq_callback g_irq_callbacks[MAX_CALLBACKS] = {NULL};
-static uint8_t g_callback_counter = 0;
 
+// Protocol engine: the RX task parses everything the UART receives and completes the pending
+// command. cmd_mutex keeps one command in flight; pending is guarded by pending_lock.
+typedef enum {
+    FRAME_IGNORED = 0, // Not meant for this command
+    FRAME_PROGRESS,    // Consumed, more frames to come; wakes the caller to drain
+    FRAME_DONE,        // Last frame of the command
+} frame_result_t;
+
+// Called under pending_lock, so handlers only copy
+typedef frame_result_t (*frame_handler_t)(const uint8_t *frame, size_t len, void *ctx);
+// Called by the commanding task, outside the lock, after every FRAME_PROGRESS
+typedef esp_err_t (*drain_fn_t)(void *ctx);
+
+typedef struct {
+    bool              active;
+    frame_handler_t   handler;
+    void             *ctx;
+    esp_err_t         result;
+} pending_command_t;
+
+typedef struct {
+    uint8_t  command;
+    uint32_t count;
+    uint64_t total_us;
+    uint32_t max_us;
+    uint32_t last_us;
+} rtt_slot_t;
+
+// Data packages of an UpChar transfer, collected by the RX task and drained to the sink by the
+// caller. Sized for a whole template so a slow sink never loses data.
+typedef struct {
+    uint8_t         data[1024];
+    size_t          head;     // Bytes received
+    size_t          tail;     // Bytes handed to the sink
+    bool            acked;
+    uint8_t         conf_code;
+    bool            overflow;
+    r502_handle_t   dev;
+    r502_data_sink  sink;
+    void           *sink_ctx;
+} upchar_stream_t;
+
+typedef struct {
+    r502_irq_callback callback;
+    void             *arg;
+} irq_callback_t;
+
+// Everything a reader needs lives here, so readers on different UARTs never share a lock
+struct r502_dev {
+    r502_config_t     config;
+    uint32_t          uart_timeout;
+
+    irq_callback_t    irq_callbacks[MAX_CALLBACKS];
+    uint8_t           callback_count;
+    SemaphoreHandle_t touch_sem;
+    volatile int64_t  touch_time_us;
+
+    TaskHandle_t      rx_task;
+    QueueHandle_t     uart_queue;
+    r502_parser_t     parser;
+    SemaphoreHandle_t cmd_mutex;
+    SemaphoreHandle_t cmd_done;
+    portMUX_TYPE      pending_lock;
+    pending_command_t pending;
+    r502_link_guard_t link_guard; // Guarded by pending_lock
+    r502_link_stats_t link_stats;
+
+    // Round-trip times per command code since init or the last baud rate change, and the table
+    // of the rate before that change
+    rtt_slot_t        rtt[RTT_SLOTS];
+    size_t            rtt_count;
+    rtt_slot_t        rtt_prev[RTT_SLOTS];
+    size_t            rtt_prev_count;
+    uint32_t          rtt_prev_baud_rate; // 0 until the rate changed after some command got through
+    uint32_t          baud_rate;
+    uint16_t          data_packet_size;
+
+    // Template library occupancy, one bit per slot, LSB first as in the index table
+    portMUX_TYPE      index_lock;
+    uint8_t           index[R502_MAX_TEMPLATES / 8];
+    bool              index_valid;
+    uint16_t          lib_size;
+    uint16_t          template_count;
+    uint16_t          free_hint; // No free slot below this one
+
+    upchar_stream_t   upchar; // Only used with cmd_mutex held
+};
 
 static void IRAM_ATTR gpio_isr_handler(void* arg) {
-    for (int i = 0; i < g_callback_counter; i++) {
-        if (g_irq_callbacks[i]) {
-            g_irq_callbacks[i]();
+    r502_handle_t dev = arg;
+    for (int i = 0; i < dev->callback_count; i++) {
+        if (dev->irq_callbacks[i].callback) {
+            dev->irq_callbacks[i].callback(dev->irq_callbacks[i].arg);
         }
     }
 }
 
+static void IRAM_ATTR touch_irq_callback(void *arg) {
+    r502_handle_t dev = arg;
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+    dev->touch_time_us = esp_timer_get_time();
+    xSemaphoreGiveFromISR(dev->touch_sem, &xHigherPriorityTaskWoken);
+    if (xHigherPriorityTaskWoken) {
+        portYIELD_FROM_ISR();
+    }
+}
+
 // The arithmetic sum of package identifier, package length and all package content.
 // Overflowing bits are omitted.
 static uint16_t calculate_checksum(uint8_t *data, size_t len) {
@@ -32,13 +144,6 @@ static uint16_t calculate_checksum(uint8_t *data, size_t len) {
     return sum;
 }
 
-static bool check_checksum(uint8_t *data, size_t len) {
-    if (len < 2)
-        return false;
-    uint16_t received = (data[len-2] << 8) | data[len-1];
-    return received == calculate_checksum(data + 6, len - 2 - 6);
-}
-
 static void add_command_arg_8(uint8_t **payload, uint8_t value) {
     *(*payload)++ = value;
 }
@@ -59,7 +164,7 @@ static void add_command_arg_32(uint8_t **payload, uint32_t value) {
 // * cmd 0 command code (id)
 // * packet_size = packet buffer size
 // return pointer to the first byte of command payload
-static uint8_t *init_command(uint8_t *packet, uint8_t cmd, uint16_t packet_size) {
+static uint8_t *init_command(r502_handle_t dev, uint8_t *packet, uint8_t cmd, uint16_t packet_size) {
     uint8_t *ptr = packet;
 
     // Packet header
@@ -67,7 +172,7 @@ static uint8_t *init_command(uint8_t *packet, uint8_t cmd, uint16_t packet_size)
     add_command_arg_8(&ptr, 0x01);
 
     // Device address
-    add_command_arg_32(&ptr, g_config.address);
+    add_command_arg_32(&ptr, dev->config.address);
 
     // Package identifier ()
     add_command_arg_8(&ptr, 0x01);
@@ -92,23 +197,86 @@ static void finalize_command(uint8_t *packet, uint16_t packet_size) {
     add_command_arg_16(&checksum_ptr, checksum);
 }
 
-static size_t read_bytes(uint8_t *buffer, size_t len) {
-    size_t remaining = len;
-    size_t offset = 0;
+// Runs in the RX task for every frame the parser delimits
+static void on_frame(r502_frame_status_t status, const uint8_t *frame, size_t len, void *ctx) {
+    r502_handle_t dev = ctx;
+    frame_result_t result = FRAME_IGNORED;
+
+    portENTER_CRITICAL(&dev->pending_lock);
+    if (!r502_link_guard_accept(&dev->link_guard, esp_timer_get_time())) {
+        dev->link_stats.late_frames++;
+    } else if (!dev->pending.active) {
+        dev->link_stats.unexpected_frames++;
+    } else if (status != R502_FRAME_OK) {
+        dev->pending.result = status == R502_FRAME_BAD_CHECKSUM ? ESP_ERR_INVALID_CRC : ESP_ERR_INVALID_RESPONSE;
+        result = FRAME_DONE;
+    } else {
+        result = dev->pending.handler(frame, len, dev->pending.ctx);
+        dev->pending.result = ESP_OK;
+    }
+    if (result == FRAME_DONE) {
+        dev->pending.active = false;
+    }
+    portEXIT_CRITICAL(&dev->pending_lock);
 
-    while (remaining > 0) {
-        int read = uart_read_bytes(g_config.uart_num, buffer + offset, remaining,  pdMS_TO_TICKS(g_uart_timeout));
-        if(read <= 0)
-            break;
+    if (result != FRAME_IGNORED) {
+        xSemaphoreGive(dev->cmd_done);
+    }
+}
+
+static void rx_task(void *arg) {
+    r502_handle_t dev = arg;
+    uart_event_t event;
+    uint8_t buffer[128];
 
-        offset += read;
-        remaining -= read;
+    while (1) {
+        if (xQueueReceive(dev->uart_queue, &event, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        switch (event.type) {
+            case UART_DATA: {
+                size_t available = 0;
+                uart_get_buffered_data_len(dev->config.uart_num, &available);
+                while (available > 0) {
+                    int read = uart_read_bytes(dev->config.uart_num, buffer,
+                                               available < sizeof(buffer) ? available : sizeof(buffer), 0);
+                    if (read <= 0) {
+                        break;
+                    }
+                    r502_parser_feed(&dev->parser, buffer, read, on_frame, dev);
+                    available -= read;
+                }
+                break;
+            }
+            case UART_FIFO_OVF:
+            case UART_BUFFER_FULL:
+                // Bytes were lost; start over from a clean buffer
+                ESP_LOGW(TAG, "UART%d: overflow, resyncing", dev->config.uart_num);
+                portENTER_CRITICAL(&dev->pending_lock);
+                dev->link_stats.overflows++;
+                portEXIT_CRITICAL(&dev->pending_lock);
+                uart_flush_input(dev->config.uart_num);
+                xQueueReset(dev->uart_queue);
+                r502_parser_reset(&dev->parser);
+                break;
+            default:
+                break;
+        }
     }
-    return offset;
 }
 
-void r502_init(r502_config_t cfg) {
-    g_config = cfg;
+esp_err_t r502_init(r502_config_t cfg, r502_handle_t *handle) {
+    r502_handle_t dev = calloc(1, sizeof(struct r502_dev));
+    if (dev == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    dev->config = cfg;
+    dev->uart_timeout = R502_DEFAULT_TIMEOUT_MS;
+    dev->baud_rate = R502_DEFAULT_BAUD_RATE;
+    dev->data_packet_size = 128;
+    portMUX_INITIALIZE(&dev->pending_lock);
+    portMUX_INITIALIZE(&dev->index_lock);
+    dev->upchar.dev = dev;
 
     uart_config_t uart_cfg = {
         .baud_rate = R502_DEFAULT_BAUD_RATE,
@@ -119,77 +287,167 @@ void r502_init(r502_config_t cfg) {
         .source_clk = UART_SCLK_DEFAULT,
     };
 
-    ESP_ERROR_CHECK(uart_param_config(g_config.uart_num, &uart_cfg));
-    ESP_ERROR_CHECK(uart_set_pin(g_config.uart_num, g_config.tx_pin, g_config.rx_pin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
-    ESP_ERROR_CHECK(uart_driver_install(g_config.uart_num, 2048, 2048, 0, NULL, 0));
+    // A UART already taken by another reader fails here
+    esp_err_t err = uart_driver_install(dev->config.uart_num, 2048, 2048, UART_EVENT_QUEUE_LEN, &dev->uart_queue, 0);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "UART%d: driver install failed: %s", dev->config.uart_num, esp_err_to_name(err));
+        free(dev);
+        return err;
+    }
+    ESP_ERROR_CHECK(uart_param_config(dev->config.uart_num, &uart_cfg));
+    ESP_ERROR_CHECK(uart_set_pin(dev->config.uart_num, dev->config.tx_pin, dev->config.rx_pin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+
+    r502_parser_init(&dev->parser, dev->config.address);
+    dev->cmd_mutex = xSemaphoreCreateRecursiveMutex();
+    dev->cmd_done = xSemaphoreCreateBinary();
+    if (dev->cmd_mutex == NULL || dev->cmd_done == NULL ||
+        xTaskCreate(rx_task, "R502 RX", 3072, dev, 10, &dev->rx_task) != pdPASS) {
+        r502_deinit(dev);
+        return ESP_ERR_NO_MEM;
+    }
 
     // Configure enable pin if used
-    if (g_config.en_pin >= 0) {
+    if (dev->config.en_pin >= 0) {
         gpio_config_t io_conf = {
-            .pin_bit_mask = (1ULL << g_config.en_pin),
+            .pin_bit_mask = (1ULL << dev->config.en_pin),
             .mode = GPIO_MODE_OUTPUT,
             .pull_up_en = GPIO_PULLUP_DISABLE,
             .pull_down_en = GPIO_PULLDOWN_DISABLE,
             .intr_type = GPIO_INTR_DISABLE
         };
         gpio_config(&io_conf);
-        gpio_set_level(g_config.en_pin, 1); // Disabled by default
+        gpio_set_level(dev->config.en_pin, 1); // Disabled by default
     }
 
     // Configure IRQ pin if used
-    if (g_config.irq_pin >= 0) {
+    if (dev->config.irq_pin >= 0) {
         gpio_config_t io_conf = {
-            .pin_bit_mask = (1ULL << g_config.irq_pin),
+            .pin_bit_mask = (1ULL << dev->config.irq_pin),
             .mode = GPIO_MODE_INPUT,
             .pull_up_en = GPIO_PULLUP_DISABLE,
             .pull_down_en = GPIO_PULLDOWN_DISABLE,
             .intr_type = GPIO_INTR_DISABLE // Will be configured when callback is set
         };
         gpio_config(&io_conf);
+
+        // Touch events wake r502_wait_touch() callers
+        dev->touch_sem = xSemaphoreCreateBinary();
+        if (dev->touch_sem != NULL) {
+            r502_add_irq_callback(dev, touch_irq_callback, dev);
+        }
+    }
+
+    *handle = dev;
+    return ESP_OK;
+}
+
+void r502_deinit(r502_handle_t dev) {
+    if (dev->config.irq_pin >= 0 && dev->callback_count > 0) {
+        r502_clear_irq_callbacks(dev);
+    }
+    if (dev->rx_task != NULL) {
+        vTaskDelete(dev->rx_task);
     }
+    uart_driver_delete(dev->config.uart_num);
+    if (dev->touch_sem != NULL) {
+        vSemaphoreDelete(dev->touch_sem);
+    }
+    if (dev->cmd_done != NULL) {
+        vSemaphoreDelete(dev->cmd_done);
+    }
+    if (dev->cmd_mutex != NULL) {
+        vSemaphoreDelete(dev->cmd_mutex);
+    }
+    free(dev);
 }
 
-void r502_set_timeout(uint32_t timeout_ms) {
-    g_uart_timeout = timeout_ms;
+void r502_lock(r502_handle_t dev) {
+    xSemaphoreTakeRecursive(dev->cmd_mutex, portMAX_DELAY);
 }
 
-void r502_set_enable(bool enable) {
+void r502_unlock(r502_handle_t dev) {
+    xSemaphoreGiveRecursive(dev->cmd_mutex);
+}
+
+void r502_set_timeout(r502_handle_t dev, uint32_t timeout_ms) {
+    dev->uart_timeout = timeout_ms;
+}
+
+void r502_set_enable(r502_handle_t dev, bool enable) {
     // HI = disabled, LOW = enabled
-    if (g_config.en_pin >= 0) {
-        gpio_set_level(g_config.en_pin, enable ? 0 : 1);
+    if (dev->config.en_pin >= 0) {
+        gpio_set_level(dev->config.en_pin, enable ? 0 : 1);
         if (enable) {
             vTaskDelay(pdMS_TO_TICKS(300));
-            uart_flush(g_config.uart_num);
+            uart_flush(dev->config.uart_num);
         }
     }
 }
 
-bool r502_is_enabled(void) {
-    if (g_config.en_pin >= 0) {
-        return gpio_get_level(g_config.en_pin) == 1;
+bool r502_is_enabled(r502_handle_t dev) {
+    if (dev->config.en_pin >= 0) {
+        return gpio_get_level(dev->config.en_pin) == 1;
     }
     return true;
 }
 
-void r502_add_irq_callback(r502_irq_callback callback) {
-    if (g_config.irq_pin < 0) {
+bool r502_has_touch_irq(r502_handle_t dev) {
+    return dev->touch_sem != NULL;
+}
+
+// Block until the IRQ line reports a touch or timeout_ms elapses. Without an IRQ pin this is a
+// plain delay, so callers polling GenImg keep working unchanged.
+bool r502_wait_touch(r502_handle_t dev, uint32_t timeout_ms) {
+    if (dev->touch_sem == NULL) {
+        vTaskDelay(pdMS_TO_TICKS(timeout_ms));
+        return false;
+    }
+    return xSemaphoreTake(dev->touch_sem, pdMS_TO_TICKS(timeout_ms)) == pdTRUE;
+}
+
+// Forget touches that happened before the caller started waiting
+void r502_clear_touch(r502_handle_t dev) {
+    if (dev->touch_sem != NULL) {
+        xSemaphoreTake(dev->touch_sem, 0);
+    }
+}
+
+int64_t r502_get_touch_time(r502_handle_t dev) {
+    return dev->touch_time_us;
+}
+
+void r502_get_link_stats(r502_handle_t dev, r502_link_stats_t *stats) {
+    portENTER_CRITICAL(&dev->pending_lock);
+    *stats = dev->link_stats;
+    stats->baud_rate = dev->baud_rate;
+    stats->data_packet_size = dev->data_packet_size;
+    stats->frames = dev->parser.stats.frames;
+    stats->resyncs = dev->parser.stats.resyncs;
+    stats->discarded_bytes = dev->parser.stats.discarded_bytes;
+    stats->checksum_errors = dev->parser.stats.checksum_errors;
+    stats->length_errors = dev->parser.stats.length_errors;
+    portEXIT_CRITICAL(&dev->pending_lock);
+}
+
+void r502_add_irq_callback(r502_handle_t dev, r502_irq_callback callback, void *arg) {
+    if (dev->config.irq_pin < 0) {
         ESP_LOGE(TAG, "IRQ pin not configured");
         return;
     }
 
-    if (g_callback_counter >= MAX_CALLBACKS) {
+    if (dev->callback_count >= MAX_CALLBACKS) {
         ESP_LOGE(TAG, "Max callbacks reached");
         return;
     }
 
     // Add callback to list
-    g_irq_callbacks[g_callback_counter++] = callback;
+    dev->irq_callbacks[dev->callback_count++] = (irq_callback_t){.callback = callback, .arg = arg};
 
     // Configure GPIO interrupt if first callback
-    if (g_callback_counter == 1) {
-        gpio_set_intr_type(g_config.irq_pin, GPIO_INTR_NEGEDGE);
+    if (dev->callback_count == 1) {
+        gpio_set_intr_type(dev->config.irq_pin, GPIO_INTR_NEGEDGE);
 
-        // Install ISR service if not already installed
+        // Install ISR service if not already installed; it is shared by all readers
         static bool isr_service_installed = false;
         if (!isr_service_installed) {
             gpio_install_isr_service(0);
@@ -197,77 +455,230 @@ void r502_add_irq_callback(r502_irq_callback callback) {
         }
 
         // Hook ISR handler for this pin
-        gpio_isr_handler_add(g_config.irq_pin, gpio_isr_handler, NULL);
+        gpio_isr_handler_add(dev->config.irq_pin, gpio_isr_handler, dev);
     }
 }
 
-void r502_remove_irq_callback(r502_irq_callback callback) {
-    if (g_config.irq_pin < 0) {
+void r502_remove_irq_callback(r502_handle_t dev, r502_irq_callback callback, void *arg) {
+    if (dev->config.irq_pin < 0) {
         ESP_LOGE(TAG, "IRQ pin not configured");
         return;
     }
 
     // Find and remove callback
-    for (int i = 0; i < g_callback_counter; i++) {
-        if (g_irq_callbacks[i] == callback) {
+    for (int i = 0; i < dev->callback_count; i++) {
+        if (dev->irq_callbacks[i].callback == callback && dev->irq_callbacks[i].arg == arg) {
             // Shift remaining callbacks down
-            for (int j = i; j < g_callback_counter - 1; j++) {
-                g_irq_callbacks[j] = g_irq_callbacks[j + 1];
+            for (int j = i; j < dev->callback_count - 1; j++) {
+                dev->irq_callbacks[j] = dev->irq_callbacks[j + 1];
             }
-            g_callback_counter--;
-            g_irq_callbacks[g_callback_counter] = NULL;
+            dev->callback_count--;
+            dev->irq_callbacks[dev->callback_count] = (irq_callback_t){0};
             break;
         }
     }
 
     // Disable interrupt if no more callbacks
-    if (g_callback_counter == 0) {
-        gpio_set_intr_type(g_config.irq_pin, GPIO_INTR_DISABLE);
-        gpio_isr_handler_remove(g_config.irq_pin);
+    if (dev->callback_count == 0) {
+        gpio_set_intr_type(dev->config.irq_pin, GPIO_INTR_DISABLE);
+        gpio_isr_handler_remove(dev->config.irq_pin);
     }
 }
 
-void r502_clear_irq_callbacks() {
-    if (g_config.irq_pin < 0) {
+void r502_clear_irq_callbacks(r502_handle_t dev) {
+    if (dev->config.irq_pin < 0) {
         ESP_LOGE(TAG, "IRQ pin not configured");
         return;
     }
 
     // Clear all callbacks
-    g_callback_counter = 0;
-    memset(g_irq_callbacks, 0, sizeof(g_irq_callbacks));
+    dev->callback_count = 0;
+    memset(dev->irq_callbacks, 0, sizeof(dev->irq_callbacks));
 
     // Disable interrupt
-    gpio_set_intr_type(g_config.irq_pin, GPIO_INTR_DISABLE);
-    gpio_isr_handler_remove(g_config.irq_pin);
+    gpio_set_intr_type(dev->config.irq_pin, GPIO_INTR_DISABLE);
+    gpio_isr_handler_remove(dev->config.irq_pin);
 }
 
-static esp_err_t send_command(uint8_t *packet, size_t packet_len, uint8_t *response, size_t response_len, r502_generic_reply *reply) {
-    uart_write_bytes(g_config.uart_num, (char*)packet, packet_len);
-    size_t read = read_bytes(response, response_len);
-    if (read == 0) {
-        return ESP_ERR_TIMEOUT;
+// Caller holds dev->pending_lock.
+static void record_rtt(r502_handle_t dev, uint8_t command, uint32_t us) {
+    rtt_slot_t *slot = NULL;
+    for (size_t i = 0; i < dev->rtt_count; i++) {
+        if (dev->rtt[i].command == command) {
+            slot = &dev->rtt[i];
+            break;
+        }
+    }
+    if (slot == NULL) {
+        if (dev->rtt_count == RTT_SLOTS) {
+            return;
+        }
+        slot = &dev->rtt[dev->rtt_count++];
+        slot->command = command;
     }
+    slot->count++;
+    slot->total_us += us;
+    slot->last_us = us;
+    if (us > slot->max_us) {
+        slot->max_us = us;
+    }
+}
 
-    if (read != response_len) {
-        return ESP_ERR_INVALID_RESPONSE;
+// A corrupted acknowledge does not tell whether the module carried out the command. These change
+// state in a way a second copy can break, so they are never sent twice.
+static bool command_retryable(uint8_t command) {
+    switch (command) {
+        case 0x0E: // SetSysPara: the module may already use the new baud rate or package length
+        case 0x12: // SetPwd: the copy would need the new password
+        case 0x0D: // Empty
+        case 0x09: // DownChar: once acknowledged the module takes what follows as template data
+            return false;
+        default:
+            return true;
     }
+}
 
-    if (!check_checksum(response, read)) {
-        return ESP_ERR_INVALID_CRC;
+// Hold the next command back while a timed-out one may still answer
+static void settle_link(r502_handle_t dev) {
+    while (1) {
+        portENTER_CRITICAL(&dev->pending_lock);
+        int64_t wait_us = r502_link_guard_wait(&dev->link_guard, esp_timer_get_time());
+        portEXIT_CRITICAL(&dev->pending_lock);
+        if (wait_us == 0) {
+            return;
+        }
+        vTaskDelay(pdMS_TO_TICKS(wait_us / 1000) + 1);
+    }
+}
+
+// Send packet and feed the frames that come back to handler until it reports the command done.
+// A corrupted reply sends an idempotent command again, up to COMMAND_RETRIES times, unless the
+// command streams data to drain: what was drained can not be taken back. After a timeout, or a
+// transfer aborted by drain, the link is closed until the abandoned command has gone quiet.
+static esp_err_t transact(r502_handle_t dev, const uint8_t *packet, size_t packet_len, frame_handler_t handler, void *ctx,
+                          drain_fn_t drain, uint32_t timeout_ms) {
+    xSemaphoreTakeRecursive(dev->cmd_mutex, portMAX_DELAY);
+    esp_err_t err = ESP_ERR_TIMEOUT;
+    int64_t start_us = 0;
+    bool abandoned = false;
+    // The command code sits right after the header
+    uint8_t command = packet[R502_HEADER_SIZE];
+    int retries = drain == NULL && command_retryable(command) ? COMMAND_RETRIES : 0;
+
+    settle_link(dev);
+
+    for (int attempt = 0; attempt <= retries; attempt++) {
+        xSemaphoreTake(dev->cmd_done, 0);
+        portENTER_CRITICAL(&dev->pending_lock);
+        if (attempt > 0) {
+            dev->link_stats.retries++;
+        }
+        dev->pending = (pending_command_t){.active = true, .handler = handler, .ctx = ctx};
+        portEXIT_CRITICAL(&dev->pending_lock);
+
+        start_us = esp_timer_get_time();
+        uart_write_bytes(dev->config.uart_num, (const char*)packet, packet_len);
+
+        // The timeout applies per frame, so long transfers are fine as long as data keeps coming
+        while (1) {
+            if (xSemaphoreTake(dev->cmd_done, pdMS_TO_TICKS(timeout_ms)) != pdTRUE) {
+                portENTER_CRITICAL(&dev->pending_lock);
+                bool completed = !dev->pending.active; // Completed between the timeout and here
+                dev->pending.active = false;
+                err = completed ? dev->pending.result : ESP_ERR_TIMEOUT;
+                portEXIT_CRITICAL(&dev->pending_lock);
+                break;
+            }
+
+            portENTER_CRITICAL(&dev->pending_lock);
+            bool active = dev->pending.active;
+            err = dev->pending.result;
+            portEXIT_CRITICAL(&dev->pending_lock);
+
+            if (drain != NULL) {
+                esp_err_t drain_err = drain(ctx);
+                if (drain_err != ESP_OK) {
+                    portENTER_CRITICAL(&dev->pending_lock);
+                    dev->pending.active = false;
+                    portEXIT_CRITICAL(&dev->pending_lock);
+                    err = drain_err;
+                    abandoned = true;
+                    break;
+                }
+            }
+            if (!active) {
+                break;
+            }
+        }
+
+        if (err != ESP_ERR_INVALID_CRC && err != ESP_ERR_INVALID_RESPONSE) {
+            break;
+        }
+    }
+
+    portENTER_CRITICAL(&dev->pending_lock);
+    if (err == ESP_OK) {
+        record_rtt(dev, command, (uint32_t)(esp_timer_get_time() - start_us));
+    } else if (err == ESP_ERR_TIMEOUT) {
+        dev->link_stats.timeouts++;
+        abandoned = true;
+    }
+    if (abandoned) {
+        uint32_t quiet_ms = timeout_ms < LATE_REPLY_QUIET_MS ? timeout_ms : LATE_REPLY_QUIET_MS;
+        r502_link_guard_close(&dev->link_guard, esp_timer_get_time(), (int64_t)quiet_ms * 1000);
+    }
+    portEXIT_CRITICAL(&dev->pending_lock);
+    xSemaphoreGiveRecursive(dev->cmd_mutex);
+    return err;
+}
+
+typedef struct {
+    uint8_t *buffer;
+    size_t   size;
+    size_t   len;
+} reply_buffer_t;
+
+static frame_result_t copy_reply(const uint8_t *frame, size_t len, void *ctx) {
+    reply_buffer_t *reply = ctx;
+    if (frame[6] != R502_PID_ACK) {
+        return FRAME_IGNORED; // Keep waiting for the acknowledge
+    }
+    // A length other than expected is left for send_command to report
+    if (len == reply->size) {
+        memcpy(reply->buffer, frame, len);
+    }
+    reply->len = len;
+    return FRAME_DONE;
+}
+
+static esp_err_t send_command_timeout(r502_handle_t dev, uint8_t *packet, size_t packet_len, uint8_t *response, size_t response_len,
+                                      r502_generic_reply *reply, uint32_t timeout_ms) {
+    reply_buffer_t buffer = {.buffer = response, .size = response_len};
+    esp_err_t err = transact(dev, packet, packet_len, copy_reply, &buffer, NULL, timeout_ms);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    // The frame is valid, but not the reply this command expects
+    if (buffer.len != response_len) {
+        return ESP_ERR_INVALID_RESPONSE;
     }
 
     reply->conf_code = response[9];
     return ESP_OK;
 }
 
+static esp_err_t send_command(r502_handle_t dev, uint8_t *packet, size_t packet_len, uint8_t *response, size_t response_len, r502_generic_reply *reply) {
+    return send_command_timeout(dev, packet, packet_len, response, response_len, reply, dev->uart_timeout);
+}
+
 // Command implementations ----------------------------------------------------
 
- esp_err_t r502_setsyspara(r502_param_num_t param_num, uint8_t value, r502_generic_reply *reply) {
+ esp_err_t r502_setsyspara(r502_handle_t dev, r502_param_num_t param_num, uint8_t value, r502_generic_reply *reply) {
     uint8_t packet[R502_SET_SYS_PARA_PACKET_SIZE] = {0};
 
     // Build command package (instruction code 0x0E)
-    uint8_t *payload = init_command(packet, 0x0E, sizeof(packet));
+    uint8_t *payload = init_command(dev, packet, 0x0E, sizeof(packet));
 
     // Add parameters
     add_command_arg_8(&payload, (uint8_t)param_num); // Parameter number
@@ -277,13 +688,13 @@ static esp_err_t send_command(uint8_t *packet, size_t packet_len, uint8_t *respo
 
     // Response format: 12 bytes (header + checksum)
     uint8_t response[12];
-    return send_command(packet, sizeof(packet), response, sizeof(response), reply);
+    return send_command(dev, packet, sizeof(packet), response, sizeof(response), reply);
 }
 
 // Helper function to get the current status of the sensor using r502_readsyspara command
- esp_err_t r502_get_status(r502_status_t *status) {
+ esp_err_t r502_get_status(r502_handle_t dev, r502_status_t *status) {
     r502_syspara_reply reply;
-    esp_err_t err = r502_readsyspara(&reply);
+    esp_err_t err = r502_readsyspara(dev, &reply);
     if (err != ESP_OK) {
         return err;
     }
@@ -297,17 +708,17 @@ static esp_err_t send_command(uint8_t *packet, size_t packet_len, uint8_t *respo
     return ESP_OK;
 }
 
-esp_err_t r502_readsyspara(r502_syspara_reply *reply) {
+esp_err_t r502_readsyspara(r502_handle_t dev, r502_syspara_reply *reply) {
     uint8_t packet[R502_READ_SYS_PARA_PACKET_SIZE] = {0};
 
     // Build command package (instruction code 0x0F)
-    init_command(packet, 0x0F, sizeof(packet));
+    init_command(dev, packet, 0x0F, sizeof(packet));
     finalize_command(packet, sizeof(packet));
 
     // Response format: 28 bytes (header + 16 bytes parameters + checksum)
     uint8_t response[28];
     r502_generic_reply generic_reply;
-    esp_err_t err = send_command(packet, sizeof(packet), response, sizeof(response), &generic_reply);
+    esp_err_t err = send_command(dev, packet, sizeof(packet), response, sizeof(response), &generic_reply);
 
     // Parse system parameters if successful
     if (err == ESP_OK && generic_reply.conf_code == 0x00) {
@@ -324,10 +735,10 @@ esp_err_t r502_readsyspara(r502_syspara_reply *reply) {
     return err;
 }
 
-esp_err_t r502_auraledconfig(uint8_t control, uint8_t speed, uint8_t color, uint8_t times, r502_generic_reply *reply) {
+esp_err_t r502_auraledconfig(r502_handle_t dev, uint8_t control, uint8_t speed, uint8_t color, uint8_t times, r502_generic_reply *reply) {
     uint8_t packet[R502_AURALED_PACKET_SIZE] = {0};
 
-    uint8_t *payload = init_command(packet, 0x35, sizeof(packet)); // Command code, data length
+    uint8_t *payload = init_command(dev, packet, 0x35, sizeof(packet)); // Command code, data length
     add_command_arg_8(&payload, control); // 1 - breathing, 2 - flashing, 3 - on, 4 - off
     add_command_arg_8(&payload, speed); // 0x00-0xff, 256 gears, Minimum 5s cycle.
     add_command_arg_8(&payload, color); // Colors: 1=red, 2=blue, 3=purple
@@ -336,23 +747,45 @@ esp_err_t r502_auraledconfig(uint8_t control, uint8_t speed, uint8_t color, uint
     finalize_command(packet, sizeof(packet));
 
     uint8_t response[12];
-    return send_command(packet, sizeof(packet), response, sizeof(response), reply);
+    return send_command(dev, packet, sizeof(packet), response, sizeof(response), reply);
 }
 
-esp_err_t r502_genimg(r502_generic_reply *reply) {
+esp_err_t r502_genimg(r502_handle_t dev, r502_generic_reply *reply) {
     uint8_t packet[R502_GENIMG_PACKET_SIZE] = {0};
 
-    init_command(packet, 0x01, sizeof(packet)); // GenImg command
+    init_command(dev, packet, 0x01, sizeof(packet)); // GenImg command
     finalize_command(packet, sizeof(packet));
 
     uint8_t response[12];
-    return send_command(packet, sizeof(packet), response, sizeof(response), reply);
+    return send_command(dev, packet, sizeof(packet), response, sizeof(response), reply);
+}
+
+esp_err_t r502_match(r502_handle_t dev, r502_match_reply *reply) {
+    uint8_t packet[R502_MATCH_PACKET_SIZE] = {0};
+
+    init_command(dev, packet, 0x03, sizeof(packet)); // Match command
+    finalize_command(packet, sizeof(packet));
+
+    uint8_t response[14];
+    r502_generic_reply generic_reply;
+    esp_err_t err = send_command(dev, packet, sizeof(packet), response, sizeof(response), &generic_reply);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    reply->conf_code = generic_reply.conf_code;
+    reply->match_score = 0;
+    if (generic_reply.conf_code == 0x00) {
+        reply->match_score = (response[10] << 8) | response[11];
+    }
+
+    return err;
 }
 
-esp_err_t r502_search(uint8_t buffer, uint16_t start, uint16_t count, r502_search_reply *reply) {
+esp_err_t r502_search(r502_handle_t dev, uint8_t buffer, uint16_t start, uint16_t count, r502_search_reply *reply) {
     uint8_t packet[R502_SEARCH_PACKET_SIZE] = {0};
 
-    uint8_t *payload = init_command(packet, 0x04, sizeof(packet)); // Search command
+    uint8_t *payload = init_command(dev, packet, 0x04, sizeof(packet)); // Search command
     add_command_arg_8(&payload, buffer);
     add_command_arg_16(&payload, start);
     add_command_arg_16(&payload, count);
@@ -361,7 +794,7 @@ esp_err_t r502_search(uint8_t buffer, uint16_t start, uint16_t count, r502_searc
 
     uint8_t response[16];
     r502_generic_reply generic_reply;
-    esp_err_t err = send_command(packet, sizeof(packet), response, sizeof(response), &generic_reply);
+    esp_err_t err = send_command(dev, packet, sizeof(packet), response, sizeof(response), &generic_reply);
     if (err != ESP_OK) {
         return err;
     }
@@ -376,38 +809,38 @@ esp_err_t r502_search(uint8_t buffer, uint16_t start, uint16_t count, r502_searc
     return err;
 }
 
-esp_err_t r502_vfypwd(uint32_t password, r502_generic_reply *reply) {
+esp_err_t r502_vfypwd(r502_handle_t dev, uint32_t password, r502_generic_reply *reply) {
     uint8_t packet[R502_VFYPWD_PACKET_SIZE] = {0};
 
-    uint8_t *payload = init_command(packet, 0x13, sizeof(packet)); // VfyPwd command
+    uint8_t *payload = init_command(dev, packet, 0x13, sizeof(packet)); // VfyPwd command
     add_command_arg_32(&payload, password);
     finalize_command(packet, sizeof(packet));
 
     uint8_t response[12];
-    return send_command(packet, sizeof(packet), response, sizeof(response), reply);
+    return send_command(dev, packet, sizeof(packet), response, sizeof(response), reply);
 }
 
-esp_err_t r502_img2tz(uint8_t buffer, r502_generic_reply *reply) {
+esp_err_t r502_img2tz(r502_handle_t dev, uint8_t buffer, r502_generic_reply *reply) {
     uint8_t packet[R502_IMG2TZ_PACKET_SIZE] = {0};
 
-    uint8_t *payload = init_command(packet, 0x02, sizeof(packet)); // Img2Tz command
+    uint8_t *payload = init_command(dev, packet, 0x02, sizeof(packet)); // Img2Tz command
     add_command_arg_8(&payload, buffer);
 
     finalize_command(packet, sizeof(packet));
 
     uint8_t response[12];
-    return send_command(packet, sizeof(packet), response, sizeof(response), reply);
+    return send_command(dev, packet, sizeof(packet), response, sizeof(response), reply);
 }
 
-esp_err_t r502_templatenum(r502_templatenum_reply *reply) {
+esp_err_t r502_templatenum(r502_handle_t dev, r502_templatenum_reply *reply) {
     uint8_t packet[R502_TEMPLATENUM_PACKET_SIZE] = {0};
 
-    init_command(packet, 0x1d, sizeof(packet)); // TemplateNum command
+    init_command(dev, packet, 0x1d, sizeof(packet)); // TemplateNum command
     finalize_command(packet, sizeof(packet));
 
     uint8_t response[14];
     r502_generic_reply generic_reply;
-    esp_err_t err = send_command(packet, sizeof(packet), response, sizeof(response), &generic_reply);
+    esp_err_t err = send_command(dev, packet, sizeof(packet), response, sizeof(response), &generic_reply);
     if (err != ESP_OK) {
         return err;
     }
@@ -421,81 +854,126 @@ esp_err_t r502_templatenum(r502_templatenum_reply *reply) {
     return err;
 }
 
-esp_err_t r502_regmodel(r502_generic_reply *reply) {
+esp_err_t r502_regmodel(r502_handle_t dev, r502_generic_reply *reply) {
     uint8_t packet[R502_REGMODEL_PACKET_SIZE] = {0};
 
-    init_command(packet, 0x05, sizeof(packet)); // RegModel command
+    init_command(dev, packet, 0x05, sizeof(packet)); // RegModel command
     finalize_command(packet, sizeof(packet));
 
     uint8_t response[12];
-    return send_command(packet, sizeof(packet), response, sizeof(response), reply);
+    return send_command(dev, packet, sizeof(packet), response, sizeof(response), reply);
+}
+
+// Caller holds dev->index_lock.
+static void index_mark(r502_handle_t dev, uint16_t start, uint16_t count, bool occupied) {
+    for (uint32_t i = start; i < (uint32_t)start + count && i < dev->lib_size; i++) {
+        uint8_t mask = 1 << (i % 8);
+        bool was = (dev->index[i / 8] & mask) != 0;
+        if (was == occupied) {
+            continue;
+        }
+        if (occupied) {
+            dev->index[i / 8] |= mask;
+            dev->template_count++;
+        } else {
+            dev->index[i / 8] &= ~mask;
+            dev->template_count--;
+            if (i < dev->free_hint) {
+                dev->free_hint = i;
+            }
+        }
+    }
 }
 
-esp_err_t r502_store(uint8_t buffer, uint16_t index, r502_generic_reply *reply) {
+esp_err_t r502_store(r502_handle_t dev, uint8_t buffer, uint16_t index, r502_generic_reply *reply) {
     uint8_t packet[R502_STORE_PACKET_SIZE] = {0};
 
-    uint8_t *payload = init_command(packet, 0x06, sizeof(packet)); // Store command
+    uint8_t *payload = init_command(dev, packet, 0x06, sizeof(packet)); // Store command
     add_command_arg_8(&payload, buffer);
     add_command_arg_16(&payload, index);
     finalize_command(packet, sizeof(packet));
 
     uint8_t response[12];
-    return send_command(packet, sizeof(packet), response, sizeof(response), reply);
+    esp_err_t err = send_command(dev, packet, sizeof(packet), response, sizeof(response), reply);
+    if (err == ESP_OK && reply->conf_code == 0x00) {
+        portENTER_CRITICAL(&dev->index_lock);
+        index_mark(dev, index, 1, true);
+        portEXIT_CRITICAL(&dev->index_lock);
+    }
+    return err;
 }
 
-esp_err_t r502_handshake(r502_generic_reply *reply) {
+static esp_err_t handshake_timeout(r502_handle_t dev, uint32_t timeout_ms, r502_generic_reply *reply) {
     uint8_t packet[R502_HANDSHAKE_PACKET_SIZE] = {0};
 
-    init_command(packet, 0x40, sizeof(packet)); // HandShake command
+    init_command(dev, packet, 0x40, sizeof(packet)); // HandShake command
     finalize_command(packet, sizeof(packet));
 
     uint8_t response[12];
-    return send_command(packet, sizeof(packet), response, sizeof(response), reply);
+    return send_command_timeout(dev, packet, sizeof(packet), response, sizeof(response), reply, timeout_ms);
+}
+
+esp_err_t r502_handshake(r502_handle_t dev, r502_generic_reply *reply) {
+    return handshake_timeout(dev, dev->uart_timeout, reply);
 }
 
-esp_err_t r502_setpwd(uint32_t new_password, r502_generic_reply *reply) {
+esp_err_t r502_setpwd(r502_handle_t dev, uint32_t new_password, r502_generic_reply *reply) {
     uint8_t packet[R502_SETPWD_PACKET_SIZE] = {0};
 
-    uint8_t *payload = init_command(packet, 0x12, sizeof(packet)); // SetPwd command
+    uint8_t *payload = init_command(dev, packet, 0x12, sizeof(packet)); // SetPwd command
     add_command_arg_32(&payload, new_password);
     finalize_command(packet, sizeof(packet));
 
     uint8_t response[12];
-    return send_command(packet, sizeof(packet), response, sizeof(response), reply);
+    return send_command(dev, packet, sizeof(packet), response, sizeof(response), reply);
 }
 
-esp_err_t r502_deletechar(uint16_t start, uint16_t count, r502_generic_reply *reply) {
+esp_err_t r502_deletechar(r502_handle_t dev, uint16_t start, uint16_t count, r502_generic_reply *reply) {
     uint8_t packet[R502_DELETECHAR_PACKET_SIZE] = {0};
 
-    uint8_t *payload = init_command(packet, 0x0c, sizeof(packet)); // DeleteChar command
+    uint8_t *payload = init_command(dev, packet, 0x0c, sizeof(packet)); // DeleteChar command
     add_command_arg_16(&payload, start);
     add_command_arg_16(&payload, count);
     finalize_command(packet, sizeof(packet));
 
     uint8_t response[12];
-    return send_command(packet, sizeof(packet), response, sizeof(response), reply);
+    esp_err_t err = send_command(dev, packet, sizeof(packet), response, sizeof(response), reply);
+    if (err == ESP_OK && reply->conf_code == 0x00) {
+        portENTER_CRITICAL(&dev->index_lock);
+        index_mark(dev, start, count, false);
+        portEXIT_CRITICAL(&dev->index_lock);
+    }
+    return err;
 }
 
-esp_err_t r502_empty(r502_generic_reply *reply) {
+esp_err_t r502_empty(r502_handle_t dev, r502_generic_reply *reply) {
     uint8_t packet[R502_EMPTY_PACKET_SIZE] = {0};
 
-    init_command(packet, 0x0d, sizeof(packet)); // Empty command
+    init_command(dev, packet, 0x0d, sizeof(packet)); // Empty command
     finalize_command(packet, sizeof(packet));
 
     uint8_t response[12];
-    return send_command(packet, sizeof(packet), response, sizeof(response), reply);
+    esp_err_t err = send_command(dev, packet, sizeof(packet), response, sizeof(response), reply);
+    if (err == ESP_OK && reply->conf_code == 0x00) {
+        portENTER_CRITICAL(&dev->index_lock);
+        memset(dev->index, 0, sizeof(dev->index));
+        dev->template_count = 0;
+        dev->free_hint = 0;
+        portEXIT_CRITICAL(&dev->index_lock);
+    }
+    return err;
 }
 
-esp_err_t r502_readindextable(uint8_t page, r502_indextable_reply *reply) {
+esp_err_t r502_readindextable(r502_handle_t dev, uint8_t page, r502_indextable_reply *reply) {
     uint8_t packet[R502_READINDEXTABLE_PACKET_SIZE] = {0};
 
-    uint8_t *payload = init_command(packet, 0x1f, sizeof(packet)); // ReadIndexTable command
+    uint8_t *payload = init_command(dev, packet, 0x1f, sizeof(packet)); // ReadIndexTable command
     add_command_arg_8(&payload, page);
     finalize_command(packet, sizeof(packet));
 
     uint8_t response[44];
     r502_generic_reply generic_reply;
-    esp_err_t err = send_command(packet, sizeof(packet), response, sizeof(response), &generic_reply);
+    esp_err_t err = send_command(dev, packet, sizeof(packet), response, sizeof(response), &generic_reply);
 
     reply->conf_code = generic_reply.conf_code;
 
@@ -505,3 +983,446 @@ esp_err_t r502_readindextable(uint8_t page, r502_indextable_reply *reply) {
 
     return err;
 }
+
+esp_err_t r502_loadchar(r502_handle_t dev, uint8_t buffer, uint16_t index, r502_generic_reply *reply) {
+    uint8_t packet[R502_LOADCHAR_PACKET_SIZE] = {0};
+
+    uint8_t *payload = init_command(dev, packet, 0x07, sizeof(packet)); // LoadChar command
+    add_command_arg_8(&payload, buffer);
+    add_command_arg_16(&payload, index);
+    finalize_command(packet, sizeof(packet));
+
+    uint8_t response[12];
+    return send_command(dev, packet, sizeof(packet), response, sizeof(response), reply);
+}
+
+static frame_result_t upchar_frame(const uint8_t *frame, size_t len, void *ctx) {
+    upchar_stream_t *stream = ctx;
+    uint8_t pid = frame[6];
+
+    if (!stream->acked) {
+        if (pid != R502_PID_ACK) {
+            return FRAME_IGNORED;
+        }
+        stream->acked = true;
+        stream->conf_code = frame[9];
+        // The data packages follow only a successful acknowledge
+        return stream->conf_code == 0x00 ? FRAME_PROGRESS : FRAME_DONE;
+    }
+    if (pid != R502_PID_DATA && pid != R502_PID_END_DATA) {
+        return FRAME_IGNORED;
+    }
+
+    size_t size = len - R502_FRAME_HEADER_SIZE - 2;
+    if (stream->head - stream->tail + size > sizeof(stream->data)) {
+        stream->overflow = true;
+        return FRAME_DONE;
+    }
+    for (size_t i = 0; i < size; i++) {
+        stream->data[(stream->head + i) % sizeof(stream->data)] = frame[R502_FRAME_HEADER_SIZE + i];
+    }
+    stream->head += size;
+    return pid == R502_PID_END_DATA ? FRAME_DONE : FRAME_PROGRESS;
+}
+
+static esp_err_t upchar_drain(void *ctx) {
+    upchar_stream_t *stream = ctx;
+    r502_handle_t dev = stream->dev;
+    while (1) {
+        portENTER_CRITICAL(&dev->pending_lock);
+        size_t available = stream->head - stream->tail;
+        portEXIT_CRITICAL(&dev->pending_lock);
+        if (available == 0) {
+            return ESP_OK;
+        }
+
+        // The RX task only writes past head, so the range up to head is safe to read unlocked
+        size_t offset = stream->tail % sizeof(stream->data);
+        size_t chunk = sizeof(stream->data) - offset;
+        if (chunk > available) {
+            chunk = available;
+        }
+        esp_err_t err = stream->sink(stream->data + offset, chunk, stream->sink_ctx);
+        if (err != ESP_OK) {
+            return err;
+        }
+
+        portENTER_CRITICAL(&dev->pending_lock);
+        stream->tail += chunk;
+        portEXIT_CRITICAL(&dev->pending_lock);
+    }
+}
+
+/*
+ * @brief Upload the template in buffer (1 or 2), handing it to sink as the data packages arrive.
+ *
+ * The sink runs in the calling task and may block, e.g. on a chunked HTTP send.
+ * Returns ESP_OK with a non-zero conf_code when the module refused the upload.
+ */
+esp_err_t r502_upchar(r502_handle_t dev, uint8_t buffer, r502_data_sink sink, void *ctx, r502_generic_reply *reply) {
+    uint8_t packet[R502_UPCHAR_PACKET_SIZE] = {0};
+
+    uint8_t *payload = init_command(dev, packet, 0x08, sizeof(packet)); // UpChar command
+    add_command_arg_8(&payload, buffer);
+    finalize_command(packet, sizeof(packet));
+
+    xSemaphoreTakeRecursive(dev->cmd_mutex, portMAX_DELAY);
+    upchar_stream_t *stream = &dev->upchar;
+    memset(stream, 0, offsetof(upchar_stream_t, dev));
+    stream->sink = sink;
+    stream->sink_ctx = ctx;
+
+    esp_err_t err = transact(dev, packet, sizeof(packet), upchar_frame, stream, upchar_drain, dev->uart_timeout);
+    if (err == ESP_OK) {
+        err = upchar_drain(stream); // The last package may have arrived together with the timeout
+    }
+    if (err == ESP_OK && stream->overflow) {
+        err = ESP_ERR_NO_MEM;
+    }
+    reply->conf_code = stream->conf_code;
+    xSemaphoreGiveRecursive(dev->cmd_mutex);
+    return err;
+}
+
+static void send_data_package(r502_handle_t dev, uint8_t pid, const uint8_t *data, size_t len) {
+    uint8_t header[R502_FRAME_HEADER_SIZE];
+    uint8_t *ptr = header;
+    add_command_arg_8(&ptr, 0xEF);
+    add_command_arg_8(&ptr, 0x01);
+    add_command_arg_32(&ptr, dev->config.address);
+    add_command_arg_8(&ptr, pid);
+    add_command_arg_16(&ptr, len + 2);
+
+    uint16_t sum = pid + ((len + 2) >> 8) + ((len + 2) & 0xFF) + calculate_checksum((uint8_t *)data, len);
+    uint8_t checksum[2] = {(uint8_t)(sum >> 8), (uint8_t)(sum & 0xFF)};
+
+    uart_write_bytes(dev->config.uart_num, (const char *)header, sizeof(header));
+    uart_write_bytes(dev->config.uart_num, (const char *)data, len);
+    uart_write_bytes(dev->config.uart_num, (const char *)checksum, sizeof(checksum));
+}
+
+/*
+ * @brief Download a template of len bytes into buffer (1 or 2), split into data packages of the
+ * negotiated size. Store it to the library with r502_store afterwards.
+ */
+esp_err_t r502_downchar(r502_handle_t dev, uint8_t buffer, const uint8_t *data, size_t len, r502_generic_reply *reply) {
+    uint8_t packet[R502_DOWNCHAR_PACKET_SIZE] = {0};
+
+    uint8_t *payload = init_command(dev, packet, 0x09, sizeof(packet)); // DownChar command
+    add_command_arg_8(&payload, buffer);
+    finalize_command(packet, sizeof(packet));
+
+    // Nothing may come between the acknowledge and the data packages
+    xSemaphoreTakeRecursive(dev->cmd_mutex, portMAX_DELAY);
+    uint8_t response[12];
+    esp_err_t err = send_command(dev, packet, sizeof(packet), response, sizeof(response), reply);
+    if (err == ESP_OK && reply->conf_code == 0x00) {
+        for (size_t offset = 0; offset < len; offset += dev->data_packet_size) {
+            size_t chunk = len - offset < dev->data_packet_size ? len - offset : dev->data_packet_size;
+            bool last = offset + chunk >= len;
+            send_data_package(dev, last ? R502_PID_END_DATA : R502_PID_DATA, data + offset, chunk);
+        }
+        uart_wait_tx_done(dev->config.uart_num, pdMS_TO_TICKS(dev->uart_timeout));
+    }
+    xSemaphoreGiveRecursive(dev->cmd_mutex);
+    return err;
+}
+
+esp_err_t r502_cancel(r502_handle_t dev, r502_generic_reply *reply) {
+    uint8_t packet[R502_CANCEL_PACKET_SIZE] = {0};
+
+    init_command(dev, packet, 0x30, sizeof(packet)); // Cancel command
+    finalize_command(packet, sizeof(packet));
+
+    uint8_t response[12];
+    return send_command(dev, packet, sizeof(packet), response, sizeof(response), reply);
+}
+
+// Occupancy cache --------------------------------------------------------------
+
+// Read the library size and the index table pages covering it
+esp_err_t r502_load_index(r502_handle_t dev) {
+    r502_syspara_reply syspara;
+    esp_err_t err = r502_readsyspara(dev, &syspara);
+    if (err != ESP_OK || syspara.conf_code != 0x00) {
+        return err != ESP_OK ? err : ESP_FAIL;
+    }
+    uint16_t lib_size = syspara.lib_size;
+    if (lib_size == 0 || lib_size > R502_MAX_TEMPLATES) {
+        lib_size = R502_MAX_TEMPLATES;
+    }
+
+    uint8_t index[R502_MAX_TEMPLATES / 8] = {0};
+    uint8_t pages = (lib_size + R502_INDEX_PAGE_SLOTS - 1) / R502_INDEX_PAGE_SLOTS;
+    for (uint8_t page = 0; page < pages; page++) {
+        r502_indextable_reply reply;
+        err = r502_readindextable(dev, page, &reply);
+        if (err != ESP_OK || reply.conf_code != 0x00) {
+            return err != ESP_OK ? err : ESP_FAIL;
+        }
+        memcpy(index + page * sizeof(reply.index_page), reply.index_page, sizeof(reply.index_page));
+    }
+
+    uint16_t count = 0;
+    for (uint16_t i = 0; i < lib_size; i++) {
+        count += (index[i / 8] >> (i % 8)) & 1;
+    }
+
+    portENTER_CRITICAL(&dev->index_lock);
+    memcpy(dev->index, index, sizeof(dev->index));
+    dev->lib_size = lib_size;
+    dev->template_count = count;
+    dev->free_hint = 0;
+    dev->index_valid = true;
+    portEXIT_CRITICAL(&dev->index_lock);
+
+    ESP_LOGI(TAG, "UART%d: template library: %u of %u slots used", dev->config.uart_num, count, lib_size);
+    return ESP_OK;
+}
+
+// Force a reload, e.g. after the library was changed behind the driver's back
+void r502_invalidate_index(r502_handle_t dev) {
+    portENTER_CRITICAL(&dev->index_lock);
+    dev->index_valid = false;
+    portEXIT_CRITICAL(&dev->index_lock);
+}
+
+static esp_err_t ensure_index(r502_handle_t dev) {
+    portENTER_CRITICAL(&dev->index_lock);
+    bool valid = dev->index_valid;
+    portEXIT_CRITICAL(&dev->index_lock);
+    return valid ? ESP_OK : r502_load_index(dev);
+}
+
+bool r502_is_occupied(r502_handle_t dev, uint16_t index) {
+    portENTER_CRITICAL(&dev->index_lock);
+    bool occupied = dev->index_valid && index < dev->lib_size && (dev->index[index / 8] >> (index % 8)) & 1;
+    portEXIT_CRITICAL(&dev->index_lock);
+    return occupied;
+}
+
+uint16_t r502_template_count(r502_handle_t dev) {
+    portENTER_CRITICAL(&dev->index_lock);
+    uint16_t count = dev->index_valid ? dev->template_count : 0;
+    portEXIT_CRITICAL(&dev->index_lock);
+    return count;
+}
+
+esp_err_t r502_alloc_slot(r502_handle_t dev, uint16_t *index) {
+    esp_err_t err = ensure_index(dev);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    portENTER_CRITICAL(&dev->index_lock);
+    // Everything below the hint is taken; full bytes are skipped whole
+    uint16_t slot = dev->free_hint;
+    while (slot < dev->lib_size) {
+        if (slot % 8 == 0 && dev->index[slot / 8] == 0xFF) {
+            slot += 8;
+        } else if ((dev->index[slot / 8] >> (slot % 8)) & 1) {
+            slot++;
+        } else {
+            break;
+        }
+    }
+    dev->free_hint = slot;
+    bool full = slot >= dev->lib_size;
+    portEXIT_CRITICAL(&dev->index_lock);
+
+    if (full) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    *index = slot;
+    return ESP_OK;
+}
+
+esp_err_t r502_occupied_span(r502_handle_t dev, uint16_t *start, uint16_t *count) {
+    esp_err_t err = ensure_index(dev);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    portENTER_CRITICAL(&dev->index_lock);
+    int32_t bytes = (dev->lib_size + 7) / 8;
+    int32_t first = 0;
+    int32_t last = bytes - 1;
+    while (first < bytes && dev->index[first] == 0) {
+        first++;
+    }
+    while (last >= first && dev->index[last] == 0) {
+        last--;
+    }
+    if (first > last) {
+        *start = 0;
+        *count = 0;
+    } else {
+        uint16_t low = first * 8 + __builtin_ctz(dev->index[first]);
+        uint16_t high = last * 8 + 31 - __builtin_clz(dev->index[last]);
+        *start = low;
+        *count = high - low + 1;
+    }
+    portEXIT_CRITICAL(&dev->index_lock);
+    return ESP_OK;
+}
+
+// Link negotiation -------------------------------------------------------------
+
+static void set_local_baud(r502_handle_t dev, uint32_t baud) {
+    uart_wait_tx_done(dev->config.uart_num, pdMS_TO_TICKS(100));
+    uart_set_baudrate(dev->config.uart_num, baud);
+    uart_flush_input(dev->config.uart_num);
+
+    // Round-trip times are only comparable within one rate. The old rate's table is kept for
+    // comparison, unless nothing got through at it (a failed probe). Whatever was still on the
+    // way at the old rate can not be read at the new one.
+    portENTER_CRITICAL(&dev->pending_lock);
+    r502_link_guard_open(&dev->link_guard);
+    if (baud != dev->baud_rate) {
+        if (dev->rtt_count > 0) {
+            memcpy(dev->rtt_prev, dev->rtt, sizeof(dev->rtt));
+            dev->rtt_prev_count     = dev->rtt_count;
+            dev->rtt_prev_baud_rate = dev->baud_rate;
+        }
+        dev->rtt_count = 0;
+        memset(dev->rtt, 0, sizeof(dev->rtt));
+    }
+    dev->baud_rate = baud;
+    portEXIT_CRITICAL(&dev->pending_lock);
+}
+
+static bool probe(r502_handle_t dev, uint32_t baud) {
+    set_local_baud(dev, baud);
+    r502_generic_reply reply;
+    return handshake_timeout(dev, PROBE_TIMEOUT_MS, &reply) == ESP_OK && reply.conf_code == 0x00;
+}
+
+// Average handshake round trip in us, 0 if any handshake failed
+static uint32_t measure_rtt(r502_handle_t dev) {
+    uint64_t total = 0;
+    for (int i = 0; i < STABLE_HANDSHAKES; i++) {
+        r502_generic_reply reply;
+        int64_t start = esp_timer_get_time();
+        if (handshake_timeout(dev, PROBE_TIMEOUT_MS, &reply) != ESP_OK || reply.conf_code != 0x00) {
+            return 0;
+        }
+        total += esp_timer_get_time() - start;
+    }
+    return total / STABLE_HANDSHAKES;
+}
+
+static esp_err_t set_module_baud(r502_handle_t dev, uint32_t baud) {
+    r502_generic_reply reply;
+    // The module acknowledges at the old rate and switches afterwards
+    esp_err_t err = r502_setsyspara(dev, R502_PARAM_BAUD_RATE, baud / 9600, &reply);
+    if (err == ESP_OK && reply.conf_code != 0x00) {
+        err = ESP_FAIL;
+    }
+    return err;
+}
+
+/*
+ * @brief Find the module's baud rate and move both ends to max_baud.
+ *
+ * The module keeps its rate across power cycles, so the probe tries max_baud first. If the new
+ * rate does not carry STABLE_HANDSHAKES handshakes, both ends go back to the rate found. Then the
+ * data package length is raised to packet_size (32, 64, 128 or 256) for template transfers.
+ */
+esp_err_t r502_negotiate_link(r502_handle_t dev, uint32_t max_baud, uint16_t packet_size) {
+    static const uint32_t candidates[] = {R502_MAX_BAUD_RATE, R502_DEFAULT_BAUD_RATE, 38400, 19200, 9600};
+    uint32_t found = 0;
+
+    if (probe(dev, max_baud)) {
+        found = max_baud;
+    }
+    for (size_t i = 0; found == 0 && i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+        if (candidates[i] != max_baud && probe(dev, candidates[i])) {
+            found = candidates[i];
+        }
+    }
+    if (found == 0) {
+        set_local_baud(dev, R502_DEFAULT_BAUD_RATE);
+        ESP_LOGE(TAG, "UART%d: no reply at any baud rate", dev->config.uart_num);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    uint32_t rtt_before = measure_rtt(dev);
+    ESP_LOGI(TAG, "UART%d: module at %lu baud, handshake %lu us", dev->config.uart_num, (unsigned long)found,
+             (unsigned long)rtt_before);
+
+    esp_err_t err = ESP_OK;
+    if (found != max_baud) {
+        err = set_module_baud(dev, max_baud);
+        if (err == ESP_OK) {
+            vTaskDelay(pdMS_TO_TICKS(20));
+            set_local_baud(dev, max_baud);
+            uint32_t rtt_after = measure_rtt(dev);
+            if (rtt_after != 0) {
+                ESP_LOGI(TAG, "UART%d: switched to %lu baud, handshake %lu us (was %lu us)", dev->config.uart_num,
+                         (unsigned long)max_baud, (unsigned long)rtt_after, (unsigned long)rtt_before);
+            } else {
+                ESP_LOGW(TAG, "UART%d: %lu baud unstable, falling back to %lu", dev->config.uart_num,
+                         (unsigned long)max_baud, (unsigned long)found);
+                // Ask the module back if it still hears us; otherwise it never switched
+                if (probe(dev, max_baud)) {
+                    set_module_baud(dev, found);
+                    vTaskDelay(pdMS_TO_TICKS(20));
+                }
+                err = probe(dev, found) ? ESP_ERR_NOT_SUPPORTED : ESP_FAIL;
+            }
+        } else {
+            ESP_LOGW(TAG, "UART%d: module refused %lu baud", dev->config.uart_num, (unsigned long)max_baud);
+        }
+    }
+
+    r502_syspara_reply syspara;
+    uint8_t packet_code = packet_size >= 256 ? 3 : packet_size >= 128 ? 2 : packet_size >= 64 ? 1 : 0;
+    r502_generic_reply reply;
+    if (r502_setsyspara(dev, R502_PARAM_PACKET_SIZE, packet_code, &reply) != ESP_OK || reply.conf_code != 0x00) {
+        ESP_LOGW(TAG, "UART%d: failed to set data package length %u", dev->config.uart_num, packet_size);
+    }
+    if (r502_readsyspara(dev, &syspara) == ESP_OK && syspara.conf_code == 0x00 && syspara.data_packet_size <= 3) {
+        dev->data_packet_size = 32 << syspara.data_packet_size;
+    }
+    ESP_LOGI(TAG, "UART%d: link %lu baud, %u byte data packages", dev->config.uart_num, (unsigned long)dev->baud_rate,
+             dev->data_packet_size);
+    return err;
+}
+
+uint32_t r502_get_baud_rate(r502_handle_t dev) {
+    return dev->baud_rate;
+}
+
+uint16_t r502_get_data_packet_size(r502_handle_t dev) {
+    return dev->data_packet_size;
+}
+
+// Caller holds dev->pending_lock.
+static size_t copy_rtt(const rtt_slot_t *slots, size_t slot_count, r502_command_rtt_t *out, size_t max) {
+    size_t count = slot_count < max ? slot_count : max;
+    for (size_t i = 0; i < count; i++) {
+        out[i] = (r502_command_rtt_t){
+            .command = slots[i].command,
+            .count   = slots[i].count,
+            .avg_us  = slots[i].count > 0 ? (uint32_t)(slots[i].total_us / slots[i].count) : 0,
+            .max_us  = slots[i].max_us,
+            .last_us = slots[i].last_us,
+        };
+    }
+    return count;
+}
+
+size_t r502_get_command_rtt(r502_handle_t dev, r502_command_rtt_t *out, size_t max) {
+    portENTER_CRITICAL(&dev->pending_lock);
+    size_t count = copy_rtt(dev->rtt, dev->rtt_count, out, max);
+    portEXIT_CRITICAL(&dev->pending_lock);
+    return count;
+}
+
+size_t r502_get_previous_command_rtt(r502_handle_t dev, uint32_t *baud_rate, r502_command_rtt_t *out, size_t max) {
+    portENTER_CRITICAL(&dev->pending_lock);
+    *baud_rate = dev->rtt_prev_baud_rate;
+    size_t count = copy_rtt(dev->rtt_prev, dev->rtt_prev_count, out, max);
+    portEXIT_CRITICAL(&dev->pending_lock);
+    return count;
+}
@@ -0,0 +1,168 @@
+#include "r502_parser.h"
+#include <string.h>
+
+typedef enum {
+    STATE_SYNC_HI = 0,
+    STATE_SYNC_LO,
+    STATE_ADDRESS,
+    STATE_PID,
+    STATE_LENGTH,
+    STATE_BODY,
+} parser_state_t;
+
+static void feed_byte(r502_parser_t *p, uint8_t b, r502_frame_callback callback, void *ctx);
+
+void r502_parser_init(r502_parser_t *parser, uint32_t address) {
+    memset(parser, 0, sizeof(r502_parser_t));
+    parser->address = address;
+    parser->state   = STATE_SYNC_HI;
+}
+
+void r502_parser_reset(r502_parser_t *parser) {
+    parser->state = STATE_SYNC_HI;
+    parser->pos   = 0;
+}
+
+static void discard(r502_parser_t *p, size_t count) {
+    p->stats.discarded_bytes += count;
+    if (!p->hunting) {
+        p->stats.resyncs++;
+        p->hunting = true;
+    }
+}
+
+// The header went wrong after pos bytes. Drop its first byte and parse the rest again, so a real
+// 0xEF01 that followed a stray 0xEF or a torn frame is still found. Bounded by the header size.
+static void rewind_header(r502_parser_t *p, r502_frame_callback callback, void *ctx) {
+    uint8_t replay[R502_FRAME_HEADER_SIZE];
+    size_t  count = p->pos - 1;
+    memcpy(replay, p->frame + 1, count);
+
+    discard(p, 1);
+    r502_parser_reset(p);
+    for (size_t i = 0; i < count; i++) {
+        feed_byte(p, replay[i], callback, ctx);
+    }
+}
+
+static void feed_byte(r502_parser_t *p, uint8_t b, r502_frame_callback callback, void *ctx) {
+    switch (p->state) {
+        case STATE_SYNC_HI:
+            if (b == 0xEF) {
+                p->frame[0] = b;
+                p->pos      = 1;
+                p->state    = STATE_SYNC_LO;
+            } else {
+                discard(p, 1);
+            }
+            break;
+
+        case STATE_SYNC_LO:
+            if (b == 0x01) {
+                p->frame[p->pos++] = b;
+                p->state           = STATE_ADDRESS;
+            } else if (b == 0xEF) {
+                discard(p, 1); // The earlier 0xEF was noise; this one may start the header
+            } else {
+                discard(p, 2);
+                r502_parser_reset(p);
+            }
+            break;
+
+        case STATE_ADDRESS:
+            p->frame[p->pos++] = b;
+            if (p->pos == 6) {
+                uint32_t address = ((uint32_t)p->frame[2] << 24) | ((uint32_t)p->frame[3] << 16) |
+                                   ((uint32_t)p->frame[4] << 8) | p->frame[5];
+                if (address != p->address) {
+                    rewind_header(p, callback, ctx);
+                } else {
+                    p->state = STATE_PID;
+                }
+            }
+            break;
+
+        case STATE_PID:
+            p->frame[p->pos++] = b;
+            if (b != R502_PID_COMMAND && b != R502_PID_DATA && b != R502_PID_ACK && b != R502_PID_END_DATA) {
+                rewind_header(p, callback, ctx);
+            } else {
+                p->sum   = b;
+                p->state = STATE_LENGTH;
+            }
+            break;
+
+        case STATE_LENGTH:
+            p->frame[p->pos++] = b;
+            p->sum += b;
+            if (p->pos == R502_FRAME_HEADER_SIZE) {
+                p->length = (p->frame[7] << 8) | p->frame[8];
+                // At least one byte of payload plus the checksum
+                if (p->length < 3 || p->length > R502_FRAME_MAX_DATA + 2) {
+                    p->stats.length_errors++;
+                    callback(R502_FRAME_BAD_LENGTH, p->frame, p->pos, ctx);
+                    rewind_header(p, callback, ctx);
+                } else {
+                    p->state = STATE_BODY;
+                }
+            }
+            break;
+
+        case STATE_BODY:
+            p->frame[p->pos++] = b;
+            // The checksum covers identifier, length and payload
+            if (p->pos <= R502_FRAME_HEADER_SIZE + p->length - 2) {
+                p->sum += b;
+            }
+            if (p->pos == R502_FRAME_HEADER_SIZE + p->length) {
+                uint16_t received = (p->frame[p->pos - 2] << 8) | p->frame[p->pos - 1];
+                if (received == p->sum) {
+                    p->stats.frames++;
+                    p->hunting = false;
+                    callback(R502_FRAME_OK, p->frame, p->pos, ctx);
+                } else {
+                    p->stats.checksum_errors++;
+                    callback(R502_FRAME_BAD_CHECKSUM, p->frame, p->pos, ctx);
+                }
+                r502_parser_reset(p);
+            }
+            break;
+    }
+}
+
+void r502_parser_feed(r502_parser_t *parser, const uint8_t *data, size_t len, r502_frame_callback callback, void *ctx) {
+    for (size_t i = 0; i < len; i++) {
+        feed_byte(parser, data[i], callback, ctx);
+    }
+}
+
+void r502_link_guard_close(r502_link_guard_t *guard, int64_t now_us, int64_t quiet_us) {
+    guard->quiet_us        = quiet_us;
+    guard->closed_until_us = now_us + quiet_us;
+}
+
+void r502_link_guard_open(r502_link_guard_t *guard) {
+    guard->closed_until_us = 0;
+}
+
+bool r502_link_guard_accept(r502_link_guard_t *guard, int64_t now_us) {
+    if (guard->closed_until_us == 0) {
+        return true;
+    }
+    // The timed-out command is still talking, give it another quiet period
+    if (now_us + guard->quiet_us > guard->closed_until_us) {
+        guard->closed_until_us = now_us + guard->quiet_us;
+    }
+    return false;
+}
+
+int64_t r502_link_guard_wait(r502_link_guard_t *guard, int64_t now_us) {
+    if (guard->closed_until_us == 0) {
+        return 0;
+    }
+    if (now_us >= guard->closed_until_us) {
+        guard->closed_until_us = 0;
+        return 0;
+    }
+    return guard->closed_until_us - now_us;
+}
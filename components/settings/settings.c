@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include "nvs_flash.h"
 #include "nvs.h"
+#include "nvs_stats.h"
 #include "settings.h"
 
 // Update static array: use settings_field_t and updated type enums
@@ -178,14 +179,14 @@ esp_err_t settings_init(void) {
     }
     ESP_ERROR_CHECK(ret);
 
-    ret = nvs_open("storage", NVS_READWRITE, &nvs_settings_handle);
+    ret = nvs_stats_open("storage", NVS_READWRITE, &nvs_settings_handle);
     if (ret != ESP_OK) {
         return ret;
     }
 
     // Try to load settings; if not found, set defaults
     size_t required_size = sizeof(settings_t);
-    ret = nvs_get_blob(nvs_settings_handle, "settings", &g_settings, &required_size);
+    ret = nvs_stats_get_blob(nvs_settings_handle, "settings", &g_settings, &required_size);
     if (ret == ESP_ERR_NVS_NOT_FOUND || ret == ESP_ERR_NVS_INVALID_LENGTH) {
         set_default_settings();
         return settings_save();
@@ -199,12 +200,12 @@ settings_t* settings_get_settings(void) {
 }
 
 esp_err_t settings_save(void) {
-    esp_err_t err = nvs_set_blob(nvs_settings_handle, "settings", &g_settings, sizeof(settings_t));
+    esp_err_t err = nvs_stats_set_blob(nvs_settings_handle, "settings", &g_settings, sizeof(settings_t));
     if (err != ESP_OK) {
         return err;
     }
 
-    err = nvs_commit(nvs_settings_handle);
+    err = nvs_stats_commit(nvs_settings_handle);
     if (err == ESP_OK && settings_change_callback != NULL) {
         settings_change_callback(&g_settings);
     }
@@ -47,3 +47,72 @@ function getAuthHeaders() {
     const auth = localStorage.getItem('auth');
     return auth ? { 'Authorization': `Basic ${auth}` } : {};
 }
+
+// Page-at-a-time enrollment listing, filtered on the device
+const ENROLLMENT_PAGE_SIZE = 20;
+
+class EnrollmentPager {
+    constructor(type, render) {
+        this.type = type;
+        this.render = render;
+        this.filter = {enabled: '', namePrefix: ''};
+        this.filterTimer = null;
+        this.reset();
+    }
+
+    reset() {
+        this.afters = [null]; // "after" token of every page up to the current one
+        this.next = null;
+    }
+
+    url() {
+        const params = new URLSearchParams({limit: ENROLLMENT_PAGE_SIZE});
+        const after = this.afters[this.afters.length - 1];
+        if (after !== null) params.set('after', after);
+        if (this.filter.enabled !== '') params.set('enabled', this.filter.enabled);
+        if (this.filter.namePrefix) params.set('name_prefix', this.filter.namePrefix);
+        return `/api/enrollments/${this.type}?${params}`;
+    }
+
+    async load() {
+        let data;
+        try {
+            data = await fetchWithAuth(this.url());
+        } catch (error) {
+            // The record this page continues after may have been deleted, start over
+            if (this.afters.length === 1) throw error;
+            this.reset();
+            return this.load();
+        }
+        this.next = data.next;
+        this.render(data.items);
+        document.getElementById('prev-page').disabled = this.afters.length === 1;
+        document.getElementById('next-page').disabled = this.next === null;
+    }
+
+    loadOrReport() {
+        return this.load().catch(error => showError('Failed to load list: ' + error.message));
+    }
+
+    nextPage() {
+        if (this.next === null) return;
+        this.afters.push(this.next);
+        return this.loadOrReport();
+    }
+
+    prevPage() {
+        if (this.afters.length === 1) return;
+        this.afters.pop();
+        return this.loadOrReport();
+    }
+
+    // Debounced so typing a name prefix does not send a request per key
+    setFilter(filter) {
+        clearTimeout(this.filterTimer);
+        this.filterTimer = setTimeout(() => {
+            this.filter = filter;
+            this.reset();
+            this.loadOrReport();
+        }, 300);
+    }
+}
@@ -8,6 +8,7 @@
 #include "esp_err.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
+#include "tabledb_backend.h"
 
 // Maximum size of an object that can be stored in the tabledb.
 #define TABLEDB_MAX_OBJECT_SIZE 512
@@ -26,12 +27,87 @@ typedef struct {
     char head_key[16]; // NVS key of the first record in the list.
 } tabledb_meta_t;
 
+// On-flash layout of a table.
+typedef enum {
+    TABLEDB_LAYOUT_LIST = 0, // One rec_<id> blob per record, linked list (default)
+    TABLEDB_LAYOUT_PAGED,    // Records packed into pg_<n> page blobs; lists are migrated on init
+} tabledb_layout_t;
+
 // Update callback. This callback will be called when the version of the data stored in NVS.
 // If function return != ESP_OK caller should return error
 typedef esp_err_t (*tabledb_upgrade_cb)(uint8_t old_version, const void* old_data, void* new_data);
 
+// Changes a record payload in place, see tabledb_update_deferred_fn(). Must not block.
+typedef void (*tabledb_mutate_cb)(void *data, void *arg);
+
+// Secondary key of a record payload, usually tabledb_hash_str() of a field such as the name.
+typedef uint32_t (*tabledb_key_cb)(const void *data);
+
+// In-RAM index of record IDs kept in linked-list order (head first).
+// Built by tabledb_init and kept in sync by insert/delete/drop, so iteration,
+// existence checks and counting never have to walk the list in NVS.
+// Every record also carries an insertion sequence number, strictly descending along
+// the list; it keeps a scan position valid when the record at that position is deleted.
+typedef struct {
+    uint32_t *ids;
+    uint32_t *seqs;     // Insertion sequence number of ids[i]
+    size_t    count;
+    size_t    capacity;
+    size_t    hint;     // Position of the last record returned by tabledb_get_next
+    uint32_t  next_seq; // Sequence number of the next inserted record
+} tabledb_index_t;
+
+// Write-behind cache triggers for tabledb_update_deferred(). All zero disables the cache.
+typedef struct {
+    uint32_t flush_interval_ms; // Flush once the oldest dirty record is this old
+    uint16_t max_dirty;         // Flush once this many records are dirty (also the cache capacity)
+    uint32_t idle_flush_ms;     // Flush after this long without deferred updates
+} tabledb_cache_config_t;
+
+// Progress of the background upgrade pass (lazy_upgrade).
+typedef struct {
+    bool      running;
+    size_t    total;    // Records in the table when the pass started
+    size_t    checked;  // Records whose stored version has been checked
+    size_t    upgraded; // Records rewritten with the current version
+    esp_err_t result;   // Outcome of the finished pass
+} tabledb_upgrade_progress_t;
+
+// Maximum number of change callbacks per table, see tabledb_subscribe().
+#define TABLEDB_MAX_SUBSCRIBERS 4
+
+typedef enum {
+    TABLEDB_CHANGE_INSERT,
+    TABLEDB_CHANGE_UPDATE,
+    TABLEDB_CHANGE_DELETE,
+    TABLEDB_CHANGE_DROP, // Whole table erased, id is 0
+} tabledb_change_op_t;
+
+typedef struct {
+    tabledb_change_op_t op;
+    uint32_t            id;
+    uint32_t            generation; // Table generation after the change
+} tabledb_change_t;
+
+struct tabledb_config;
+typedef void (*tabledb_change_cb)(struct tabledb_config *config, const tabledb_change_t *change, void *arg);
+
 typedef struct {
-    nvs_handle handle;
+    tabledb_change_cb cb;
+    void             *arg;
+} tabledb_subscriber_t;
+
+// Staged changes of an open transaction (private to tabledb.c).
+struct tabledb_txn;
+// Dirty records of the write-behind cache (private to tabledb.c).
+struct tabledb_cache;
+// Page geometry and slot map of a paged table (private to tabledb.c).
+struct tabledb_pages;
+// Secondary key index (private to tabledb.c).
+struct tabledb_keys;
+
+typedef struct tabledb_config {
+    void *handle; // Backend store handle, managed by tabledb
     const uint32_t size;
     const char* namespace;
     // Version of the data stored in NVS
@@ -39,12 +115,57 @@ typedef struct {
     // If version is different from the one stored in NVS, this callback will be called
     // to upgrade the data to the data.
     tabledb_upgrade_cb update_cb;
+    // Upgrade stale records on read and in a low-priority task started by tabledb_init,
+    // instead of calling tabledb_upgrade() before the table is used.
+    bool lazy_upgrade;
+    tabledb_layout_t layout;
+    // Storage backend, NULL selects tabledb_backend_nvs. backend_arg is passed to its open().
+    const tabledb_backend_t *backend;
+    const void *backend_arg;
+    // Optional write-behind cache for frequently updated records.
+    tabledb_cache_config_t cache;
+    // Optional secondary key, indexed in RAM for tabledb_find_by_key().
+    tabledb_key_cb key_cb;
     SemaphoreHandle_t mutex;  // Mutex for thread-safe operations (must be initialized)
+    tabledb_index_t index;    // Managed by tabledb, do not touch
+    struct tabledb_txn *txn;  // Open transaction, NULL if none
+    struct tabledb_cache *cache_state; // Managed by tabledb, do not touch
+    struct tabledb_pages *pages;       // Managed by tabledb, NULL for TABLEDB_LAYOUT_LIST
+    struct tabledb_keys *keys;         // Managed by tabledb, NULL without key_cb
+    tabledb_upgrade_progress_t upgrade; // Managed by tabledb, read with tabledb_get_upgrade_progress
+    tabledb_subscriber_t subscribers[TABLEDB_MAX_SUBSCRIBERS]; // Managed by tabledb_subscribe
+    uint32_t generation; // Managed by tabledb, read with tabledb_get_generation
 } tabledb_config_t;
 
 
+// Iterator over the record IDs at open time, see tabledb_cursor_open(). Close it to free them.
+typedef struct {
+    tabledb_config_t *config;
+    uint32_t         *ids;  // Record IDs at open time, list order
+    uint32_t         *seqs; // Their insertion sequence numbers
+    size_t            count;
+    size_t            pos;
+} tabledb_cursor_t;
+
+// Filter for tabledb_scan(); return true to keep the record.
+typedef bool (*tabledb_predicate_t)(uint32_t id, const void *data, void *arg);
+// Called for every record tabledb_scan() returns; an error stops the scan.
+typedef esp_err_t (*tabledb_scan_cb_t)(uint32_t id, const void *data, void *arg);
+
+// One page of a filtered scan. Pass the same struct again to get the next page.
+typedef struct {
+    tabledb_predicate_t predicate;     // NULL keeps every record
+    void               *predicate_arg;
+    size_t              offset;        // Matches to skip before the first one returned
+    size_t              limit;         // Max records per call, 0 = no limit
+    bool                resume;        // Continue after resume_token
+    uint32_t            resume_token;  // Position after the last record returned, survives its deletion
+    bool                more;          // Out: further matches exist after this page
+} tabledb_scan_t;
+
 esp_err_t tabledb_init(tabledb_config_t *config);
 esp_err_t tabledb_upgrade(tabledb_config_t *config);
+esp_err_t tabledb_get_upgrade_progress(tabledb_config_t *config, tabledb_upgrade_progress_t *progress);
 esp_err_t tabledb_insert(tabledb_config_t *config, uint32_t id, void *data);
 esp_err_t tabledb_delete(tabledb_config_t *config, uint32_t id);
 esp_err_t tabledb_drop(tabledb_config_t *config);
@@ -53,4 +174,31 @@ esp_err_t tabledb_get_next(tabledb_config_t *config, uint32_t id, uint32_t *data
 esp_err_t tabledb_get_count(tabledb_config_t *config, size_t *count);
 esp_err_t tabledb_update(tabledb_config_t *config, uint32_t id, void *data);
 
+// ID snapshot, live payloads: the records and their order are fixed at open, each
+// payload is read when returned, one record per call under the table lock.
+esp_err_t tabledb_cursor_open(tabledb_config_t *config, tabledb_cursor_t *cursor);
+esp_err_t tabledb_cursor_next(tabledb_cursor_t *cursor, uint32_t *id, void *data);
+void tabledb_cursor_close(tabledb_cursor_t *cursor);
+esp_err_t tabledb_scan(tabledb_config_t *config, tabledb_scan_t *scan, tabledb_scan_cb_t cb, void *arg);
+
+// Look up records by secondary key without reading flash.
+uint32_t tabledb_hash_str(const char *str, size_t max_len);
+esp_err_t tabledb_find_by_key(tabledb_config_t *config, uint32_t key, uint32_t *ids, size_t max_ids, size_t *count);
+
+// Update without waiting for NVS; written later by the write-behind cache.
+esp_err_t tabledb_update_deferred(tabledb_config_t *config, uint32_t id, void *data);
+esp_err_t tabledb_update_deferred_fn(tabledb_config_t *config, uint32_t id, tabledb_mutate_cb fn, void *arg);
+esp_err_t tabledb_flush(tabledb_config_t *config);
+
+// Change notifications; the generation grows with every visible change.
+esp_err_t tabledb_subscribe(tabledb_config_t *config, tabledb_change_cb cb, void *arg);
+esp_err_t tabledb_unsubscribe(tabledb_config_t *config, tabledb_change_cb cb, void *arg);
+uint32_t tabledb_get_generation(tabledb_config_t *config);
+
+// Batch several inserts/updates/deletes into one NVS commit.
+// Calls between begin and commit/abort must come from the same task.
+esp_err_t tabledb_txn_begin(tabledb_config_t *config);
+esp_err_t tabledb_txn_commit(tabledb_config_t *config);
+esp_err_t tabledb_txn_abort(tabledb_config_t *config);
+
 #endif /* _TABLEDB_H_ */
@@ -0,0 +1,35 @@
+#ifndef _TABLEDB_BACKEND_H_
+#define _TABLEDB_BACKEND_H_
+
+#include <stddef.h>
+#include "esp_err.h"
+
+// Key/value store tabledb keeps its blobs in. All functions follow the NVS blob
+// semantics tabledb relies on:
+//  - get with data == NULL only reports the stored size,
+//  - a missing key is ESP_ERR_NVS_NOT_FOUND, a short buffer ESP_ERR_NVS_INVALID_LENGTH,
+//  - keys are at most 15 characters.
+// A store is opened once per table; open may be called again on the same name
+// after close (tabledb reopens on rollback) and must see the committed data.
+typedef struct {
+    esp_err_t (*open)(const void *arg, const char *name, void **handle);
+    void (*close)(void *handle);
+    esp_err_t (*get)(void *handle, const char *key, void *data, size_t *size);
+    esp_err_t (*set)(void *handle, const char *key, const void *data, size_t size);
+    esp_err_t (*erase)(void *handle, const char *key);
+    esp_err_t (*erase_all)(void *handle);
+    esp_err_t (*commit)(void *handle);
+} tabledb_backend_t;
+
+// One NVS namespace per table (default). arg is unused.
+extern const tabledb_backend_t tabledb_backend_nvs;
+
+// Append-only log file <arg>/<table name>.tdb on a mounted filesystem, meant for
+// a dedicated LittleFS partition. arg is the directory (const char *). Keys are
+// indexed in RAM, the log is compacted on commit once more than half of it is dead.
+extern const tabledb_backend_t tabledb_backend_file;
+
+// Process-local RAM store, lost on reset. For host tests and scratch tables. arg is unused.
+extern const tabledb_backend_t tabledb_backend_ram;
+
+#endif /* _TABLEDB_BACKEND_H_ */
@@ -7,31 +7,44 @@
 #include <stdio.h>
 #include "nvs.h"
 #include "esp_log.h"
+#include "esp_system.h"
+#include "freertos/task.h"
 
 #define EXIT_WITH_MUTEX(expr)                                                                      \
     do {                                                                                           \
-        xSemaphoreGive(config->mutex);                                                             \
+        xSemaphoreGiveRecursive(config->mutex);                                                    \
         return expr;                                                                               \
     } while (0)
 
 static const char *TAG = "TABLE_DB";
 
+// Storage access goes through the configured backend (tabledb_backend.h).
+#define store_get(config, key, data, size) (config)->backend->get((config)->handle, key, data, size)
+#define store_set(config, key, data, size) (config)->backend->set((config)->handle, key, data, size)
+#define store_erase(config, key) (config)->backend->erase((config)->handle, key)
+#define store_erase_all(config) (config)->backend->erase_all((config)->handle)
+#define store_commit(config) (config)->backend->commit((config)->handle)
+
 static esp_err_t tabledb_rollback(tabledb_config_t *config) {
-    nvs_close(config->handle);
+    config->backend->close(config->handle);
 
-    esp_err_t err = nvs_open(config->namespace, NVS_READWRITE, &config->handle);
+    esp_err_t err = config->backend->open(config->backend_arg, config->namespace, &config->handle);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Rollback failed");
     }
     return err;
 }
 
+static void meta_key(tabledb_config_t *config, char *key, size_t key_size) {
+    snprintf(key, key_size, "_meta_%s", config->namespace);
+}
+
 // Helper: Load metadata blob from NVS (key: _meta_<namespace>)
 static esp_err_t load_meta(tabledb_config_t *config, tabledb_meta_t *meta) {
-    char meta_key[15];
-    snprintf(meta_key, sizeof(meta_key), "_meta_%s", config->namespace);
+    char key[15];
+    meta_key(config, key, sizeof(key));
     size_t    size = sizeof(tabledb_meta_t);
-    esp_err_t err  = nvs_get_blob(config->handle, meta_key, meta, &size);
+    esp_err_t err  = store_get(config, key, meta, &size);
     if (err == ESP_ERR_NVS_NOT_FOUND) {
         meta->count       = 0;
         meta->head_key[0] = '\0';
@@ -42,506 +55,2635 @@ static esp_err_t load_meta(tabledb_config_t *config, tabledb_meta_t *meta) {
 
 // Helper: Save metadata blob to NVS.
 static esp_err_t save_meta(tabledb_config_t *config, tabledb_meta_t *meta) {
-    char meta_key[15];
-    snprintf(meta_key, sizeof(meta_key), "_meta_%s", config->namespace);
-    return nvs_set_blob(config->handle, meta_key, meta, sizeof(tabledb_meta_t));
+    char key[15];
+    meta_key(config, key, sizeof(key));
+    return store_set(config, key, meta, sizeof(tabledb_meta_t));
 }
 
+// Largest blob a record can occupy: header plus the biggest payload we ever allow.
+#define TABLEDB_MAX_RECORD_SIZE (sizeof(tabledb_internal_record_t) + TABLEDB_MAX_OBJECT_SIZE)
 
-// Initialize the tabledb library
-/*
- * @brief Initialize the table database.
- *
- * This function opens the NVS namespace specified in the configuration and prepares the table database for operations.
- *
- * @param config Pointer to the table database configuration structure.
- *
- * @return
- *    - ESP_OK: Success.
- *    - ESP_ERR_INVALID_ARG: Null pointer or invalid arguments.
- *    - Other error codes from nvs_open.
- */
-esp_err_t tabledb_init(tabledb_config_t *config) {
-    if (config->namespace == NULL || config->version == 0) {
-        return ESP_ERR_INVALID_ARG;
+// Helper: Read a whole record blob with a single NVS call (no size probe).
+static esp_err_t read_record(tabledb_config_t *config, const char *key, uint8_t *buffer, size_t *size) {
+    *size         = TABLEDB_MAX_RECORD_SIZE;
+    esp_err_t err = store_get(config, key, buffer, size);
+    if (err != ESP_OK) {
+        return err;
     }
-
-    if (config->size > TABLEDB_MAX_OBJECT_SIZE) {
-        ESP_LOGE(TAG, "Data size is too large");
+    if (*size < sizeof(tabledb_internal_record_t)) {
         return ESP_ERR_INVALID_SIZE;
     }
+    return ESP_OK;
+}
 
-    // Create mutex (initialie)
-    config->mutex = xSemaphoreCreateMutex();
-    if (config->mutex == NULL) {
-        return ESP_ERR_NO_MEM;
+// Helper: Copy a stored payload into data, upgrading it through update_cb if needed.
+static esp_err_t convert_payload(tabledb_config_t *config, uint8_t version, const uint8_t *payload, void *data) {
+    if (version != config->version) {
+        if (config->update_cb == NULL) {
+            return ESP_ERR_INVALID_VERSION;
+        }
+        return config->update_cb(version, payload, data);
     }
 
-    esp_err_t err = nvs_open(config->namespace, NVS_READWRITE, &config->handle);
-    if (err != ESP_OK) {
-        vSemaphoreDelete(config->mutex);
-        return err;
+    memcpy(data, payload, config->size);
+    return ESP_OK;
+}
+
+/***************** RAM index ******************/
+
+#define TABLEDB_INDEX_NOT_FOUND SIZE_MAX
+#define TABLEDB_INDEX_MIN_CAPACITY 16
+
+// Find the position of id in the index. Sequential scans hit the hint, so a
+// full walk through tabledb_get_next() costs O(1) per step.
+static size_t index_find(tabledb_index_t *index, uint32_t id) {
+    if (index->hint < index->count && index->ids[index->hint] == id) {
+        return index->hint;
+    }
+    for (size_t i = 0; i < index->count; i++) {
+        if (index->ids[i] == id) {
+            return i;
+        }
     }
+    return TABLEDB_INDEX_NOT_FOUND;
+}
 
-    return err;
+static esp_err_t index_reserve(tabledb_index_t *index, size_t capacity) {
+    if (capacity <= index->capacity) {
+        return ESP_OK;
+    }
+
+    size_t new_capacity = index->capacity ? index->capacity : TABLEDB_INDEX_MIN_CAPACITY;
+    while (new_capacity < capacity) {
+        new_capacity *= 2;
+    }
+
+    uint32_t *ids = realloc(index->ids, new_capacity * sizeof(uint32_t));
+    if (ids == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    index->ids = ids;
+    uint32_t *seqs = realloc(index->seqs, new_capacity * sizeof(uint32_t));
+    if (seqs == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    index->seqs     = seqs;
+    index->capacity = new_capacity;
+    return ESP_OK;
 }
 
-// Function traverses the linked list and call the update callback for each record
-// then updates the version of the record.
-esp_err_t tabledb_upgrade(tabledb_config_t *config) {
-    if (xSemaphoreTake(config->mutex, portMAX_DELAY) != pdTRUE) {
-        return ESP_ERR_TIMEOUT;
+// New records are linked in at the head, mirror that in the index.
+static void index_insert_head(tabledb_index_t *index, uint32_t id) {
+    assert(index->count < index->capacity);
+    memmove(index->ids + 1, index->ids, index->count * sizeof(uint32_t));
+    memmove(index->seqs + 1, index->seqs, index->count * sizeof(uint32_t));
+    index->ids[0]  = id;
+    index->seqs[0] = index->next_seq++;
+    index->count++;
+    index->hint++;
+}
+
+static void index_remove_at(tabledb_index_t *index, size_t pos) {
+    memmove(index->ids + pos, index->ids + pos + 1, (index->count - pos - 1) * sizeof(uint32_t));
+    memmove(index->seqs + pos, index->seqs + pos + 1, (index->count - pos - 1) * sizeof(uint32_t));
+    index->count--;
+    if (index->hint > pos) {
+        index->hint--;
     }
+}
+
+static void index_clear(tabledb_index_t *index) {
+    index->count = 0;
+    index->hint  = 0;
+}
+
+static void index_free(tabledb_index_t *index) {
+    free(index->ids);
+    free(index->seqs);
+    memset(index, 0, sizeof(tabledb_index_t));
+}
 
+// Walk the linked list stored in NVS once and record every ID in list order. The list
+// stores no sequence numbers, so they are handed out again from the tail up.
+static esp_err_t list_index_build(tabledb_config_t *config) {
     tabledb_meta_t meta;
     esp_err_t      err = load_meta(config, &meta);
     if (err != ESP_OK) {
-        EXIT_WITH_MUTEX(err);
+        return err;
+    }
+
+    index_clear(&config->index);
+    err = index_reserve(&config->index, meta.count);
+    if (err != ESP_OK) {
+        return err;
     }
 
     char cur_key[15];
     strncpy(cur_key, meta.head_key, sizeof(cur_key));
 
-    // Traverse the linked list
+    uint8_t buffer[TABLEDB_MAX_RECORD_SIZE];
     while (cur_key[0] != '\0') {
-        size_t blob_size;
-        err = nvs_get_blob(config->handle, cur_key, NULL, &blob_size);
+        size_t size;
+        err = read_record(config, cur_key, buffer, &size);
         if (err != ESP_OK) {
-            EXIT_WITH_MUTEX(err);
-        }
-
-        // If stored blob version is smaller than new version, lets use the new version
-        // if stored blob size is bigger than the new size, use blob_size
-        if (blob_size < sizeof(tabledb_internal_record_t) + config->size) {
-            blob_size = sizeof(tabledb_internal_record_t) + config->size;
+            ESP_LOGE(TAG, "%s: broken list at %s: %s", config->namespace, cur_key, esp_err_to_name(err));
+            return err;
         }
 
-        uint8_t buffer[blob_size];
-        err = nvs_get_blob(config->handle, cur_key, buffer, &blob_size);
+        tabledb_internal_record_t *record = (tabledb_internal_record_t *) buffer;
+        err = index_reserve(&config->index, config->index.count + 1);
         if (err != ESP_OK) {
-            EXIT_WITH_MUTEX(err);
+            return err;
         }
+        config->index.ids[config->index.count++] = record->id;
 
-        tabledb_internal_record_t *record = (tabledb_internal_record_t *) buffer;
-        // Save next key before updating current record.
-        char next_key[15];
-        strncpy(next_key, record->next_key, sizeof(next_key));
-
-        // Check if upgrade is needed.
-        if (record->version != config->version) {
-            if (config->update_cb == NULL) {
-                EXIT_WITH_MUTEX(ESP_ERR_INVALID_VERSION);
-            }
-            // Temporary buffer for updated payload.
-            uint8_t  new_payload[config->size];
-            uint8_t *old_payload = buffer + sizeof(tabledb_internal_record_t);
-            err                  = config->update_cb(record->version, old_payload, new_payload);
-            if (err != ESP_OK) {
-                EXIT_WITH_MUTEX(err);
-            }
-            memcpy(old_payload, new_payload, config->size);
-            record->version = config->version;
+        strncpy(cur_key, record->next_key, sizeof(cur_key));
+    }
 
-            err = nvs_set_blob(config->handle, cur_key, buffer, sizeof(buffer));
-            if (err != ESP_OK) {
-                tabledb_rollback(config);
-                EXIT_WITH_MUTEX(err);
-            }
-        }
-        // Move to the next record
-        strncpy(cur_key, next_key, sizeof(cur_key));
+    for (size_t i = 0; i < config->index.count; i++) {
+        config->index.seqs[i] = config->index.count - i;
     }
+    config->index.next_seq = config->index.count + 1;
 
-    err = nvs_commit(config->handle);
-    EXIT_WITH_MUTEX(err);
+    if (config->index.count != meta.count) {
+        ESP_LOGW(TAG, "%s: meta count %" PRIu32 " does not match list length %u", config->namespace,
+                 meta.count, (unsigned) config->index.count);
+    }
+    return ESP_OK;
 }
 
-/***************** tabledb_insert ******************/
+
+/***************** Transactions ******************/
 /*
- * Insert a new record using linked-list mechanism.
+ * Every mutation is staged in a transaction: the pending record order lives in
+ * a private copy of the index and new payloads are kept in RAM. On commit each
+ * touched record is written exactly once with its final list pointers, the
+ * meta blob is written once and the backend is committed once. Single-record
+ * insert/update/delete run as an implicit one-operation transaction.
  */
-esp_err_t tabledb_insert(tabledb_config_t *config, uint32_t id, void *data) {
-    if (xSemaphoreTake(config->mutex, portMAX_DELAY) != pdTRUE) {
-        return ESP_ERR_TIMEOUT;
-    }
-
-    char key[15];
-    snprintf(key, sizeof(key), "rec_%" PRIu32, id);
-
-    size_t    blob_size;
-    esp_err_t err = nvs_get_blob(config->handle, key, NULL, &blob_size);
-    if (err == ESP_OK) {
-        EXIT_WITH_MUTEX(ESP_ERR_INVALID_STATE);
-    } else if (err != ESP_ERR_NVS_NOT_FOUND) {
-        EXIT_WITH_MUTEX(err);
-    }
 
-    tabledb_meta_t meta;
-    err = load_meta(config, &meta);
-    if (err != ESP_OK) {
-        EXIT_WITH_MUTEX(err);
-    }
+typedef enum {
+    TABLEDB_TXN_PUT,
+    TABLEDB_TXN_DELETE,
+} tabledb_txn_op_t;
+
+typedef struct {
+    uint32_t         id;
+    tabledb_txn_op_t op;
+    uint8_t         *data;     // config->size bytes for TABLEDB_TXN_PUT, NULL otherwise
+    bool             inserted; // Linked in at the head by this transaction
+    bool             existed;  // Committed before the transaction, for change notifications
+} tabledb_txn_entry_t;
+
+struct tabledb_txn {
+    tabledb_index_t      index; // Record order as it will be after commit
+    tabledb_txn_entry_t *entries;
+    size_t               count;
+    size_t               capacity;
+};
+
+// Index visible to the caller: the pending one inside a transaction.
+static tabledb_index_t *active_index(tabledb_config_t *config) {
+    return config->txn ? &config->txn->index : &config->index;
+}
 
-    // Prepare new record with next pointer = current head and prev pointer empty.
-    tabledb_internal_record_t record = {.id = id, .version = config->version, .size = config->size};
-    strncpy(record.next_key, meta.head_key, sizeof(record.next_key));
-    record.prev_key[0] = '\0';
+static void record_key(uint32_t id, char *key, size_t key_size) {
+    snprintf(key, key_size, "rec_%" PRIu32, id);
+}
 
-    uint8_t buffer[sizeof(tabledb_internal_record_t) + config->size];
-    memcpy(buffer, &record, sizeof(tabledb_internal_record_t));
-    memcpy(buffer + sizeof(tabledb_internal_record_t), data, config->size);
+// Read one record of the linked-list layout. version (optional) receives the stored version.
+static esp_err_t list_load(tabledb_config_t *config, uint32_t id, void *data, uint8_t *version) {
+    char key[15];
+    record_key(id, key, sizeof(key));
 
-    err = nvs_set_blob(config->handle, key, buffer, sizeof(buffer));
+    size_t    size;
+    uint8_t   buffer[TABLEDB_MAX_RECORD_SIZE];
+    esp_err_t err = read_record(config, key, buffer, &size);
     if (err != ESP_OK) {
-        EXIT_WITH_MUTEX(err);
+        return err;
     }
 
-    // If list is not empty, update previous head's prev_key to new record.
-    if (meta.head_key[0] != '\0') {
-        size_t  head_size;
-        err = nvs_get_blob(config->handle, meta.head_key, NULL, &head_size);
-        if (err != ESP_OK) {
-            tabledb_rollback(config);
-            EXIT_WITH_MUTEX(err);
-        }
+    tabledb_internal_record_t *record = (tabledb_internal_record_t *) buffer;
+    if (version != NULL) {
+        *version = record->version;
+    }
+    return convert_payload(config, record->version, buffer + sizeof(tabledb_internal_record_t), data);
+}
 
-        uint8_t head_buffer[head_size];
-        err = nvs_get_blob(config->handle, meta.head_key, head_buffer, &head_size);
-        if (err == ESP_OK) {
-            tabledb_internal_record_t *head_record = (tabledb_internal_record_t *) head_buffer;
-            strncpy(head_record->prev_key, key, sizeof(head_record->prev_key));
-            err = nvs_set_blob(config->handle, meta.head_key, head_buffer, head_size);
-            if (err != ESP_OK) {
-                tabledb_rollback(config);
-                EXIT_WITH_MUTEX(err);
-            }
+// Erase the linked-list blobs of every indexed record and the meta blob.
+// Missing keys are skipped, so an interrupted erase can simply be repeated.
+static esp_err_t list_erase(tabledb_config_t *config) {
+    char key[15];
+    for (size_t i = 0; i < config->index.count; i++) {
+        record_key(config->index.ids[i], key, sizeof(key));
+        esp_err_t err = store_erase(config, key);
+        if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+            return err;
         }
     }
-
-    // Update meta: new record becomes head; count++.
-    strncpy(meta.head_key, key, sizeof(meta.head_key));
-    meta.count++;
-    err = save_meta(config, &meta);
-    if (err != ESP_OK) {
-        tabledb_rollback(config);
-        EXIT_WITH_MUTEX(err);
+    meta_key(config, key, sizeof(key));
+    esp_err_t err = store_erase(config, key);
+    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+        return err;
     }
-
-    err = nvs_commit(config->handle);
-    EXIT_WITH_MUTEX(err);
+    return store_commit(config);
 }
 
-/***************** tabledb_delete ******************/
-/*
- * Delete a record from the linked list.
- */
-esp_err_t tabledb_delete(tabledb_config_t *config, uint32_t id) {
-    if (xSemaphoreTake(config->mutex, portMAX_DELAY) != pdTRUE) {
-        return ESP_ERR_TIMEOUT;
+// Key of the record at pos + offset in the index, or empty string if there is none.
+static void neighbour_key(const tabledb_index_t *index, size_t pos, int offset, char *key, size_t key_size) {
+    if ((offset < 0 && pos == 0) || (offset > 0 && pos + 1 >= index->count)) {
+        key[0] = '\0';
+        return;
     }
-    char key[15];
-    snprintf(key, sizeof(key), "rec_%" PRIu32, id);
+    record_key(index->ids[pos + offset], key, key_size);
+}
 
-    // Load meta to update list.
-    tabledb_meta_t meta;
-    esp_err_t      err = load_meta(config, &meta);
-    if (err != ESP_OK) {
-        EXIT_WITH_MUTEX(err);
+static esp_err_t txn_alloc(tabledb_config_t *config) {
+    struct tabledb_txn *txn = calloc(1, sizeof(struct tabledb_txn));
+    if (txn == NULL) {
+        return ESP_ERR_NO_MEM;
     }
 
-    size_t rec_size;
-    err = nvs_get_blob(config->handle, key, NULL, &rec_size);
-    if (err != ESP_OK) {
-        EXIT_WITH_MUTEX(err);
+    // Pending index starts as a copy of the committed one.
+    if (index_reserve(&txn->index, config->index.count + 1) != ESP_OK) {
+        free(txn);
+        return ESP_ERR_NO_MEM;
+    }
+    if (config->index.count > 0) {
+        memcpy(txn->index.ids, config->index.ids, config->index.count * sizeof(uint32_t));
+        memcpy(txn->index.seqs, config->index.seqs, config->index.count * sizeof(uint32_t));
     }
+    txn->index.count    = config->index.count;
+    txn->index.next_seq = config->index.next_seq;
 
-    // Load record to be deleted.
-    uint8_t rec_buffer[rec_size];
-    err = nvs_get_blob(config->handle, key, rec_buffer, &rec_size);
-    if (err != ESP_OK) {
-        EXIT_WITH_MUTEX(err);
+    config->txn = txn;
+    return ESP_OK;
+}
+
+static void cache_unshadow(tabledb_config_t *config);
+
+// Close the transaction. Dirty records it shadowed become visible again unless
+// the commit path dropped them already.
+static void txn_free(tabledb_config_t *config) {
+    struct tabledb_txn *txn = config->txn;
+    if (txn == NULL) {
+        return;
     }
-    tabledb_internal_record_t *record = (tabledb_internal_record_t *) rec_buffer;
+    cache_unshadow(config);
+    for (size_t i = 0; i < txn->count; i++) {
+        free(txn->entries[i].data);
+    }
+    free(txn->entries);
+    index_free(&txn->index);
+    free(txn);
+    config->txn = NULL;
+}
 
-    // Update previous neighbor, if exists.
-    if (record->prev_key[0] != '\0') {
-        size_t prev_size;
-        err = nvs_get_blob(config->handle, record->prev_key, NULL, &prev_size);
-        if (err != ESP_OK) {
-            EXIT_WITH_MUTEX(err);
+static tabledb_txn_entry_t *txn_find(struct tabledb_txn *txn, uint32_t id) {
+    for (size_t i = 0; i < txn->count; i++) {
+        if (txn->entries[i].id == id) {
+            return &txn->entries[i];
         }
+    }
+    return NULL;
+}
 
-        uint8_t prev_buffer[prev_size];
-        err = nvs_get_blob(config->handle, record->prev_key, prev_buffer, &prev_size);
-        if (err != ESP_OK) {
-            EXIT_WITH_MUTEX(err);
-        }
-        tabledb_internal_record_t *prev_record = (tabledb_internal_record_t *) prev_buffer;
-        // Set previous record's next pointer to current record's next.
-        strncpy(prev_record->next_key, record->next_key, sizeof(prev_record->next_key));
-        err = nvs_set_blob(config->handle, record->prev_key, prev_buffer, prev_size);
-        if (err != ESP_OK) {
-            EXIT_WITH_MUTEX(err);
-        }
-    } else {
-        // If no previous pointer, update meta if this record is head.
-        if (strncmp(meta.head_key, key, sizeof(meta.head_key)) == 0) {
-            strncpy(meta.head_key, record->next_key, sizeof(meta.head_key));
-        }
+// Get (or create) the staged entry for id.
+static tabledb_txn_entry_t *txn_entry(tabledb_config_t *config, uint32_t id) {
+    struct tabledb_txn  *txn   = config->txn;
+    tabledb_txn_entry_t *entry = txn_find(txn, id);
+    if (entry != NULL) {
+        return entry;
     }
 
-    // Update next neighbor, if exists.
-    if (record->next_key[0] != '\0') {
-        size_t  next_size;
-        err = nvs_get_blob(config->handle, record->next_key, NULL, &next_size);
-        if (err != ESP_OK) {
-            tabledb_rollback(config);
-            EXIT_WITH_MUTEX(err);
+    if (txn->count == txn->capacity) {
+        size_t               capacity = txn->capacity ? txn->capacity * 2 : 8;
+        tabledb_txn_entry_t *entries  = realloc(txn->entries, capacity * sizeof(tabledb_txn_entry_t));
+        if (entries == NULL) {
+            return NULL;
         }
+        txn->entries  = entries;
+        txn->capacity = capacity;
+    }
 
-        uint8_t next_buffer[next_size];
-        err = nvs_get_blob(config->handle, record->next_key, next_buffer, &next_size);
-        if (err != ESP_OK) {
-            tabledb_rollback(config);
-            EXIT_WITH_MUTEX(err);
-        }
+    entry       = &txn->entries[txn->count++];
+    entry->id   = id;
+    entry->op       = TABLEDB_TXN_DELETE;
+    entry->data     = NULL;
+    entry->inserted = false;
+    entry->existed  = index_find(&config->index, id) != TABLEDB_INDEX_NOT_FOUND;
+    return entry;
+}
 
-        tabledb_internal_record_t *next_record = (tabledb_internal_record_t *) next_buffer;
-        // Set next record's prev pointer to current record's prev.
-        strncpy(next_record->prev_key, record->prev_key, sizeof(next_record->prev_key));
-        err = nvs_set_blob(config->handle, record->next_key, next_buffer, next_size);
-        if (err != ESP_OK) {
-            tabledb_rollback(config);
-            EXIT_WITH_MUTEX(err);
+static esp_err_t txn_stage_put(tabledb_config_t *config, uint32_t id, const void *data) {
+    tabledb_txn_entry_t *entry = txn_entry(config, id);
+    if (entry == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    if (entry->data == NULL) {
+        entry->data = malloc(config->size);
+        if (entry->data == NULL) {
+            return ESP_ERR_NO_MEM;
         }
     }
+    memcpy(entry->data, data, config->size);
+    entry->op = TABLEDB_TXN_PUT;
+    return ESP_OK;
+}
 
-    // Erase the record.
-    err = nvs_erase_key(config->handle, key);
+static void cache_shadow(tabledb_config_t *config, uint32_t id);
+
+static esp_err_t txn_stage_insert(tabledb_config_t *config, uint32_t id, const void *data) {
+    tabledb_index_t *index = &config->txn->index;
+    if (index_find(index, id) != TABLEDB_INDEX_NOT_FOUND) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t err = index_reserve(index, index->count + 1);
     if (err != ESP_OK) {
-        tabledb_rollback(config);
-        EXIT_WITH_MUTEX(err);
+        return err;
     }
-    meta.count = (meta.count > 0) ? meta.count - 1 : 0;
-    err        = save_meta(config, &meta);
+    cache_shadow(config, id);
+    err = txn_stage_put(config, id, data);
     if (err != ESP_OK) {
-        tabledb_rollback(config);
-        EXIT_WITH_MUTEX(err);
+        return err;
     }
-
-    err = nvs_commit(config->handle);
-    EXIT_WITH_MUTEX(err);
+    txn_find(config->txn, id)->inserted = true;
+    index_insert_head(index, id);
+    return ESP_OK;
 }
 
-/*
- * @brief Drop the entire table and delete all records.
- *
- * This function erases all records in the table by clearing the entire NVS namespace.
- *
- * @param config Pointer to the table database configuration structure.
- *
- * @return
- *    - ESP_OK: Success.
- *    - Other error codes from NVS functions.
- */
-esp_err_t tabledb_drop(tabledb_config_t *config) {
-    if (xSemaphoreTake(config->mutex, portMAX_DELAY) != pdTRUE) {
-        return ESP_ERR_TIMEOUT;
-    }
-    esp_err_t err = nvs_erase_all(config->handle);
-    if (err != ESP_OK) {
-        EXIT_WITH_MUTEX(err);
+static esp_err_t txn_stage_update(tabledb_config_t *config, uint32_t id, const void *data) {
+    if (index_find(&config->txn->index, id) == TABLEDB_INDEX_NOT_FOUND) {
+        return ESP_ERR_NVS_NOT_FOUND;
     }
+    // A direct update supersedes any deferred one once committed.
+    cache_shadow(config, id);
+    return txn_stage_put(config, id, data);
+}
 
-    // Commit changes
-    err = nvs_commit(config->handle);
-    if (err != ESP_OK) {
-        EXIT_WITH_MUTEX(err);
+static esp_err_t txn_stage_delete(tabledb_config_t *config, uint32_t id) {
+    tabledb_index_t *index = &config->txn->index;
+    size_t           pos   = index_find(index, id);
+    if (pos == TABLEDB_INDEX_NOT_FOUND) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    tabledb_txn_entry_t *entry = txn_entry(config, id);
+    if (entry == NULL) {
+        return ESP_ERR_NO_MEM;
     }
+    cache_shadow(config, id);
+    free(entry->data);
+    entry->data     = NULL;
+    entry->op       = TABLEDB_TXN_DELETE;
+    entry->inserted = false;
+    index_remove_at(index, pos);
+    return ESP_OK;
+}
 
-    EXIT_WITH_MUTEX(ESP_OK);
+// Pending order becomes the committed one.
+static void txn_adopt_index(tabledb_config_t *config) {
+    index_free(&config->index);
+    config->index = config->txn->index;
+    memset(&config->txn->index, 0, sizeof(tabledb_index_t));
+    config->index.hint = 0;
 }
 
+/***************** Paged layout ******************/
 /*
- * @brief Retrieve a record by ID.
- *
- * This function retrieves a record from the table using the specified ID. If the record's version
- * differs from the current version, the update callback will be called if provided.
- *
- * @param config Pointer to the table database configuration structure.
- * @param id Unique ID of the record to be retrieved.
- * @param data Pointer to the buffer where the data will be stored.
+ * TABLEDB_LAYOUT_PAGED packs many records into fixed-size page blobs (pg_<n>)
+ * described by one small directory blob (_pdir). NVS spends 64 bytes of entry
+ * overhead on every blob, which dwarfs a 40 byte record stored on its own.
  *
- * @return
- *    - ESP_OK: Success.
- *    - ESP_ERR_INVALID_ARG: Null pointer or invalid arguments.
- *    - ESP_ERR_NOT_FOUND: Record with the given ID does not exist.
- *    - ESP_ERR_INVALID_VERSION: Record version mismatch and no update callback provided.
- *    - ESP_ERR_INVALID_SIZE: Provided buffer size is too small.
- *    - Other error codes from NVS functions.
+ * Every slot starts with a header holding the record id, its version and an
+ * insertion sequence number; list order (newest first) is rebuilt from the
+ * sequence numbers at init. A transaction rewrites each touched page once.
+ * The directory format is versioned; linked-list tables are migrated when
+ * they are opened with the paged layout.
  */
-esp_err_t tabledb_get(tabledb_config_t *config, uint32_t id, void *data) {
-    char key[15];
-    snprintf(key, sizeof(key), "rec_%" PRIu32, id);
 
-    size_t    required_size;
-    esp_err_t err = nvs_get_blob(config->handle, key, NULL, &required_size);
-    if (err != ESP_OK) {
-        return err;
-    }
+#define TABLEDB_PAGE_SIZE 1024
+#define TABLEDB_MAX_PAGES 128
+#define TABLEDB_PAGED_FORMAT 1
+#define TABLEDB_PAGE_DIR_KEY "_pdir"
+
+typedef struct {
+    uint8_t  format;      // TABLEDB_PAGED_FORMAT
+    uint8_t  per_page;    // Slots per page
+    uint16_t record_size; // Payload size the pages are laid out for
+    uint16_t page_count;
+    uint16_t reserved;
+    uint32_t count;
+    uint32_t next_seq; // Sequence number of the next inserted record
+} tabledb_page_dir_t;  // Followed by uint8_t used[page_count]
+
+typedef struct {
+    uint32_t id;
+    uint32_t seq;
+    uint8_t  version;
+    uint8_t  used;
+    uint16_t reserved;
+} tabledb_page_slot_t; // Followed by the payload
+
+// RAM copy of the slot occupancy, so lookups and allocation never read pages.
+typedef struct {
+    uint32_t id;
+    bool     used;
+} tabledb_slot_ref_t;
+
+struct tabledb_pages {
+    uint16_t            record_size;
+    uint8_t             per_page;
+    size_t              stride; // Bytes per slot, header included
+    uint16_t            page_count;
+    uint16_t            page_capacity;
+    uint32_t            next_seq;
+    tabledb_slot_ref_t *slots; // page_count * per_page
+    uint8_t            *buf;   // TABLEDB_PAGE_SIZE
+    int                 cached_page; // Page held in buf, -1 if none
+};
+
+static void page_key(uint16_t page, char *key, size_t key_size) {
+    snprintf(key, key_size, "pg_%u", (unsigned) page);
+}
 
-    if (required_size < sizeof(tabledb_internal_record_t)) {
-        return ESP_ERR_INVALID_SIZE;
-    }
+static void paged_geometry(struct tabledb_pages *pages, uint16_t record_size) {
+    pages->record_size = record_size;
+    pages->stride      = sizeof(tabledb_page_slot_t) + ((record_size + 3) & ~3u);
+    pages->per_page    = TABLEDB_PAGE_SIZE / pages->stride;
+}
 
-    uint8_t buffer[required_size];
-    err = nvs_get_blob(config->handle, key, buffer, &required_size);
-    if (err != ESP_OK) {
-        return err;
-    }
+static size_t page_bytes(const struct tabledb_pages *pages) {
+    return pages->per_page * pages->stride;
+}
 
-    tabledb_internal_record_t *record = (tabledb_internal_record_t *) buffer;
-    if (record->version != config->version && config->update_cb == NULL) {
-        return ESP_ERR_INVALID_VERSION;
-    }
+static tabledb_page_slot_t *page_slot(struct tabledb_pages *pages, size_t pos) {
+    return (tabledb_page_slot_t *) (pages->buf + pos * pages->stride);
+}
 
-    uint8_t *payload = buffer + sizeof(tabledb_internal_record_t);
-    if (record->version != config->version) {
-        err = config->update_cb(record->version, payload, data);
-        if (err != ESP_OK) {
-            return err;
-        }
-    } else {
-        memcpy(data, payload, record->size);
+static esp_err_t paged_reserve(struct tabledb_pages *pages, uint16_t page_count) {
+    if (page_count <= pages->page_capacity) {
+        return ESP_OK;
+    }
+    size_t              bytes = (size_t) page_count * pages->per_page * sizeof(tabledb_slot_ref_t);
+    tabledb_slot_ref_t *slots = realloc(pages->slots, bytes);
+    if (slots == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    pages->slots         = slots;
+    pages->page_capacity = page_count;
+    return ESP_OK;
+}
+
+static size_t paged_find(const struct tabledb_pages *pages, uint32_t id) {
+    size_t total = (size_t) pages->page_count * pages->per_page;
+    for (size_t i = 0; i < total; i++) {
+        if (pages->slots[i].used && pages->slots[i].id == id) {
+            return i;
+        }
+    }
+    return TABLEDB_INDEX_NOT_FOUND;
+}
+
+// Take the first free slot, appending a page if all are full.
+static esp_err_t paged_alloc_slot(struct tabledb_pages *pages, size_t *slot) {
+    size_t total = (size_t) pages->page_count * pages->per_page;
+    for (size_t i = 0; i < total; i++) {
+        if (!pages->slots[i].used) {
+            *slot = i;
+            return ESP_OK;
+        }
+    }
+    if (pages->page_count >= TABLEDB_MAX_PAGES) {
+        return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    }
+    esp_err_t err = paged_reserve(pages, pages->page_count + 1);
+    if (err != ESP_OK) {
+        return err;
+    }
+    memset(&pages->slots[total], 0, pages->per_page * sizeof(tabledb_slot_ref_t));
+    pages->page_count++;
+    *slot = total;
+    return ESP_OK;
+}
+
+static esp_err_t paged_read_page(tabledb_config_t *config, uint16_t page) {
+    struct tabledb_pages *pages = config->pages;
+    if (pages->cached_page == page) {
+        return ESP_OK;
+    }
+
+    char key[15];
+    page_key(page, key, sizeof(key));
+    size_t    size = TABLEDB_PAGE_SIZE;
+    esp_err_t err  = store_get(config, key, pages->buf, &size);
+    if (err != ESP_OK) {
+        pages->cached_page = -1;
+        return err;
+    }
+    if (size != page_bytes(pages)) {
+        pages->cached_page = -1;
+        return ESP_ERR_INVALID_SIZE;
+    }
+    pages->cached_page = page;
+    return ESP_OK;
+}
+
+static esp_err_t paged_write_page(tabledb_config_t *config, uint16_t page) {
+    char key[15];
+    page_key(page, key, sizeof(key));
+    config->pages->cached_page = page;
+    return store_set(config, key, config->pages->buf, page_bytes(config->pages));
+}
+
+static esp_err_t paged_save_dir(tabledb_config_t *config, uint32_t count) {
+    struct tabledb_pages *pages = config->pages;
+    uint8_t               buffer[sizeof(tabledb_page_dir_t) + TABLEDB_MAX_PAGES];
+    tabledb_page_dir_t   *dir  = (tabledb_page_dir_t *) buffer;
+    uint8_t              *used = buffer + sizeof(tabledb_page_dir_t);
+
+    memset(buffer, 0, sizeof(buffer));
+    dir->format      = TABLEDB_PAGED_FORMAT;
+    dir->per_page    = pages->per_page;
+    dir->record_size = pages->record_size;
+    dir->page_count  = pages->page_count;
+    dir->count       = count;
+    dir->next_seq    = pages->next_seq;
+    for (size_t i = 0; i < (size_t) pages->page_count * pages->per_page; i++) {
+        used[i / pages->per_page] += pages->slots[i].used;
+    }
+    return store_set(config, TABLEDB_PAGE_DIR_KEY, buffer,
+                        sizeof(tabledb_page_dir_t) + pages->page_count);
+}
+
+typedef struct {
+    uint32_t seq;
+    uint32_t id;
+} tabledb_seq_id_t;
+
+static int compare_seq_desc(const void *a, const void *b) {
+    uint32_t sa = ((const tabledb_seq_id_t *) a)->seq;
+    uint32_t sb = ((const tabledb_seq_id_t *) b)->seq;
+    return (sa < sb) - (sa > sb);
+}
+
+// Read the directory and every non-empty page once; rebuild the slot map and
+// the index (newest first).
+static esp_err_t paged_build(tabledb_config_t *config) {
+    struct tabledb_pages *pages = config->pages;
+    uint8_t               buffer[sizeof(tabledb_page_dir_t) + TABLEDB_MAX_PAGES];
+    tabledb_page_dir_t   *dir  = (tabledb_page_dir_t *) buffer;
+    uint8_t              *used = buffer + sizeof(tabledb_page_dir_t);
+    size_t                size = sizeof(buffer);
+
+    index_clear(&config->index);
+    pages->cached_page = -1;
+
+    esp_err_t err = store_get(config, TABLEDB_PAGE_DIR_KEY, buffer, &size);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        paged_geometry(pages, config->size);
+        pages->page_count      = 0;
+        pages->next_seq        = 1;
+        config->index.next_seq = 1;
+        return ESP_OK;
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (size < sizeof(tabledb_page_dir_t) || dir->format != TABLEDB_PAGED_FORMAT ||
+        dir->page_count > TABLEDB_MAX_PAGES || size != sizeof(tabledb_page_dir_t) + dir->page_count) {
+        ESP_LOGE(TAG, "%s: unsupported page directory (format %u)", config->namespace, dir->format);
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    // Geometry comes from flash, it may predate a change of config->size.
+    paged_geometry(pages, dir->record_size);
+    pages->per_page = dir->per_page;
+    if (pages->per_page == 0 || page_bytes(pages) > TABLEDB_PAGE_SIZE) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    pages->page_capacity = 0;
+    free(pages->slots);
+    pages->slots      = NULL;
+    pages->page_count = 0;
+    err               = paged_reserve(pages, dir->page_count);
+    if (err != ESP_OK) {
+        return err;
+    }
+    pages->page_count = dir->page_count;
+    pages->next_seq   = dir->next_seq;
+    size_t total = (size_t) pages->page_count * pages->per_page;
+    memset(pages->slots, 0, total * sizeof(tabledb_slot_ref_t));
+
+    tabledb_seq_id_t *order = malloc((total + 1) * sizeof(tabledb_seq_id_t));
+    if (order == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    size_t count = 0;
+    for (uint16_t page = 0; page < pages->page_count; page++) {
+        if (used[page] == 0) {
+            continue;
+        }
+        err = paged_read_page(config, page);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "%s: page %u unreadable: %s", config->namespace, page,
+                     esp_err_to_name(err));
+            free(order);
+            return err;
+        }
+        for (size_t i = 0; i < pages->per_page; i++) {
+            tabledb_page_slot_t *slot = page_slot(pages, i);
+            if (!slot->used) {
+                continue;
+            }
+            pages->slots[page * pages->per_page + i] =
+                (tabledb_slot_ref_t) {.id = slot->id, .used = true};
+            order[count++] = (tabledb_seq_id_t) {.seq = slot->seq, .id = slot->id};
+        }
+    }
+
+    qsort(order, count, sizeof(tabledb_seq_id_t), compare_seq_desc);
+    err = index_reserve(&config->index, count);
+    if (err == ESP_OK) {
+        for (size_t i = 0; i < count; i++) {
+            config->index.ids[i]  = order[i].id;
+            config->index.seqs[i] = order[i].seq;
+        }
+        config->index.count = count;
+    }
+    config->index.next_seq = pages->next_seq;
+    free(order);
+
+    if (count != dir->count) {
+        ESP_LOGW(TAG, "%s: directory count %" PRIu32 " does not match pages %u", config->namespace,
+                 dir->count, (unsigned) count);
+    }
+    return err;
+}
+
+static esp_err_t paged_load(tabledb_config_t *config, uint32_t id, void *data, uint8_t *version) {
+    struct tabledb_pages *pages = config->pages;
+    size_t                pos   = paged_find(pages, id);
+    if (pos == TABLEDB_INDEX_NOT_FOUND) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    esp_err_t err = paged_read_page(config, pos / pages->per_page);
+    if (err != ESP_OK) {
+        return err;
+    }
+    tabledb_page_slot_t *slot = page_slot(pages, pos % pages->per_page);
+    if (version != NULL) {
+        *version = slot->version;
+    }
+    return convert_payload(config, slot->version, (uint8_t *) (slot + 1), data);
+}
+
+// Write the staged changes page by page. Inserted records store the sequence
+// number the pending index gave them.
+static esp_err_t paged_flush(tabledb_config_t *config) {
+    struct tabledb_pages *pages     = config->pages;
+    struct tabledb_txn   *txn       = config->txn;
+    tabledb_index_t      *new       = &txn->index;
+    uint16_t              old_pages = pages->page_count;
+    uint8_t               dirty[(TABLEDB_MAX_PAGES + 7) / 8] = {0};
+    bool                  dir_dirty = false;
+    size_t                written   = 0;
+    esp_err_t             err       = ESP_OK;
+
+    // Update the slot map first, then produce each dirty page once.
+    for (size_t i = 0; i < txn->count; i++) {
+        tabledb_txn_entry_t *entry = &txn->entries[i];
+        size_t               pos   = paged_find(pages, entry->id);
+        if (entry->op == TABLEDB_TXN_DELETE) {
+            if (pos != TABLEDB_INDEX_NOT_FOUND) {
+                pages->slots[pos].used = false;
+                dirty[pos / pages->per_page / 8] |= 1 << (pos / pages->per_page % 8);
+                dir_dirty = true;
+            }
+            continue;
+        }
+        if (pos == TABLEDB_INDEX_NOT_FOUND) {
+            err = paged_alloc_slot(pages, &pos);
+            if (err != ESP_OK) {
+                goto fail;
+            }
+            pages->slots[pos] = (tabledb_slot_ref_t) {.id = entry->id, .used = true};
+        }
+        dir_dirty |= entry->inserted;
+        dirty[pos / pages->per_page / 8] |= 1 << (pos / pages->per_page % 8);
+    }
+
+    for (uint16_t page = 0; page < pages->page_count; page++) {
+        if (!(dirty[page / 8] & (1 << (page % 8)))) {
+            continue;
+        }
+        if (page >= old_pages) {
+            memset(pages->buf, 0, page_bytes(pages));
+        } else {
+            err = paged_read_page(config, page);
+            if (err != ESP_OK) {
+                goto fail;
+            }
+        }
+
+        for (size_t i = 0; i < pages->per_page; i++) {
+            tabledb_slot_ref_t  *ref  = &pages->slots[page * pages->per_page + i];
+            tabledb_page_slot_t *slot = page_slot(pages, i);
+            if (!ref->used) {
+                if (slot->used) {
+                    memset(slot, 0, pages->stride);
+                }
+                continue;
+            }
+            tabledb_txn_entry_t *entry = txn_find(txn, ref->id);
+            if (entry == NULL || entry->op != TABLEDB_TXN_PUT) {
+                continue;
+            }
+            if (entry->inserted) {
+                slot->seq = new->seqs[index_find(new, ref->id)];
+            }
+            slot->id      = ref->id;
+            slot->used    = 1;
+            slot->version = config->version;
+            memcpy(slot + 1, entry->data, config->size);
+        }
+
+        err = paged_write_page(config, page);
+        if (err != ESP_OK) {
+            goto fail;
+        }
+        written++;
+    }
+
+    if (dir_dirty) {
+        pages->next_seq = new->next_seq;
+        err = paged_save_dir(config, new->count);
+        if (err != ESP_OK) {
+            goto fail;
+        }
+        written++;
+    }
+
+    if (written > 0) {
+        err = store_commit(config);
+        if (err != ESP_OK) {
+            goto fail;
+        }
+    }
+
+    txn_adopt_index(config);
+    return ESP_OK;
+
+fail:
+    ESP_LOGE(TAG, "%s: commit failed: %s", config->namespace, esp_err_to_name(err));
+    tabledb_rollback(config);
+    if (paged_build(config) != ESP_OK) {
+        ESP_LOGE(TAG, "%s: index rebuild failed", config->namespace);
+    }
+    return err;
+}
+
+// Lay out all records from scratch with the current config->size. payloads
+// holds count records in index order (newest first).
+static esp_err_t paged_write_all(tabledb_config_t *config, const uint32_t *ids, size_t count,
+                                 const uint8_t *payloads) {
+    struct tabledb_pages *pages     = config->pages;
+    uint16_t              old_pages = pages->page_count;
+
+    paged_geometry(pages, config->size);
+    size_t page_count = (count + pages->per_page - 1) / pages->per_page;
+    if (page_count > TABLEDB_MAX_PAGES) {
+        return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+    }
+
+    // The slot map is resized for the new geometry.
+    free(pages->slots);
+    pages->slots         = NULL;
+    pages->page_capacity = 0;
+    pages->page_count    = 0;
+    esp_err_t err        = paged_reserve(pages, page_count);
+    if (err != ESP_OK) {
+        return err;
+    }
+    pages->page_count = page_count;
+    pages->next_seq   = count + 1;
+    memset(pages->slots, 0, page_count * pages->per_page * sizeof(tabledb_slot_ref_t));
+
+    for (uint16_t page = 0; page < page_count; page++) {
+        memset(pages->buf, 0, page_bytes(pages));
+        for (size_t i = 0; i < pages->per_page; i++) {
+            size_t pos = page * pages->per_page + i;
+            if (pos >= count) {
+                break;
+            }
+            tabledb_page_slot_t *slot = page_slot(pages, i);
+            slot->id                  = ids[pos];
+            slot->seq                 = count - pos;
+            slot->version             = config->version;
+            slot->used                = 1;
+            memcpy(slot + 1, payloads + pos * config->size, config->size);
+            pages->slots[pos] = (tabledb_slot_ref_t) {.id = ids[pos], .used = true};
+        }
+        err = paged_write_page(config, page);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+
+    for (uint16_t page = page_count; page < old_pages; page++) {
+        char key[15];
+        page_key(page, key, sizeof(key));
+        err = store_erase(config, key);
+        if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
+            return err;
+        }
+    }
+    return paged_save_dir(config, count);
+}
+
+// Read every record of the index into one RAM buffer (count * size bytes).
+typedef esp_err_t (*record_loader_t)(tabledb_config_t *config, uint32_t id, void *data, uint8_t *version);
+
+static esp_err_t load_all(tabledb_config_t *config, record_loader_t load, uint8_t **payloads) {
+    *payloads = malloc(config->index.count * config->size + 1);
+    if (*payloads == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    for (size_t i = 0; i < config->index.count; i++) {
+        esp_err_t err = load(config, config->index.ids[i], *payloads + i * config->size, NULL);
+        if (err != ESP_OK) {
+            free(*payloads);
+            *payloads = NULL;
+            return err;
+        }
+    }
+    return ESP_OK;
+}
+
+// Rewrite all records with new geometry/version (source is loaded with load).
+static esp_err_t paged_rewrite(tabledb_config_t *config, record_loader_t load) {
+    uint8_t  *payloads;
+    esp_err_t err = load_all(config, load, &payloads);
+    if (err != ESP_OK) {
+        return err;
+    }
+    err = paged_write_all(config, config->index.ids, config->index.count, payloads);
+    free(payloads);
+    if (err == ESP_OK) {
+        err = store_commit(config);
+    }
+    if (err != ESP_OK) {
+        tabledb_rollback(config);
+        paged_build(config);
+    }
+    return err;
+}
+
+static void paged_free(tabledb_config_t *config) {
+    if (config->pages == NULL) {
+        return;
+    }
+    free(config->pages->slots);
+    free(config->pages->buf);
+    free(config->pages);
+    config->pages = NULL;
+}
+
+static void paged_reset(tabledb_config_t *config) {
+    struct tabledb_pages *pages = config->pages;
+    if (pages == NULL) {
+        return;
+    }
+    paged_geometry(pages, config->size);
+    pages->page_count  = 0;
+    pages->next_seq    = 1;
+    pages->cached_page = -1;
+}
+
+// Open a paged table: migrate a linked-list table, finish an interrupted
+// migration, and repack pages laid out for an older record size.
+static esp_err_t paged_init(tabledb_config_t *config) {
+    config->pages = calloc(1, sizeof(struct tabledb_pages));
+    if (config->pages == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    config->pages->buf = malloc(TABLEDB_PAGE_SIZE);
+    if (config->pages->buf == NULL) {
+        paged_free(config);
+        return ESP_ERR_NO_MEM;
+    }
+    config->pages->cached_page = -1;
+
+    size_t         size;
+    bool           has_dir = store_get(config, TABLEDB_PAGE_DIR_KEY, NULL, &size) == ESP_OK;
+    tabledb_meta_t meta;
+    esp_err_t      err = load_meta(config, &meta);
+    if (err == ESP_OK && meta.head_key[0] != '\0') {
+        if (!has_dir) {
+            err = list_index_build(config);
+            if (err == ESP_OK) {
+                err = paged_rewrite(config, list_load);
+            }
+            if (err == ESP_OK) {
+                ESP_LOGI(TAG, "%s: migrated %u records to paged layout", config->namespace,
+                         (unsigned) config->index.count);
+            }
+        } else {
+            err = paged_build(config);
+        }
+        // Pages are committed, the linked list is garbage now.
+        if (err == ESP_OK) {
+            err = list_erase(config);
+        }
+    } else if (err == ESP_OK) {
+        err = paged_build(config);
+    }
+
+    if (err == ESP_OK && config->pages->record_size != config->size) {
+        ESP_LOGI(TAG, "%s: repacking pages for record size %u", config->namespace,
+                 (unsigned) config->size);
+        err = paged_rewrite(config, paged_load);
+    }
+    if (err != ESP_OK) {
+        paged_free(config);
+    }
+    return err;
+}
+
+// Rewrite stale records in place (record size is already current, see paged_init).
+static esp_err_t paged_upgrade(tabledb_config_t *config) {
+    struct tabledb_pages *pages = config->pages;
+    uint8_t               new_payload[config->size];
+    esp_err_t             err     = ESP_OK;
+    size_t                written = 0;
+
+    for (uint16_t page = 0; page < pages->page_count; page++) {
+        bool changed = false;
+        for (size_t i = 0; i < pages->per_page && err == ESP_OK; i++) {
+            if (!pages->slots[page * pages->per_page + i].used) {
+                continue;
+            }
+            err = paged_read_page(config, page);
+            if (err != ESP_OK) {
+                break;
+            }
+            tabledb_page_slot_t *slot = page_slot(pages, i);
+            if (slot->version == config->version) {
+                continue;
+            }
+            if (config->update_cb == NULL) {
+                err = ESP_ERR_INVALID_VERSION;
+                break;
+            }
+            err = config->update_cb(slot->version, slot + 1, new_payload);
+            if (err == ESP_OK) {
+                memcpy(slot + 1, new_payload, config->size);
+                slot->version = config->version;
+                changed       = true;
+            }
+        }
+        if (err == ESP_OK && changed) {
+            err = paged_write_page(config, page);
+            written++;
+        }
+        if (err != ESP_OK) {
+            pages->cached_page = -1;
+            tabledb_rollback(config);
+            return err;
+        }
+    }
+
+    return written > 0 ? store_commit(config) : ESP_OK;
+}
+
+static esp_err_t index_build(tabledb_config_t *config) {
+    return config->pages != NULL ? paged_build(config) : list_index_build(config);
+}
+
+// Load a record from the backend, ignoring staged and cached payloads.
+static esp_err_t stored_load(tabledb_config_t *config, uint32_t id, void *data, uint8_t *version) {
+    if (config->pages != NULL) {
+        return paged_load(config, id, data, version);
+    }
+    return list_load(config, id, data, version);
+}
+
+/***************** Secondary key index ******************/
+/*
+ * With key_cb set, tabledb keeps the key of every committed record in a RAM
+ * array sorted by key, so tabledb_find_by_key() is a binary search instead of
+ * a walk over flash. The array is built at init and updated when a transaction
+ * commits; staged and deferred payloads are checked at lookup time. After a
+ * failed commit it is marked stale and rebuilt by the next lookup.
+ */
+
+typedef struct {
+    uint32_t key;
+    uint32_t id;
+} tabledb_key_entry_t;
+
+struct tabledb_keys {
+    tabledb_key_entry_t *entries; // Sorted by key
+    size_t               count;
+    size_t               capacity;
+    bool                 valid; // False until rebuilt after a failed commit
+};
+
+// Position of the first entry with a key not below key.
+static size_t keys_lower_bound(const struct tabledb_keys *keys, uint32_t key) {
+    size_t lo = 0, hi = keys->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (keys->entries[mid].key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static esp_err_t keys_reserve(struct tabledb_keys *keys, size_t capacity) {
+    if (capacity <= keys->capacity) {
+        return ESP_OK;
+    }
+
+    size_t new_capacity = keys->capacity ? keys->capacity : TABLEDB_INDEX_MIN_CAPACITY;
+    while (new_capacity < capacity) {
+        new_capacity *= 2;
+    }
+
+    tabledb_key_entry_t *entries = realloc(keys->entries, new_capacity * sizeof(tabledb_key_entry_t));
+    if (entries == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    keys->entries  = entries;
+    keys->capacity = new_capacity;
+    return ESP_OK;
+}
+
+// Room for the entry must have been reserved.
+static void keys_add(struct tabledb_keys *keys, uint32_t key, uint32_t id) {
+    assert(keys->count < keys->capacity);
+    size_t pos = keys_lower_bound(keys, key);
+    memmove(keys->entries + pos + 1, keys->entries + pos, (keys->count - pos) * sizeof(tabledb_key_entry_t));
+    keys->entries[pos].key = key;
+    keys->entries[pos].id  = id;
+    keys->count++;
+}
+
+static void keys_remove(struct tabledb_keys *keys, uint32_t id) {
+    for (size_t pos = 0; pos < keys->count; pos++) {
+        if (keys->entries[pos].id == id) {
+            memmove(keys->entries + pos, keys->entries + pos + 1,
+                    (keys->count - pos - 1) * sizeof(tabledb_key_entry_t));
+            keys->count--;
+            return;
+        }
+    }
+}
+
+// Read every committed record once and collect its key.
+static esp_err_t keys_build(tabledb_config_t *config) {
+    struct tabledb_keys *keys = config->keys;
+    keys->count               = 0;
+    keys->valid               = false;
+
+    esp_err_t err = keys_reserve(keys, config->index.count);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    uint8_t data[TABLEDB_MAX_OBJECT_SIZE];
+    for (size_t i = 0; i < config->index.count; i++) {
+        uint32_t id = config->index.ids[i];
+        err         = stored_load(config, id, data, NULL);
+        if (err != ESP_OK) {
+            return err;
+        }
+        keys_add(keys, config->key_cb(data), id);
+    }
+    keys->valid = true;
+    return ESP_OK;
+}
+
+// Mirror a committed transaction in the key index.
+static void keys_apply_txn(tabledb_config_t *config) {
+    struct tabledb_keys *keys = config->keys;
+    struct tabledb_txn  *txn  = config->txn;
+    if (keys == NULL || !keys->valid) {
+        return;
+    }
+    if (keys_reserve(keys, keys->count + txn->count) != ESP_OK) {
+        keys->valid = false;
+        return;
+    }
+    for (size_t i = 0; i < txn->count; i++) {
+        keys_remove(keys, txn->entries[i].id);
+        if (txn->entries[i].op == TABLEDB_TXN_PUT) {
+            keys_add(keys, config->key_cb(txn->entries[i].data), txn->entries[i].id);
+        }
+    }
+}
+
+static void keys_free(tabledb_config_t *config) {
+    if (config->keys == NULL) {
+        return;
+    }
+    free(config->keys->entries);
+    free(config->keys);
+    config->keys = NULL;
+}
+
+static esp_err_t keys_init(tabledb_config_t *config) {
+    config->keys = NULL;
+    if (config->key_cb == NULL) {
+        return ESP_OK;
+    }
+    config->keys = calloc(1, sizeof(struct tabledb_keys));
+    if (config->keys == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    esp_err_t err = keys_build(config);
+    if (err != ESP_OK) {
+        keys_free(config);
+    }
+    return err;
+}
+
+// Write the staged changes of a linked-list table. On failure the RAM index is
+// rebuilt from whatever actually reached flash.
+static esp_err_t list_flush(tabledb_config_t *config) {
+    struct tabledb_txn *txn     = config->txn;
+    tabledb_index_t    *old     = &config->index;
+    tabledb_index_t    *new     = &txn->index;
+    size_t              written = 0;
+    esp_err_t           err     = ESP_OK;
+    uint8_t             buffer[TABLEDB_MAX_RECORD_SIZE];
+
+    // Rewrite every record whose payload or list neighbours changed.
+    for (size_t pos = 0; pos < new->count; pos++) {
+        uint32_t             id    = new->ids[pos];
+        tabledb_txn_entry_t *entry = txn_find(txn, id);
+
+        char prev_key[16], next_key[16];
+        neighbour_key(new, pos, -1, prev_key, sizeof(prev_key));
+        neighbour_key(new, pos, 1, next_key, sizeof(next_key));
+
+        size_t old_pos = index_find(old, id);
+        if (entry == NULL && old_pos != TABLEDB_INDEX_NOT_FOUND) {
+            char old_prev[16], old_next[16];
+            neighbour_key(old, old_pos, -1, old_prev, sizeof(old_prev));
+            neighbour_key(old, old_pos, 1, old_next, sizeof(old_next));
+            old->hint = old_pos + 1;
+            if (strcmp(prev_key, old_prev) == 0 && strcmp(next_key, old_next) == 0) {
+                continue;
+            }
+        }
+
+        char key[15];
+        record_key(id, key, sizeof(key));
+
+        tabledb_internal_record_t *record = (tabledb_internal_record_t *) buffer;
+        size_t                     size;
+        if (entry != NULL) {
+            memset(record, 0, sizeof(tabledb_internal_record_t));
+            record->id      = id;
+            record->version = config->version;
+            record->size    = config->size;
+            memcpy(buffer + sizeof(tabledb_internal_record_t), entry->data, config->size);
+            size = sizeof(tabledb_internal_record_t) + config->size;
+        } else {
+            // Only the list pointers changed, keep the stored payload as is.
+            err = read_record(config, key, buffer, &size);
+            if (err != ESP_OK) {
+                goto fail;
+            }
+        }
+        strncpy(record->prev_key, prev_key, sizeof(record->prev_key));
+        strncpy(record->next_key, next_key, sizeof(record->next_key));
+
+        err = store_set(config, key, buffer, size);
+        if (err != ESP_OK) {
+            goto fail;
+        }
+        written++;
+    }
+
+    // Meta is written once per transaction and only if it changed.
+    tabledb_meta_t meta;
+    err = load_meta(config, &meta);
+    if (err != ESP_OK) {
+        goto fail;
+    }
+    char head_key[16] = {0};
+    if (new->count > 0) {
+        record_key(new->ids[0], head_key, sizeof(head_key));
+    }
+    if (meta.count != new->count || strncmp(meta.head_key, head_key, sizeof(meta.head_key)) != 0) {
+        meta.count = new->count;
+        strncpy(meta.head_key, head_key, sizeof(meta.head_key));
+        err = save_meta(config, &meta);
+        if (err != ESP_OK) {
+            goto fail;
+        }
+        written++;
+    }
+
+    // Erase deleted records last. Nothing links to them any more, so a reset before this
+    // point leaves at most orphaned blobs and never a list pointing at a missing key.
+    for (size_t i = 0; i < txn->count; i++) {
+        uint32_t id = txn->entries[i].id;
+        if (txn->entries[i].op != TABLEDB_TXN_DELETE || index_find(old, id) == TABLEDB_INDEX_NOT_FOUND) {
+            continue;
+        }
+        char key[15];
+        record_key(id, key, sizeof(key));
+        err = store_erase(config, key);
+        if (err != ESP_OK) {
+            goto fail;
+        }
+        written++;
+    }
+
+    if (written > 0) {
+        err = store_commit(config);
+        if (err != ESP_OK) {
+            goto fail;
+        }
+    }
+
+    txn_adopt_index(config);
+    return ESP_OK;
+
+fail:
+    ESP_LOGE(TAG, "%s: commit failed: %s", config->namespace, esp_err_to_name(err));
+    tabledb_rollback(config);
+    if (index_build(config) != ESP_OK) {
+        ESP_LOGE(TAG, "%s: index rebuild failed", config->namespace);
+    }
+    return err;
+}
+
+// Write the staged changes to NVS and keep the key index in step.
+static esp_err_t txn_flush(tabledb_config_t *config) {
+    esp_err_t err = config->pages != NULL ? paged_flush(config) : list_flush(config);
+    if (err == ESP_OK) {
+        keys_apply_txn(config);
+    } else if (config->keys != NULL) {
+        config->keys->valid = false;
+    }
+    return err;
+}
+
+/***************** Write-behind cache ******************/
+/*
+ * tabledb_update_deferred() parks the new payload in RAM and returns without
+ * touching NVS. A low-priority flusher task writes all dirty records of a table
+ * in one transaction when any of the configured triggers fires: the oldest
+ * dirty record reached flush_interval_ms, max_dirty records are pending, or no
+ * deferred update arrived for idle_flush_ms. Dirty records are also flushed on
+ * esp_restart() through a shutdown handler.
+ *
+ * The dirty set has its own lock so deferred updates never wait for the table
+ * mutex, which the flusher holds while it writes to NVS.
+ */
+
+#define TABLEDB_CACHE_DEFAULT_CAPACITY 32
+#define TABLEDB_CACHE_MAX_TABLES 4
+#define TABLEDB_CACHE_POLL_MS 1000
+
+struct tabledb_cache {
+    SemaphoreHandle_t lock;
+    uint32_t         *ids;
+    uint8_t          *data;     // capacity * config->size bytes
+    bool             *shadowed; // Staged over by the open transaction
+    uint32_t         *versions; // Bumped on every change, lets tabledb_flush spot newer updates
+    uint32_t          next_version;
+    size_t            count;
+    size_t            capacity;
+    TickType_t        first_dirty; // Tick of the oldest unflushed update
+    TickType_t        last_dirty;  // Tick of the newest update
+};
+
+static tabledb_config_t *g_cached_tables[TABLEDB_CACHE_MAX_TABLES];
+static TaskHandle_t      g_cache_task = NULL;
+
+static bool cache_enabled(const tabledb_cache_config_t *cfg) {
+    return cfg->flush_interval_ms || cfg->max_dirty || cfg->idle_flush_ms;
+}
+
+// Copy the dirty payload of id into data. Returns false if id is not dirty.
+// Shadowed records are hidden, the staged operation decides what readers see.
+static bool cache_lookup(tabledb_config_t *config, uint32_t id, void *data) {
+    struct tabledb_cache *cache = config->cache_state;
+    bool                  found = false;
+    if (cache == NULL) {
+        return false;
+    }
+
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    for (size_t i = 0; i < cache->count; i++) {
+        if (cache->ids[i] == id && !cache->shadowed[i]) {
+            memcpy(data, cache->data + i * config->size, config->size);
+            found = true;
+            break;
+        }
+    }
+    xSemaphoreGive(cache->lock);
+    return found;
+}
+
+static void cache_remove_at(tabledb_config_t *config, size_t pos) {
+    struct tabledb_cache *cache = config->cache_state;
+    size_t                last  = cache->count - 1;
+    cache->ids[pos]      = cache->ids[last];
+    cache->shadowed[pos] = cache->shadowed[last];
+    cache->versions[pos] = cache->versions[last];
+    memcpy(cache->data + pos * config->size, cache->data + last * config->size, config->size);
+    cache->count--;
+}
+
+// Mark a dirty record as superseded by a staged write or delete. The record is
+// only dropped once the transaction commits (cache_forget_shadowed), so an abort
+// or a failed flush keeps the deferred update.
+static void cache_shadow(tabledb_config_t *config, uint32_t id) {
+    struct tabledb_cache *cache = config->cache_state;
+    if (cache == NULL) {
+        return;
+    }
+
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    for (size_t i = 0; i < cache->count; i++) {
+        if (cache->ids[i] == id) {
+            cache->shadowed[i] = true;
+            break;
+        }
+    }
+    xSemaphoreGive(cache->lock);
+}
+
+// Drop the dirty records superseded by a committed transaction.
+static void cache_forget_shadowed(tabledb_config_t *config) {
+    struct tabledb_cache *cache = config->cache_state;
+    if (cache == NULL) {
+        return;
+    }
+
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    for (size_t i = cache->count; i-- > 0;) {
+        if (cache->shadowed[i]) {
+            cache_remove_at(config, i);
+        }
+    }
+    xSemaphoreGive(cache->lock);
+}
+
+// Make shadowed records visible again after an abort or a failed commit.
+static void cache_unshadow(tabledb_config_t *config) {
+    struct tabledb_cache *cache = config->cache_state;
+    if (cache == NULL) {
+        return;
+    }
+
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    for (size_t i = 0; i < cache->count; i++) {
+        cache->shadowed[i] = false;
+    }
+    xSemaphoreGive(cache->lock);
+}
+
+// Call fn for every dirty record. Runs with the cache lock held, fn must not block.
+static void cache_visit(tabledb_config_t *config, void (*fn)(uint32_t id, const void *data, void *arg),
+                        void *arg) {
+    struct tabledb_cache *cache = config->cache_state;
+    if (cache == NULL) {
+        return;
+    }
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    for (size_t i = 0; i < cache->count; i++) {
+        if (!cache->shadowed[i]) {
+            fn(cache->ids[i], cache->data + i * config->size, arg);
+        }
+    }
+    xSemaphoreGive(cache->lock);
+}
+
+static void cache_clear(tabledb_config_t *config) {
+    struct tabledb_cache *cache = config->cache_state;
+    if (cache == NULL) {
+        return;
+    }
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    cache->count = 0;
+    xSemaphoreGive(cache->lock);
+}
+
+// Store a dirty record. An existing dirty copy is replaced only if replace is set,
+// so caching a lazily upgraded record never clobbers a newer update.
+// Returns false if the dirty set is full.
+static bool cache_put(tabledb_config_t *config, uint32_t id, const void *data, bool replace) {
+    struct tabledb_cache *cache = config->cache_state;
+    TickType_t            now   = xTaskGetTickCount();
+    size_t                pos;
+    bool                  notify;
+
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    for (pos = 0; pos < cache->count; pos++) {
+        if (cache->ids[pos] == id) {
+            break;
+        }
+    }
+    if (pos < cache->count && !replace) {
+        xSemaphoreGive(cache->lock);
+        return true;
+    }
+    if (pos == cache->count) {
+        if (cache->count == cache->capacity) {
+            xSemaphoreGive(cache->lock);
+            return false;
+        }
+        if (cache->count == 0) {
+            cache->first_dirty = now;
+        }
+        cache->ids[cache->count++] = id;
+    }
+    memcpy(cache->data + pos * config->size, data, config->size);
+    cache->shadowed[pos] = false;
+    cache->versions[pos] = ++cache->next_version;
+    cache->last_dirty = now;
+    notify            = config->cache.max_dirty && cache->count >= config->cache.max_dirty;
+    xSemaphoreGive(cache->lock);
+
+    if (notify && g_cache_task != NULL) {
+        xTaskNotifyGive(g_cache_task);
+    }
+    return true;
+}
+
+// Apply fn to the dirty copy of id in place. Returns false if id is not dirty
+// or shadowed by the open transaction.
+static bool cache_mutate(tabledb_config_t *config, uint32_t id, tabledb_mutate_cb fn, void *arg) {
+    struct tabledb_cache *cache = config->cache_state;
+    bool                  found = false;
+    if (cache == NULL) {
+        return false;
+    }
+
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    for (size_t i = 0; i < cache->count; i++) {
+        if (cache->ids[i] == id && !cache->shadowed[i]) {
+            fn(cache->data + i * config->size, arg);
+            cache->versions[i] = ++cache->next_version;
+            cache->last_dirty  = xTaskGetTickCount();
+            found              = true;
+            break;
+        }
+    }
+    xSemaphoreGive(cache->lock);
+    return found;
+}
+
+// Drop the records written by tabledb_flush, unless they changed since the snapshot.
+static void cache_forget_flushed(tabledb_config_t *config, const uint32_t *ids, const uint32_t *versions,
+                                 size_t count) {
+    struct tabledb_cache *cache = config->cache_state;
+
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    for (size_t i = 0; i < count; i++) {
+        for (size_t pos = 0; pos < cache->count; pos++) {
+            if (cache->ids[pos] == ids[i]) {
+                if (cache->versions[pos] == versions[i]) {
+                    cache_remove_at(config, pos);
+                }
+                break;
+            }
+        }
+    }
+    if (cache->count > 0) {
+        cache->first_dirty = xTaskGetTickCount();
+    }
+    xSemaphoreGive(cache->lock);
+}
+
+static bool cache_flush_due(tabledb_config_t *config) {
+    struct tabledb_cache        *cache = config->cache_state;
+    const tabledb_cache_config_t *cfg   = &config->cache;
+    TickType_t                    now   = xTaskGetTickCount();
+    bool                          due   = false;
+
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    if (cache->count > 0) {
+        due = (cfg->max_dirty && cache->count >= cfg->max_dirty) ||
+              (cfg->flush_interval_ms && now - cache->first_dirty >= pdMS_TO_TICKS(cfg->flush_interval_ms)) ||
+              (cfg->idle_flush_ms && now - cache->last_dirty >= pdMS_TO_TICKS(cfg->idle_flush_ms));
+    }
+    xSemaphoreGive(cache->lock);
+    return due;
+}
+
+static void cache_flush_task(void *arg) {
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(TABLEDB_CACHE_POLL_MS));
+        for (int i = 0; i < TABLEDB_CACHE_MAX_TABLES; i++) {
+            tabledb_config_t *config = g_cached_tables[i];
+            if (config != NULL && cache_flush_due(config)) {
+                esp_err_t err = tabledb_flush(config);
+                if (err != ESP_OK) {
+                    ESP_LOGE(TAG, "%s: deferred flush failed: %s", config->namespace, esp_err_to_name(err));
+                }
+            }
+        }
+    }
+}
+
+static void cache_shutdown_handler(void) {
+    for (int i = 0; i < TABLEDB_CACHE_MAX_TABLES; i++) {
+        if (g_cached_tables[i] != NULL) {
+            tabledb_flush(g_cached_tables[i]);
+        }
+    }
+}
+
+static esp_err_t cache_init(tabledb_config_t *config) {
+    config->cache_state = NULL;
+    if (!cache_enabled(&config->cache)) {
+        return ESP_OK;
+    }
+
+    int slot = -1;
+    for (int i = 0; i < TABLEDB_CACHE_MAX_TABLES; i++) {
+        if (g_cached_tables[i] == NULL) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot < 0) {
+        ESP_LOGE(TAG, "%s: too many tables with write-behind cache", config->namespace);
+        return ESP_ERR_NO_MEM;
+    }
+
+    struct tabledb_cache *cache = calloc(1, sizeof(struct tabledb_cache));
+    if (cache == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    cache->capacity = config->cache.max_dirty ? config->cache.max_dirty : TABLEDB_CACHE_DEFAULT_CAPACITY;
+    cache->ids      = malloc(cache->capacity * sizeof(uint32_t));
+    cache->data     = malloc(cache->capacity * config->size);
+    cache->shadowed = malloc(cache->capacity * sizeof(bool));
+    cache->versions = malloc(cache->capacity * sizeof(uint32_t));
+    cache->lock     = xSemaphoreCreateMutex();
+    if (cache->ids == NULL || cache->data == NULL || cache->shadowed == NULL || cache->versions == NULL ||
+        cache->lock == NULL) {
+        if (cache->lock != NULL) {
+            vSemaphoreDelete(cache->lock);
+        }
+        free(cache->ids);
+        free(cache->data);
+        free(cache->shadowed);
+        free(cache->versions);
+        free(cache);
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (g_cache_task == NULL) {
+        if (xTaskCreate(cache_flush_task, "tabledb_flush", 4096, NULL, tskIDLE_PRIORITY + 1, &g_cache_task) != pdPASS) {
+            vSemaphoreDelete(cache->lock);
+            free(cache->ids);
+            free(cache->data);
+            free(cache->shadowed);
+            free(cache->versions);
+            free(cache);
+            return ESP_ERR_NO_MEM;
+        }
+        esp_register_shutdown_handler(cache_shutdown_handler);
+    }
+
+    config->cache_state    = cache;
+    g_cached_tables[slot] = config;
+    return ESP_OK;
+}
+
+// Load a record as seen by the caller: staged payload first, then the
+// write-behind cache, NVS otherwise.
+static esp_err_t load_record(tabledb_config_t *config, uint32_t id, void *data) {
+    if (config->txn != NULL) {
+        tabledb_txn_entry_t *entry = txn_find(config->txn, id);
+        if (entry != NULL && entry->op == TABLEDB_TXN_PUT) {
+            memcpy(data, entry->data, config->size);
+            return ESP_OK;
+        }
+    }
+    if (cache_lookup(config, id, data)) {
+        return ESP_OK;
+    }
+
+    uint8_t   version;
+    esp_err_t err = stored_load(config, id, data, &version);
+    if (err == ESP_OK && version != config->version && config->lazy_upgrade && config->cache_state != NULL) {
+        // Converted on read; let the write-behind cache persist it. Without a
+        // cache the background upgrade pass gets to it.
+        cache_put(config, id, data, false);
+    }
+    return err;
+}
+
+/***************** Change notifications ******************/
+/*
+ * Every visible change bumps the table generation once and is reported to the
+ * subscribers, one call per record. Transactions report after their commit,
+ * deferred updates when they are made (reads see them from then on). Flushing
+ * the write-behind cache and upgrading stale records change nothing a reader
+ * could see, so they stay silent.
+ */
+
+static portMUX_TYPE g_generation_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static uint32_t generation_bump(tabledb_config_t *config) {
+    portENTER_CRITICAL(&g_generation_lock);
+    uint32_t generation = ++config->generation;
+    portEXIT_CRITICAL(&g_generation_lock);
+    return generation;
+}
+
+static void notify(tabledb_config_t *config, tabledb_change_op_t op, uint32_t id, uint32_t generation) {
+    tabledb_change_t change = {.op = op, .id = id, .generation = generation};
+    for (int i = 0; i < TABLEDB_MAX_SUBSCRIBERS; i++) {
+        tabledb_subscriber_t *subscriber = &config->subscribers[i];
+        if (subscriber->cb != NULL) {
+            subscriber->cb(config, &change, subscriber->arg);
+        }
+    }
+}
+
+// Report the records of a committed transaction under a single new generation.
+static void notify_txn(tabledb_config_t *config) {
+    struct tabledb_txn *txn        = config->txn;
+    uint32_t            generation = 0;
+    for (size_t i = 0; i < txn->count; i++) {
+        tabledb_txn_entry_t *entry = &txn->entries[i];
+        tabledb_change_op_t  op;
+        if (entry->op == TABLEDB_TXN_PUT) {
+            op = entry->existed ? TABLEDB_CHANGE_UPDATE : TABLEDB_CHANGE_INSERT;
+        } else if (entry->existed) {
+            op = TABLEDB_CHANGE_DELETE;
+        } else {
+            continue; // Inserted and deleted again within the transaction
+        }
+        if (generation == 0) {
+            generation = generation_bump(config);
+        }
+        notify(config, op, entry->id, generation);
+    }
+}
+
+// Run a single staged operation, committing it right away unless the caller
+// has an explicit transaction open.
+#define TXN_OP(stage_expr)                                                                         \
+    do {                                                                                           \
+        if (xSemaphoreTakeRecursive(config->mutex, portMAX_DELAY) != pdTRUE) {                     \
+            return ESP_ERR_TIMEOUT;                                                                \
+        }                                                                                          \
+        bool      implicit = (config->txn == NULL);                                                \
+        esp_err_t err      = implicit ? txn_alloc(config) : ESP_OK;                                \
+        if (err == ESP_OK) {                                                                       \
+            err = (stage_expr);                                                                    \
+            if (implicit) {                                                                        \
+                if (err == ESP_OK) {                                                               \
+                    err = txn_flush(config);                                                       \
+                }                                                                                  \
+                if (err == ESP_OK) {                                                               \
+                    cache_forget_shadowed(config);                                                 \
+                    notify_txn(config);                                                            \
+                }                                                                                  \
+                txn_free(config);                                                                  \
+            }                                                                                      \
+        }                                                                                          \
+        EXIT_WITH_MUTEX(err);                                                                      \
+    } while (0)
+
+/***************** Background upgrade ******************/
+/*
+ * With lazy_upgrade set, tabledb_init does not rewrite stale records. Reads
+ * convert them through update_cb (and queue the result in the write-behind
+ * cache if there is one), and a low-priority task rewrites the rest in small
+ * transactions, pausing between batches so foreground work is not delayed.
+ */
+
+#define TABLEDB_UPGRADE_BATCH 8
+#define TABLEDB_UPGRADE_PAUSE_MS 50
+
+// Upgrade the next TABLEDB_UPGRADE_BATCH records of the snapshot in one transaction.
+static esp_err_t upgrade_batch(tabledb_config_t *config, tabledb_cursor_t *cursor, uint8_t *data) {
+    if (xSemaphoreTakeRecursive(config->mutex, portMAX_DELAY) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+
+    esp_err_t err    = txn_alloc(config);
+    size_t    staged = 0;
+    for (size_t n = 0; err == ESP_OK && n < TABLEDB_UPGRADE_BATCH && cursor->pos < cursor->count; n++) {
+        uint32_t id = cursor->ids[cursor->pos++];
+        config->upgrade.checked++;
+        if (index_find(&config->index, id) == TABLEDB_INDEX_NOT_FOUND) {
+            continue;
+        }
+
+        uint8_t version;
+        err = stored_load(config, id, data, &version);
+        if (err != ESP_OK || version == config->version) {
+            continue;
+        }
+        // A newer deferred update already has the current version, prefer it.
+        cache_lookup(config, id, data);
+        err = txn_stage_put(config, id, data);
+        staged++;
+    }
+
+    if (config->txn != NULL) {
+        if (err == ESP_OK && staged > 0) {
+            err = txn_flush(config);
+        }
+        txn_free(config);
+    }
+    if (err == ESP_OK) {
+        config->upgrade.upgraded += staged;
+    }
+    EXIT_WITH_MUTEX(err);
+}
+
+static void upgrade_task(void *arg) {
+    tabledb_config_t *config = arg;
+    tabledb_cursor_t  cursor;
+    uint8_t          *data = malloc(config->size);
+
+    esp_err_t err = data != NULL ? tabledb_cursor_open(config, &cursor) : ESP_ERR_NO_MEM;
+    if (err == ESP_OK) {
+        config->upgrade.total = cursor.count;
+        while (err == ESP_OK && cursor.pos < cursor.count) {
+            err = upgrade_batch(config, &cursor, data);
+            vTaskDelay(pdMS_TO_TICKS(TABLEDB_UPGRADE_PAUSE_MS));
+        }
+        tabledb_cursor_close(&cursor);
+    }
+    free(data);
+
+    if (err == ESP_OK) {
+        ESP_LOGI(TAG, "%s: background upgrade done, %u of %u records rewritten", config->namespace,
+                 (unsigned) config->upgrade.upgraded, (unsigned) config->upgrade.total);
+    } else {
+        ESP_LOGE(TAG, "%s: background upgrade failed: %s", config->namespace, esp_err_to_name(err));
+    }
+    config->upgrade.result  = err;
+    config->upgrade.running = false;
+    vTaskDelete(NULL);
+}
+
+static esp_err_t upgrade_start(tabledb_config_t *config) {
+    memset(&config->upgrade, 0, sizeof(tabledb_upgrade_progress_t));
+    if (!config->lazy_upgrade || config->update_cb == NULL) {
+        return ESP_OK;
+    }
+
+    config->upgrade.running = true;
+    if (xTaskCreate(upgrade_task, "tabledb_upgrade", 4096, config, tskIDLE_PRIORITY + 1, NULL) != pdPASS) {
+        config->upgrade.running = false;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+/*
+ * @brief Report how far the background upgrade pass has come.
+ *
+ * Counters stay at zero when lazy_upgrade is not set or the table has no update_cb.
+ */
+esp_err_t tabledb_get_upgrade_progress(tabledb_config_t *config, tabledb_upgrade_progress_t *progress) {
+    if (xSemaphoreTakeRecursive(config->mutex, portMAX_DELAY) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+    *progress = config->upgrade;
+    EXIT_WITH_MUTEX(ESP_OK);
+}
+
+// Initialize the tabledb library
+/*
+ * @brief Initialize the table database.
+ *
+ * This function opens the backend store named after the table (an NVS namespace by default),
+ * builds the in-RAM index of record IDs and prepares the table database for operations. A
+ * linked-list table opened with TABLEDB_LAYOUT_PAGED is migrated to pages here.
+ *
+ * @param config Pointer to the table database configuration structure.
+ *
+ * @return
+ *    - ESP_OK: Success.
+ *    - ESP_ERR_INVALID_ARG: Null pointer or invalid arguments.
+ *    - ESP_ERR_NO_MEM: Not enough memory for the index.
+ *    - ESP_ERR_INVALID_STATE: Paged table opened with TABLEDB_LAYOUT_LIST.
+ *    - ESP_ERR_INVALID_VERSION: Unknown page directory format.
+ *    - Other error codes from the backend open function.
+ */
+esp_err_t tabledb_init(tabledb_config_t *config) {
+    if (config->namespace == NULL || config->version == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (config->size > TABLEDB_MAX_OBJECT_SIZE) {
+        ESP_LOGE(TAG, "Data size is too large");
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // Create mutex (initialie). Recursive, so operations can run inside an open transaction.
+    config->mutex = xSemaphoreCreateRecursiveMutex();
+    if (config->mutex == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (config->backend == NULL) {
+        config->backend = &tabledb_backend_nvs;
+    }
+    esp_err_t err = config->backend->open(config->backend_arg, config->namespace, &config->handle);
+    if (err != ESP_OK) {
+        vSemaphoreDelete(config->mutex);
+        return err;
+    }
+
+    memset(&config->index, 0, sizeof(tabledb_index_t));
+    config->txn        = NULL;
+    config->pages      = NULL;
+    config->generation = 0;
+    size_t dir_size;
+    if (config->layout == TABLEDB_LAYOUT_PAGED) {
+        err = paged_init(config);
+    } else if (store_get(config, TABLEDB_PAGE_DIR_KEY, NULL, &dir_size) == ESP_OK) {
+        // Migration only goes from the linked list to pages.
+        ESP_LOGE(TAG, "%s: table is stored in the paged layout", config->namespace);
+        err = ESP_ERR_INVALID_STATE;
+    } else {
+        err = list_index_build(config);
+    }
+    if (err == ESP_OK) {
+        err = keys_init(config);
+    }
+    if (err != ESP_OK) {
+        paged_free(config);
+        index_free(&config->index);
+        config->backend->close(config->handle);
+        vSemaphoreDelete(config->mutex);
+        return err;
+    }
+
+    err = cache_init(config);
+    if (err != ESP_OK) {
+        keys_free(config);
+        paged_free(config);
+        index_free(&config->index);
+        config->backend->close(config->handle);
+        vSemaphoreDelete(config->mutex);
+        return err;
+    }
+
+    err = upgrade_start(config);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "%s: background upgrade not started, stale records are converted on read",
+                 config->namespace);
+        err = ESP_OK;
+    }
+
+    ESP_LOGI(TAG, "%s: %u records indexed", config->namespace, (unsigned) config->index.count);
+    return err;
+}
+
+// Function walks the record index and calls the update callback for each stale record,
+// then updates the version of the record. Tables with lazy_upgrade set do not need this.
+esp_err_t tabledb_upgrade(tabledb_config_t *config) {
+    if (xSemaphoreTakeRecursive(config->mutex, portMAX_DELAY) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+
+    if (config->pages != NULL) {
+        EXIT_WITH_MUTEX(paged_upgrade(config));
+    }
+
+    esp_err_t err;
+    uint8_t   buffer[TABLEDB_MAX_RECORD_SIZE];
+
+    for (size_t i = 0; i < config->index.count; i++) {
+        char cur_key[15];
+        snprintf(cur_key, sizeof(cur_key), "rec_%" PRIu32, config->index.ids[i]);
+
+        size_t blob_size;
+        err = read_record(config, cur_key, buffer, &blob_size);
+        if (err != ESP_OK) {
+            EXIT_WITH_MUTEX(err);
+        }
+
+        tabledb_internal_record_t *record = (tabledb_internal_record_t *) buffer;
+        if (record->version == config->version) {
+            continue;
+        }
+        if (config->update_cb == NULL) {
+            EXIT_WITH_MUTEX(ESP_ERR_INVALID_VERSION);
+        }
+
+        // Temporary buffer for updated payload.
+        uint8_t  new_payload[config->size];
+        uint8_t *old_payload = buffer + sizeof(tabledb_internal_record_t);
+        err                  = config->update_cb(record->version, old_payload, new_payload);
+        if (err != ESP_OK) {
+            EXIT_WITH_MUTEX(err);
+        }
+        memcpy(old_payload, new_payload, config->size);
+        record->version = config->version;
+        record->size    = config->size;
+
+        err = store_set(config, cur_key, buffer, sizeof(tabledb_internal_record_t) + config->size);
+        if (err != ESP_OK) {
+            tabledb_rollback(config);
+            EXIT_WITH_MUTEX(err);
+        }
+    }
+
+    err = store_commit(config);
+    EXIT_WITH_MUTEX(err);
+}
+
+/***************** tabledb_insert ******************/
+/*
+ * Insert a new record using linked-list mechanism.
+ */
+esp_err_t tabledb_insert(tabledb_config_t *config, uint32_t id, void *data) {
+    TXN_OP(txn_stage_insert(config, id, data));
+}
+
+/***************** tabledb_delete ******************/
+/*
+ * Delete a record from the linked list.
+ */
+esp_err_t tabledb_delete(tabledb_config_t *config, uint32_t id) {
+    TXN_OP(txn_stage_delete(config, id));
+}
+
+/*
+ * @brief Drop the entire table and delete all records.
+ *
+ * This function erases all records in the table by clearing the entire backend store.
+ *
+ * @param config Pointer to the table database configuration structure.
+ *
+ * @return
+ *    - ESP_OK: Success.
+ *    - ESP_ERR_INVALID_STATE: A transaction is open on the table.
+ *    - Other error codes from NVS functions.
+ */
+esp_err_t tabledb_drop(tabledb_config_t *config) {
+    if (xSemaphoreTakeRecursive(config->mutex, portMAX_DELAY) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+    if (config->txn != NULL) {
+        // Dropping can not be staged, commit or abort the transaction first.
+        EXIT_WITH_MUTEX(ESP_ERR_INVALID_STATE);
+    }
+    esp_err_t err = store_erase_all(config);
+    if (err != ESP_OK) {
+        EXIT_WITH_MUTEX(err);
+    }
+
+    // Commit changes
+    err = store_commit(config);
+    if (err != ESP_OK) {
+        EXIT_WITH_MUTEX(err);
     }
 
-    return ESP_OK;
+    index_clear(&config->index);
+    paged_reset(config);
+    cache_clear(config);
+    if (config->keys != NULL) {
+        config->keys->count = 0;
+        config->keys->valid = true;
+    }
+    notify(config, TABLEDB_CHANGE_DROP, 0, generation_bump(config));
+    EXIT_WITH_MUTEX(ESP_OK);
+}
+
+/*
+ * @brief Retrieve a record by ID.
+ *
+ * This function retrieves a record from the table using the specified ID. If the record's version
+ * differs from the current version, the update callback will be called if provided.
+ *
+ * @param config Pointer to the table database configuration structure.
+ * @param id Unique ID of the record to be retrieved.
+ * @param data Pointer to the buffer where the data will be stored.
+ *
+ * @return
+ *    - ESP_OK: Success.
+ *    - ESP_ERR_INVALID_ARG: Null pointer or invalid arguments.
+ *    - ESP_ERR_NOT_FOUND: Record with the given ID does not exist.
+ *    - ESP_ERR_INVALID_VERSION: Record version mismatch and no update callback provided.
+ *    - ESP_ERR_INVALID_SIZE: Provided buffer size is too small.
+ *    - Other error codes from NVS functions.
+ */
+esp_err_t tabledb_get(tabledb_config_t *config, uint32_t id, void *data) {
+    if (xSemaphoreTakeRecursive(config->mutex, portMAX_DELAY) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+    if (index_find(active_index(config), id) == TABLEDB_INDEX_NOT_FOUND) {
+        EXIT_WITH_MUTEX(ESP_ERR_NVS_NOT_FOUND);
+    }
+    EXIT_WITH_MUTEX(load_record(config, id, data));
 }
 
 /***************** tabledb_get_next ******************/
 /*
  * Get the next record in the linked list.
  * If id==0, return the head record.
+ *
+ * The next ID is taken from the in-RAM index, so only the payload of the
+ * returned record is read from NVS.
  */
 esp_err_t tabledb_get_next(tabledb_config_t *config, uint32_t id, uint32_t *data_id, void *data) {
-    char key[15];
+    if (xSemaphoreTakeRecursive(config->mutex, portMAX_DELAY) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+
+    tabledb_index_t *index = active_index(config);
+    size_t           next_pos;
     if (id == 0) {
-        tabledb_meta_t meta;
-        esp_err_t      err = load_meta(config, &meta);
-        if (err != ESP_OK) {
-            return err;
+        next_pos = 0;
+    } else {
+        size_t pos = index_find(index, id);
+        if (pos == TABLEDB_INDEX_NOT_FOUND) {
+            EXIT_WITH_MUTEX(ESP_ERR_NVS_NOT_FOUND);
         }
-        if (meta.head_key[0] == '\0') {
-            return ESP_ERR_NOT_FOUND;
+        next_pos = pos + 1;
+    }
+
+    if (next_pos >= index->count) {
+        EXIT_WITH_MUTEX(ESP_ERR_NOT_FOUND);
+    }
+
+    esp_err_t err = load_record(config, index->ids[next_pos], data);
+    if (err != ESP_OK) {
+        EXIT_WITH_MUTEX(err);
+    }
+
+    index->hint = next_pos;
+    *data_id    = index->ids[next_pos];
+    EXIT_WITH_MUTEX(ESP_OK);
+}
+
+/***************** tabledb_get_count ******************/
+/*
+ * Get the number of records from the in-RAM index.
+ */
+esp_err_t tabledb_get_count(tabledb_config_t *config, size_t *count) {
+    if (xSemaphoreTakeRecursive(config->mutex, portMAX_DELAY) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+    *count = active_index(config)->count;
+    EXIT_WITH_MUTEX(ESP_OK);
+}
+
+/***************** tabledb_cursor_* ******************/
+/*
+ * A cursor snapshots the record IDs, not the payloads. The IDs and their order
+ * are copied once when it is opened; each tabledb_cursor_next() then takes the
+ * table mutex for one lookup and one record read. Records deleted after the
+ * open are skipped, records inserted after it are not returned, and a record
+ * updated in between comes back with its new payload. The mutex is not held
+ * between records, but it is the same one every other call takes: cursors on
+ * the same table read one after another, and a transaction open in another
+ * task makes tabledb_cursor_next() wait until it commits or aborts.
+ */
+esp_err_t tabledb_cursor_open(tabledb_config_t *config, tabledb_cursor_t *cursor) {
+    memset(cursor, 0, sizeof(tabledb_cursor_t));
+    if (xSemaphoreTakeRecursive(config->mutex, portMAX_DELAY) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+
+    tabledb_index_t *index = active_index(config);
+    if (index->count > 0) {
+        cursor->ids  = malloc(index->count * sizeof(uint32_t));
+        cursor->seqs = malloc(index->count * sizeof(uint32_t));
+        if (cursor->ids == NULL || cursor->seqs == NULL) {
+            tabledb_cursor_close(cursor);
+            EXIT_WITH_MUTEX(ESP_ERR_NO_MEM);
         }
-        strncpy(key, meta.head_key, sizeof(key));
-    } else {
-        snprintf(key, sizeof(key), "rec_%" PRIu32, id);
+        memcpy(cursor->ids, index->ids, index->count * sizeof(uint32_t));
+        memcpy(cursor->seqs, index->seqs, index->count * sizeof(uint32_t));
+    }
+    cursor->config = config;
+    cursor->count  = index->count;
+    EXIT_WITH_MUTEX(ESP_OK);
+}
 
-        size_t curr_size;
-        esp_err_t err = nvs_get_blob(config->handle, key, NULL, &curr_size);
-        if (err != ESP_OK) {
-            return err;
+/*
+ * @brief Read the current payload of the next snapshot ID still in the table.
+ *
+ * @return
+ *    - ESP_OK: Record stored in id/data.
+ *    - ESP_ERR_NOT_FOUND: No more records.
+ *    - Other error codes from the backend.
+ */
+esp_err_t tabledb_cursor_next(tabledb_cursor_t *cursor, uint32_t *id, void *data) {
+    tabledb_config_t *config = cursor->config;
+    if (config == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    while (cursor->pos < cursor->count) {
+        uint32_t next = cursor->ids[cursor->pos];
+        if (xSemaphoreTakeRecursive(config->mutex, portMAX_DELAY) != pdTRUE) {
+            return ESP_ERR_TIMEOUT;
         }
 
-        uint8_t curr_buffer[curr_size];
-        err  = nvs_get_blob(config->handle, key, curr_buffer, &curr_size);
-        if (err != ESP_OK) {
-            return err;
+        // Positions still match while the table is unchanged, so the lookup is O(1).
+        tabledb_index_t *index = active_index(config);
+        index->hint            = cursor->pos;
+        cursor->pos++;
+        if (index_find(index, next) == TABLEDB_INDEX_NOT_FOUND) {
+            xSemaphoreGiveRecursive(config->mutex);
+            continue;
         }
-        tabledb_internal_record_t *curr_record = (tabledb_internal_record_t *) curr_buffer;
-        if (curr_record->next_key[0] == '\0') {
-            return ESP_ERR_NOT_FOUND;
+
+        esp_err_t err = load_record(config, next, data);
+        xSemaphoreGiveRecursive(config->mutex);
+        if (err == ESP_OK) {
+            *id = next;
         }
-        strncpy(key, curr_record->next_key, sizeof(key));
+        return err;
     }
+    return ESP_ERR_NOT_FOUND;
+}
 
-    // Now load the next record.
-    size_t    next_size;
-    esp_err_t err = nvs_get_blob(config->handle, key, NULL, &next_size);
-    if (err != ESP_OK) {
-        return err;
+void tabledb_cursor_close(tabledb_cursor_t *cursor) {
+    free(cursor->ids);
+    free(cursor->seqs);
+    memset(cursor, 0, sizeof(tabledb_cursor_t));
+}
+
+/***************** tabledb_scan ******************/
+static bool scan_match(const tabledb_scan_t *scan, uint32_t id, const void *data) {
+    return scan->predicate == NULL || scan->predicate(id, data, scan->predicate_arg);
+}
+
+// Position the cursor on the first record inserted before the one that got sequence
+// number seq. That record may be gone by now; inserts since then sit ahead of it.
+static void scan_seek(tabledb_cursor_t *cursor, uint32_t seq) {
+    cursor->pos = 0;
+    while (cursor->pos < cursor->count && cursor->seqs[cursor->pos] >= seq) {
+        cursor->pos++;
+    }
+}
+
+/*
+ * @brief Return one page of the records accepted by scan->predicate.
+ *
+ * Runs on a cursor (ID snapshot, live payloads), so cb and the predicate are
+ * called without the table lock held and may use other tabledb functions. On return
+ * scan->resume_token holds the insertion sequence number of the last record
+ * passed to cb and scan->more tells whether another call would return
+ * anything. Resuming continues with the next older record still in the table,
+ * whether or not the last one returned was deleted in between; records
+ * inserted since the previous page are not returned.
+ *
+ * @return
+ *    - ESP_OK: Page done, possibly empty.
+ *    - Error returned by cb, or other error codes from the backend.
+ */
+esp_err_t tabledb_scan(tabledb_config_t *config, tabledb_scan_t *scan, tabledb_scan_cb_t cb,
+                       void *arg) {
+    scan->more = false;
+    void *data = malloc(config->size);
+    if (data == NULL) {
+        return ESP_ERR_NO_MEM;
     }
 
-    uint8_t next_buffer[next_size];
-    err = nvs_get_blob(config->handle, key, next_buffer, &next_size);
+    tabledb_cursor_t cursor;
+    esp_err_t        err = tabledb_cursor_open(config, &cursor);
     if (err != ESP_OK) {
+        free(data);
         return err;
     }
 
-    tabledb_internal_record_t *next_record = (tabledb_internal_record_t *) next_buffer;
-    *data_id                               = next_record->id;
+    if (scan->resume) {
+        scan_seek(&cursor, scan->resume_token);
+    }
 
-    // New update callback logic in tabledb_get_next:
-    uint8_t *payload = next_buffer + sizeof(tabledb_internal_record_t);
-    if (next_record->version != config->version) {
-        if (config->update_cb) {
-            err = config->update_cb(next_record->version, payload, data);
-            if (err != ESP_OK) {
-                return err;
-            }
-        } else {
-            return ESP_ERR_INVALID_VERSION;
+    size_t   returned = 0;
+    uint32_t id;
+    while ((err = tabledb_cursor_next(&cursor, &id, data)) == ESP_OK) {
+        if (!scan_match(scan, id, data)) {
+            continue;
+        }
+        if (scan->offset > 0) {
+            scan->offset--;
+            continue;
+        }
+        if (scan->limit > 0 && returned == scan->limit) {
+            // One match past the limit, leave it for the next page.
+            scan->more = true;
+            break;
+        }
+        returned++;
+        scan->resume       = true;
+        scan->resume_token = cursor.seqs[cursor.pos - 1];
+        if ((err = cb(id, data, arg)) != ESP_OK) {
+            break;
         }
-    } else {
-        memcpy(data, payload, config->size);
     }
-    return ESP_OK;
+    if (err == ESP_ERR_NOT_FOUND && cursor.pos == cursor.count) {
+        err = ESP_OK; // Reached the end of the snapshot
+    }
+
+    tabledb_cursor_close(&cursor);
+    free(data);
+    return err;
+}
+
+/***************** tabledb_find_by_key ******************/
+// FNV-1a over at most max_len characters, a cheap spread for fixed-size name fields.
+uint32_t tabledb_hash_str(const char *str, size_t max_len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < max_len && str[i] != '\0'; i++) {
+        hash ^= (uint8_t) str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+typedef struct {
+    tabledb_config_t *config;
+    uint32_t          key;
+    uint32_t         *ids;
+    size_t            max_ids;
+    size_t            count;
+} find_ctx_t;
+
+static void find_emit(find_ctx_t *ctx, uint32_t id) {
+    if (ctx->count < ctx->max_ids) {
+        ctx->ids[ctx->count] = id;
+    }
+    ctx->count++;
+}
+
+// Deferred payloads not shadowed by the open transaction.
+static void find_dirty(uint32_t id, const void *data, void *arg) {
+    find_ctx_t       *ctx    = arg;
+    tabledb_config_t *config = ctx->config;
+    if (config->txn != NULL && txn_find(config->txn, id) != NULL) {
+        return;
+    }
+    if (index_find(active_index(config), id) != TABLEDB_INDEX_NOT_FOUND && config->key_cb(data) == ctx->key) {
+        find_emit(ctx, id);
+    }
 }
 
-/***************** tabledb_get_count ******************/
 /*
- * Get the number of records from the metadata blob.
+ * @brief Look up records by the secondary key computed by config->key_cb.
+ *
+ * Served from RAM; staged and deferred payloads count like they do for
+ * tabledb_get(). Keys are hashes, so a match is a candidate: read the record
+ * to compare the actual field.
+ *
+ * @param ids Receives up to max_ids matching IDs.
+ * @param count Receives the number of matches, which can exceed max_ids.
+ *
+ * @return
+ *    - ESP_OK: Success, also when nothing matched.
+ *    - ESP_ERR_NOT_SUPPORTED: The table has no key_cb.
+ *    - Other error codes from rebuilding a stale index.
  */
-esp_err_t tabledb_get_count(tabledb_config_t *config, size_t *count) {
-    tabledb_meta_t meta;
-    esp_err_t      err = load_meta(config, &meta);
-    if (err != ESP_OK) {
-        return err;
+esp_err_t tabledb_find_by_key(tabledb_config_t *config, uint32_t key, uint32_t *ids, size_t max_ids,
+                              size_t *count) {
+    if (config->keys == NULL) {
+        return ESP_ERR_NOT_SUPPORTED;
     }
-    *count = meta.count;
-    return ESP_OK;
+    if (xSemaphoreTakeRecursive(config->mutex, portMAX_DELAY) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+    struct tabledb_keys *keys = config->keys;
+    if (!keys->valid) {
+        esp_err_t err = keys_build(config);
+        if (err != ESP_OK) {
+            EXIT_WITH_MUTEX(err);
+        }
+    }
+
+    find_ctx_t ctx = {.config = config, .key = key, .ids = ids, .max_ids = max_ids};
+    uint8_t    data[TABLEDB_MAX_OBJECT_SIZE];
+    for (size_t pos = keys_lower_bound(keys, key); pos < keys->count && keys->entries[pos].key == key; pos++) {
+        uint32_t id = keys->entries[pos].id;
+        // Staged or deferred payloads are checked below.
+        if ((config->txn == NULL || txn_find(config->txn, id) == NULL) && !cache_lookup(config, id, data)) {
+            find_emit(&ctx, id);
+        }
+    }
+    if (config->txn != NULL) {
+        for (size_t i = 0; i < config->txn->count; i++) {
+            tabledb_txn_entry_t *entry = &config->txn->entries[i];
+            if (entry->op == TABLEDB_TXN_PUT && config->key_cb(entry->data) == key) {
+                find_emit(&ctx, entry->id);
+            }
+        }
+    }
+    cache_visit(config, find_dirty, &ctx);
+
+    *count = ctx.count;
+    EXIT_WITH_MUTEX(ESP_OK);
 }
 
 /***************** tabledb_update ******************/
 esp_err_t tabledb_update(tabledb_config_t *config, uint32_t id, void *data) {
-    if (xSemaphoreTake(config->mutex, portMAX_DELAY) != pdTRUE) {
+    TXN_OP(txn_stage_update(config, id, data));
+}
+
+/***************** tabledb_update_deferred ******************/
+typedef struct {
+    const void *data;
+    size_t      size;
+} record_copy_t;
+
+// tabledb_mutate_cb that replaces the whole payload
+static void copy_record(void *data, void *arg) {
+    const record_copy_t *copy = arg;
+    memcpy(data, copy->data, copy->size);
+}
+
+/*
+ * @brief Update a record through the write-behind cache.
+ *
+ * The payload is kept in RAM and written by the flusher task later. A record that
+ * is dirty already is replaced under the cache lock only; otherwise the table lock
+ * is taken to check that the record exists. Reads see the cached payload
+ * immediately. If the table has no cache configured, the dirty set is full or the
+ * calling task has a transaction open, this falls back to tabledb_update(). A
+ * record deleted before the flush is silently skipped. Subscribers are told right
+ * away, without the table lock held.
+ *
+ * The whole record is replaced; use tabledb_update_deferred_fn() to change a few
+ * fields without overwriting concurrent updates.
+ *
+ * @return
+ *    - ESP_OK: Success.
+ *    - ESP_ERR_NVS_NOT_FOUND: The record does not exist, nothing was cached.
+ *    - Other error codes from NVS functions.
+ */
+esp_err_t tabledb_update_deferred(tabledb_config_t *config, uint32_t id, void *data) {
+    if (config->cache_state == NULL) {
+        return tabledb_update(config, id, data);
+    }
+    // A dirty record that no transaction shadows exists, deleting it would have shadowed it
+    record_copy_t copy = {.data = data, .size = config->size};
+    if (cache_mutate(config, id, copy_record, &copy)) {
+        notify(config, TABLEDB_CHANGE_UPDATE, id, generation_bump(config));
+        return ESP_OK;
+    }
+
+    if (xSemaphoreTakeRecursive(config->mutex, portMAX_DELAY) != pdTRUE) {
         return ESP_ERR_TIMEOUT;
     }
+    if (index_find(active_index(config), id) == TABLEDB_INDEX_NOT_FOUND) {
+        EXIT_WITH_MUTEX(ESP_ERR_NVS_NOT_FOUND);
+    }
+    if (config->txn != NULL || !cache_put(config, id, data, true)) {
+        EXIT_WITH_MUTEX(tabledb_update(config, id, data));
+    }
+    xSemaphoreGiveRecursive(config->mutex);
+    notify(config, TABLEDB_CHANGE_UPDATE, id, generation_bump(config));
+    return ESP_OK;
+}
 
-    char key[15];
-    snprintf(key, sizeof(key), "rec_%" PRIu32, id);
+/*
+ * @brief Modify a record in place through the write-behind cache.
+ *
+ * fn is applied to the current record: the dirty copy if there is one, otherwise
+ * the record as loaded from NVS, which is then cached. A dirty record is changed
+ * under the cache lock only, so the call neither takes the table lock nor waits
+ * for NVS. fn runs with a lock held and must not block.
+ *
+ * Falls back to tabledb_update() of the modified record if the table has no cache,
+ * the dirty set is full or the calling task has a transaction open.
+ *
+ * @return
+ *    - ESP_OK: Success.
+ *    - ESP_ERR_NVS_NOT_FOUND: The record does not exist.
+ *    - Other error codes from NVS functions.
+ */
+esp_err_t tabledb_update_deferred_fn(tabledb_config_t *config, uint32_t id, tabledb_mutate_cb fn, void *arg) {
+    if (cache_mutate(config, id, fn, arg)) {
+        notify(config, TABLEDB_CHANGE_UPDATE, id, generation_bump(config));
+        return ESP_OK;
+    }
+
+    // Not dirty yet (or shadowed by a transaction). The table lock keeps a
+    // commit from landing between the load and the cache_put.
+    if (xSemaphoreTakeRecursive(config->mutex, portMAX_DELAY) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+    if (config->txn == NULL && cache_mutate(config, id, fn, arg)) {
+        xSemaphoreGiveRecursive(config->mutex);
+        notify(config, TABLEDB_CHANGE_UPDATE, id, generation_bump(config));
+        return ESP_OK;
+    }
+    if (index_find(active_index(config), id) == TABLEDB_INDEX_NOT_FOUND) {
+        EXIT_WITH_MUTEX(ESP_ERR_NVS_NOT_FOUND);
+    }
 
-    size_t blob_size;
-    esp_err_t err = nvs_get_blob(config->handle, key, NULL, &blob_size);
+    uint8_t   data[TABLEDB_MAX_OBJECT_SIZE];
+    esp_err_t err = load_record(config, id, data);
     if (err != ESP_OK) {
         EXIT_WITH_MUTEX(err);
     }
+    fn(data, arg);
+    if (config->txn != NULL || config->cache_state == NULL || !cache_put(config, id, data, true)) {
+        EXIT_WITH_MUTEX(tabledb_update(config, id, data));
+    }
+    xSemaphoreGiveRecursive(config->mutex);
+    notify(config, TABLEDB_CHANGE_UPDATE, id, generation_bump(config));
+    return ESP_OK;
+}
 
-    if (blob_size < config->size + sizeof(tabledb_internal_record_t)) {
-        blob_size = sizeof(tabledb_internal_record_t) + config->size;
+/*
+ * @brief Write all records pending in the write-behind cache in one transaction.
+ *
+ * Called by the flusher task and on shutdown; can also be called directly.
+ *
+ * @return
+ *    - ESP_OK: Success (also when nothing is pending).
+ *    - ESP_ERR_INVALID_STATE: A transaction is open on the table.
+ *    - Other error codes from NVS functions. Unwritten records stay dirty.
+ */
+esp_err_t tabledb_flush(tabledb_config_t *config) {
+    struct tabledb_cache *cache = config->cache_state;
+    if (cache == NULL) {
+        return ESP_OK;
     }
 
-    uint8_t buffer[blob_size];
-    err = nvs_get_blob(config->handle, key, buffer, &blob_size);
-    if (err != ESP_OK) {
-        EXIT_WITH_MUTEX(err);
+    if (xSemaphoreTakeRecursive(config->mutex, portMAX_DELAY) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+    if (config->txn != NULL) {
+        EXIT_WITH_MUTEX(ESP_ERR_INVALID_STATE);
     }
 
-    tabledb_internal_record_t *record = (tabledb_internal_record_t *) buffer;
+    // Snapshot the dirty set. The records stay cached while we write, so deferred
+    // updates keep hitting the cache instead of waiting for the table lock.
+    xSemaphoreTake(cache->lock, portMAX_DELAY);
+    size_t    count    = cache->count;
+    uint32_t *ids      = count ? malloc(count * sizeof(uint32_t)) : NULL;
+    uint32_t *versions = count ? malloc(count * sizeof(uint32_t)) : NULL;
+    uint8_t  *data     = count ? malloc(count * config->size) : NULL;
+    if (count == 0 || ids == NULL || versions == NULL || data == NULL) {
+        xSemaphoreGive(cache->lock);
+        free(ids);
+        free(versions);
+        free(data);
+        EXIT_WITH_MUTEX(count == 0 ? ESP_OK : ESP_ERR_NO_MEM);
+    }
+    memcpy(ids, cache->ids, count * sizeof(uint32_t));
+    memcpy(versions, cache->versions, count * sizeof(uint32_t));
+    memcpy(data, cache->data, count * config->size);
+    xSemaphoreGive(cache->lock);
+
+    esp_err_t err = txn_alloc(config);
+    if (err == ESP_OK) {
+        for (size_t i = 0; i < count && err == ESP_OK; i++) {
+            if (index_find(&config->txn->index, ids[i]) == TABLEDB_INDEX_NOT_FOUND) {
+                ESP_LOGW(TAG, "%s: dropping deferred update of missing record %" PRIu32, config->namespace, ids[i]);
+                continue;
+            }
+            err = txn_stage_put(config, ids[i], data + i * config->size);
+        }
+        if (err == ESP_OK) {
+            err = txn_flush(config);
+        }
+        txn_free(config);
+    }
 
-    // Update the internal values to make sure record is having the latest version and size.
-    record->size    = config->size;
-    record->version = config->version;
+    if (err == ESP_OK) {
+        // Records updated again meanwhile stay dirty for the next flush.
+        cache_forget_flushed(config, ids, versions, count);
+    }
 
-    // Copy the new data into the buffer.
-    memcpy(buffer + sizeof(tabledb_internal_record_t), data, config->size);
+    free(ids);
+    free(versions);
+    free(data);
+    EXIT_WITH_MUTEX(err);
+}
 
-    err = nvs_set_blob(config->handle, key, buffer, sizeof(buffer));
+/***************** tabledb_txn_* ******************/
+/*
+ * @brief Open a transaction on the table.
+ *
+ * Inserts, updates and deletes issued by the calling task are staged in RAM until
+ * tabledb_txn_commit() writes them with a single nvs_commit. The table stays locked
+ * for other tasks until the transaction is committed or aborted.
+ *
+ * @return
+ *    - ESP_OK: Success.
+ *    - ESP_ERR_INVALID_STATE: A transaction is already open.
+ *    - ESP_ERR_NO_MEM: Not enough memory for the transaction.
+ */
+esp_err_t tabledb_txn_begin(tabledb_config_t *config) {
+    if (xSemaphoreTakeRecursive(config->mutex, portMAX_DELAY) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+    if (config->txn != NULL) {
+        EXIT_WITH_MUTEX(ESP_ERR_INVALID_STATE);
+    }
+    esp_err_t err = txn_alloc(config);
     if (err != ESP_OK) {
         EXIT_WITH_MUTEX(err);
     }
+    // Keep the mutex until commit/abort.
+    return ESP_OK;
+}
 
-    err = nvs_commit(config->handle);
+/*
+ * @brief Write all staged changes and close the transaction.
+ *
+ * Each touched record is written once with its final list pointers, the meta blob
+ * at most once, followed by a single nvs_commit. The transaction is closed even if
+ * writing fails; in that case the index is rebuilt from NVS.
+ */
+esp_err_t tabledb_txn_commit(tabledb_config_t *config) {
+    if (xSemaphoreTakeRecursive(config->mutex, portMAX_DELAY) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+    if (config->txn == NULL) {
+        EXIT_WITH_MUTEX(ESP_ERR_INVALID_STATE);
+    }
+    esp_err_t err = txn_flush(config);
+    if (err == ESP_OK) {
+        cache_forget_shadowed(config);
+        notify_txn(config);
+    }
+    txn_free(config);
+    // Release the lock taken by tabledb_txn_begin.
+    xSemaphoreGiveRecursive(config->mutex);
     EXIT_WITH_MUTEX(err);
 }
+
+/*
+ * @brief Discard all staged changes and close the transaction.
+ */
+esp_err_t tabledb_txn_abort(tabledb_config_t *config) {
+    if (xSemaphoreTakeRecursive(config->mutex, portMAX_DELAY) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+    if (config->txn == NULL) {
+        EXIT_WITH_MUTEX(ESP_ERR_INVALID_STATE);
+    }
+    txn_free(config);
+    xSemaphoreGiveRecursive(config->mutex);
+    EXIT_WITH_MUTEX(ESP_OK);
+}
+
+/***************** tabledb_subscribe ******************/
+/*
+ * @brief Register a callback for changes to the table.
+ *
+ * The callback runs in the task making the change, for committed changes with the
+ * table lock held. It may read the table but must not block. Subscribe right after
+ * tabledb_init(), before other tasks use the table.
+ *
+ * @return
+ *    - ESP_OK: Success.
+ *    - ESP_ERR_NO_MEM: TABLEDB_MAX_SUBSCRIBERS callbacks are registered already.
+ */
+esp_err_t tabledb_subscribe(tabledb_config_t *config, tabledb_change_cb cb, void *arg) {
+    if (xSemaphoreTakeRecursive(config->mutex, portMAX_DELAY) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+    for (int i = 0; i < TABLEDB_MAX_SUBSCRIBERS; i++) {
+        if (config->subscribers[i].cb == NULL) {
+            config->subscribers[i].arg = arg;
+            config->subscribers[i].cb  = cb;
+            EXIT_WITH_MUTEX(ESP_OK);
+        }
+    }
+    EXIT_WITH_MUTEX(ESP_ERR_NO_MEM);
+}
+
+esp_err_t tabledb_unsubscribe(tabledb_config_t *config, tabledb_change_cb cb, void *arg) {
+    if (xSemaphoreTakeRecursive(config->mutex, portMAX_DELAY) != pdTRUE) {
+        return ESP_ERR_TIMEOUT;
+    }
+    for (int i = 0; i < TABLEDB_MAX_SUBSCRIBERS; i++) {
+        if (config->subscribers[i].cb == cb && config->subscribers[i].arg == arg) {
+            config->subscribers[i].cb  = NULL;
+            config->subscribers[i].arg = NULL;
+            EXIT_WITH_MUTEX(ESP_OK);
+        }
+    }
+    EXIT_WITH_MUTEX(ESP_ERR_NOT_FOUND);
+}
+
+// Generation counter, increased by every visible change since tabledb_init().
+uint32_t tabledb_get_generation(tabledb_config_t *config) {
+    portENTER_CRITICAL(&g_generation_lock);
+    uint32_t generation = config->generation;
+    portEXIT_CRITICAL(&g_generation_lock);
+    return generation;
+}
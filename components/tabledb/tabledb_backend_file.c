@@ -0,0 +1,403 @@
+#include "tabledb_backend.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "nvs.h"
+#include "esp_log.h"
+
+/*
+ * Append-only log. Every set or erase appends one record:
+ *
+ *   file_record_t | key (key_len bytes) | data (size bytes, none for erase)
+ *
+ * The log is replayed into a RAM key index on open; values stay in the file.
+ * A record with a bad checksum ends the replay and the file is truncated
+ * there, which drops a write torn by a reset. Once dead records make up more
+ * than half of the file, commit rewrites the live ones into <file>.tmp and
+ * renames it over the log.
+ */
+
+#define FILE_MAX_VALUE_SIZE 4096
+#define FILE_COMPACT_MIN_DEAD 4096
+#define FILE_RECORD_ERASED 0xFFFF
+
+typedef struct {
+    uint32_t crc; // Over key_len, size, key and data
+    uint16_t size;
+    uint8_t  key_len;
+    uint8_t  reserved;
+} file_record_t;
+
+typedef struct {
+    char     key[16];
+    uint32_t offset; // Offset of the value in the file
+    uint16_t size;
+} file_entry_t;
+
+typedef struct {
+    FILE         *fp;
+    char          path[64];
+    file_entry_t *entries;
+    size_t        count;
+    size_t        capacity;
+    uint32_t      end;  // Append position
+    uint32_t      dead; // Bytes taken by overwritten or erased records
+} file_store_t;
+
+static const char *TAG = "TABLE_DB_FILE";
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len) {
+    crc = ~crc;
+    while (len--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t record_crc(const file_record_t *record, const char *key, const void *data) {
+    uint32_t crc = crc32_update(0, (const uint8_t *) &record->size, sizeof(record->size));
+    crc          = crc32_update(crc, &record->key_len, sizeof(record->key_len));
+    crc          = crc32_update(crc, (const uint8_t *) key, record->key_len);
+    if (record->size != FILE_RECORD_ERASED) {
+        crc = crc32_update(crc, data, record->size);
+    }
+    return crc;
+}
+
+static size_t record_length(const file_record_t *record) {
+    size_t data = record->size == FILE_RECORD_ERASED ? 0 : record->size;
+    return sizeof(file_record_t) + record->key_len + data;
+}
+
+static file_entry_t *file_find(file_store_t *store, const char *key) {
+    for (size_t i = 0; i < store->count; i++) {
+        if (strcmp(store->entries[i].key, key) == 0) {
+            return &store->entries[i];
+        }
+    }
+    return NULL;
+}
+
+// Record the latest position of key in the RAM index (size FILE_RECORD_ERASED removes it).
+static esp_err_t file_index(file_store_t *store, const char *key, uint32_t offset, uint16_t size) {
+    file_entry_t *entry = file_find(store, key);
+    if (entry != NULL) {
+        store->dead += sizeof(file_record_t) + strlen(entry->key) + entry->size;
+        if (size == FILE_RECORD_ERASED) {
+            *entry = store->entries[--store->count];
+            return ESP_OK;
+        }
+    } else {
+        if (size == FILE_RECORD_ERASED) {
+            return ESP_OK;
+        }
+        if (store->count == store->capacity) {
+            size_t        capacity = store->capacity ? store->capacity * 2 : 16;
+            file_entry_t *entries  = realloc(store->entries, capacity * sizeof(file_entry_t));
+            if (entries == NULL) {
+                return ESP_ERR_NO_MEM;
+            }
+            store->entries  = entries;
+            store->capacity = capacity;
+        }
+        entry = &store->entries[store->count++];
+        strcpy(entry->key, key);
+    }
+    entry->offset = offset;
+    entry->size   = size;
+    return ESP_OK;
+}
+
+static esp_err_t file_append(file_store_t *store, const char *key, const void *data, uint16_t size) {
+    file_record_t record = {.size = size, .key_len = strlen(key)};
+    record.crc           = record_crc(&record, key, data);
+
+    if (fseek(store->fp, store->end, SEEK_SET) != 0 ||
+        fwrite(&record, sizeof(record), 1, store->fp) != 1 ||
+        fwrite(key, record.key_len, 1, store->fp) != 1 ||
+        (size != FILE_RECORD_ERASED && size > 0 && fwrite(data, size, 1, store->fp) != 1)) {
+        return ESP_FAIL;
+    }
+
+    uint32_t value = store->end + sizeof(record) + record.key_len;
+    store->end += record_length(&record);
+    if (size == FILE_RECORD_ERASED) {
+        store->dead += record_length(&record);
+    }
+    return file_index(store, key, value, size);
+}
+
+// Rebuild the key index from the log, truncating a torn tail.
+static esp_err_t file_replay(file_store_t *store) {
+    uint8_t      *data = malloc(FILE_MAX_VALUE_SIZE);
+    file_record_t record;
+    char          key[16];
+    if (data == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    store->count = 0;
+    store->end   = 0;
+    store->dead  = 0;
+    fseek(store->fp, 0, SEEK_SET);
+    while (fread(&record, sizeof(record), 1, store->fp) == 1) {
+        size_t size = record.size == FILE_RECORD_ERASED ? 0 : record.size;
+        if (record.key_len == 0 || record.key_len >= sizeof(key) || size > FILE_MAX_VALUE_SIZE ||
+            fread(key, record.key_len, 1, store->fp) != 1 ||
+            (size > 0 && fread(data, size, 1, store->fp) != 1)) {
+            break;
+        }
+        key[record.key_len] = '\0';
+        if (record_crc(&record, key, data) != record.crc) {
+            break;
+        }
+
+        uint32_t value = store->end + sizeof(record) + record.key_len;
+        store->end += record_length(&record);
+        if (record.size == FILE_RECORD_ERASED) {
+            store->dead += record_length(&record);
+        }
+        esp_err_t err = file_index(store, key, value, record.size);
+        if (err != ESP_OK) {
+            free(data);
+            return err;
+        }
+    }
+    free(data);
+
+    fseek(store->fp, 0, SEEK_END);
+    if (ftell(store->fp) != (long) store->end) {
+        ESP_LOGW(TAG, "%s: dropping %ld bytes of torn log", store->path,
+                 ftell(store->fp) - (long) store->end);
+        fflush(store->fp);
+        if (ftruncate(fileno(store->fp), store->end) != 0) {
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+// Get the handle back after file_compact could not reopen the log. The index is
+// rebuilt from whatever log is in place, so it matches the handle again.
+static esp_err_t file_handle(file_store_t *store) {
+    if (store->fp != NULL) {
+        return ESP_OK;
+    }
+    store->fp = fopen(store->path, "r+b");
+    if (store->fp == NULL) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    esp_err_t err = file_replay(store);
+    if (err != ESP_OK) {
+        fclose(store->fp);
+        store->fp = NULL;
+    }
+    return err;
+}
+
+// Copy the live records into a fresh log and swap it in. The RAM index keeps
+// pointing into the old log until the new one is in place.
+static esp_err_t file_compact(file_store_t *store) {
+    char tmp_path[sizeof(store->path) + 4];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", store->path);
+
+    FILE     *fp      = fopen(tmp_path, "wb");
+    uint8_t  *data    = malloc(FILE_MAX_VALUE_SIZE);
+    uint32_t *offsets = malloc((store->count ? store->count : 1) * sizeof(uint32_t));
+    if (fp == NULL || data == NULL || offsets == NULL) {
+        if (fp != NULL) {
+            fclose(fp);
+            remove(tmp_path);
+        }
+        free(data);
+        free(offsets);
+        return ESP_ERR_NO_MEM;
+    }
+
+    uint32_t  end = 0;
+    esp_err_t err = ESP_OK;
+    for (size_t i = 0; i < store->count && err == ESP_OK; i++) {
+        file_entry_t *entry  = &store->entries[i];
+        file_record_t record = {.size = entry->size, .key_len = strlen(entry->key)};
+        if (fseek(store->fp, entry->offset, SEEK_SET) != 0 ||
+            (entry->size > 0 && fread(data, entry->size, 1, store->fp) != 1)) {
+            err = ESP_FAIL;
+            break;
+        }
+        record.crc = record_crc(&record, entry->key, data);
+        if (fwrite(&record, sizeof(record), 1, fp) != 1 ||
+            fwrite(entry->key, record.key_len, 1, fp) != 1 ||
+            (entry->size > 0 && fwrite(data, entry->size, 1, fp) != 1)) {
+            err = ESP_FAIL;
+            break;
+        }
+        offsets[i] = end + sizeof(record) + record.key_len;
+        end += record_length(&record);
+    }
+    free(data);
+
+    if (err == ESP_OK && (fflush(fp) != 0 || fsync(fileno(fp)) != 0)) {
+        err = ESP_FAIL;
+    }
+    fclose(fp);
+    if (err != ESP_OK) {
+        // The old log and its handle were not touched.
+        remove(tmp_path);
+        free(offsets);
+        return err;
+    }
+
+    // Some filesystems refuse to rename over an open file, so the log is closed for the swap.
+    fclose(store->fp);
+    store->fp = NULL;
+    if (rename(tmp_path, store->path) != 0) {
+        ESP_LOGW(TAG, "%s: compaction rename failed, keeping the old log", store->path);
+        remove(tmp_path);
+        free(offsets);
+        // Reopen the old log and replay it, in case the rename got partway.
+        return file_handle(store);
+    }
+
+    for (size_t i = 0; i < store->count; i++) {
+        store->entries[i].offset = offsets[i];
+    }
+    free(offsets);
+    ESP_LOGD(TAG, "%s: compacted %" PRIu32 " -> %" PRIu32 " bytes", store->path, store->end, end);
+    store->end  = end;
+    store->dead = 0;
+
+    // Without a handle every entry point retries through file_handle() first.
+    store->fp = fopen(store->path, "r+b");
+    if (store->fp == NULL) {
+        ESP_LOGE(TAG, "Can not reopen %s after compaction", store->path);
+        return ESP_ERR_INVALID_STATE;
+    }
+    return ESP_OK;
+}
+
+static void file_backend_close(void *handle) {
+    file_store_t *store = handle;
+    if (store->fp != NULL) {
+        fclose(store->fp);
+    }
+    free(store->entries);
+    free(store);
+}
+
+static esp_err_t file_backend_open(const void *arg, const char *name, void **handle) {
+    if (arg == NULL) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    file_store_t *store = calloc(1, sizeof(file_store_t));
+    if (store == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    snprintf(store->path, sizeof(store->path), "%s/%s.tdb", (const char *) arg, name);
+
+    store->fp = fopen(store->path, "r+b");
+    if (store->fp == NULL) {
+        store->fp = fopen(store->path, "w+b");
+    }
+    if (store->fp == NULL) {
+        ESP_LOGE(TAG, "Can not open %s", store->path);
+        free(store);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    esp_err_t err = file_replay(store);
+    if (err != ESP_OK) {
+        file_backend_close(store);
+        return err;
+    }
+    *handle = store;
+    return ESP_OK;
+}
+
+static esp_err_t file_backend_get(void *handle, const char *key, void *data, size_t *size) {
+    file_store_t *store = handle;
+    esp_err_t     err   = file_handle(store);
+    if (err != ESP_OK) {
+        return err;
+    }
+    file_entry_t *entry = file_find(store, key);
+    if (entry == NULL) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (data != NULL) {
+        if (*size < entry->size) {
+            return ESP_ERR_NVS_INVALID_LENGTH;
+        }
+        if (fseek(store->fp, entry->offset, SEEK_SET) != 0 ||
+            (entry->size > 0 && fread(data, entry->size, 1, store->fp) != 1)) {
+            return ESP_FAIL;
+        }
+    }
+    *size = entry->size;
+    return ESP_OK;
+}
+
+static esp_err_t file_backend_set(void *handle, const char *key, const void *data, size_t size) {
+    if (strlen(key) == 0 || strlen(key) > 15) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+    if (size > FILE_MAX_VALUE_SIZE) {
+        return ESP_ERR_NVS_VALUE_TOO_LONG;
+    }
+    esp_err_t err = file_handle(handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    return file_append(handle, key, data, size);
+}
+
+static esp_err_t file_backend_erase(void *handle, const char *key) {
+    esp_err_t err = file_handle(handle);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (file_find(handle, key) == NULL) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    return file_append(handle, key, NULL, FILE_RECORD_ERASED);
+}
+
+static esp_err_t file_backend_erase_all(void *handle) {
+    file_store_t *store = handle;
+    FILE         *fp    = store->fp != NULL ? freopen(store->path, "w+b", store->fp) : fopen(store->path, "w+b");
+    store->fp           = fp;
+    store->count        = 0;
+    store->end          = 0;
+    store->dead         = 0;
+    return fp != NULL ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t file_backend_commit(void *handle) {
+    file_store_t *store = handle;
+    esp_err_t     err   = file_handle(store);
+    if (err != ESP_OK) {
+        return err;
+    }
+    if (fflush(store->fp) != 0 || fsync(fileno(store->fp)) != 0) {
+        return ESP_FAIL;
+    }
+    if (store->dead >= FILE_COMPACT_MIN_DEAD && store->dead > store->end / 2) {
+        return file_compact(store);
+    }
+    return ESP_OK;
+}
+
+const tabledb_backend_t tabledb_backend_file = {
+    .open      = file_backend_open,
+    .close     = file_backend_close,
+    .get       = file_backend_get,
+    .set       = file_backend_set,
+    .erase     = file_backend_erase,
+    .erase_all = file_backend_erase_all,
+    .commit    = file_backend_commit,
+};
@@ -0,0 +1,51 @@
+#include "tabledb_backend.h"
+#include <stdint.h>
+#include "nvs.h"
+#include "nvs_stats.h"
+
+// The NVS handle is stored in the opaque handle pointer itself. Operations go through
+// nvs_stats so flash writes and stalls show up per table namespace.
+#define NVS_HANDLE(handle) ((nvs_handle_t) (uintptr_t) (handle))
+
+static esp_err_t nvs_backend_open(const void *arg, const char *name, void **handle) {
+    nvs_handle_t nvs;
+    esp_err_t    err = nvs_stats_open(name, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        *handle = (void *) (uintptr_t) nvs;
+    }
+    return err;
+}
+
+static void nvs_backend_close(void *handle) {
+    nvs_stats_close(NVS_HANDLE(handle));
+}
+
+static esp_err_t nvs_backend_get(void *handle, const char *key, void *data, size_t *size) {
+    return nvs_stats_get_blob(NVS_HANDLE(handle), key, data, size);
+}
+
+static esp_err_t nvs_backend_set(void *handle, const char *key, const void *data, size_t size) {
+    return nvs_stats_set_blob(NVS_HANDLE(handle), key, data, size);
+}
+
+static esp_err_t nvs_backend_erase(void *handle, const char *key) {
+    return nvs_stats_erase_key(NVS_HANDLE(handle), key);
+}
+
+static esp_err_t nvs_backend_erase_all(void *handle) {
+    return nvs_stats_erase_all(NVS_HANDLE(handle));
+}
+
+static esp_err_t nvs_backend_commit(void *handle) {
+    return nvs_stats_commit(NVS_HANDLE(handle));
+}
+
+const tabledb_backend_t tabledb_backend_nvs = {
+    .open      = nvs_backend_open,
+    .close     = nvs_backend_close,
+    .get       = nvs_backend_get,
+    .set       = nvs_backend_set,
+    .erase     = nvs_backend_erase,
+    .erase_all = nvs_backend_erase_all,
+    .commit    = nvs_backend_commit,
+};
@@ -0,0 +1,135 @@
+#include "tabledb_backend.h"
+#include <stdlib.h>
+#include <string.h>
+#include "nvs.h"
+
+typedef struct {
+    char     key[16];
+    uint8_t *data;
+    size_t   size;
+} ram_entry_t;
+
+typedef struct ram_store {
+    char              name[16];
+    ram_entry_t      *entries;
+    size_t            count;
+    size_t            capacity;
+    struct ram_store *next;
+} ram_store_t;
+
+// Stores outlive close(), so a reopened table finds its data again.
+static ram_store_t *g_stores = NULL;
+
+static ram_entry_t *ram_find(ram_store_t *store, const char *key) {
+    for (size_t i = 0; i < store->count; i++) {
+        if (strcmp(store->entries[i].key, key) == 0) {
+            return &store->entries[i];
+        }
+    }
+    return NULL;
+}
+
+static esp_err_t ram_backend_open(const void *arg, const char *name, void **handle) {
+    for (ram_store_t *store = g_stores; store != NULL; store = store->next) {
+        if (strncmp(store->name, name, sizeof(store->name) - 1) == 0) {
+            *handle = store;
+            return ESP_OK;
+        }
+    }
+
+    ram_store_t *store = calloc(1, sizeof(ram_store_t));
+    if (store == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    strncpy(store->name, name, sizeof(store->name) - 1);
+    store->next = g_stores;
+    g_stores    = store;
+    *handle     = store;
+    return ESP_OK;
+}
+
+static void ram_backend_close(void *handle) {
+}
+
+static esp_err_t ram_backend_get(void *handle, const char *key, void *data, size_t *size) {
+    ram_entry_t *entry = ram_find(handle, key);
+    if (entry == NULL) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (data != NULL) {
+        if (*size < entry->size) {
+            return ESP_ERR_NVS_INVALID_LENGTH;
+        }
+        memcpy(data, entry->data, entry->size);
+    }
+    *size = entry->size;
+    return ESP_OK;
+}
+
+static esp_err_t ram_backend_set(void *handle, const char *key, const void *data, size_t size) {
+    ram_store_t *store = handle;
+    if (strlen(key) >= sizeof(store->entries[0].key)) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+
+    uint8_t *copy = malloc(size ? size : 1);
+    if (copy == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(copy, data, size);
+
+    ram_entry_t *entry = ram_find(store, key);
+    if (entry == NULL) {
+        if (store->count == store->capacity) {
+            size_t       capacity = store->capacity ? store->capacity * 2 : 16;
+            ram_entry_t *entries  = realloc(store->entries, capacity * sizeof(ram_entry_t));
+            if (entries == NULL) {
+                free(copy);
+                return ESP_ERR_NO_MEM;
+            }
+            store->entries  = entries;
+            store->capacity = capacity;
+        }
+        entry = &store->entries[store->count++];
+        strcpy(entry->key, key);
+        entry->data = NULL;
+    }
+    free(entry->data);
+    entry->data = copy;
+    entry->size = size;
+    return ESP_OK;
+}
+
+static esp_err_t ram_backend_erase(void *handle, const char *key) {
+    ram_store_t *store = handle;
+    ram_entry_t *entry = ram_find(store, key);
+    if (entry == NULL) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    free(entry->data);
+    *entry = store->entries[--store->count];
+    return ESP_OK;
+}
+
+static esp_err_t ram_backend_erase_all(void *handle) {
+    ram_store_t *store = handle;
+    for (size_t i = 0; i < store->count; i++) {
+        free(store->entries[i].data);
+    }
+    store->count = 0;
+    return ESP_OK;
+}
+
+static esp_err_t ram_backend_commit(void *handle) {
+    return ESP_OK;
+}
+
+const tabledb_backend_t tabledb_backend_ram = {
+    .open      = ram_backend_open,
+    .close     = ram_backend_close,
+    .get       = ram_backend_get,
+    .set       = ram_backend_set,
+    .erase     = ram_backend_erase,
+    .erase_all = ram_backend_erase_all,
+    .commit    = ram_backend_commit,
+};
@@ -1,94 +1,166 @@
 #include "access_control.h"
+#include <inttypes.h>
+#include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
 #include "freertos/semphr.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "vl53l0x.h"
 #include "r502.h"
 #include "f900.h"
 #include "tabledb.h"
 #include "buzzer.h"
 #include "table_types.h"
+#include "auth_trace.h"
+#include "settings.h"
+#include "presence.h"
 
 static const char *TAG = "ACCESS_CONTROL";
 
 // Event group for triggering sensor tasks
 static EventGroupHandle_t xAccessControlEventGroup;
-#define EVENT_TRIGGER_DISTANCE_REACHED BIT0
+#define EVENT_TRIGGER_FINGERPRINT BIT0
 #define EVENT_TRIGGER_VL53L0X_MEASURE_DONE BIT1
+#define EVENT_TRIGGER_FACE BIT2
+// Someone is approaching: power the face module up ahead of the attempt
+#define EVENT_FACE_PREWAKE BIT3
+// The approach came to nothing: the face module may power down again
+#define EVENT_FACE_RELEASE BIT4
+// Every presence event is fanned out to both pipelines
+#define EVENT_TRIGGER_DISTANCE_REACHED (EVENT_TRIGGER_FINGERPRINT | EVENT_TRIGGER_FACE)
 
 /************ Algorithm Constants ************/
-// Interval between measurements (approximately)
-static const uint16_t MEASUREMENT_INTERVAL_MS = 200; // ms
-
-// Time thresholds (in ms)
-// 1 second – user must be within 50cm continuously for detection
-static const uint16_t DETECTION_DURATION_MS =1000;
-// 10 seconds – after flag is set, do not clear even if user leaves
-static const uint16_t MIN_ACTIVE_DURATION_MS =10000;
-// 3 seconds – after 10 sec, allow flag removal if user is absent (>50cm)
-static const uint16_t REMOVAL_DURATION_MS = 3000;
-// 60 seconds – maximum time the flag remains active (then cleared even if user is present)
-static const uint16_t MAX_ACTIVE_DURATION_MS = 60000;
-// 10 seconds – period before a new detection is allowed after flag removal
-static const uint16_t COOLDOWN_DURATION_MS =10000;
-
-// Macros to calculate cycle counts from time durations
-#define MS_TO_CYCLES(ms) ((ms) / MEASUREMENT_INTERVAL_MS)
-
-// Converting time thresholds into number of measurement cycles:
-static const uint16_t DETECTION_COUNT_THRESHOLD = MS_TO_CYCLES(DETECTION_DURATION_MS);  // 5 cycles
-static const uint16_t MIN_ACTIVE_COUNT          = MS_TO_CYCLES(MIN_ACTIVE_DURATION_MS); // 50 cycles
-static const uint16_t REMOVAL_COUNT_THRESHOLD   = MS_TO_CYCLES(REMOVAL_DURATION_MS);    // 15 cycles
-static const uint16_t MAX_ACTIVE_COUNT         = MS_TO_CYCLES(MAX_ACTIVE_DURATION_MS); // 300 cycles
-static const uint16_t COOLDOWN_COUNT_THRESHOLD = MS_TO_CYCLES(COOLDOWN_DURATION_MS);   // 50 cycles
-
-// Distance threshold (50 cm = 500 mm)
-static const uint16_t DISTANCE_THRESHOLD_MM = 500;
-
-/************ State Machine Definition ************/
-typedef enum {
-    // Waiting for the user to approach (i.e., be within the distance threshold)
-    ACCESS_STATE_WAITING_FOR_USER = 0,
-    // User detected continuously (access granted; latched for a minimum of 10 seconds)
-    ACCESS_STATE_USER_CONFIRMED,
-    // After the minimum period, monitoring the user’s presence; if the user is absent for 3 sec, access is revoked
-    ACCESS_STATE_USER_MONITORING,
-    // Cooldown period after access is revoked, delaying new detection for 10 seconds
-    ACCESS_STATE_COOLDOWN
-} access_state_t;
-
+// Presence detection timings live in PRESENCE_CONFIG_DEFAULT; distance and trigger time come from settings.
+
+// How long a fingerprint attempt waits for a finger
+static const uint16_t FINGER_WAIT_MS = 3000;
+// GenImg polling interval without the touch IRQ
+static const uint16_t FINGER_POLL_INTERVAL_MS = 200;
+// With the touch IRQ, polling only catches a missed edge (e.g. finger already on the sensor)
+static const uint16_t FINGER_FALLBACK_POLL_MS = 500;
+// How long a pre-woken face module stays powered without an attempt
+static const uint32_t FACE_PREWAKE_HOLD_MS = 15000;
+// Recently matched fingerprints tried 1:1 before the full library search. Each miss costs a
+// LoadChar + Match round trip, so only a few are kept.
+#define RECENT_FINGERPRINTS 2
+
+static r502_handle_t g_reader = NULL;
 static access_control_callback_t user_fingerprint_callback = NULL;
 static access_control_callback_t user_face_callback = NULL;
 
+/************ Attempt Dispatcher ************/
+// One presence event starts one attempt on both pipelines. The first pipeline to match
+// claims the attempt and cancels the other one.
+typedef enum {
+    PIPELINE_FINGERPRINT = 0,
+    PIPELINE_FACE,
+    PIPELINE_COUNT
+} pipeline_t;
+
+// Monotonic timestamps (esp_timer_get_time()) of the current attempt, for latency tracing
+typedef struct {
+    int64_t presence_us; // First ToF reading within the distance threshold
+    int64_t dispatch_us; // Presence confirmed and both pipelines triggered
+} attempt_times_t;
+
+static portMUX_TYPE g_attempt_lock = portMUX_INITIALIZER_UNLOCKED;
+static bool g_attempt_claimed = false;
+static bool g_pipeline_running[PIPELINE_COUNT] = {false};
+static attempt_times_t g_attempt_times = {0};
+
+static void attempt_dispatch(int64_t presence_us) {
+    int64_t now = esp_timer_get_time();
+    auth_trace_record(AUTH_MODALITY_PRESENCE, AUTH_STAGE_TOF_CONFIRM, presence_us);
+
+    portENTER_CRITICAL(&g_attempt_lock);
+    g_attempt_claimed = false;
+    g_attempt_times   = (attempt_times_t){.presence_us = presence_us, .dispatch_us = now};
+    portEXIT_CRITICAL(&g_attempt_lock);
+    xEventGroupSetBits(xAccessControlEventGroup, EVENT_TRIGGER_DISTANCE_REACHED);
+}
+
+// Mark a pipeline as working on the current attempt and fetch the attempt's timestamps.
+// Returns false if the other pipeline already granted access.
+static bool attempt_join(pipeline_t pipeline, attempt_times_t *times) {
+    portENTER_CRITICAL(&g_attempt_lock);
+    bool claimed = g_attempt_claimed;
+    g_pipeline_running[pipeline] = !claimed;
+    *times = g_attempt_times;
+    portEXIT_CRITICAL(&g_attempt_lock);
+    return !claimed;
+}
+
+static void attempt_leave(pipeline_t pipeline) {
+    portENTER_CRITICAL(&g_attempt_lock);
+    g_pipeline_running[pipeline] = false;
+    portEXIT_CRITICAL(&g_attempt_lock);
+}
+
+static bool attempt_cancelled(void) {
+    portENTER_CRITICAL(&g_attempt_lock);
+    bool claimed = g_attempt_claimed;
+    portEXIT_CRITICAL(&g_attempt_lock);
+    return claimed;
+}
+
+// Claim the attempt for a matching pipeline and stop the other one.
+// Returns false if the other pipeline matched first.
+static bool attempt_claim(pipeline_t pipeline) {
+    portENTER_CRITICAL(&g_attempt_lock);
+    bool won = !g_attempt_claimed;
+    g_attempt_claimed = true;
+    bool face_running = g_pipeline_running[PIPELINE_FACE];
+    portEXIT_CRITICAL(&g_attempt_lock);
+
+    if (!won) {
+        return false;
+    }
+
+    // The fingerprint pipeline notices the claim between sensor commands and cancels on its
+    // own UART. The face module is stuck in a blocking verify, so abort it from here.
+    if (pipeline == PIPELINE_FINGERPRINT && face_running) {
+        ESP_LOGI(TAG, "Fingerprint matched first, aborting face verification");
+        f900_reset();
+    }
+    // Skip the trigger of a pipeline that has not picked up the attempt yet
+    xEventGroupClearBits(xAccessControlEventGroup,
+                         pipeline == PIPELINE_FINGERPRINT ? EVENT_TRIGGER_FACE : EVENT_TRIGGER_FINGERPRINT);
+    return true;
+}
+
 static void IRAM_ATTR vl53l0x_irq_handler(void *arg) {
     // Set freertos event flag
     BaseType_t xHigherPriorityTaskWoken = pdFALSE;
     xEventGroupSetBitsFromISR(xAccessControlEventGroup, EVENT_TRIGGER_VL53L0X_MEASURE_DONE, &xHigherPriorityTaskWoken);
 }
 
+// Settings may change at any time from the web UI; read them on every measurement.
+// distance_threshold is stored in cm, distance_trigger_time in seconds.
+static void load_presence_config(presence_config_t *config) {
+    const settings_t *settings = settings_get_settings();
+    if (settings->distance_threshold > 0 && settings->distance_threshold <= 800) {
+        config->threshold_mm = settings->distance_threshold * 10;
+    }
+    if (settings->distance_trigger_time > 0) {
+        config->detection_ms = settings->distance_trigger_time * 1000;
+    }
+}
+
 // ToF Task
 static void tof_task(void *arg) {
     vl53l0x_addInterruptHandler(vl53l0x_irq_handler, NULL);
 
     ESP_LOGI(TAG, "Starting ToF sensor task...");
 
-    uint16_t distance = 0;
-
-    // Variables for implementing the state machine
-    access_state_t state = ACCESS_STATE_WAITING_FOR_USER;
-    // Counts consecutive measurements below threshold (in detection phase)
-    uint16_t detection_counter = 0;
-    // Counts cycles in the flag active state (since flag was set)
-    uint16_t state_counter = 0;
-    // Counts consecutive measurements above threshold (for flag removal)
-    uint16_t above_counter = 0;
-    // Counts cycles in the cooldown state
-    uint16_t cooldown_counter = 0;
+    presence_t        presence;
+    presence_config_t config      = PRESENCE_CONFIG_DEFAULT;
+    uint16_t          interval_ms = config.idle_interval_ms;
+    presence_init(&presence, (uint32_t) (esp_timer_get_time() / 1000));
 
     vl53l0x_clearInterrupt();
-    vl53l0x_startContinuous(MEASUREMENT_INTERVAL_MS);
+    vl53l0x_startContinuous(interval_ms);
 
     while (1) {
         // Wait for the sensor measurement done event (with timeout)
@@ -101,89 +173,45 @@ static void tof_task(void *arg) {
         }
 
         // Read the measurement result
-        distance = vl53l0x_readResultRangeStatus();
+        uint16_t distance = vl53l0x_readResultRangeStatus();
         xEventGroupClearBits(xAccessControlEventGroup, EVENT_TRIGGER_VL53L0X_MEASURE_DONE);
         vl53l0x_clearInterrupt();
 
         //ESP_LOGI(TAG, "Distance: %dmm", distance);
 
-        switch (state) {
-        case ACCESS_STATE_WAITING_FOR_USER:
-            // If the distance is below the threshold, increment the detection counter
-            if (distance < DISTANCE_THRESHOLD_MM) {
-                detection_counter++;
-            } else {
-                detection_counter = 0;
-            }
-            // If the condition holds for 1 second (5 cycles), set the flag
-            if (detection_counter >= DETECTION_COUNT_THRESHOLD) {
-                ESP_LOGI(TAG, "User detected within %d mm for %d ms. Setting flag.",
-                         DISTANCE_THRESHOLD_MM, DETECTION_DURATION_MS);
-                xEventGroupSetBits(xAccessControlEventGroup, EVENT_TRIGGER_DISTANCE_REACHED);
-                state             = ACCESS_STATE_USER_CONFIRMED;
-                state_counter     = 0;
-                detection_counter = 0;
-            }
-            break;
-
-        case ACCESS_STATE_USER_CONFIRMED:
-            state_counter++;
-            // During the first 10 seconds (50 cycles), do not clear the flag even if the user leaves
-            if (state_counter >= MIN_ACTIVE_COUNT) {
-                state         = ACCESS_STATE_USER_MONITORING;
-                above_counter = 0;
-            }
-            // If the maximum flag active time is reached, clear the flag
-            if (state_counter >= MAX_ACTIVE_COUNT) {
-                ESP_LOGI(TAG, "Maximum active duration reached. Clearing flag.");
-                xEventGroupClearBits(xAccessControlEventGroup, EVENT_TRIGGER_DISTANCE_REACHED);
-                state            = ACCESS_STATE_COOLDOWN;
-                cooldown_counter = 0;
-            }
-            break;
-
-        case ACCESS_STATE_USER_MONITORING:
-            state_counter++;
-            // If the measured distance is greater than the threshold, count consecutive "absence" cycles
-            if (distance > DISTANCE_THRESHOLD_MM) {
-                above_counter++;
-            } else {
-                above_counter = 0;
-            }
-            // If the user is absent for 3 seconds consecutively (15 cycles), clear the flag
-            if (above_counter >= REMOVAL_COUNT_THRESHOLD) {
-                ESP_LOGI(TAG, "User absent for %d ms. Clearing flag.", REMOVAL_DURATION_MS);
-                xEventGroupClearBits(xAccessControlEventGroup, EVENT_TRIGGER_DISTANCE_REACHED);
-                state            = ACCESS_STATE_COOLDOWN;
-                cooldown_counter = 0;
-            }
-            // Also, if the maximum flag active time is reached, clear the flag
-            if (state_counter >= MAX_ACTIVE_COUNT) {
-                ESP_LOGI(TAG, "Maximum active duration reached. Clearing flag.");
-                xEventGroupClearBits(xAccessControlEventGroup, EVENT_TRIGGER_DISTANCE_REACHED);
-                state            = ACCESS_STATE_COOLDOWN;
-                cooldown_counter = 0;
-            }
-            break;
-
-        case ACCESS_STATE_COOLDOWN:
-            cooldown_counter++;
-            // After 10 seconds (50 cycles) cooldown, new detection is allowed
-            if (cooldown_counter >= COOLDOWN_COUNT_THRESHOLD) {
-                ESP_LOGI(TAG, "Cooldown period ended. Ready for new detection.");
-                state             = ACCESS_STATE_WAITING_FOR_USER;
-                detection_counter = 0;
-            }
-            break;
-
-        default:
-            state = ACCESS_STATE_WAITING_FOR_USER;
-            break;
+        config = (presence_config_t) PRESENCE_CONFIG_DEFAULT;
+        load_presence_config(&config);
+
+        int64_t           now_us = esp_timer_get_time();
+        uint32_t          now_ms = (uint32_t) (now_us / 1000);
+        presence_state_t  prev   = presence.state;
+        presence_output_t out    = presence_update(&presence, &config, now_ms, distance);
+
+        if (out.event == PRESENCE_EVENT_APPROACHING) {
+            ESP_LOGI(TAG, "Approach at %d mm, %d mm/s. Pre-waking face module.", out.filtered_mm,
+                     out.velocity_mm_s);
+            xEventGroupSetBits(xAccessControlEventGroup, EVENT_FACE_PREWAKE);
+        } else if (out.event == PRESENCE_EVENT_RECEDED) {
+            ESP_LOGI(TAG, "Approach receded without detection.");
+            xEventGroupSetBits(xAccessControlEventGroup, EVENT_FACE_RELEASE);
+        } else if (out.event == PRESENCE_EVENT_DETECTED) {
+            ESP_LOGI(TAG, "User detected within %d mm for %" PRIu32 " ms. Setting flag.",
+                     config.threshold_mm, config.detection_ms);
+            attempt_dispatch(now_us - (int64_t) (now_ms - out.presence_start_ms) * 1000);
+        } else if (out.event == PRESENCE_EVENT_CLEARED) {
+            ESP_LOGI(TAG, "User left or maximum active duration reached. Clearing flag.");
+            xEventGroupClearBits(xAccessControlEventGroup, EVENT_TRIGGER_DISTANCE_REACHED);
+        } else if (prev == PRESENCE_STATE_COOLDOWN && presence.state == PRESENCE_STATE_WAITING_FOR_USER) {
+            ESP_LOGI(TAG, "Cooldown period ended. Ready for new detection.");
         }
 
-        // Optionally, add a delay for the next cycle:
-        // vTaskDelay(pdMS_TO_TICKS(MEASUREMENT_INTERVAL_MS));
-        // However, the loop is typically driven by sensor interrupts.
+        // Adapt the ranging rate to what the state machine is doing
+        if (out.interval_ms != interval_ms) {
+            vl53l0x_stopContinuous();
+            vl53l0x_clearInterrupt();
+            vl53l0x_startContinuous(out.interval_ms);
+            interval_ms = out.interval_ms;
+        }
 
         // Add a small delay at the end of each loop iteration
         // to prevent watchdog timeouts
@@ -191,104 +219,303 @@ static void tof_task(void *arg) {
     }
 }
 
+// Stop the fingerprint pipeline after the face pipeline granted access
+static void fingerprint_cancel(void) {
+    r502_generic_reply reply;
+
+    ESP_LOGI(TAG, "Face matched first, cancelling fingerprint scan");
+    r502_cancel(g_reader, &reply);
+    // Turn off the sensor's LED
+    r502_auraledconfig(g_reader, 4, 0, 0, 0, &reply);
+}
+
+// Most recent first; only touched by the fingerprint task
+static uint16_t g_recent_fingerprints[RECENT_FINGERPRINTS];
+static uint8_t  g_recent_count = 0;
+
+static void recent_fingerprint_note(uint16_t id) {
+    uint8_t pos = 0;
+    while (pos < g_recent_count && g_recent_fingerprints[pos] != id) {
+        pos++;
+    }
+    if (pos == g_recent_count && g_recent_count < RECENT_FINGERPRINTS) {
+        g_recent_count++;
+    }
+    if (pos == RECENT_FINGERPRINTS) {
+        pos--;
+    }
+    memmove(&g_recent_fingerprints[1], &g_recent_fingerprints[0], pos * sizeof(uint16_t));
+    g_recent_fingerprints[0] = id;
+}
+
+// Compare CharBuffer1 1:1 against the recent users. A deleted or reused slot simply fails to load
+// or match, so the cache needs no invalidation.
+static bool fingerprint_match_recent(uint16_t *matched_id) {
+    if (g_recent_count == 0) {
+        return false;
+    }
+
+    int64_t stage_us = esp_timer_get_time();
+    bool    matched  = false;
+    for (uint8_t i = 0; i < g_recent_count && !matched && !attempt_cancelled(); i++) {
+        uint16_t id = g_recent_fingerprints[i];
+        if (!r502_is_occupied(g_reader, id)) {
+            continue;
+        }
+        r502_generic_reply reply;
+        r502_match_reply   match_reply;
+        if (r502_loadchar(g_reader, 2, id, &reply) == ESP_OK && reply.conf_code == 0x00 &&
+            r502_match(g_reader, &match_reply) == ESP_OK && match_reply.conf_code == 0x00) {
+            ESP_LOGI(TAG, "1:1 match with recent fingerprint %u, score %u", id, match_reply.match_score);
+            *matched_id = id;
+            matched     = true;
+        }
+    }
+    auth_trace_record(AUTH_MODALITY_FINGERPRINT, AUTH_STAGE_MATCH, stage_us);
+    return matched;
+}
+
+// 1:N search, only across the occupied part of the library
+static bool fingerprint_search(uint16_t *matched_id) {
+    uint16_t search_start = 0;
+    uint16_t search_count = 0xFFFF;
+    if (r502_occupied_span(g_reader, &search_start, &search_count) != ESP_OK) {
+        search_start = 0;
+        search_count = 0xFFFF;
+    }
+    if (search_count == 0) {
+        return false;
+    }
+
+    r502_search_reply search_reply;
+    int64_t stage_us = esp_timer_get_time();
+    if (r502_search(g_reader, 1, search_start, search_count, &search_reply) != ESP_OK) {
+        return false;
+    }
+    auth_trace_record(AUTH_MODALITY_FINGERPRINT, AUTH_STAGE_SEARCH, stage_us);
+    if (search_reply.conf_code != 0x00) {
+        return false;
+    }
+    *matched_id = search_reply.index;
+    return true;
+}
+
 // Fingerprint Task
 static void fingerprint_task(void *arg) {
     r502_generic_reply reply;
 
     while (1) {
         // Wait for the trigger signal
-        xEventGroupWaitBits(xAccessControlEventGroup, EVENT_TRIGGER_DISTANCE_REACHED, pdTRUE,
+        xEventGroupWaitBits(xAccessControlEventGroup, EVENT_TRIGGER_FINGERPRINT, pdTRUE,
                             pdFALSE, portMAX_DELAY);
 
-        // Turn on the sensor's LED (e.g., breathing blue light)
-        r502_auraledconfig(1, 100, 2, 0, &reply);
+        attempt_times_t times;
+        if (!attempt_join(PIPELINE_FINGERPRINT, &times)) {
+            continue;
+        }
 
-        // Wait for finger detection
-        int retries = 0;
-        while (retries++ < 15) { // Total wait time 15 * 200ms = 3 seconds
-            if (r502_genimg(&reply) == ESP_OK && reply.conf_code == 0x00) {
+        // Turn on the sensor's LED (e.g., breathing blue light)
+        r502_auraledconfig(g_reader, 1, 100, 2, 0, &reply);
+
+        // Wait for finger detection. The touch IRQ wakes us up to issue GenImg right away.
+        const uint32_t   poll_ms    = r502_has_touch_irq(g_reader) ? FINGER_FALLBACK_POLL_MS : FINGER_POLL_INTERVAL_MS;
+        const TickType_t wait_start = xTaskGetTickCount();
+        const int64_t    start_us   = esp_timer_get_time();
+        bool             detected   = false;
+        bool             woke_irq   = false;
+        int64_t          poll_us    = 0; // Last GenImg without a finger returned, or the one that found it started
+        r502_clear_touch(g_reader);
+        while (xTaskGetTickCount() - wait_start < pdMS_TO_TICKS(FINGER_WAIT_MS)) {
+            if (attempt_cancelled()) {
+                break;
+            }
+            // The image and char buffers are ours from the capture until the search finished,
+            // so enrollment or a backup can not swap a template in between
+            r502_lock(g_reader);
+            int64_t genimg_us = esp_timer_get_time();
+            if (r502_genimg(g_reader, &reply) == ESP_OK && reply.conf_code == 0x00) {
                 // Finger detected
+                auth_trace_record(AUTH_MODALITY_FINGERPRINT, AUTH_STAGE_GENIMG, genimg_us);
+                auth_trace_record(AUTH_MODALITY_FINGERPRINT, AUTH_STAGE_FINGER_WAIT, times.dispatch_us);
+                if (poll_us == 0) {
+                    poll_us = genimg_us; // The finger was on before the first GenImg
+                }
+                detected = true;
                 break;
             }
-            vTaskDelay(pdMS_TO_TICKS(200));
+            poll_us = esp_timer_get_time();
+            r502_unlock(g_reader);
+            woke_irq = r502_wait_touch(g_reader, poll_ms);
         }
 
-        if (retries >= 15) {
+        if (attempt_cancelled()) {
+            if (detected) {
+                r502_unlock(g_reader);
+            }
+            fingerprint_cancel();
+            attempt_leave(PIPELINE_FINGERPRINT);
+            continue;
+        }
+
+        if (!detected) {
             ESP_LOGW(TAG, "No finger detected");
             // Turn off the sensor's LED
-            r502_auraledconfig(4, 0, 0, 0, &reply);
+            r502_auraledconfig(g_reader, 4, 0, 0, 0, &reply);
+            attempt_leave(PIPELINE_FINGERPRINT);
             continue;
         }
 
         // Convert image to character file
-        if (r502_img2tz(1, &reply) != ESP_OK || reply.conf_code != 0x00) {
+        int64_t stage_us = esp_timer_get_time();
+        if (r502_img2tz(g_reader, 1, &reply) != ESP_OK || reply.conf_code != 0x00) {
             ESP_LOGW(TAG, "Failed to convert image to character file");
             // Handle error
+            r502_unlock(g_reader);
+            attempt_leave(PIPELINE_FINGERPRINT);
             continue;
         }
-
-        // Search for matching fingerprint
-        r502_search_reply search_reply;
-        if (r502_search(1, 0, 0xFFFF, &search_reply) == ESP_OK &&
-            search_reply.conf_code == 0x00) {
-            uint16_t            matched_id = search_reply.index;
+        auth_trace_record(AUTH_MODALITY_FINGERPRINT, AUTH_STAGE_IMG2TZ, stage_us);
+
+        // Touch to template, split by how the finger was found. Polling only knows the finger landed
+        // after the last GenImg that saw none, so touch_poll is an upper bound.
+        int64_t touch_us = r502_get_touch_time(g_reader);
+        bool    by_irq   = woke_irq && touch_us >= start_us;
+        if (!by_irq) {
+            touch_us = poll_us;
+        }
+        auth_trace_record(AUTH_MODALITY_FINGERPRINT, by_irq ? AUTH_STAGE_TOUCH_IRQ : AUTH_STAGE_TOUCH_POLL, touch_us);
+        ESP_LOGI(TAG, "Touch to template: %" PRId64 " ms (%s)", (esp_timer_get_time() - touch_us) / 1000,
+                 by_irq ? "irq" : "poll");
+
+        // Try the recent users 1:1 before searching the whole library
+        uint16_t matched_id = 0;
+        bool     matched    = fingerprint_match_recent(&matched_id);
+        if (!matched && !attempt_cancelled()) {
+            matched = fingerprint_search(&matched_id);
+        }
+        r502_unlock(g_reader);
+        if (matched) {
+            recent_fingerprint_note(matched_id);
 
             // Invoke fingerprint verification callback instead of inline handling
-            if (user_fingerprint_callback != NULL) {
+            if (attempt_claim(PIPELINE_FINGERPRINT) && user_fingerprint_callback != NULL) {
+                stage_us = esp_timer_get_time();
                 user_fingerprint_callback(matched_id);
+                auth_trace_record(AUTH_MODALITY_FINGERPRINT, AUTH_STAGE_CALLBACK, stage_us);
+                auth_trace_record(AUTH_MODALITY_FINGERPRINT, AUTH_STAGE_TOTAL, times.presence_us);
             }
-        } else {
+        } else if (!attempt_cancelled()) {
             ESP_LOGW(TAG, "No matching fingerprint found");
             buzzer_error_honk();
         }
 
         // Turn off the sensor's LED
-        r502_auraledconfig(4, 0, 0, 0, &reply);
-
+        r502_auraledconfig(g_reader, 4, 0, 0, 0, &reply);
+        attempt_leave(PIPELINE_FINGERPRINT);
     }
 }
 
 // Face Task
 // F900 will generate heat during operation and should not be used for a long time.
-// It is recommended to power off and reset after working for a few minutes
+// The f900 power manager powers it off after each session and enforces a duty cycle budget.
 static void face_task(void *arg) {
     const TickType_t cooldown_period   = pdMS_TO_TICKS(30000); // 30 seconds
     TickType_t       last_attempt_time = xTaskGetTickCount() - cooldown_period;
+    // A pre-wake holds one power reference until the attempt, a release or FACE_PREWAKE_HOLD_MS
+    bool             prewoken          = false;
+    TickType_t       prewake_time      = 0;
 
     ESP_LOGI(TAG, "Starting Face detection task");
 
     while (1) {
-        // Wait for the trigger signal
-        xEventGroupWaitBits(xAccessControlEventGroup, EVENT_TRIGGER_DISTANCE_REACHED, pdTRUE,
-                            pdFALSE, portMAX_DELAY);
+        TickType_t wait = portMAX_DELAY;
+        if (prewoken) {
+            TickType_t held = xTaskGetTickCount() - prewake_time;
+            TickType_t hold = pdMS_TO_TICKS(FACE_PREWAKE_HOLD_MS);
+            wait            = held < hold ? hold - held : 0;
+        }
+
+        // Wait for the trigger signal or a pre-wake request
+        EventBits_t bits = xEventGroupWaitBits(
+            xAccessControlEventGroup, EVENT_TRIGGER_FACE | EVENT_FACE_PREWAKE | EVENT_FACE_RELEASE,
+            pdTRUE, pdFALSE, wait);
 
         TickType_t current_time = xTaskGetTickCount();
-        if (current_time - last_attempt_time < cooldown_period) {
+        bool       cooldown     = current_time - last_attempt_time < cooldown_period;
+
+        if (!(bits & EVENT_TRIGGER_FACE)) {
+            if ((bits & EVENT_FACE_PREWAKE) && !prewoken && !cooldown) {
+                prewoken     = true;
+                prewake_time = current_time;
+                if (!f900_power_acquire(F900_READY_TIMEOUT_MS)) {
+                    ESP_LOGW(TAG, "Face module not ready after pre-wake");
+                }
+            } else if (prewoken && ((bits & EVENT_FACE_RELEASE) || bits == 0)) {
+                ESP_LOGI(TAG, "Powering down pre-woken face module");
+                prewoken = false;
+                f900_power_release();
+            }
+            continue;
+        }
+
+        if (cooldown) {
             ESP_LOGI(TAG, "Face scan cooldown active");
             continue;
         }
 
+        attempt_times_t times;
+        if (!attempt_join(PIPELINE_FACE, &times)) {
+            continue;
+        }
+
         ESP_LOGI(TAG, "Face detection started");
 
+        // Nobody pre-woke the module: pay the cold start now
+        int64_t stage_us = esp_timer_get_time();
+        if (!prewoken) {
+            prewoken = true;
+            if (f900_power_acquire(F900_READY_TIMEOUT_MS)) {
+                auth_trace_record(AUTH_MODALITY_FACE, AUTH_STAGE_FACE_WAKE, stage_us);
+            }
+        }
+
         // Start face verification with a timeout of 30 seconds
         f900_user_info_t user_info;
-        if (f900_verify(30, &user_info)) {
+        stage_us = esp_timer_get_time();
+        // A missed READY note is not fatal; verify reports a module that really is down.
+        // A module kept off by the duty budget leaves this attempt to the fingerprint.
+        if (!f900_is_powered()) {
+            ESP_LOGW(TAG, "Face module off for thermal budget; skipping face scan");
+        } else if (!attempt_cancelled() && f900_verify(30, &user_info)) {
             uint16_t user_id = (user_info.user_id_heb << 8) | user_info.user_id_leb;
+            auth_trace_record(AUTH_MODALITY_FACE, AUTH_STAGE_FACE_VERIFY, stage_us);
 
             // Invoke callback when faceid verified
-            if (user_face_callback != NULL) {
+            if (attempt_claim(PIPELINE_FACE) && user_face_callback != NULL) {
+                stage_us = esp_timer_get_time();
                 user_face_callback(user_id);
+                auth_trace_record(AUTH_MODALITY_FACE, AUTH_STAGE_CALLBACK, stage_us);
+                auth_trace_record(AUTH_MODALITY_FACE, AUTH_STAGE_TOTAL, times.presence_us);
+            }
+        } else if (attempt_cancelled()) {
+            // MID_RESET aborted the verify; drop the module's reply to the reset itself
+            f900_message_t msg;
+            while (f900_receive_message(&msg)) {
             }
         } else {
             ESP_LOGW(TAG, "Face verification failed or timed out");
             buzzer_error_honk();
         }
 
+        attempt_leave(PIPELINE_FACE);
+        prewoken = false;
+        f900_power_release();
         last_attempt_time = xTaskGetTickCount();
     }
 }
 
-void access_control_start() {
+void access_control_start(r502_handle_t fingerprint_reader) {
+    g_reader = fingerprint_reader;
     // Initialize the event group before starting tasks
     xAccessControlEventGroup = xEventGroupCreate();
     if (xAccessControlEventGroup == NULL) {
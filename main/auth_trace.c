@@ -0,0 +1,121 @@
+#include "auth_trace.h"
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+
+typedef struct {
+    uint32_t samples[AUTH_TRACE_WINDOW]; // Ring buffer of durations in us
+    uint32_t count;                      // Samples ever recorded; next slot is count % window
+} stage_window_t;
+
+static const char *modality_names[AUTH_MODALITY_COUNT] = {"presence", "fingerprint", "face"};
+static const char *stage_names[AUTH_STAGE_COUNT]       = {
+    "tof_confirm", "finger_wait", "genimg", "img2tz", "touch_irq", "touch_poll", "search", "match",
+    "face_wake", "face_verify", "callback", "total",
+};
+
+static stage_window_t g_windows[AUTH_MODALITY_COUNT][AUTH_STAGE_COUNT];
+static uint32_t g_total_count = 0;
+static portMUX_TYPE g_trace_lock = portMUX_INITIALIZER_UNLOCKED;
+
+void auth_trace_record(auth_modality_t modality, auth_stage_t stage, int64_t start_us) {
+    if (modality >= AUTH_MODALITY_COUNT || stage >= AUTH_STAGE_COUNT) {
+        return;
+    }
+    int64_t  elapsed = esp_timer_get_time() - start_us;
+    uint32_t us      = elapsed < 0 ? 0 : elapsed > UINT32_MAX ? UINT32_MAX : (uint32_t) elapsed;
+
+    portENTER_CRITICAL(&g_trace_lock);
+    stage_window_t *window = &g_windows[modality][stage];
+    window->samples[window->count % AUTH_TRACE_WINDOW] = us;
+    window->count++;
+    g_total_count++;
+    portEXIT_CRITICAL(&g_trace_lock);
+}
+
+// Nearest-rank percentile of a sorted array
+static uint32_t percentile(const uint32_t *sorted, uint32_t n, uint32_t p) {
+    uint32_t rank = (p * n + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+bool auth_trace_get(auth_modality_t modality, auth_stage_t stage, auth_trace_summary_t *summary) {
+    if (modality >= AUTH_MODALITY_COUNT || stage >= AUTH_STAGE_COUNT) {
+        return false;
+    }
+
+    uint32_t sorted[AUTH_TRACE_WINDOW];
+    portENTER_CRITICAL(&g_trace_lock);
+    const stage_window_t *window = &g_windows[modality][stage];
+    uint32_t count = window->count;
+    uint32_t n     = count < AUTH_TRACE_WINDOW ? count : AUTH_TRACE_WINDOW;
+    memcpy(sorted, window->samples, n * sizeof(uint32_t));
+    portEXIT_CRITICAL(&g_trace_lock);
+
+    if (n == 0) {
+        return false;
+    }
+
+    // Insertion sort; the window is small
+    for (uint32_t i = 1; i < n; i++) {
+        uint32_t value = sorted[i];
+        uint32_t j     = i;
+        while (j > 0 && sorted[j - 1] > value) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = value;
+    }
+
+    summary->count   = count;
+    summary->samples = n;
+    summary->p50_us  = percentile(sorted, n, 50);
+    summary->p95_us  = percentile(sorted, n, 95);
+    summary->p99_us  = percentile(sorted, n, 99);
+    summary->max_us  = sorted[n - 1];
+    return true;
+}
+
+uint32_t auth_trace_total_count(void) {
+    portENTER_CRITICAL(&g_trace_lock);
+    uint32_t count = g_total_count;
+    portEXIT_CRITICAL(&g_trace_lock);
+    return count;
+}
+
+cJSON *auth_trace_to_json(void) {
+    cJSON *root = cJSON_CreateObject();
+    if (root == NULL) {
+        return NULL;
+    }
+    cJSON_AddNumberToObject(root, "window", AUTH_TRACE_WINDOW);
+    cJSON *modalities = cJSON_AddObjectToObject(root, "modalities");
+
+    for (int m = 0; m < AUTH_MODALITY_COUNT; m++) {
+        cJSON *stages = NULL;
+        for (int s = 0; s < AUTH_STAGE_COUNT; s++) {
+            auth_trace_summary_t summary;
+            if (!auth_trace_get(m, s, &summary)) {
+                continue;
+            }
+            if (stages == NULL) {
+                stages = cJSON_AddObjectToObject(modalities, modality_names[m]);
+            }
+            cJSON *item = cJSON_AddObjectToObject(stages, stage_names[s]);
+            cJSON_AddNumberToObject(item, "count", summary.count);
+            cJSON_AddNumberToObject(item, "samples", summary.samples);
+            cJSON_AddNumberToObject(item, "p50_us", summary.p50_us);
+            cJSON_AddNumberToObject(item, "p95_us", summary.p95_us);
+            cJSON_AddNumberToObject(item, "p99_us", summary.p99_us);
+            cJSON_AddNumberToObject(item, "max_us", summary.max_us);
+        }
+    }
+    return root;
+}
+
+void auth_trace_reset(void) {
+    portENTER_CRITICAL(&g_trace_lock);
+    memset(g_windows, 0, sizeof(g_windows));
+    g_total_count = 0;
+    portEXIT_CRITICAL(&g_trace_lock);
+}
@@ -2,12 +2,13 @@
 #define _ACCESS_CONTROL_H_
 
 #include <stdint.h>
+#include "r502.h"
 
 
 typedef void (*access_control_callback_t)(uint32_t user_id);
 
 
-void  access_control_start();
+void  access_control_start(r502_handle_t fingerprint_reader);
 
 void access_control_set_fingerprint_success_callback(access_control_callback_t callback);
 void access_control_set_face_success_callback(access_control_callback_t callback);
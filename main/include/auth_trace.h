@@ -0,0 +1,65 @@
+#ifndef _AUTH_TRACE_H_
+#define _AUTH_TRACE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "cJSON.h"
+
+// Number of most recent samples kept per stage for the rolling percentiles
+#define AUTH_TRACE_WINDOW 64
+
+typedef enum {
+    AUTH_MODALITY_PRESENCE = 0, // Stages shared by both pipelines
+    AUTH_MODALITY_FINGERPRINT,
+    AUTH_MODALITY_FACE,
+    AUTH_MODALITY_COUNT
+} auth_modality_t;
+
+typedef enum {
+    AUTH_STAGE_TOF_CONFIRM = 0, // First ToF reading in range until the attempt is dispatched
+    AUTH_STAGE_FINGER_WAIT,     // Attempt dispatched until GenImg captured a finger
+    AUTH_STAGE_GENIMG,          // The GenImg command that captured the finger
+    AUTH_STAGE_IMG2TZ,
+    AUTH_STAGE_TOUCH_IRQ,       // Touch IRQ until Img2Tz produced the template
+    AUTH_STAGE_TOUCH_POLL,      // Same when polling found the finger: from the last GenImg that saw none
+    AUTH_STAGE_SEARCH,          // 1:N search over the occupied library
+    AUTH_STAGE_MATCH,           // 1:1 LoadChar + Match against the recent users, hit or miss
+    AUTH_STAGE_FACE_WAKE,       // Cold power-up of the F900 until NID_READY (not pre-woken)
+    AUTH_STAGE_FACE_VERIFY,     // f900_verify() call
+    AUTH_STAGE_CALLBACK,        // Success callback; the buzzer chime is only queued
+    AUTH_STAGE_TOTAL,           // First ToF reading in range until the callback returned
+    AUTH_STAGE_COUNT
+} auth_stage_t;
+
+typedef struct {
+    uint32_t count;   // Samples recorded since boot or the last reset
+    uint32_t samples; // Samples in the rolling window
+    uint32_t p50_us;
+    uint32_t p95_us;
+    uint32_t p99_us;
+    uint32_t max_us;  // Maximum within the rolling window
+} auth_trace_summary_t;
+
+/*
+ * @brief Record the duration of a stage that started at start_us (esp_timer_get_time()).
+ */
+void auth_trace_record(auth_modality_t modality, auth_stage_t stage, int64_t start_us);
+
+/*
+ * @brief Compute the rolling percentiles of one stage.
+ * @return false if the stage has no samples.
+ */
+bool auth_trace_get(auth_modality_t modality, auth_stage_t stage, auth_trace_summary_t *summary);
+
+// Total samples recorded over all stages; changes whenever new data is available
+uint32_t auth_trace_total_count(void);
+
+/*
+ * @brief Build {"window":N,"modalities":{"<modality>":{"<stage>":{...}}}} for all stages with samples.
+ * @return cJSON object owned by the caller, or NULL when out of memory.
+ */
+cJSON *auth_trace_to_json(void);
+
+void auth_trace_reset(void);
+
+#endif /* _AUTH_TRACE_H_ */
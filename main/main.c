@@ -11,7 +11,9 @@
    software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
    CONDITIONS OF ANY KIND, either express or implied.
 */
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
@@ -46,21 +48,49 @@
 #include "table_types.h"
 #include "web_handlers.h"
 #include "log_redirect.h"
+#include "auth_trace.h"
 
 static const char *TAG = "Main";
 
+// Authentication latency summaries go to MQTT at most this often, and only when new samples arrived
+#define AUTH_LATENCY_PUBLISH_INTERVAL_S 60
+
+// Secondary keys for tabledb_find_by_key(): lookups by user name
+static uint32_t fingerprint_name_key(const void *data) {
+    const table_fingerprint_t *record = data;
+    return tabledb_hash_str(record->name, sizeof(record->name));
+}
+
+static uint32_t face_name_key(const void *data) {
+    const table_face_t *record = data;
+    return tabledb_hash_str(record->name, sizeof(record->name));
+}
+
 static tabledb_config_t table_fingerprint_config = {
     .namespace = "fingerprint",
     .version = TABLE_FINGERPRINT_STRUCT_VERSION,
     .size = sizeof(table_fingerprint_t),
-    .update_cb = NULL
+    .update_cb = NULL,
+    .lazy_upgrade = true,
+    .layout = TABLEDB_LAYOUT_PAGED,
+    // Usage counters change on every grant; batch them instead of writing NVS each time
+    .cache = {.flush_interval_ms = 10 * 60 * 1000, .max_dirty = 16, .idle_flush_ms = 30 * 1000},
+    .key_cb = fingerprint_name_key
 };
 
+// Entry reader; a second reader on another UART gets its own handle the same way
+static r502_handle_t fingerprint_reader = NULL;
+
 static tabledb_config_t table_face_config = {
     .namespace = "face",
     .version = TABLE_FACE_STRUCT_VERSION,
     .size = sizeof(table_face_t),
-    .update_cb = NULL
+    .update_cb = NULL,
+    .lazy_upgrade = true,
+    .layout = TABLEDB_LAYOUT_PAGED,
+    // Usage counters change on every grant; batch them instead of writing NVS each time
+    .cache = {.flush_interval_ms = 10 * 60 * 1000, .max_dirty = 16, .idle_flush_ms = 30 * 1000},
+    .key_cb = face_name_key
 };
 
 void settings_change_callback(settings_t *new_srttings) {
@@ -78,35 +108,78 @@ void start_and_configure_webserver() {
 
     register_settings_web_handlers(server);
 
-    register_enrollment_web_handlers(server, &table_face_config, &table_fingerprint_config);
+    register_enrollment_web_handlers(server, &table_face_config, &table_fingerprint_config, fingerprint_reader);
 
     register_photo_web_handlers(server);
 
     register_log_web_handlers(server);
 
-    register_system_web_handlers(server);
+    register_system_web_handlers(server, fingerprint_reader);
 
     register_ota_web_handlers(server);
 
     register_static_web_handlers(server);
 }
 
+// Counts a granted access. Runs under the write-behind cache lock.
+static void record_fingerprint_usage(void *data, void *arg) {
+    table_fingerprint_t *record = data;
+    record->used_count++;
+    record->last_usage_time = *(uint32_t *) arg;
+}
+
+static void record_face_usage(void *data, void *arg) {
+    table_face_t *record = data;
+    record->used_count++;
+    record->last_usage_time = *(uint32_t *) arg;
+}
+
 void fingerprint_success_callback(uint32_t user_id) {
     ESP_LOGI(TAG, "Fingerprint verified for user %" PRIu32, user_id);
     buzzer_success_chime();
+
+    uint32_t now = (uint32_t) time(NULL);
+    tabledb_update_deferred_fn(&table_fingerprint_config, user_id, record_fingerprint_usage, &now);
 }
 
 void face_success_callback(uint32_t user_id) {
     ESP_LOGI(TAG, "Face verified for user %" PRIu32, user_id);
     buzzer_success_chime();
+
+    uint32_t now = (uint32_t) time(NULL);
+    tabledb_update_deferred_fn(&table_face_config, user_id, record_face_usage, &now);
 }
 
 void start_and_configure_access_control() {
-    access_control_start();
+    access_control_start(fingerprint_reader);
     access_control_set_fingerprint_success_callback(fingerprint_success_callback);
     access_control_set_face_success_callback(face_success_callback);
 }
 
+void publish_auth_latency(const char *client_id, uint32_t *published_count) {
+    uint32_t count = auth_trace_total_count();
+    if (count == *published_count || mqtt_client_get_state() != MQTT_STATE_CONNECTED) {
+        return;
+    }
+
+    cJSON *root = auth_trace_to_json();
+    if (!root) {
+        return;
+    }
+    char *json_str = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    if (!json_str) {
+        return;
+    }
+
+    char topic[MQTT_CLIENT_ID_MAX_LEN + 16];
+    snprintf(topic, sizeof(topic), "%s/auth/latency", client_id[0] ? client_id : "access_control");
+    if (mqtt_client_publish(topic, json_str, strlen(json_str), 0, true) >= 0) {
+        *published_count = count;
+    }
+    cJSON_free(json_str);
+}
+
 bool start_tof_sensor() {
     // Init VL53L0X sensor
     bool ret = vl53l0x_config(
@@ -174,8 +247,12 @@ void app_main(void) {
     f900_init((f900_config_t){.rx_pin = 34, .tx_pin = 35, .en_pin = 21, .uart_num = UART_NUM_2});
 
     /* Init R502 */
-    r502_init((r502_config_t){.rx_pin = 10, .tx_pin = 11, .en_pin = 9, .irq_pin = 8, .uart_num = UART_NUM_1, .address = 0xFFFFFFFF});
-    r502_set_enable(true);
+    r502_config_t reader_config = {.rx_pin = 10, .tx_pin = 11, .en_pin = 9, .irq_pin = 8, .uart_num = UART_NUM_1, .address = 0xFFFFFFFF};
+    ESP_ERROR_CHECK(r502_init(reader_config, &fingerprint_reader));
+    r502_set_enable(fingerprint_reader, true);
+    if (r502_negotiate_link(fingerprint_reader, R502_MAX_BAUD_RATE, 256) != ESP_OK) {
+        ESP_LOGW(TAG, "Fingerprint link running at %" PRIu32 " baud", r502_get_baud_rate(fingerprint_reader));
+    }
 
     // Buzzer initialization
     if (settings->buzzer_enabled) {
@@ -192,10 +269,13 @@ void app_main(void) {
 
     // Verify password
     r502_generic_reply sensor_reply;
-    ret = r502_vfypwd(0x00000000, &sensor_reply);
+    ret = r502_vfypwd(fingerprint_reader, 0x00000000, &sensor_reply);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Fingerprint sensor password verification failed");
         // TODO: Fatal error
+    } else if (r502_load_index(fingerprint_reader) != ESP_OK) {
+        // Loaded again on first use
+        ESP_LOGW(TAG, "Failed to read fingerprint template index");
     }
 
     // Configure mqtt if enabled
@@ -211,6 +291,7 @@ void app_main(void) {
             .buffer_size = 1024, // 1KB buffer
             .message_retry_count = 3 // Retry up to 3 times for QoS>0 messages
         });
+        mqtt_client_connect();
     } else {
         ESP_LOGI(TAG, "MQTT is disabled");
     }
@@ -221,7 +302,14 @@ void app_main(void) {
     // Start web server
     start_and_configure_webserver();
 
+    uint32_t published_count = 0;
+    int      publish_timer   = 0;
     while (1) {
         vTaskDelay(pdMS_TO_TICKS(1000));
+
+        if (settings->mqtt_enabled && ++publish_timer >= AUTH_LATENCY_PUBLISH_INTERVAL_S) {
+            publish_timer = 0;
+            publish_auth_latency(settings->mqtt_client_id, &published_count);
+        }
     }
 }
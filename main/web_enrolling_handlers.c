@@ -1,8 +1,13 @@
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
 #include "esp_log.h"
 #include "esp_err.h"
+#include "esp_random.h"
 #include "webserver.h"
 #include "cJSON.h"
 #include "r502.h"
@@ -15,6 +20,9 @@ static const char *TAG = "ENROLL_HANDLERS";
 
 static tabledb_config_t *table_fingerprint_config;
 static tabledb_config_t *table_face_config;
+static r502_handle_t fingerprint_reader;
+// Mixed into listing ETags so tags from before a reboot never match.
+static uint32_t etag_salt;
 
 typedef enum {
     ENROLLING_TYPE_FINGERPRINT,
@@ -34,8 +42,14 @@ typedef struct {
 static enrollment_state_t current_enrollment = {0};
 
 static bool wait_for_finger_state(bool want_present, int max_retries, int delay_ms, r502_generic_reply *sensor_reply) {
-    for (int i = 0; i < max_retries; i++) {
-        esp_err_t err = r502_genimg(sensor_reply);
+    // The touch IRQ only fires on placement, so removal is always polled
+    const TickType_t wait_start = xTaskGetTickCount();
+    const TickType_t wait_ticks = pdMS_TO_TICKS(max_retries * delay_ms);
+    if (want_present) {
+        r502_clear_touch(fingerprint_reader);
+    }
+    while (xTaskGetTickCount() - wait_start < wait_ticks) {
+        esp_err_t err = r502_genimg(fingerprint_reader, sensor_reply);
         if (err == ESP_OK) {
             if (want_present && sensor_reply->conf_code == 0x00) {
                 return true; // finger detected
@@ -50,7 +64,11 @@ static bool wait_for_finger_state(bool want_present, int max_retries, int delay_
         } else {
             ESP_LOGW(TAG, "GenImg failed while waiting for %s: %s", want_present ? "finger" : "removal", esp_err_to_name(err));
         }
-        vTaskDelay(pdMS_TO_TICKS(delay_ms));
+        if (want_present) {
+            r502_wait_touch(fingerprint_reader, delay_ms);
+        } else {
+            vTaskDelay(pdMS_TO_TICKS(delay_ms));
+        }
     }
     return false;
 }
@@ -97,6 +115,8 @@ static void enroll_face_task(void *arg) {
     };
     strncpy((char*)enroll_data.user_name, enroll->user_name, F900_USER_NAME_SIZE-1);
 
+    f900_power_acquire(F900_READY_TIMEOUT_MS);
+
     const f900_face_dir_t directions[] = {
         FACE_DIRECTION_MIDDLE,
         FACE_DIRECTION_UP,
@@ -143,6 +163,7 @@ error:
         buzzer_error_honk();
         ESP_LOGE(TAG, "Face enrollment failed: %d", err);
     }
+    f900_power_release();
 
     // Cleanup
     memset(enroll, 0, sizeof(enrollment_state_t));
@@ -154,14 +175,17 @@ static void enroll_fingerprint_task(void *arg) {
     esp_err_t err;
     r502_generic_reply sensor_reply;
 
-    // Get next available template index for ID
-    r502_templatenum_reply templatenum_reply;
-    err = r502_templatenum(&templatenum_reply);
+    // Both scans live in the char buffers until RegModel and Store; keep the access control
+    // pipeline from capturing or loading templates in between
+    r502_lock(fingerprint_reader);
+
+    // Get the first free template slot; the template count collides once a middle slot is deleted
+    uint16_t next_index;
+    err = r502_alloc_slot(fingerprint_reader, &next_index);
     if (err != ESP_OK) {
-        ESP_LOGE(TAG, "TemplateNum command failed");
+        ESP_LOGE(TAG, "No free template slot");
         goto error;
     }
-    uint16_t next_index = templatenum_reply.index;
 
     // Scan loop for two fingerprints
     // Step 1
@@ -169,7 +193,7 @@ static void enroll_fingerprint_task(void *arg) {
     ESP_LOGI(TAG, "Place finger for first scan");
 
     // Start enrollment - breathing (1) blue
-    r502_auraledconfig(1, 100, 2, 0, &sensor_reply);
+    r502_auraledconfig(fingerprint_reader, 1, 100, 2, 0, &sensor_reply);
     buzzer_short_beep();
 
     // Ensure finger present
@@ -180,7 +204,7 @@ static void enroll_fingerprint_task(void *arg) {
     }
 
     // Convert to template with buffer ID
-    err = r502_img2tz(1, &sensor_reply);
+    err = r502_img2tz(fingerprint_reader, 1, &sensor_reply);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Img2Tz failed for scan 1");
         goto error;
@@ -190,7 +214,7 @@ static void enroll_fingerprint_task(void *arg) {
     enroll->step = 1;
     // Require finger removal before next step (or finish)
     ESP_LOGI(TAG, "Remove finger after scan");
-    r502_auraledconfig(4, 0, 0, 0, &sensor_reply); // off light
+    r502_auraledconfig(fingerprint_reader, 4, 0, 0, 0, &sensor_reply); // off light
     buzzer_short_beep();
 
     if (!wait_for_finger_state(false, 20, 200, &sensor_reply)) {
@@ -200,7 +224,7 @@ static void enroll_fingerprint_task(void *arg) {
     }
 
     ESP_LOGI(TAG, "Place finger for second scan");
-    r502_auraledconfig(1, 100, 3, 0, &sensor_reply); // purple light
+    r502_auraledconfig(fingerprint_reader, 1, 100, 3, 0, &sensor_reply); // purple light
     // Ensure finger removed before starting
     if (!wait_for_finger_state(true, 20, 200, &sensor_reply)) {
         ESP_LOGE(TAG, "Finger detection timeout");
@@ -209,7 +233,7 @@ static void enroll_fingerprint_task(void *arg) {
     }
 
     // Convert to template with buffer ID
-    err = r502_img2tz(2, &sensor_reply);
+    err = r502_img2tz(fingerprint_reader, 2, &sensor_reply);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "Img2Tz failed for scan 2");
         goto error;
@@ -218,14 +242,14 @@ static void enroll_fingerprint_task(void *arg) {
 
     // Save to sensor and database
     // Create template model
-    err = r502_regmodel(&sensor_reply);
+    err = r502_regmodel(fingerprint_reader, &sensor_reply);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "RegModel failed");
         goto error;
     }
 
     // Store template
-    err = r502_store(1, next_index, &sensor_reply);
+    err = r502_store(fingerprint_reader, 1, next_index, &sensor_reply);
     if (err  != ESP_OK) {
         ESP_LOGE(TAG, "Store failed");
         goto error;
@@ -249,11 +273,12 @@ static void enroll_fingerprint_task(void *arg) {
     buzzer_success_chime();
 
 error:
+    r502_unlock(fingerprint_reader);
     if (err != ESP_OK) {
         TickType_t error_tick_start = xTaskGetTickCount();
 
         // On error - red (1) breathing light
-        r502_auraledconfig(1, 100, 1, 0, &sensor_reply);
+        r502_auraledconfig(fingerprint_reader, 1, 100, 1, 0, &sensor_reply);
 
         // Play error sound first
         buzzer_error_honk();
@@ -268,11 +293,34 @@ error:
     }
 
     // Cleanup - turn off LED
-    r502_auraledconfig(4, 0, 0, 0, &sensor_reply);
+    r502_auraledconfig(fingerprint_reader, 4, 0, 0, 0, &sensor_reply);
     memset(enroll, 0, sizeof(enrollment_state_t));
     vTaskDelete(NULL);
 }
 
+// True if a record of the table already carries this name. Uses the name index, so
+// only the records whose name hash matches are read.
+static bool enrollment_name_taken(tabledb_config_t *config, const char *name) {
+    union {
+        table_fingerprint_t fingerprint;
+        table_face_t face;
+    } record;
+    const char *stored = config == table_face_config ? record.face.name : record.fingerprint.name;
+    uint32_t ids[4];
+    size_t count = 0;
+
+    if (tabledb_find_by_key(config, tabledb_hash_str(name, sizeof(record.face.name)), ids, 4, &count) != ESP_OK) {
+        return false;
+    }
+    for (size_t i = 0; i < count && i < 4; i++) {
+        if (tabledb_get(config, ids[i], &record) == ESP_OK &&
+            strncmp(stored, name, sizeof(record.face.name)) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 static esp_err_t start_enrollment_handler(httpd_req_t *req) {
     char content[256];
     int received = httpd_req_recv(req, content, sizeof(content));
@@ -302,6 +350,19 @@ static esp_err_t start_enrollment_handler(httpd_req_t *req) {
         return ESP_FAIL;
     }
 
+    // Only look the name up once the enrollment can start.
+    char user_name[sizeof(current_enrollment.user_name)] = {0};
+    if (cJSON_IsString(name)) {
+        strncpy(user_name, name->valuestring, sizeof(user_name) - 1);
+    }
+    tabledb_config_t *table = cJSON_IsString(type) && strcmp(type->valuestring, "face") == 0
+                                  ? table_face_config : table_fingerprint_config;
+    if (enrollment_name_taken(table, user_name)) {
+        cJSON_Delete(root);
+        send_error_response(req, HTTPD_400_BAD_REQUEST, "duplicate_name", "A user with this name is already enrolled");
+        return ESP_FAIL;
+    }
+
     memset(&current_enrollment, 0, sizeof(enrollment_state_t));
     current_enrollment.active = true;
 
@@ -530,7 +591,7 @@ static esp_err_t delete_enrollment_handler(httpd_req_t *req) {
         if (etype == ENROLLING_TYPE_FINGERPRINT) {
             esp_err_t table_del_result = tabledb_delete(table_fingerprint_config, id);
             r502_generic_reply sensor_reply;
-            esp_err_t sensor_del_result = r502_deletechar(id, 1, &sensor_reply);
+            esp_err_t sensor_del_result = r502_deletechar(fingerprint_reader, id, 1, &sensor_reply);
             bool sensor_ok = (sensor_del_result == ESP_OK && sensor_reply.conf_code == 0);
             bool table_ok = (table_del_result == ESP_OK);
             if (sensor_ok && table_ok) {
@@ -543,7 +604,9 @@ static esp_err_t delete_enrollment_handler(httpd_req_t *req) {
             }
         } else { // ENROLLING_TYPE_FACE
             esp_err_t table_del_result = tabledb_delete(table_face_config, id);
+            f900_power_acquire(F900_READY_TIMEOUT_MS);
             bool sensor_del_result = f900_delete_user(id);
+            f900_power_release();
             if (sensor_del_result && table_del_result == ESP_OK) {
                 cJSON_AddBoolToObject(response, "ok", true);
                 cJSON_AddStringToObject(response, "message", "Deleted face record");
@@ -559,7 +622,7 @@ static esp_err_t delete_enrollment_handler(httpd_req_t *req) {
             etype == ENROLLING_TYPE_FINGERPRINT ? "fingerprint" : "face");
         if (etype == ENROLLING_TYPE_FINGERPRINT) {
             r502_generic_reply sensor_reply;
-            esp_err_t sensor_result = r502_empty(&sensor_reply);
+            esp_err_t sensor_result = r502_empty(fingerprint_reader, &sensor_reply);
             esp_err_t table_result = tabledb_drop(table_fingerprint_config);
             bool sensor_ok = (sensor_result == ESP_OK && sensor_reply.conf_code == 0);
             bool table_ok = (table_result == ESP_OK);
@@ -572,7 +635,9 @@ static esp_err_t delete_enrollment_handler(httpd_req_t *req) {
                 return ESP_FAIL;
             }
         } else { // ENROLLING_TYPE_FACE
+            f900_power_acquire(F900_READY_TIMEOUT_MS);
             bool sensor_result = f900_delete_all_users();
+            f900_power_release();
             esp_err_t table_result = tabledb_drop(table_face_config);
             if (sensor_result && table_result == ESP_OK) {
                 cJSON_AddBoolToObject(response, "ok", true);
@@ -594,96 +659,505 @@ static esp_err_t delete_enrollment_handler(httpd_req_t *req) {
 }
 
 // Handler for GET /api/enrollments/{fingerprint|face}
+// Filter and output state of one GET /api/enrollments/{type} page.
+typedef struct {
+    bool        is_face;
+    int         enabled;         // -1 = any, otherwise 0 or 1
+    char        name_prefix[32];
+    httpd_req_t *req;
+    bool        first_item;
+} enrollment_list_ctx_t;
+
+static void enrollment_fields(const enrollment_list_ctx_t *ctx, const void *data, const char **name, bool *enabled, uint16_t *used_count) {
+    if (ctx->is_face) {
+        const table_face_t *record = data;
+        *name = record->name;
+        *enabled = record->enabled;
+        *used_count = record->used_count;
+    } else {
+        const table_fingerprint_t *record = data;
+        *name = record->name;
+        *enabled = record->enabled;
+        *used_count = record->used_count;
+    }
+}
+
+static bool enrollment_matches(uint32_t id, const void *data, void *arg) {
+    const enrollment_list_ctx_t *ctx = arg;
+    const char *name;
+    bool enabled;
+    uint16_t used_count;
+    enrollment_fields(ctx, data, &name, &enabled, &used_count);
+
+    if (ctx->enabled >= 0 && enabled != (ctx->enabled == 1)) {
+        return false;
+    }
+    return strncasecmp(name, ctx->name_prefix, strlen(ctx->name_prefix)) == 0;
+}
+
+static esp_err_t send_enrollment_item(uint32_t id, const void *data, void *arg) {
+    enrollment_list_ctx_t *ctx = arg;
+    const char *name;
+    bool enabled;
+    uint16_t used_count;
+    enrollment_fields(ctx, data, &name, &enabled, &used_count);
+
+    cJSON *item = cJSON_CreateObject();
+    cJSON_AddNumberToObject(item, "id", id);
+    cJSON_AddStringToObject(item, "name", name);
+    cJSON_AddBoolToObject(item, "enabled", enabled);
+    cJSON_AddNumberToObject(item, "usage_count", used_count);
+    char *item_str = cJSON_PrintUnformatted(item);
+    cJSON_Delete(item);
+    if (!item_str) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    esp_err_t err = httpd_resp_sendstr_chunk(ctx->req, ctx->first_item ? "{\"items\":[" : ",");
+    if (err == ESP_OK) {
+        err = httpd_resp_sendstr_chunk(ctx->req, item_str);
+    }
+    ctx->first_item = false;
+    cJSON_free(item_str);
+    return err;
+}
+
+// Decode %XX escapes and '+' in place, query values arrive URL-encoded.
+static void url_decode(char *value) {
+    char *out = value;
+    for (char *in = value; *in; in++, out++) {
+        if (*in == '%' && isxdigit((unsigned char)in[1]) && isxdigit((unsigned char)in[2])) {
+            char hex[3] = {in[1], in[2], '\0'};
+            *out = (char)strtol(hex, NULL, 16);
+            in += 2;
+        } else {
+            *out = (*in == '+') ? ' ' : *in;
+        }
+    }
+    *out = '\0';
+}
+
+// Absent keys are fine; a value too long for the buffer is an error, not an absent key.
+static bool parse_query_uint(const char *query, const char *key, uint32_t *out, bool *present) {
+    char value[16] = {0};
+    esp_err_t err = httpd_query_key_value(query, key, value, sizeof(value));
+    *present = err == ESP_OK;
+    if (err == ESP_ERR_NOT_FOUND) {
+        return true;
+    }
+    if (err != ESP_OK) {
+        return false;
+    }
+    char *endptr = NULL;
+    unsigned long parsed = strtoul(value, &endptr, 10);
+    if (value[0] == '\0' || !endptr || *endptr != '\0' || parsed > UINT32_MAX) {
+        return false;
+    }
+    *out = (uint32_t)parsed;
+    return true;
+}
+
+// Handler for GET /api/enrollments/{type}?limit=&after=&enabled=&name_prefix=
+// Responds {"items": [...], "next": <token for "after", or null on the last page>}.
 static esp_err_t list_enrollments_handler(httpd_req_t *req) {
     char type[16] = {0};
-    if (sscanf(req->uri, "/api/enrollments/%15s", type) != 1) {
+    if (sscanf(req->uri, "/api/enrollments/%15[^/?]", type) != 1) {
          send_error_response(req, HTTPD_400_BAD_REQUEST, "invalid_uri", "Invalid URI format");
          return ESP_FAIL;
     }
-    // Remove any trailing slash if present
-    char *slash = strchr(type, '/');
-    if (slash) *slash = '\0';
 
     tabledb_config_t *config = NULL;
+    enrollment_list_ctx_t ctx = {.enabled = -1, .req = req, .first_item = true};
     if (strcmp(type, "fingerprint") == 0) {
         config = table_fingerprint_config;
     } else if (strcmp(type, "face") == 0) {
         config = table_face_config;
+        ctx.is_face = true;
     } else {
          send_error_response(req, HTTPD_400_BAD_REQUEST, "invalid_type", "Invalid enrollment type specified");
          return ESP_FAIL;
     }
 
-    httpd_resp_set_type(req, "application/json");
-    httpd_resp_sendstr_chunk(req, "{ \"items\": [");
-
-    uint32_t last_id = 0;
-    uint32_t record_id = 0;
-    bool first_item = true;
-    bool first_pass = true;
-    while (true) {
-        esp_err_t err;
-        if (strcmp(type, "fingerprint") == 0) {
-            table_fingerprint_t record;
-            err = tabledb_get_next(config, first_pass ? 0 : last_id, &record_id, &record);
-            if (err != ESP_OK) {
-                break;
+    // The listing only changes with the table generation, let the browser revalidate cheaply.
+    char etag[24];
+    snprintf(etag, sizeof(etag), "\"%08" PRIx32 "-%" PRIu32 "\"", etag_salt, tabledb_get_generation(config));
+    httpd_resp_set_hdr(req, "ETag", etag);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    char if_none_match[24] = {0};
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match)) == ESP_OK &&
+        strcmp(if_none_match, etag) == 0) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        httpd_resp_send(req, NULL, 0);
+        return ESP_OK;
+    }
+
+    tabledb_scan_t scan = {.predicate = enrollment_matches, .predicate_arg = &ctx};
+    size_t query_len = httpd_req_get_url_query_len(req) + 1;
+    if (query_len > 1) {
+        if (query_len > 160) {
+            send_error_response(req, HTTPD_400_BAD_REQUEST, "invalid_query", "Query too long");
+            return ESP_FAIL;
+        }
+        char query[160] = {0};
+        if (httpd_req_get_url_query_str(req, query, query_len) == ESP_OK) {
+            uint32_t limit = 0;
+            uint32_t enabled = 0;
+            bool has_limit, has_enabled;
+            if (!parse_query_uint(query, "limit", &limit, &has_limit) ||
+                !parse_query_uint(query, "after", &scan.resume_token, &scan.resume) ||
+                !parse_query_uint(query, "enabled", &enabled, &has_enabled) || enabled > 1) {
+                send_error_response(req, HTTPD_400_BAD_REQUEST, "invalid_query", "Invalid query parameter");
+                return ESP_FAIL;
             }
-            last_id = record_id;
-            cJSON *item = cJSON_CreateObject();
-            cJSON_AddNumberToObject(item, "id", record_id);
-            cJSON_AddStringToObject(item, "name", record.name);
-            cJSON_AddBoolToObject(item, "enabled", record.enabled);
-            cJSON_AddNumberToObject(item, "usage_count", record.used_count);
-            char *item_str = cJSON_PrintUnformatted(item);
-            if (!first_item) {
-                httpd_resp_sendstr_chunk(req, ",");
+            scan.limit = limit;
+            if (has_enabled) {
+                ctx.enabled = (int)enabled;
             }
-            httpd_resp_sendstr_chunk(req, item_str);
-            first_item = false;
-            cJSON_free(item_str);
-            cJSON_Delete(item);
-        } else {
-            table_face_t record;
-            err = tabledb_get_next(config, first_pass ? 0 : last_id, &record_id, &record);
-            if (err != ESP_OK) {
-                break;
+            esp_err_t err = httpd_query_key_value(query, "name_prefix", ctx.name_prefix, sizeof(ctx.name_prefix));
+            if (err == ESP_OK) {
+                url_decode(ctx.name_prefix);
+            } else if (err != ESP_ERR_NOT_FOUND) {
+                // A truncated prefix would silently widen the filter
+                send_error_response(req, HTTPD_400_BAD_REQUEST, "invalid_query", "Invalid name_prefix");
+                return ESP_FAIL;
             }
-            last_id = record_id;
-            cJSON *item = cJSON_CreateObject();
-            cJSON_AddNumberToObject(item, "id", record_id);
-            cJSON_AddStringToObject(item, "name", record.name);
-            cJSON_AddBoolToObject(item, "enabled", record.enabled);
-            cJSON_AddNumberToObject(item, "usage_count", record.used_count);
-            char *item_str = cJSON_PrintUnformatted(item);
-            if (!first_item) {
-                httpd_resp_sendstr_chunk(req, ",");
+        }
+    }
+
+    // The scan walks a snapshot of the IDs, so concurrent enrollments or deletions can not break the listing.
+    httpd_resp_set_type(req, "application/json");
+    // "after" is a position, not an ID: deleting the last item of a page does not break the next one.
+    esp_err_t err = tabledb_scan(config, &scan, send_enrollment_item, &ctx);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to list %s enrollments: %s", type, esp_err_to_name(err));
+    }
+    if (ctx.first_item) {
+        httpd_resp_sendstr_chunk(req, "{\"items\":[");
+    }
+
+    char tail[32] = "],\"next\":null}";
+    if (scan.more) {
+        snprintf(tail, sizeof(tail), "],\"next\":%" PRIu32 "}", scan.resume_token);
+    }
+    httpd_resp_sendstr_chunk(req, tail);
+    httpd_resp_sendstr_chunk(req, NULL); // finalize chunked response
+    return ESP_OK;
+}
+
+// Fingerprint templates are moved in CharBuffer 2. Each LoadChar+UpChar and DownChar+Store pair
+// runs under r502_lock, since the access control pipeline loads templates into the same buffer.
+#define BACKUP_CHAR_BUFFER 2
+#define BACKUP_LINE_MAX (R502_TEMPLATE_SIZE * 2 + 256)
+
+typedef struct {
+    uint8_t data[R502_TEMPLATE_SIZE];
+    size_t  len;
+} template_buffer_t;
+
+static esp_err_t collect_template(const uint8_t *data, size_t len, void *ctx) {
+    template_buffer_t *buffer = ctx;
+    if (buffer->len + len > sizeof(buffer->data)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    return ESP_OK;
+}
+
+typedef struct {
+    httpd_req_t       *req;
+    template_buffer_t  template;
+    char              *hex;      // R502_TEMPLATE_SIZE * 2 + 1
+    uint32_t           exported;
+    uint32_t           failed;
+} backup_ctx_t;
+
+static esp_err_t send_backup_item(uint32_t id, const void *data, void *arg) {
+    backup_ctx_t *ctx = arg;
+    const table_fingerprint_t *record = data;
+
+    // A record whose template can not be read is reported in the trailer, not as a torn line
+    r502_generic_reply reply;
+    ctx->template.len = 0;
+    r502_lock(fingerprint_reader);
+    esp_err_t err = r502_loadchar(fingerprint_reader, BACKUP_CHAR_BUFFER, id, &reply);
+    if (err == ESP_OK && reply.conf_code == 0x00) {
+        err = r502_upchar(fingerprint_reader, BACKUP_CHAR_BUFFER, collect_template, &ctx->template, &reply);
+    }
+    r502_unlock(fingerprint_reader);
+    if (err != ESP_OK || reply.conf_code != 0x00 || ctx->template.len != R502_TEMPLATE_SIZE) {
+        ESP_LOGW(TAG, "Backup of fingerprint %" PRIu32 " failed: %s, code 0x%02X, %u bytes", id,
+                 esp_err_to_name(err), reply.conf_code, (unsigned)ctx->template.len);
+        ctx->failed++;
+        return ESP_OK;
+    }
+
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < R502_TEMPLATE_SIZE; i++) {
+        ctx->hex[i * 2] = digits[ctx->template.data[i] >> 4];
+        ctx->hex[i * 2 + 1] = digits[ctx->template.data[i] & 0x0F];
+    }
+    ctx->hex[R502_TEMPLATE_SIZE * 2] = '\0';
+
+    cJSON *item = cJSON_CreateObject();
+    cJSON_AddNumberToObject(item, "id", id);
+    cJSON_AddStringToObject(item, "name", record->name);
+    cJSON_AddBoolToObject(item, "enabled", record->enabled);
+    cJSON_AddNumberToObject(item, "used_count", record->used_count);
+    cJSON_AddNumberToObject(item, "last_usage_time", record->last_usage_time);
+    cJSON_AddStringToObject(item, "template", ctx->hex);
+    char *item_str = cJSON_PrintUnformatted(item);
+    cJSON_Delete(item);
+    if (!item_str) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    err = httpd_resp_sendstr_chunk(ctx->req, item_str);
+    if (err == ESP_OK) {
+        err = httpd_resp_sendstr_chunk(ctx->req, "\n");
+    }
+    cJSON_free(item_str);
+    ctx->exported++;
+    return err;
+}
+
+// Handler for GET /api/enrollment/backup
+// Streams the fingerprint table together with the sensor templates as NDJSON: a header line, one
+// line per record and a trailer with the counts. Only one template is held in RAM at a time.
+static esp_err_t backup_fingerprints_handler(httpd_req_t *req) {
+    if (current_enrollment.active) {
+        send_error_response(req, HTTPD_400_BAD_REQUEST, "enrollment_active", "An enrollment is in progress");
+        return ESP_FAIL;
+    }
+
+    backup_ctx_t *ctx = calloc(1, sizeof(backup_ctx_t));
+    char *hex = malloc(R502_TEMPLATE_SIZE * 2 + 1);
+    if (!ctx || !hex) {
+        free(ctx);
+        free(hex);
+        send_error_response(req, HTTPD_500_INTERNAL_SERVER_ERROR, "no_memory", "Out of memory");
+        return ESP_FAIL;
+    }
+    ctx->req = req;
+    ctx->hex = hex;
+
+    httpd_resp_set_type(req, "application/x-ndjson");
+    httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=\"fingerprints.ndjson\"");
+    char header[96];
+    snprintf(header, sizeof(header), "{\"format\":\"r502-templates\",\"version\":1,\"template_size\":%d}\n",
+             R502_TEMPLATE_SIZE);
+    esp_err_t err = httpd_resp_sendstr_chunk(req, header);
+
+    if (err == ESP_OK) {
+        tabledb_scan_t scan = {0};
+        err = tabledb_scan(table_fingerprint_config, &scan, send_backup_item, ctx);
+    }
+    if (err == ESP_OK) {
+        char trailer[64];
+        snprintf(trailer, sizeof(trailer), "{\"exported\":%" PRIu32 ",\"failed\":%" PRIu32 "}\n",
+                 ctx->exported, ctx->failed);
+        err = httpd_resp_sendstr_chunk(req, trailer);
+    } else {
+        ESP_LOGE(TAG, "Fingerprint backup aborted: %s", esp_err_to_name(err));
+    }
+    httpd_resp_sendstr_chunk(req, NULL);
+
+    ESP_LOGI(TAG, "Fingerprint backup: %" PRIu32 " exported, %" PRIu32 " failed", ctx->exported, ctx->failed);
+    free(hex);
+    free(ctx);
+    return err;
+}
+
+static bool hex_decode(const char *hex, uint8_t *out, size_t len) {
+    if (strlen(hex) != len * 2) {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!isxdigit((unsigned char)hex[i * 2]) || !isxdigit((unsigned char)hex[i * 2 + 1])) {
+            return false;
+        }
+        char byte[3] = {hex[i * 2], hex[i * 2 + 1], '\0'};
+        out[i] = (uint8_t)strtol(byte, NULL, 16);
+    }
+    return true;
+}
+
+// Restore one backup line. Header and trailer lines carry no id and are skipped.
+static esp_err_t restore_line(const char *line, uint8_t *template, bool *skipped) {
+    *skipped = false;
+    cJSON *root = cJSON_Parse(line);
+    if (!root) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    esp_err_t err = ESP_OK;
+    cJSON *id = cJSON_GetObjectItem(root, "id");
+    cJSON *name = cJSON_GetObjectItem(root, "name");
+    cJSON *hex = cJSON_GetObjectItem(root, "template");
+    if (!id) {
+        *skipped = true;
+    } else if (!cJSON_IsNumber(id) || id->valuedouble < 0 || id->valuedouble >= R502_MAX_TEMPLATES ||
+               !cJSON_IsString(name) || !cJSON_IsString(hex) ||
+               !hex_decode(hex->valuestring, template, R502_TEMPLATE_SIZE)) {
+        err = ESP_ERR_INVALID_ARG;
+    } else {
+        uint16_t index = (uint16_t)id->valuedouble;
+        r502_generic_reply reply;
+        r502_lock(fingerprint_reader);
+        err = r502_downchar(fingerprint_reader, BACKUP_CHAR_BUFFER, template, R502_TEMPLATE_SIZE, &reply);
+        if (err == ESP_OK && reply.conf_code == 0x00) {
+            err = r502_store(fingerprint_reader, BACKUP_CHAR_BUFFER, index, &reply);
+        }
+        r502_unlock(fingerprint_reader);
+        if (err == ESP_OK && reply.conf_code != 0x00) {
+            ESP_LOGW(TAG, "Restore of fingerprint %u refused by sensor, code 0x%02X", index, reply.conf_code);
+            err = ESP_FAIL;
+        }
+
+        if (err == ESP_OK) {
+            table_fingerprint_t record = {0};
+            strncpy(record.name, name->valuestring, sizeof(record.name) - 1);
+            cJSON *enabled = cJSON_GetObjectItem(root, "enabled");
+            record.enabled = !cJSON_IsBool(enabled) || cJSON_IsTrue(enabled);
+            cJSON *used_count = cJSON_GetObjectItem(root, "used_count");
+            cJSON *last_usage_time = cJSON_GetObjectItem(root, "last_usage_time");
+            record.used_count = cJSON_IsNumber(used_count) ? (uint16_t)used_count->valuedouble : 0;
+            record.last_usage_time = cJSON_IsNumber(last_usage_time) ? (uint32_t)last_usage_time->valuedouble : 0;
+
+            table_fingerprint_t existing;
+            if (tabledb_get(table_fingerprint_config, index, &existing) == ESP_OK) {
+                err = tabledb_update(table_fingerprint_config, index, &record);
+            } else {
+                err = tabledb_insert(table_fingerprint_config, index, &record);
             }
-            httpd_resp_sendstr_chunk(req, item_str);
-            first_item = false;
-            cJSON_free(item_str);
-            cJSON_Delete(item);
         }
-        first_pass = false;
-        // If the first record has id 0, tabledb_get_next cannot advance; avoid infinite loop.
-        if (last_id == 0) {
-            break;
+    }
+    cJSON_Delete(root);
+    return err;
+}
+
+// Handler for POST /api/enrollment/backup
+// Accepts the NDJSON produced by GET and writes every template back to its original slot,
+// overwriting what is stored there. The body is consumed line by line.
+static esp_err_t restore_fingerprints_handler(httpd_req_t *req) {
+    if (current_enrollment.active) {
+        send_error_response(req, HTTPD_400_BAD_REQUEST, "enrollment_active", "An enrollment is in progress");
+        return ESP_FAIL;
+    }
+
+    char *line = malloc(BACKUP_LINE_MAX);
+    uint8_t *template = malloc(R502_TEMPLATE_SIZE);
+    if (!line || !template) {
+        free(line);
+        free(template);
+        send_error_response(req, HTTPD_500_INTERNAL_SERVER_ERROR, "no_memory", "Out of memory");
+        return ESP_FAIL;
+    }
+
+    uint32_t restored = 0;
+    uint32_t failed = 0;
+    size_t line_len = 0;
+    bool overlong = false;
+    char buf[512];
+    int received;
+    do {
+        received = httpd_req_recv(req, buf, sizeof(buf));
+        if (received == HTTPD_SOCK_ERR_TIMEOUT) {
+            continue;
+        }
+        // A final line without newline is terminated by the end of the body
+        int count = received > 0 ? received : 1;
+        for (int i = 0; i < count; i++) {
+            char c = received > 0 ? buf[i] : '\n';
+            if (c != '\n') {
+                if (line_len < BACKUP_LINE_MAX - 1) {
+                    line[line_len++] = c;
+                } else {
+                    overlong = true;
+                }
+                continue;
+            }
+            line[line_len] = '\0';
+            if (overlong) {
+                failed++;
+            } else if (line_len > 0) {
+                bool skipped;
+                esp_err_t err = restore_line(line, template, &skipped);
+                if (err == ESP_OK && !skipped) {
+                    restored++;
+                } else if (err != ESP_OK) {
+                    failed++;
+                }
+            }
+            line_len = 0;
+            overlong = false;
         }
+    } while (received > 0 || received == HTTPD_SOCK_ERR_TIMEOUT);
+
+    free(line);
+    free(template);
+    ESP_LOGI(TAG, "Fingerprint restore: %" PRIu32 " restored, %" PRIu32 " failed", restored, failed);
+
+    if (received < 0) {
+        send_error_response(req, HTTPD_500_INTERNAL_SERVER_ERROR, "receive_failed", "Failed to receive backup");
+        return ESP_FAIL;
     }
 
-    httpd_resp_sendstr_chunk(req, "]}");
-    httpd_resp_sendstr_chunk(req, NULL); // finalize chunked response
+    cJSON *response = cJSON_CreateObject();
+    cJSON_AddBoolToObject(response, "ok", failed == 0);
+    cJSON_AddNumberToObject(response, "restored", restored);
+    cJSON_AddNumberToObject(response, "failed", failed);
+    char *json_str = cJSON_PrintUnformatted(response);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, json_str);
+    cJSON_free(json_str);
+    cJSON_Delete(response);
+    return ESP_OK;
+}
+
+static void add_upgrade_progress(cJSON *parent, const char *name, tabledb_config_t *config) {
+    tabledb_upgrade_progress_t progress;
+    if (tabledb_get_upgrade_progress(config, &progress) != ESP_OK) {
+        return;
+    }
+    cJSON *item = cJSON_CreateObject();
+    cJSON_AddBoolToObject(item, "running", progress.running);
+    cJSON_AddNumberToObject(item, "total", progress.total);
+    cJSON_AddNumberToObject(item, "checked", progress.checked);
+    cJSON_AddNumberToObject(item, "upgraded", progress.upgraded);
+    cJSON_AddStringToObject(item, "result", esp_err_to_name(progress.result));
+    cJSON_AddItemToObject(parent, name, item);
+}
+
+// Handler for GET /api/enrollment/upgrade - background record upgrade progress per table
+static esp_err_t get_upgrade_progress_handler(httpd_req_t *req) {
+    cJSON *response = cJSON_CreateObject();
+    add_upgrade_progress(response, "fingerprint", table_fingerprint_config);
+    add_upgrade_progress(response, "face", table_face_config);
+
+    char *json_str = cJSON_PrintUnformatted(response);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_send(req, json_str, strlen(json_str));
+
+    cJSON_free(json_str);
+    cJSON_Delete(response);
     return ESP_OK;
 }
 
-void register_enrollment_web_handlers(httpd_handle_t server, tabledb_config_t *face_config, tabledb_config_t *fingerprint_config) {
+void register_enrollment_web_handlers(httpd_handle_t server, tabledb_config_t *face_config, tabledb_config_t *fingerprint_config,
+                                      r502_handle_t reader) {
     table_fingerprint_config = fingerprint_config;
     table_face_config = face_config;
+    fingerprint_reader = reader;
+    etag_salt = esp_random();
 
     const webserver_uri_t enrollment_handlers[] = {
         {.uri = "/api/enrollment",    .method = HTTP_POST,   .handler = start_enrollment_handler,             .require_auth = true},
         {.uri = "/api/enrollment",    .method = HTTP_GET,    .handler = get_enrollment_status_handler,          .require_auth = true},
         {.uri = "/api/enrollment",    .method = HTTP_DELETE, .handler = cancel_enrollment_handler,              .require_auth = true},
+        {.uri = "/api/enrollment/upgrade", .method = HTTP_GET, .handler = get_upgrade_progress_handler,     .require_auth = true},
+        {.uri = "/api/enrollment/backup", .method = HTTP_GET,  .handler = backup_fingerprints_handler,      .require_auth = true},
+        {.uri = "/api/enrollment/backup", .method = HTTP_POST, .handler = restore_fingerprints_handler,     .require_auth = true},
         {.uri = "/api/enrollments/*", .method = HTTP_POST,   .handler = update_enrollment_enabled_handler,      .require_auth = true},
         {.uri = "/api/enrollments/*", .method = HTTP_DELETE, .handler = delete_enrollment_handler,      .require_auth = true},
         {.uri = "/api/enrollments/*", .method = HTTP_GET,    .handler = list_enrollments_handler,               .require_auth = true}
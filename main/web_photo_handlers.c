@@ -1,7 +1,7 @@
 #include "webserver.h"
 #include "f900.h"
 
-static esp_err_t get_photo(httpd_req_t *req) {
+static esp_err_t send_photo(httpd_req_t *req) {
     if (!f900_capture_images(1, 1)) {
         return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to capture photo");
     }
@@ -37,6 +37,14 @@ static esp_err_t get_photo(httpd_req_t *req) {
     return ESP_OK;
 }
 
+static esp_err_t get_photo(httpd_req_t *req) {
+    // The module is only powered while someone needs it
+    f900_power_acquire(F900_READY_TIMEOUT_MS);
+    esp_err_t ret = send_photo(req);
+    f900_power_release();
+    return ret;
+}
+
 void register_photo_web_handlers(httpd_handle_t server) {
     const webserver_uri_t enrollment_handlers[] = {
         {.uri = "/api/photo", .method = HTTP_GET, .handler = get_photo, .require_auth = true},
@@ -1,9 +1,16 @@
+#include <stdlib.h>
 #include "esp_system.h"
 #include "esp_ota_ops.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "cJSON.h"
 #include "webserver.h"
+#include "nvs_stats.h"
+#include "auth_trace.h"
+#include "f900.h"
+#include "r502.h"
+
+static r502_handle_t fingerprint_reader;
 
 // Function to restart the system
 void restart_task(void *pvParameter) {
@@ -51,10 +58,211 @@ static esp_err_t get_firmware_info_handler(httpd_req_t *req) {
     return ESP_OK;
 }
 
-void register_system_web_handlers(httpd_handle_t server) {
+static cJSON *latency_to_json(const nvs_stats_latency_t *latency) {
+    cJSON *item = cJSON_CreateObject();
+    cJSON *buckets = cJSON_AddArrayToObject(item, "buckets");
+    for (size_t i = 0; i < NVS_STATS_LATENCY_BUCKETS; i++) {
+        cJSON *bucket = cJSON_CreateObject();
+        uint32_t limit = nvs_stats_bucket_limit_us(i);
+        if (limit) {
+            cJSON_AddNumberToObject(bucket, "lt_us", limit);
+        } else {
+            cJSON_AddNullToObject(bucket, "lt_us");
+        }
+        cJSON_AddNumberToObject(bucket, "count", latency->count[i]);
+        cJSON_AddItemToArray(buckets, bucket);
+    }
+    cJSON_AddNumberToObject(item, "max_us", latency->max_us);
+    cJSON_AddNumberToObject(item, "total_us", (double)latency->total_us);
+    return item;
+}
+
+// Handler for GET /api/system/nvs - flash writes and NVS latency per namespace
+static esp_err_t get_nvs_stats_handler(httpd_req_t *req) {
+    nvs_stats_namespace_t *stats = calloc(NVS_STATS_MAX_NAMESPACES, sizeof(nvs_stats_namespace_t));
+    if (!stats) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_FAIL;
+    }
+    size_t count = 0;
+    nvs_stats_get(stats, NVS_STATS_MAX_NAMESPACES, &count);
+
+    cJSON *root = cJSON_CreateObject();
+    nvs_stats_partition_t partition;
+    if (nvs_stats_get_partition(&partition) == ESP_OK) {
+        cJSON *part = cJSON_AddObjectToObject(root, "partition");
+        cJSON_AddNumberToObject(part, "used_entries", partition.used_entries);
+        cJSON_AddNumberToObject(part, "free_entries", partition.free_entries);
+        cJSON_AddNumberToObject(part, "total_entries", partition.total_entries);
+        cJSON_AddNumberToObject(part, "namespace_count", partition.namespace_count);
+    }
+
+    cJSON *namespaces = cJSON_AddArrayToObject(root, "namespaces");
+    for (size_t i = 0; i < count; i++) {
+        const nvs_stats_namespace_t *ns = &stats[i];
+        cJSON *item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item, "namespace", ns->namespace);
+        cJSON_AddNumberToObject(item, "reads", ns->reads);
+        cJSON_AddNumberToObject(item, "writes", ns->writes);
+        cJSON_AddNumberToObject(item, "bytes_written", (double)ns->bytes_written);
+        cJSON_AddNumberToObject(item, "entry_bytes", (double)ns->entry_bytes);
+        cJSON_AddNumberToObject(item, "erases", ns->erases);
+        cJSON_AddNumberToObject(item, "commits", ns->commits);
+        cJSON_AddNumberToObject(item, "errors", ns->errors);
+        cJSON_AddNumberToObject(item, "used_entries", ns->used_entries);
+        cJSON_AddItemToObject(item, "write_latency", latency_to_json(&ns->write_latency));
+        cJSON_AddItemToObject(item, "commit_latency", latency_to_json(&ns->commit_latency));
+        cJSON_AddItemToArray(namespaces, item);
+    }
+    free(stats);
+
+    char *json_str = cJSON_PrintUnformatted(root);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, json_str);
+
+    cJSON_free(json_str);
+    cJSON_Delete(root);
+    return ESP_OK;
+}
+
+// Handler for DELETE /api/system/nvs - start counting from zero
+static esp_err_t reset_nvs_stats_handler(httpd_req_t *req) {
+    nvs_stats_reset();
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, "{\"ok\":true}");
+    return ESP_OK;
+}
+
+// Handler for GET /api/system/latency - rolling per-stage authentication latency percentiles
+static esp_err_t get_latency_handler(httpd_req_t *req) {
+    cJSON *root = auth_trace_to_json();
+    if (!root) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_FAIL;
+    }
+
+    char *json_str = cJSON_PrintUnformatted(root);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, json_str);
+
+    cJSON_free(json_str);
+    cJSON_Delete(root);
+    return ESP_OK;
+}
+
+// Handler for DELETE /api/system/latency - drop all recorded samples
+static esp_err_t reset_latency_handler(httpd_req_t *req) {
+    auth_trace_reset();
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, "{\"ok\":true}");
+    return ESP_OK;
+}
+
+// Handler for GET /api/system/face-power - F900 on-time, duty cycle budget and wake latency
+static esp_err_t get_face_power_handler(httpd_req_t *req) {
+    f900_power_stats_t stats;
+    f900_get_power_stats(&stats);
+
+    cJSON *root = cJSON_CreateObject();
+    if (!root) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_FAIL;
+    }
+    cJSON_AddStringToObject(root, "state", stats.standby ? "standby" : stats.powered ? "on" : "off");
+    cJSON_AddNumberToObject(root, "sessions", stats.sessions);
+    cJSON_AddNumberToObject(root, "cold_wakes", stats.cold_wakes);
+    cJSON_AddNumberToObject(root, "warm_hits", stats.warm_hits);
+    cJSON_AddNumberToObject(root, "budget_denials", stats.budget_denials);
+    cJSON_AddNumberToObject(root, "ready_timeouts", stats.ready_timeouts);
+    cJSON_AddNumberToObject(root, "on_time_ms", (double)stats.on_time_ms);
+    cJSON_AddNumberToObject(root, "duty_credit_ms", stats.duty_credit_ms);
+    cJSON_AddNumberToObject(root, "duty_budget_ms", F900_DUTY_BUDGET_MS);
+    cJSON_AddNumberToObject(root, "duty_window_ms", F900_DUTY_WINDOW_MS);
+    cJSON *wake = cJSON_AddObjectToObject(root, "wake_ms");
+    cJSON_AddNumberToObject(wake, "last", stats.wake_last_ms);
+    cJSON_AddNumberToObject(wake, "avg", stats.wake_avg_ms);
+    cJSON_AddNumberToObject(wake, "max", stats.wake_max_ms);
+
+    char *json_str = cJSON_PrintUnformatted(root);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, json_str);
+
+    cJSON_free(json_str);
+    cJSON_Delete(root);
+    return ESP_OK;
+}
+
+static void add_command_rtt(cJSON *parent, const r502_command_rtt_t *rtt, size_t count) {
+    cJSON *commands = cJSON_AddArrayToObject(parent, "commands");
+    for (size_t i = 0; i < count; i++) {
+        cJSON *item = cJSON_CreateObject();
+        cJSON_AddNumberToObject(item, "command", rtt[i].command);
+        cJSON_AddNumberToObject(item, "count", rtt[i].count);
+        cJSON_AddNumberToObject(item, "avg_us", rtt[i].avg_us);
+        cJSON_AddNumberToObject(item, "max_us", rtt[i].max_us);
+        cJSON_AddNumberToObject(item, "last_us", rtt[i].last_us);
+        cJSON_AddItemToArray(commands, item);
+    }
+}
+
+// Handler for GET /api/system/fingerprint-link - R502 UART speed, frame counters and command round trips
+// at the current rate and, after a switch, at the previous one
+static esp_err_t get_fingerprint_link_handler(httpd_req_t *req) {
+    r502_link_stats_t stats;
+    r502_get_link_stats(fingerprint_reader, &stats);
+    r502_command_rtt_t rtt[16];
+    size_t rtt_count = r502_get_command_rtt(fingerprint_reader, rtt, sizeof(rtt) / sizeof(rtt[0]));
+    r502_command_rtt_t prev_rtt[16];
+    uint32_t prev_baud_rate;
+    size_t prev_count = r502_get_previous_command_rtt(fingerprint_reader, &prev_baud_rate, prev_rtt,
+                                                      sizeof(prev_rtt) / sizeof(prev_rtt[0]));
+
+    cJSON *root = cJSON_CreateObject();
+    if (!root) {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Out of memory");
+        return ESP_FAIL;
+    }
+    cJSON_AddNumberToObject(root, "baud_rate", stats.baud_rate);
+    cJSON_AddNumberToObject(root, "data_packet_size", stats.data_packet_size);
+    cJSON_AddNumberToObject(root, "frames", stats.frames);
+    cJSON_AddNumberToObject(root, "resyncs", stats.resyncs);
+    cJSON_AddNumberToObject(root, "discarded_bytes", stats.discarded_bytes);
+    cJSON_AddNumberToObject(root, "checksum_errors", stats.checksum_errors);
+    cJSON_AddNumberToObject(root, "length_errors", stats.length_errors);
+    cJSON_AddNumberToObject(root, "unexpected_frames", stats.unexpected_frames);
+    cJSON_AddNumberToObject(root, "late_frames", stats.late_frames);
+    cJSON_AddNumberToObject(root, "retries", stats.retries);
+    cJSON_AddNumberToObject(root, "timeouts", stats.timeouts);
+    cJSON_AddNumberToObject(root, "overflows", stats.overflows);
+    add_command_rtt(root, rtt, rtt_count);
+    if (prev_baud_rate != 0) {
+        cJSON *previous = cJSON_AddObjectToObject(root, "previous");
+        cJSON_AddNumberToObject(previous, "baud_rate", prev_baud_rate);
+        add_command_rtt(previous, prev_rtt, prev_count);
+    } else {
+        cJSON_AddNullToObject(root, "previous");
+    }
+
+    char *json_str = cJSON_PrintUnformatted(root);
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_sendstr(req, json_str);
+
+    cJSON_free(json_str);
+    cJSON_Delete(root);
+    return ESP_OK;
+}
+
+void register_system_web_handlers(httpd_handle_t server, r502_handle_t reader) {
+    fingerprint_reader = reader;
     const webserver_uri_t system_handlers[] = {
         {.uri = "/api/system/reboot", .method = HTTP_POST, .handler = reboot_handler, .require_auth = true},
         {.uri = "/api/system/firmware", .method = HTTP_GET, .handler = get_firmware_info_handler, .require_auth = true},
+        {.uri = "/api/system/nvs", .method = HTTP_GET, .handler = get_nvs_stats_handler, .require_auth = true},
+        {.uri = "/api/system/nvs", .method = HTTP_DELETE, .handler = reset_nvs_stats_handler, .require_auth = true},
+        {.uri = "/api/system/latency", .method = HTTP_GET, .handler = get_latency_handler, .require_auth = true},
+        {.uri = "/api/system/latency", .method = HTTP_DELETE, .handler = reset_latency_handler, .require_auth = true},
+        {.uri = "/api/system/face-power", .method = HTTP_GET, .handler = get_face_power_handler, .require_auth = true},
+        {.uri = "/api/system/fingerprint-link", .method = HTTP_GET, .handler = get_fingerprint_link_handler, .require_auth = true},
     };
 
     for (int i = 0; i < sizeof(system_handlers)/sizeof(system_handlers[0]); i++) {
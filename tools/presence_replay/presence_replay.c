@@ -0,0 +1,344 @@
+/*
+ * Host replay harness for the presence detection state machine (components/presence).
+ *
+ * Replays distance traces through presence_update() the way tof_task does, honouring the
+ * measurement period the state machine asks for, and reports detection latency, false and
+ * missed triggers, approach (pre-wake) lead time, ranging load and time spent in each state.
+ *
+ * Build and run from the repository root:
+ *   gcc -O2 -Wall -Icomponents/presence/include tools/presence_replay/presence_replay.c \
+ *       components/presence/presence.c -o presence_replay
+ *   ./presence_replay                     # built-in synthetic scenarios, exit 1 on regression
+ *   ./presence_replay -t 400 -d 1500 trace.csv
+ *
+ * Trace files are CSV lines "time_ms,distance_mm[,present]". present (0/1) is the ground truth
+ * of a user wanting access; without it no false/missed triggers are reported. Readings are held
+ * until the next line, so traces may be recorded at any rate. Lines starting with '#' are ignored.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "presence.h"
+
+// VL53L0X reading when nothing is in range
+#define OUT_OF_RANGE_MM 8190
+
+typedef struct {
+    uint32_t time_ms;
+    uint16_t distance_mm;
+    bool     present;
+} trace_point_t;
+
+typedef struct {
+    const char    *name;
+    trace_point_t *points;
+    size_t         count;
+    bool           has_truth;
+    bool           interpolate; // Synthetic keyframes are interpolated, recordings are held
+    uint32_t       noise_mm;    // Synthetic: uniform noise amplitude
+    uint32_t       dropout_pct; // Synthetic: chance of an out-of-range reading
+    int            expected;    // Expected detections, or -1 for none
+} trace_t;
+
+typedef struct {
+    uint32_t detections;
+    uint32_t false_triggers;
+    uint32_t missed;
+    uint32_t samples;
+    uint32_t latency_sum_ms;
+    uint32_t latency_max_ms;
+    uint32_t latency_count;
+    uint32_t approaches;     // APPROACHING events
+    uint32_t receded;        // Approaches that ended without a detection
+    uint32_t lead_sum_ms;    // APPROACHING to DETECTED
+    uint32_t lead_min_ms;
+    uint32_t lead_count;
+    uint64_t state_ms[PRESENCE_STATE_COUNT];
+} replay_result_t;
+
+/************ Synthetic traces ************/
+
+static uint32_t g_rng = 1;
+
+static uint32_t rng_next(void) {
+    g_rng = g_rng * 1103515245u + 12345u;
+    return (g_rng >> 16) & 0x7fff;
+}
+
+static uint16_t trace_distance(const trace_t *trace, uint32_t t, bool *present) {
+    size_t i = 0;
+    while (i + 1 < trace->count && trace->points[i + 1].time_ms <= t) {
+        i++;
+    }
+    const trace_point_t *a = &trace->points[i];
+    *present = a->present;
+    if (!trace->interpolate || i + 1 >= trace->count || t <= a->time_ms) {
+        return a->distance_mm;
+    }
+
+    const trace_point_t *b = &trace->points[i + 1];
+    if (a->distance_mm >= OUT_OF_RANGE_MM || b->distance_mm >= OUT_OF_RANGE_MM) {
+        return a->distance_mm;
+    }
+    int32_t d = a->distance_mm + ((int32_t) b->distance_mm - a->distance_mm) *
+                                     (int32_t) (t - a->time_ms) / (int32_t) (b->time_ms - a->time_ms);
+    if (trace->dropout_pct && rng_next() % 100 < trace->dropout_pct) {
+        return OUT_OF_RANGE_MM;
+    }
+    if (trace->noise_mm) {
+        d += (int32_t) (rng_next() % (2 * trace->noise_mm + 1)) - (int32_t) trace->noise_mm;
+    }
+    return d < 0 ? 0 : (uint16_t) d;
+}
+
+#define FAR OUT_OF_RANGE_MM
+#define SCENARIO(name_, expected_, noise_, dropout_, ...)                                          \
+    {                                                                                              \
+        .name = name_, .points = (trace_point_t[]){__VA_ARGS__},                                   \
+        .count = sizeof((trace_point_t[]){__VA_ARGS__}) / sizeof(trace_point_t), .has_truth = true, \
+        .interpolate = true, .noise_mm = noise_, .dropout_pct = dropout_, .expected = expected_,   \
+    }
+
+// Keyframes: {time_ms, distance_mm, present}. Distances between keyframes are interpolated.
+static trace_t g_scenarios[] = {
+    SCENARIO("empty corridor", 0, 0, 0, {0, FAR, 0}, {60000, FAR, 0}),
+    SCENARIO("walk-by", 0, 15, 0, {0, FAR, 0}, {5000, 1500, 0}, {6000, 350, 0}, {6600, 350, 0},
+             {7600, 1500, 0}, {8000, FAR, 0}, {30000, FAR, 0}),
+    SCENARIO("approach", 1, 15, 0, {0, FAR, 0}, {5000, 2000, 0}, {7000, 490, 1}, {8000, 300, 1},
+             {16000, 300, 1}, {17000, 1500, 0}, {17500, FAR, 0}, {40000, FAR, 0}),
+    SCENARIO("linger", 2, 15, 0, {0, FAR, 0}, {3000, 1200, 0}, {4000, 490, 1}, {4500, 300, 1},
+             {100000, 300, 1}, {101000, 1500, 0}, {101500, FAR, 0}, {120000, FAR, 0}),
+    SCENARIO("leave and return", 2, 15, 0, {0, FAR, 0}, {3000, 1200, 0}, {4000, 490, 1},
+             {4500, 300, 1}, {10000, 300, 1}, {11000, 1500, 0}, {11500, FAR, 0}, {30000, FAR, 0},
+             {32000, 1200, 0}, {33000, 490, 1}, {33500, 300, 1}, {40000, 300, 1},
+             {41000, 1500, 0}, {41500, FAR, 0}, {70000, FAR, 0}),
+    SCENARIO("noisy approach", 1, 40, 3, {0, FAR, 0}, {5000, 2000, 0}, {7000, 490, 1},
+             {8000, 300, 1}, {16000, 300, 1}, {17000, 1500, 0}, {17500, FAR, 0}, {40000, FAR, 0}),
+};
+
+/************ Recorded traces ************/
+
+static bool load_trace(const char *path, trace_t *trace) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return false;
+    }
+
+    size_t capacity = 256;
+    *trace = (trace_t){.name = path, .points = malloc(capacity * sizeof(trace_point_t)), .expected = -1,
+                       .has_truth = true};
+    char line[128];
+    while (trace->points && fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        unsigned long t, d;
+        int present = -1;
+        int fields  = sscanf(line, "%lu,%lu,%d", &t, &d, &present);
+        if (fields < 2) {
+            continue;
+        }
+        if (fields < 3) {
+            trace->has_truth = false;
+        }
+        if (trace->count == capacity) {
+            capacity *= 2;
+            trace_point_t *points = realloc(trace->points, capacity * sizeof(trace_point_t));
+            if (!points) {
+                break;
+            }
+            trace->points = points;
+        }
+        trace->points[trace->count++] = (trace_point_t){
+            .time_ms = (uint32_t) t, .distance_mm = d > OUT_OF_RANGE_MM ? OUT_OF_RANGE_MM : (uint16_t) d,
+            .present = present > 0};
+    }
+    fclose(f);
+
+    if (!trace->points || trace->count == 0) {
+        fprintf(stderr, "%s: no samples\n", path);
+        free(trace->points);
+        return false;
+    }
+    return true;
+}
+
+/************ Replay ************/
+
+static void replay(const trace_t *trace, const presence_config_t *config, replay_result_t *result) {
+    presence_t presence;
+    uint32_t   t     = trace->points[0].time_ms;
+    uint32_t   end   = trace->points[trace->count - 1].time_ms;
+    uint32_t   last  = t;
+    bool       in_window       = false; // Inside a ground-truth presence window
+    bool       window_detected = false;
+    uint32_t   window_start    = 0;
+    bool       approach_open   = false;
+    uint32_t   approach_ms     = 0;
+
+    *result = (replay_result_t){0};
+    g_rng   = 1;
+    presence_init(&presence, t);
+
+    while (t <= end) {
+        bool     present;
+        uint16_t distance = trace_distance(trace, t, &present);
+
+        if (present && !in_window) {
+            in_window       = true;
+            window_detected = false;
+            window_start    = t;
+        } else if (!present && in_window) {
+            in_window = false;
+            if (!window_detected && t - window_start >= config->detection_ms) {
+                result->missed++;
+            }
+        }
+
+        result->state_ms[presence.state] += t - last;
+        last = t;
+
+        presence_output_t out = presence_update(&presence, config, t, distance);
+        result->samples++;
+
+        if (out.event == PRESENCE_EVENT_APPROACHING) {
+            result->approaches++;
+            approach_open = true;
+            approach_ms   = t;
+        } else if (out.event == PRESENCE_EVENT_RECEDED) {
+            result->receded++;
+            approach_open = false;
+        } else if (out.event == PRESENCE_EVENT_DETECTED) {
+            if (approach_open) {
+                uint32_t lead = t - approach_ms;
+                result->lead_sum_ms += lead;
+                if (result->lead_count++ == 0 || lead < result->lead_min_ms) {
+                    result->lead_min_ms = lead;
+                }
+                approach_open = false;
+            }
+        }
+
+        if (out.event == PRESENCE_EVENT_DETECTED) {
+            result->detections++;
+            if (trace->has_truth && !present) {
+                result->false_triggers++;
+            } else if (trace->has_truth) {
+                uint32_t latency = t - (window_detected ? out.presence_start_ms : window_start);
+                window_detected  = true;
+                result->latency_sum_ms += latency;
+                result->latency_count++;
+                if (latency > result->latency_max_ms) {
+                    result->latency_max_ms = latency;
+                }
+            }
+        }
+
+        t += out.interval_ms ? out.interval_ms : 1;
+    }
+    if (in_window && !window_detected && end - window_start >= config->detection_ms) {
+        result->missed++;
+    }
+}
+
+static bool report(const trace_t *trace, const presence_config_t *config, const replay_result_t *r) {
+    uint32_t duration = trace->points[trace->count - 1].time_ms - trace->points[0].time_ms;
+    bool     pass     = trace->expected < 0 || (r->detections == (uint32_t) trace->expected &&
+                                            r->false_triggers == 0 && r->missed == 0);
+
+    printf("%-18s %s\n", trace->name, trace->expected < 0 ? "" : pass ? "PASS" : "FAIL");
+    printf("  detections %u", r->detections);
+    if (trace->expected >= 0) {
+        printf(" (expected %d)", trace->expected);
+    }
+    if (trace->has_truth) {
+        printf(", false triggers %u, missed %u", r->false_triggers, r->missed);
+    }
+    printf("\n");
+    if (r->latency_count) {
+        printf("  detection latency avg %u ms, max %u ms (trigger time %u ms)\n",
+               r->latency_sum_ms / r->latency_count, r->latency_max_ms, config->detection_ms);
+    }
+    printf("  approaches %u, %u without detection", r->approaches, r->receded);
+    if (r->lead_count) {
+        printf(", lead before detection avg %u ms, min %u ms", r->lead_sum_ms / r->lead_count,
+               r->lead_min_ms);
+    }
+    printf("\n");
+    printf("  samples %u over %.1f s (%.1f Hz)\n", r->samples, duration / 1000.0,
+           duration ? r->samples * 1000.0 / duration : 0.0);
+    printf("  time in state:");
+    for (int s = 0; s < PRESENCE_STATE_COUNT; s++) {
+        printf(" %s %.1f s", presence_state_name(s), r->state_ms[s] / 1000.0);
+    }
+    printf("\n");
+    return pass;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-t threshold_mm] [-d detection_ms] [-i idle_ms] [-a active_ms] "
+            "[-z outer_zone_factor] [-v approach_speed_mm_s] [trace.csv ...]\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    presence_config_t config = PRESENCE_CONFIG_DEFAULT;
+    int               opt;
+    while ((opt = getopt(argc, argv, "t:d:i:a:z:v:h")) != -1) {
+        switch (opt) {
+        case 't':
+            config.threshold_mm = (uint16_t) atoi(optarg);
+            break;
+        case 'd':
+            config.detection_ms = (uint32_t) atoi(optarg);
+            break;
+        case 'i':
+            config.idle_interval_ms = (uint16_t) atoi(optarg);
+            break;
+        case 'a':
+            config.active_interval_ms = (uint16_t) atoi(optarg);
+            break;
+        case 'z':
+            config.outer_zone_factor = (uint16_t) atoi(optarg);
+            break;
+        case 'v':
+            config.approach_speed_mm_s = (uint16_t) atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    printf("threshold %u mm, trigger %u ms, ranging %u/%u ms (idle/active), outer zone x%u, "
+           "approach %u mm/s\n\n",
+           config.threshold_mm, config.detection_ms, config.idle_interval_ms,
+           config.active_interval_ms, config.outer_zone_factor, config.approach_speed_mm_s);
+
+    bool            ok = true;
+    replay_result_t result;
+    if (optind == argc) {
+        for (size_t i = 0; i < sizeof(g_scenarios) / sizeof(g_scenarios[0]); i++) {
+            replay(&g_scenarios[i], &config, &result);
+            ok &= report(&g_scenarios[i], &config, &result);
+        }
+        return ok ? 0 : 1;
+    }
+
+    for (int i = optind; i < argc; i++) {
+        trace_t trace;
+        if (!load_trace(argv[i], &trace)) {
+            ok = false;
+            continue;
+        }
+        replay(&trace, &config, &result);
+        report(&trace, &config, &result);
+        free(trace.points);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,437 @@
+/*
+ * Host test for the R502 frame parser (components/r502/r502_parser.c).
+ *
+ * Feeds hand-made and randomised byte streams through r502_parser_feed() the way the UART
+ * RX task does and checks which frames come out: fragmented input, stray header bytes, torn
+ * headers, checksum/length/address errors, line noise and bit flips. Also checks the link guard
+ * that keeps the late reply of a timed-out command from completing the next one.
+ *
+ * Build and run from the repository root:
+ *   gcc -O2 -Wall -fsanitize=address,undefined -Icomponents/r502/include \
+ *       tools/r502_parser_test/r502_parser_test.c components/r502/r502_parser.c -o r502_parser_test
+ *   ./r502_parser_test                    # exit 1 on failure
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "r502_parser.h"
+
+#define ADDRESS 0xFFFFFFFF
+#define FUZZ_FRAMES 20000
+
+typedef struct {
+    uint32_t ok;
+    uint32_t bad_checksum;
+    uint32_t bad_length;
+    uint8_t  last[R502_FRAME_MAX_SIZE];
+    size_t   last_len;
+    // Optional reference: every valid frame must equal it
+    const uint8_t *expect;
+    size_t         expect_len;
+    uint32_t       mismatches;
+} sink_t;
+
+static int g_failures = 0;
+
+#define CHECK(cond)                                                                                \
+    do {                                                                                           \
+        if (!(cond)) {                                                                             \
+            printf("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);                               \
+            g_failures++;                                                                          \
+        }                                                                                          \
+    } while (0)
+
+static uint32_t g_rng = 1;
+
+static uint32_t rng_next(void) {
+    g_rng = g_rng * 1103515245u + 12345u;
+    return (g_rng >> 16) & 0x7fff;
+}
+
+static void on_frame(r502_frame_status_t status, const uint8_t *frame, size_t len, void *ctx) {
+    sink_t *sink = ctx;
+    switch (status) {
+    case R502_FRAME_OK:
+        sink->ok++;
+        memcpy(sink->last, frame, len);
+        sink->last_len = len;
+        if (sink->expect != NULL && (len != sink->expect_len || memcmp(frame, sink->expect, len) != 0)) {
+            sink->mismatches++;
+        }
+        break;
+    case R502_FRAME_BAD_CHECKSUM:
+        sink->bad_checksum++;
+        break;
+    case R502_FRAME_BAD_LENGTH:
+        sink->bad_length++;
+        break;
+    }
+}
+
+// Build a package with a valid checksum, returns its size
+static size_t make_frame(uint8_t *buf, uint32_t address, uint8_t pid, const uint8_t *payload, size_t len) {
+    uint16_t length = (uint16_t) (len + 2);
+    buf[0]          = 0xEF;
+    buf[1]          = 0x01;
+    buf[2]          = address >> 24;
+    buf[3]          = address >> 16;
+    buf[4]          = address >> 8;
+    buf[5]          = address;
+    buf[6]          = pid;
+    buf[7]          = length >> 8;
+    buf[8]          = length & 0xff;
+    memcpy(buf + R502_FRAME_HEADER_SIZE, payload, len);
+
+    uint16_t sum = pid + buf[7] + buf[8];
+    for (size_t i = 0; i < len; i++) {
+        sum += payload[i];
+    }
+    buf[R502_FRAME_HEADER_SIZE + len]     = sum >> 8;
+    buf[R502_FRAME_HEADER_SIZE + len + 1] = sum & 0xff;
+    return R502_FRAME_HEADER_SIZE + len + 2;
+}
+
+// Feed in random fragments of 1..max_chunk bytes
+static void feed_fragmented(r502_parser_t *parser, const uint8_t *data, size_t len, size_t max_chunk, sink_t *sink) {
+    size_t pos = 0;
+    while (pos < len) {
+        size_t chunk = 1 + rng_next() % max_chunk;
+        if (chunk > len - pos) {
+            chunk = len - pos;
+        }
+        r502_parser_feed(parser, data + pos, chunk, on_frame, sink);
+        pos += chunk;
+    }
+}
+
+// A GenImg acknowledge with a few payload bytes
+static const uint8_t ACK_PAYLOAD[] = {0x00, 0x01, 0x02, 0x00, 0x50};
+
+/************ Cases ************/
+
+static void test_whole_frame(void) {
+    r502_parser_t parser;
+    sink_t        sink = {0};
+    uint8_t       frame[R502_FRAME_MAX_SIZE];
+    size_t        len = make_frame(frame, ADDRESS, R502_PID_ACK, ACK_PAYLOAD, sizeof(ACK_PAYLOAD));
+
+    r502_parser_init(&parser, ADDRESS);
+    r502_parser_feed(&parser, frame, len, on_frame, &sink);
+    CHECK(sink.ok == 1);
+    CHECK(sink.last_len == len && memcmp(sink.last, frame, len) == 0);
+    CHECK(parser.stats.frames == 1 && parser.stats.resyncs == 0);
+}
+
+static void test_byte_by_byte(void) {
+    r502_parser_t parser;
+    sink_t        sink = {0};
+    uint8_t       frame[R502_FRAME_MAX_SIZE];
+    size_t        len = make_frame(frame, ADDRESS, R502_PID_ACK, ACK_PAYLOAD, sizeof(ACK_PAYLOAD));
+
+    r502_parser_init(&parser, ADDRESS);
+    for (int round = 0; round < 3; round++) {
+        for (size_t i = 0; i < len; i++) {
+            r502_parser_feed(&parser, frame + i, 1, on_frame, &sink);
+            CHECK(sink.ok == (uint32_t) round + (i == len - 1));
+        }
+    }
+    CHECK(sink.ok == 3 && sink.bad_checksum == 0 && sink.bad_length == 0);
+    CHECK(memcmp(sink.last, frame, len) == 0);
+}
+
+static void test_stray_header_bytes(void) {
+    r502_parser_t parser;
+    sink_t        sink = {0};
+    uint8_t       frame[R502_FRAME_MAX_SIZE];
+    uint8_t       stream[2 * R502_FRAME_MAX_SIZE];
+    size_t        len = make_frame(frame, ADDRESS, R502_PID_ACK, ACK_PAYLOAD, sizeof(ACK_PAYLOAD));
+
+    // Lone 0xEF, 0xEF followed by garbage, then 0xEF 0xEF 0x01 right before the header
+    static const uint8_t junk[] = {0x12, 0xEF, 0x33, 0xEF, 0xEF};
+    memcpy(stream, junk, sizeof(junk));
+    memcpy(stream + sizeof(junk), frame, len);
+
+    r502_parser_init(&parser, ADDRESS);
+    r502_parser_feed(&parser, stream, sizeof(junk) + len, on_frame, &sink);
+    CHECK(sink.ok == 1 && memcmp(sink.last, frame, len) == 0);
+    CHECK(parser.stats.discarded_bytes == sizeof(junk));
+}
+
+static void test_torn_header(void) {
+    r502_parser_t parser;
+    sink_t        sink = {0};
+    uint8_t       frame[R502_FRAME_MAX_SIZE];
+    uint8_t       stream[2 * R502_FRAME_MAX_SIZE];
+    size_t        len = make_frame(frame, ADDRESS, R502_PID_ACK, ACK_PAYLOAD, sizeof(ACK_PAYLOAD));
+
+    // Every possible cut inside the header, followed by a complete frame
+    for (size_t cut = 1; cut < R502_FRAME_HEADER_SIZE; cut++) {
+        memset(&sink, 0, sizeof(sink));
+        memcpy(stream, frame, cut);
+        memcpy(stream + cut, frame, len);
+        r502_parser_init(&parser, ADDRESS);
+        r502_parser_feed(&parser, stream, cut + len, on_frame, &sink);
+        if (cut <= 6) {
+            // Cut before the length field: the real header is found again
+            CHECK(sink.ok == 1 && memcmp(sink.last, frame, len) == 0);
+        }
+        // A torn frame must never be reported as valid
+        CHECK(sink.ok <= 1);
+
+        // A second frame always gets through after a reset, as done after a UART flush
+        r502_parser_reset(&parser);
+        sink.ok = 0;
+        r502_parser_feed(&parser, frame, len, on_frame, &sink);
+        CHECK(sink.ok == 1);
+    }
+}
+
+static void test_bad_checksum(void) {
+    r502_parser_t parser;
+    sink_t        sink = {0};
+    uint8_t       frame[R502_FRAME_MAX_SIZE];
+    uint8_t       stream[2 * R502_FRAME_MAX_SIZE];
+    size_t        len = make_frame(frame, ADDRESS, R502_PID_ACK, ACK_PAYLOAD, sizeof(ACK_PAYLOAD));
+
+    memcpy(stream, frame, len);
+    stream[R502_FRAME_HEADER_SIZE + 1] ^= 0x40;
+    memcpy(stream + len, frame, len);
+
+    r502_parser_init(&parser, ADDRESS);
+    r502_parser_feed(&parser, stream, 2 * len, on_frame, &sink);
+    CHECK(sink.ok == 1 && sink.bad_checksum == 1);
+    CHECK(parser.stats.checksum_errors == 1);
+}
+
+static void test_bad_length(void) {
+    r502_parser_t parser;
+    sink_t        sink = {0};
+    uint8_t       frame[R502_FRAME_MAX_SIZE];
+    uint8_t       stream[2 * R502_FRAME_MAX_SIZE];
+    size_t        len = make_frame(frame, ADDRESS, R502_PID_ACK, ACK_PAYLOAD, sizeof(ACK_PAYLOAD));
+
+    // Larger than any package, and too short to hold the checksum
+    static const uint16_t lengths[] = {R502_FRAME_MAX_DATA + 3, 0x1000, 0xFFFF, 0, 1};
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        memset(&sink, 0, sizeof(sink));
+        memcpy(stream, frame, R502_FRAME_HEADER_SIZE);
+        stream[7] = lengths[i] >> 8;
+        stream[8] = lengths[i] & 0xff;
+        memcpy(stream + R502_FRAME_HEADER_SIZE, frame, len);
+
+        r502_parser_init(&parser, ADDRESS);
+        r502_parser_feed(&parser, stream, R502_FRAME_HEADER_SIZE + len, on_frame, &sink);
+        CHECK(sink.bad_length == 1);
+        CHECK(sink.ok == 1 && memcmp(sink.last, frame, len) == 0);
+    }
+}
+
+static void test_bad_address(void) {
+    r502_parser_t parser;
+    sink_t        sink = {0};
+    uint8_t       frame[R502_FRAME_MAX_SIZE];
+    uint8_t       other[R502_FRAME_MAX_SIZE];
+    uint8_t       stream[2 * R502_FRAME_MAX_SIZE];
+    size_t        len = make_frame(frame, ADDRESS, R502_PID_ACK, ACK_PAYLOAD, sizeof(ACK_PAYLOAD));
+    size_t other_len  = make_frame(other, 0xFFFF00FF, R502_PID_ACK, ACK_PAYLOAD, sizeof(ACK_PAYLOAD));
+
+    memcpy(stream, other, other_len);
+    memcpy(stream + other_len, frame, len);
+
+    r502_parser_init(&parser, ADDRESS);
+    r502_parser_feed(&parser, stream, other_len + len, on_frame, &sink);
+    CHECK(sink.ok == 1 && memcmp(sink.last, frame, len) == 0);
+    CHECK(sink.bad_checksum == 0 && sink.bad_length == 0);
+
+    // A parser for another address ignores ours
+    memset(&sink, 0, sizeof(sink));
+    r502_parser_init(&parser, 0x12345678);
+    r502_parser_feed(&parser, frame, len, on_frame, &sink);
+    CHECK(sink.ok == 0);
+}
+
+// Frames of random size and content between bursts of noise, fed in random fragments
+static void test_noise(bool noise_with_header) {
+    r502_parser_t parser;
+    sink_t        sink = {0};
+    uint8_t       stream[16 + R502_FRAME_MAX_SIZE];
+    uint8_t       payload[R502_FRAME_MAX_DATA];
+    uint32_t      sent = 0;
+
+    r502_parser_init(&parser, ADDRESS);
+    for (int i = 0; i < FUZZ_FRAMES; i++) {
+        size_t len   = 0;
+        size_t noise = rng_next() % 8;
+        for (size_t j = 0; j < noise; j++) {
+            uint8_t b = (uint8_t) rng_next();
+            if (!noise_with_header && b == 0xEF) {
+                b = 0x00;
+            }
+            stream[len++] = b;
+        }
+        size_t payload_len = 1 + rng_next() % (R502_FRAME_MAX_DATA - 1);
+        for (size_t j = 0; j < payload_len; j++) {
+            payload[j] = (uint8_t) rng_next();
+        }
+        len += make_frame(stream + len, ADDRESS, rng_next() % 2 ? R502_PID_ACK : R502_PID_DATA, payload,
+                          payload_len);
+        sent++;
+        feed_fragmented(&parser, stream, len, 17, &sink);
+    }
+
+    printf("  %u frames sent, %u ok, %u checksum / %u length errors, %u resyncs, %u bytes discarded\n", sent,
+           sink.ok, sink.bad_checksum, sink.bad_length, parser.stats.resyncs, parser.stats.discarded_bytes);
+    if (noise_with_header) {
+        // Noise that looks like a header can swallow the frame after it
+        CHECK(sink.ok >= sent * 99 / 100);
+    } else {
+        CHECK(sink.ok == sent && sink.bad_checksum == 0 && sink.bad_length == 0);
+    }
+}
+
+// Single bit flips in some frames of a steady reply stream. A corrupted frame must never
+// be reported as valid, and the parser must keep up with the clean ones.
+static void test_bit_flips(void) {
+    r502_parser_t parser;
+    uint8_t       frame[R502_FRAME_MAX_SIZE];
+    uint8_t       stream[R502_FRAME_MAX_SIZE];
+    size_t        len   = make_frame(frame, ADDRESS, R502_PID_ACK, ACK_PAYLOAD, sizeof(ACK_PAYLOAD));
+    sink_t        sink  = {.expect = frame, .expect_len = len};
+    uint32_t      clean = 0;
+
+    r502_parser_init(&parser, ADDRESS);
+    for (int i = 0; i < FUZZ_FRAMES; i++) {
+        memcpy(stream, frame, len);
+        if (rng_next() % 10 == 0) {
+            stream[rng_next() % len] ^= 1 << (rng_next() % 8);
+        } else {
+            clean++;
+        }
+        r502_parser_feed(&parser, stream, len, on_frame, &sink);
+    }
+
+    printf("  %u clean frames, %u ok, %u checksum / %u length errors, %u resyncs\n", clean, sink.ok,
+           sink.bad_checksum, sink.bad_length, parser.stats.resyncs);
+    CHECK(sink.mismatches == 0);
+    CHECK(sink.ok <= clean);
+    // A flipped length bit can make the parser wait for bytes of the next frame
+    CHECK(sink.ok >= clean * 95 / 100);
+}
+
+// What the RX task and transact() in r502.c do with the link guard, on a simulated clock
+typedef struct {
+    r502_parser_t     parser;
+    r502_link_guard_t guard;
+    int64_t           now_us;
+    bool              pending;    // A command waits for its acknowledge
+    int               reply_code; // Confirmation code it got, -1 while none
+    uint32_t          late;
+} link_sim_t;
+
+static void on_link_frame(r502_frame_status_t status, const uint8_t *frame, size_t len, void *ctx) {
+    link_sim_t *link = ctx;
+    if (!r502_link_guard_accept(&link->guard, link->now_us)) {
+        link->late++;
+    } else if (link->pending && status == R502_FRAME_OK) {
+        link->reply_code = frame[9];
+        link->pending    = false;
+    }
+}
+
+static void link_receive_ack(link_sim_t *link, int64_t at_us, uint8_t code) {
+    uint8_t frame[R502_FRAME_MAX_SIZE];
+    size_t  len  = make_frame(frame, ADDRESS, R502_PID_ACK, &code, 1);
+    link->now_us = at_us;
+    r502_parser_feed(&link->parser, frame, len, on_link_frame, link);
+}
+
+// Send the next command as transact() does: wait while the guard holds the link closed
+static void link_send(link_sim_t *link, int64_t at_us) {
+    int64_t wait;
+    link->now_us = at_us;
+    while ((wait = r502_link_guard_wait(&link->guard, link->now_us)) > 0) {
+        link->now_us += wait;
+    }
+    link->pending    = true;
+    link->reply_code = -1;
+}
+
+// A Search times out after 5 s and its "no match" acknowledge comes 300 ms later. The next
+// command must neither be sent before the link is quiet nor be completed by that acknowledge.
+static void test_late_reply(void) {
+    link_sim_t link = {.reply_code = -1};
+    r502_parser_init(&link.parser, ADDRESS);
+
+    link_send(&link, 0);
+    r502_link_guard_close(&link.guard, 5000000, 1000000);
+    link.pending = false;
+    CHECK(r502_link_guard_wait(&link.guard, 5100000) == 900000);
+
+    link_receive_ack(&link, 5300000, 0x09);
+    CHECK(link.late == 1 && link.reply_code == -1);
+    // The late frame restarts the quiet period
+    CHECK(r502_link_guard_wait(&link.guard, 5400000) == 900000);
+
+    link_send(&link, 5400000);
+    CHECK(link.now_us == 6300000);
+    link_receive_ack(&link, 6350000, 0x00);
+    CHECK(link.late == 1 && link.reply_code == 0x00);
+
+    // Clean link: replies go straight to the command
+    link_send(&link, 7000000);
+    CHECK(link.now_us == 7000000);
+    link_receive_ack(&link, 7010000, 0x00);
+    CHECK(link.reply_code == 0x00);
+
+    // A baud rate change opens the link at once, old replies can not be read any more
+    r502_link_guard_close(&link.guard, 8000000, 1000000);
+    r502_link_guard_open(&link.guard);
+    link_send(&link, 8000000);
+    CHECK(link.now_us == 8000000);
+    link_receive_ack(&link, 8010000, 0x00);
+    CHECK(link.late == 1 && link.reply_code == 0x00);
+}
+
+typedef struct {
+    const char *name;
+    void (*fn)(void);
+} test_case_t;
+
+#define CASE(fn_) {#fn_, fn_}
+
+static void test_noise_clean(void) {
+    test_noise(false);
+}
+
+static void test_noise_with_headers(void) {
+    test_noise(true);
+}
+
+static const test_case_t g_cases[] = {
+    CASE(test_whole_frame),
+    CASE(test_byte_by_byte),
+    CASE(test_stray_header_bytes),
+    CASE(test_torn_header),
+    CASE(test_bad_checksum),
+    CASE(test_bad_length),
+    CASE(test_bad_address),
+    CASE(test_noise_clean),
+    CASE(test_noise_with_headers),
+    CASE(test_bit_flips),
+    CASE(test_late_reply),
+};
+
+int main(void) {
+    for (size_t i = 0; i < sizeof(g_cases) / sizeof(g_cases[0]); i++) {
+        int before = g_failures;
+        printf("%s\n", g_cases[i].name);
+        g_cases[i].fn();
+        if (g_failures != before) {
+            printf("  -> failed\n");
+        }
+    }
+    printf("\n%s\n", g_failures ? "FAIL" : "PASS");
+    return g_failures ? 1 : 0;
+}
@@ -0,0 +1,136 @@
+/*
+ * Count the NVS writes tabledb issues for a batch of inserts (components/tabledb).
+ *
+ * Inserts the same records into fresh tables one by one and inside a single transaction,
+ * on the fake NVS of shim/host_shim.c, and reports nvs_set_blob and nvs_commit calls as
+ * counted by nvs_stats. For 100 inserts into a list table that is 299 sets and 100 commits
+ * one by one (record, old head and meta per insert) against 101 sets and 1 commit in a
+ * transaction.
+ *
+ * Build and run from the repository root:
+ *   gcc -O2 -Wall -pthread -Itools/tabledb_host/shim -Icomponents/tabledb/include \
+ *       -Icomponents/nvs_stats/include tools/tabledb_host/nvs_writes.c tools/tabledb_host/shim/host_shim.c \
+ *       components/tabledb/tabledb.c components/tabledb/tabledb_backend_nvs.c \
+ *       components/tabledb/tabledb_backend_file.c components/tabledb/tabledb_backend_ram.c \
+ *       components/nvs_stats/nvs_stats.c -o nvs_writes
+ *   ./nvs_writes           # 100 inserts, exit 1 if a transaction needs more than one write per record
+ *   ./nvs_writes 1000
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nvs_stats.h"
+#include "tabledb.h"
+
+typedef struct {
+    uint32_t id;
+    char     name[24];
+    uint16_t used_count;
+    uint32_t last_usage_time;
+} record_t;
+
+typedef struct {
+    uint32_t writes;
+    uint32_t commits;
+} write_count_t;
+
+static bool namespace_stats(const char *namespace, write_count_t *out) {
+    nvs_stats_namespace_t stats[NVS_STATS_MAX_NAMESPACES];
+    size_t                count;
+    if (nvs_stats_get(stats, NVS_STATS_MAX_NAMESPACES, &count) != ESP_OK) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(stats[i].namespace, namespace) == 0) {
+            out->writes  = stats[i].writes;
+            out->commits = stats[i].commits;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Insert count records into a fresh table and return the NVS writes that took.
+static esp_err_t count_inserts(const char *namespace, tabledb_layout_t layout, bool txn, uint32_t count,
+                               write_count_t *result) {
+    tabledb_config_t init = {
+        .size      = sizeof(record_t),
+        .namespace = namespace,
+        .version   = 1,
+        .layout    = layout,
+    };
+    tabledb_config_t *config = malloc(sizeof(tabledb_config_t));
+    memcpy(config, &init, sizeof(tabledb_config_t));
+    esp_err_t err = tabledb_init(config);
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    write_count_t before = {0};
+    namespace_stats(namespace, &before);
+    if (txn) {
+        err = tabledb_txn_begin(config);
+    }
+    for (uint32_t id = 1; id <= count && err == ESP_OK; id++) {
+        record_t record = {.id = id};
+        snprintf(record.name, sizeof(record.name), "user%" PRIu32, id);
+        err = tabledb_insert(config, id, &record);
+    }
+    if (txn && err == ESP_OK) {
+        err = tabledb_txn_commit(config);
+    }
+    if (err != ESP_OK) {
+        return err;
+    }
+
+    write_count_t after = {0};
+    namespace_stats(namespace, &after);
+    result->writes  = after.writes - before.writes;
+    result->commits = after.commits - before.commits;
+    return ESP_OK;
+}
+
+int main(int argc, char **argv) {
+    uint32_t count = argc > 1 ? (uint32_t) atoi(argv[1]) : 100;
+    if (count == 0) {
+        fprintf(stderr, "usage: %s [inserts]\n", argv[0]);
+        return 2;
+    }
+
+    static const struct {
+        const char      *name;
+        tabledb_layout_t layout;
+    } layouts[] = {
+        {"list", TABLEDB_LAYOUT_LIST},
+        {"paged", TABLEDB_LAYOUT_PAGED},
+    };
+
+    bool ok = true;
+    printf("%" PRIu32 " inserts\n%-6s %-23s %s\n", count, "", "one by one", "one transaction");
+    for (size_t i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+        write_count_t single, batched;
+        char          ns_single[16], ns_batched[16];
+        snprintf(ns_single, sizeof(ns_single), "single_%zu", i);
+        snprintf(ns_batched, sizeof(ns_batched), "batched_%zu", i);
+
+        esp_err_t err = count_inserts(ns_single, layouts[i].layout, false, count, &single);
+        if (err == ESP_OK) {
+            err = count_inserts(ns_batched, layouts[i].layout, true, count, &batched);
+        }
+        if (err != ESP_OK) {
+            printf("%-6s failed: %s\n", layouts[i].name, esp_err_to_name(err));
+            ok = false;
+            continue;
+        }
+        printf("%-6s %6" PRIu32 " sets %4" PRIu32 " commits %6" PRIu32 " sets %4" PRIu32 " commits\n",
+               layouts[i].name, single.writes, single.commits, batched.writes, batched.commits);
+
+        // Each record at most once plus the meta blob (list) or fewer (paged), one commit
+        if (batched.writes > count + 1 || batched.commits != 1) {
+            ok = false;
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,22 @@
+// Host shim: ESP-IDF logging macros print warnings and errors to stderr.
+#ifndef _HOST_ESP_LOG_H_
+#define _HOST_ESP_LOG_H_
+
+#include <stdio.h>
+
+extern int host_log_level; // 0 silent, 1 errors, 2 warnings (default), 3 info, 4 debug
+
+#define HOST_LOG(level, letter, tag, fmt, ...)                                                     \
+    do {                                                                                           \
+        if (host_log_level >= (level)) {                                                           \
+            fprintf(stderr, letter " (%s) " fmt "\n", tag, ##__VA_ARGS__);                         \
+        }                                                                                          \
+    } while (0)
+
+#define ESP_LOGE(tag, fmt, ...) HOST_LOG(1, "E", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGW(tag, fmt, ...) HOST_LOG(2, "W", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) HOST_LOG(3, "I", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) HOST_LOG(4, "D", tag, fmt, ##__VA_ARGS__)
+#define ESP_LOGV(tag, fmt, ...) HOST_LOG(5, "V", tag, fmt, ##__VA_ARGS__)
+
+#endif
@@ -0,0 +1,9 @@
+// Host shim: microseconds of a monotonic clock.
+#ifndef _HOST_ESP_TIMER_H_
+#define _HOST_ESP_TIMER_H_
+
+#include <stdint.h>
+
+int64_t esp_timer_get_time(void);
+
+#endif
@@ -0,0 +1,31 @@
+// Host shim: FreeRTOS tasks, mutexes and critical sections on top of pthreads.
+// One tick is one millisecond.
+#ifndef _HOST_FREERTOS_H_
+#define _HOST_FREERTOS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int      BaseType_t;
+typedef unsigned UBaseType_t;
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+#define portMAX_DELAY ((TickType_t) 0xffffffffUL)
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t) (ms))
+#define tskIDLE_PRIORITY 0
+
+// Critical sections share one global recursive lock on the host.
+typedef int portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED 0
+#define portMUX_INITIALIZE(mux) ((void) (mux))
+void host_critical_enter(void);
+void host_critical_exit(void);
+#define portENTER_CRITICAL(mux) ((void) (mux), host_critical_enter())
+#define portEXIT_CRITICAL(mux) ((void) (mux), host_critical_exit())
+
+#endif
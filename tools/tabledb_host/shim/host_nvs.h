@@ -0,0 +1,22 @@
+// Host shim: counters and fault injection of the fake NVS in host_shim.c.
+#ifndef _HOST_NVS_COUNTERS_H_
+#define _HOST_NVS_COUNTERS_H_
+
+#include <stdint.h>
+
+typedef struct {
+    uint32_t reads;
+    uint32_t sets;
+    uint32_t erases;
+    uint32_t commits;
+} host_nvs_counters_t;
+
+void host_nvs_get_counters(host_nvs_counters_t *out);
+void host_nvs_reset_counters(void);
+// Fail the count-th set, erase or commit from now on with ESP_FAIL, and all after it.
+// A negative count stops failing.
+void host_nvs_fail_after(int count);
+// Forget every namespace, as after erasing the partition.
+void host_nvs_erase_flash(void);
+
+#endif
@@ -0,0 +1,505 @@
+/*
+ * Host implementations of the ESP-IDF and FreeRTOS calls tabledb and nvs_stats use.
+ *
+ * NVS is a RAM store with one key list per namespace. Like on flash, every set or
+ * erase is kept right away; nvs_commit only counts. Writes can be made to fail to
+ * exercise the error paths.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "nvs.h"
+#include "host_nvs.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+
+int host_log_level = 2;
+
+/************ Errors, time, shutdown ************/
+
+const char *esp_err_to_name(esp_err_t code) {
+    switch (code) {
+    case ESP_OK:
+        return "ESP_OK";
+    case ESP_FAIL:
+        return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:
+        return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:
+        return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE:
+        return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE:
+        return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:
+        return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED:
+        return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT:
+        return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_INVALID_VERSION:
+        return "ESP_ERR_INVALID_VERSION";
+    case ESP_ERR_NVS_NOT_FOUND:
+        return "ESP_ERR_NVS_NOT_FOUND";
+    case ESP_ERR_NVS_NOT_ENOUGH_SPACE:
+        return "ESP_ERR_NVS_NOT_ENOUGH_SPACE";
+    case ESP_ERR_NVS_KEY_TOO_LONG:
+        return "ESP_ERR_NVS_KEY_TOO_LONG";
+    case ESP_ERR_NVS_INVALID_LENGTH:
+        return "ESP_ERR_NVS_INVALID_LENGTH";
+    case ESP_ERR_NVS_VALUE_TOO_LONG:
+        return "ESP_ERR_NVS_VALUE_TOO_LONG";
+    default:
+        return "UNKNOWN_ERROR";
+    }
+}
+
+int64_t esp_timer_get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+esp_err_t esp_register_shutdown_handler(shutdown_handler_t handle) {
+    (void) handle;
+    return ESP_OK;
+}
+
+/************ Mutexes and critical sections ************/
+
+struct host_semaphore {
+    pthread_mutex_t mutex;
+};
+
+static pthread_mutex_t g_critical;
+static pthread_once_t  g_critical_once = PTHREAD_ONCE_INIT;
+
+static void recursive_init(pthread_mutex_t *mutex) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static void critical_init(void) {
+    recursive_init(&g_critical);
+}
+
+void host_critical_enter(void) {
+    pthread_once(&g_critical_once, critical_init);
+    pthread_mutex_lock(&g_critical);
+}
+
+void host_critical_exit(void) {
+    pthread_mutex_unlock(&g_critical);
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex(void) {
+    SemaphoreHandle_t sem = malloc(sizeof(struct host_semaphore));
+    if (sem != NULL) {
+        recursive_init(&sem->mutex);
+    }
+    return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+    return xSemaphoreCreateRecursiveMutex();
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem) {
+    pthread_mutex_destroy(&sem->mutex);
+    free(sem);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks) {
+    if (ticks == 0) {
+        return pthread_mutex_trylock(&sem->mutex) == 0 ? pdTRUE : pdFALSE;
+    }
+    return pthread_mutex_lock(&sem->mutex) == 0 ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+    return pthread_mutex_unlock(&sem->mutex) == 0 ? pdTRUE : pdFALSE;
+}
+
+/************ Tasks ************/
+
+struct host_task {
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    uint32_t        notified;
+    TaskFunction_t  fn;
+    void           *arg;
+};
+
+static __thread struct host_task *g_current = NULL;
+
+static struct host_task *task_alloc(void) {
+    struct host_task *task = calloc(1, sizeof(struct host_task));
+    if (task != NULL) {
+        pthread_mutex_init(&task->lock, NULL);
+        pthread_cond_init(&task->cond, NULL);
+    }
+    return task;
+}
+
+static struct host_task *current_task(void) {
+    if (g_current == NULL) {
+        g_current = task_alloc(); // Main thread, or a thread not created through xTaskCreate
+    }
+    return g_current;
+}
+
+static void *task_entry(void *arg) {
+    g_current = arg;
+    g_current->fn(g_current->arg);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t fn, const char *name, uint32_t stack, void *arg, UBaseType_t priority,
+                       TaskHandle_t *handle) {
+    (void) name;
+    (void) stack;
+    (void) priority;
+    struct host_task *task = task_alloc();
+    if (task == NULL) {
+        return pdFAIL;
+    }
+    task->fn  = fn;
+    task->arg = arg;
+    if (pthread_create(&task->thread, NULL, task_entry, task) != 0) {
+        free(task);
+        return pdFAIL;
+    }
+    pthread_detach(task->thread);
+    if (handle != NULL) {
+        *handle = task;
+    }
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    if (task == NULL) {
+        pthread_exit(NULL);
+    }
+}
+
+void vTaskDelay(TickType_t ticks) {
+    struct timespec ts = {.tv_sec = ticks / 1000, .tv_nsec = (long) (ticks % 1000) * 1000000};
+    nanosleep(&ts, NULL);
+}
+
+TickType_t xTaskGetTickCount(void) {
+    return (TickType_t) (esp_timer_get_time() / 1000);
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    pthread_mutex_lock(&task->lock);
+    task->notified++;
+    pthread_cond_signal(&task->cond);
+    pthread_mutex_unlock(&task->lock);
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear, TickType_t ticks) {
+    struct host_task *task = current_task();
+    struct timespec   deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ticks / 1000;
+    deadline.tv_nsec += (long) (ticks % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&task->lock);
+    while (task->notified == 0) {
+        int rc = ticks == portMAX_DELAY ? pthread_cond_wait(&task->cond, &task->lock)
+                                        : pthread_cond_timedwait(&task->cond, &task->lock, &deadline);
+        if (rc != 0) {
+            break;
+        }
+    }
+    uint32_t value = task->notified;
+    if (value > 0) {
+        task->notified = clear ? 0 : value - 1;
+    }
+    pthread_mutex_unlock(&task->lock);
+    return value;
+}
+
+/************ NVS ************/
+
+#define HOST_NVS_MAX_HANDLES 64
+
+typedef struct {
+    char     key[NVS_KEY_NAME_MAX_SIZE];
+    uint8_t *data;
+    size_t   size;
+} nvs_entry_t;
+
+typedef struct nvs_namespace {
+    char                  name[NVS_KEY_NAME_MAX_SIZE];
+    nvs_entry_t          *entries;
+    size_t                count;
+    size_t                capacity;
+    struct nvs_namespace *next;
+} nvs_namespace_t;
+
+static nvs_namespace_t    *g_namespaces = NULL;
+static nvs_namespace_t    *g_handles[HOST_NVS_MAX_HANDLES];
+static host_nvs_counters_t g_counters;
+static int                 g_fail_after = -1;
+static pthread_mutex_t     g_nvs_lock   = PTHREAD_MUTEX_INITIALIZER;
+
+void host_nvs_get_counters(host_nvs_counters_t *out) {
+    pthread_mutex_lock(&g_nvs_lock);
+    *out = g_counters;
+    pthread_mutex_unlock(&g_nvs_lock);
+}
+
+void host_nvs_reset_counters(void) {
+    pthread_mutex_lock(&g_nvs_lock);
+    memset(&g_counters, 0, sizeof(g_counters));
+    pthread_mutex_unlock(&g_nvs_lock);
+}
+
+void host_nvs_fail_after(int count) {
+    pthread_mutex_lock(&g_nvs_lock);
+    g_fail_after = count;
+    pthread_mutex_unlock(&g_nvs_lock);
+}
+
+void host_nvs_erase_flash(void) {
+    pthread_mutex_lock(&g_nvs_lock);
+    while (g_namespaces != NULL) {
+        nvs_namespace_t *ns = g_namespaces;
+        g_namespaces        = ns->next;
+        for (size_t i = 0; i < ns->count; i++) {
+            free(ns->entries[i].data);
+        }
+        free(ns->entries);
+        free(ns);
+    }
+    memset(g_handles, 0, sizeof(g_handles));
+    pthread_mutex_unlock(&g_nvs_lock);
+}
+
+// Caller holds g_nvs_lock. Returns true if this write is to fail.
+static bool write_fails(void) {
+    if (g_fail_after < 0) {
+        return false;
+    }
+    if (g_fail_after > 1) {
+        g_fail_after--;
+        return false;
+    }
+    g_fail_after = 1;
+    return true;
+}
+
+static nvs_namespace_t *handle_ns(nvs_handle_t handle) {
+    return handle > 0 && handle <= HOST_NVS_MAX_HANDLES ? g_handles[handle - 1] : NULL;
+}
+
+static nvs_entry_t *ns_find(nvs_namespace_t *ns, const char *key) {
+    for (size_t i = 0; i < ns->count; i++) {
+        if (strcmp(ns->entries[i].key, key) == 0) {
+            return &ns->entries[i];
+        }
+    }
+    return NULL;
+}
+
+esp_err_t nvs_open(const char *namespace_name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle) {
+    (void) open_mode;
+    if (strlen(namespace_name) >= NVS_KEY_NAME_MAX_SIZE) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+    pthread_mutex_lock(&g_nvs_lock);
+    nvs_namespace_t *ns = g_namespaces;
+    while (ns != NULL && strcmp(ns->name, namespace_name) != 0) {
+        ns = ns->next;
+    }
+    if (ns == NULL) {
+        ns = calloc(1, sizeof(nvs_namespace_t));
+        if (ns == NULL) {
+            pthread_mutex_unlock(&g_nvs_lock);
+            return ESP_ERR_NO_MEM;
+        }
+        strcpy(ns->name, namespace_name);
+        ns->next     = g_namespaces;
+        g_namespaces = ns;
+    }
+    for (size_t i = 0; i < HOST_NVS_MAX_HANDLES; i++) {
+        if (g_handles[i] == NULL) {
+            g_handles[i] = ns;
+            *out_handle  = i + 1;
+            pthread_mutex_unlock(&g_nvs_lock);
+            return ESP_OK;
+        }
+    }
+    pthread_mutex_unlock(&g_nvs_lock);
+    return ESP_ERR_NO_MEM;
+}
+
+void nvs_close(nvs_handle_t handle) {
+    pthread_mutex_lock(&g_nvs_lock);
+    if (handle_ns(handle) != NULL) {
+        g_handles[handle - 1] = NULL;
+    }
+    pthread_mutex_unlock(&g_nvs_lock);
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length) {
+    esp_err_t err = ESP_OK;
+    pthread_mutex_lock(&g_nvs_lock);
+    g_counters.reads++;
+    nvs_namespace_t *ns    = handle_ns(handle);
+    nvs_entry_t     *entry = ns != NULL ? ns_find(ns, key) : NULL;
+    if (ns == NULL) {
+        err = ESP_ERR_NVS_INVALID_HANDLE;
+    } else if (entry == NULL) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    } else if (out_value != NULL && *length < entry->size) {
+        err = ESP_ERR_NVS_INVALID_LENGTH;
+    } else {
+        if (out_value != NULL) {
+            memcpy(out_value, entry->data, entry->size);
+        }
+        *length = entry->size;
+    }
+    pthread_mutex_unlock(&g_nvs_lock);
+    return err;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length) {
+    if (strlen(key) >= NVS_KEY_NAME_MAX_SIZE) {
+        return ESP_ERR_NVS_KEY_TOO_LONG;
+    }
+    pthread_mutex_lock(&g_nvs_lock);
+    g_counters.sets++;
+    nvs_namespace_t *ns = handle_ns(handle);
+    if (ns == NULL || write_fails()) {
+        pthread_mutex_unlock(&g_nvs_lock);
+        return ns == NULL ? ESP_ERR_NVS_INVALID_HANDLE : ESP_FAIL;
+    }
+    uint8_t *copy = malloc(length ? length : 1);
+    if (copy == NULL) {
+        pthread_mutex_unlock(&g_nvs_lock);
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(copy, value, length);
+
+    nvs_entry_t *entry = ns_find(ns, key);
+    if (entry == NULL) {
+        if (ns->count == ns->capacity) {
+            size_t       capacity = ns->capacity ? ns->capacity * 2 : 16;
+            nvs_entry_t *entries  = realloc(ns->entries, capacity * sizeof(nvs_entry_t));
+            if (entries == NULL) {
+                free(copy);
+                pthread_mutex_unlock(&g_nvs_lock);
+                return ESP_ERR_NO_MEM;
+            }
+            ns->entries  = entries;
+            ns->capacity = capacity;
+        }
+        entry = &ns->entries[ns->count++];
+        strcpy(entry->key, key);
+        entry->data = NULL;
+    }
+    free(entry->data);
+    entry->data = copy;
+    entry->size = length;
+    pthread_mutex_unlock(&g_nvs_lock);
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key) {
+    esp_err_t err = ESP_OK;
+    pthread_mutex_lock(&g_nvs_lock);
+    g_counters.erases++;
+    nvs_namespace_t *ns    = handle_ns(handle);
+    nvs_entry_t     *entry = ns != NULL ? ns_find(ns, key) : NULL;
+    if (ns == NULL) {
+        err = ESP_ERR_NVS_INVALID_HANDLE;
+    } else if (entry == NULL) {
+        err = ESP_ERR_NVS_NOT_FOUND;
+    } else if (write_fails()) {
+        err = ESP_FAIL;
+    } else {
+        free(entry->data);
+        *entry = ns->entries[--ns->count];
+    }
+    pthread_mutex_unlock(&g_nvs_lock);
+    return err;
+}
+
+esp_err_t nvs_erase_all(nvs_handle_t handle) {
+    esp_err_t err = ESP_OK;
+    pthread_mutex_lock(&g_nvs_lock);
+    g_counters.erases++;
+    nvs_namespace_t *ns = handle_ns(handle);
+    if (ns == NULL) {
+        err = ESP_ERR_NVS_INVALID_HANDLE;
+    } else if (write_fails()) {
+        err = ESP_FAIL;
+    } else {
+        for (size_t i = 0; i < ns->count; i++) {
+            free(ns->entries[i].data);
+        }
+        ns->count = 0;
+    }
+    pthread_mutex_unlock(&g_nvs_lock);
+    return err;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle) {
+    esp_err_t err = ESP_OK;
+    pthread_mutex_lock(&g_nvs_lock);
+    g_counters.commits++;
+    if (handle_ns(handle) == NULL) {
+        err = ESP_ERR_NVS_INVALID_HANDLE;
+    } else if (write_fails()) {
+        err = ESP_FAIL;
+    }
+    pthread_mutex_unlock(&g_nvs_lock);
+    return err;
+}
+
+esp_err_t nvs_get_used_entry_count(nvs_handle_t handle, size_t *used_entries) {
+    pthread_mutex_lock(&g_nvs_lock);
+    nvs_namespace_t *ns = handle_ns(handle);
+    if (ns == NULL) {
+        pthread_mutex_unlock(&g_nvs_lock);
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    }
+    *used_entries = 0;
+    for (size_t i = 0; i < ns->count; i++) {
+        *used_entries += 1 + (ns->entries[i].size + 31) / 32;
+    }
+    pthread_mutex_unlock(&g_nvs_lock);
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_stats(const char *part_name, nvs_stats_t *nvs_stats) {
+    (void) part_name;
+    memset(nvs_stats, 0, sizeof(nvs_stats_t));
+    pthread_mutex_lock(&g_nvs_lock);
+    for (nvs_namespace_t *ns = g_namespaces; ns != NULL; ns = ns->next) {
+        nvs_stats->namespace_count++;
+        for (size_t i = 0; i < ns->count; i++) {
+            nvs_stats->used_entries += 1 + (ns->entries[i].size + 31) / 32;
+        }
+    }
+    pthread_mutex_unlock(&g_nvs_lock);
+    return ESP_OK;
+}
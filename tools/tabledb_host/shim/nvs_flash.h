@@ -0,0 +1,7 @@
+// Host shim: the fake NVS needs no partition setup.
+#ifndef _HOST_NVS_FLASH_H_
+#define _HOST_NVS_FLASH_H_
+
+#include "nvs.h"
+
+#endif
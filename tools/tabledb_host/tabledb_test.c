@@ -0,0 +1,780 @@
+/*
+ * Host test and benchmark for tabledb (components/tabledb) on all storage backends.
+ *
+ * Runs the public API checks (CRUD, transactions, cursors and scans, secondary keys,
+ * change notifications, write-behind cache) against the NVS backend (on the fake NVS
+ * of shim/host_shim.c, through nvs_stats), the file backend (in a temporary directory)
+ * and the RAM backend, for both the list and the paged layout, then times the basic
+ * operations on each of them.
+ *
+ * Build and run from the repository root:
+ *   gcc -O2 -Wall -pthread -fsanitize=address -Itools/tabledb_host/shim -Icomponents/tabledb/include \
+ *       -Icomponents/nvs_stats/include tools/tabledb_host/tabledb_test.c tools/tabledb_host/shim/host_shim.c \
+ *       components/tabledb/tabledb.c components/tabledb/tabledb_backend_nvs.c \
+ *       components/tabledb/tabledb_backend_file.c components/tabledb/tabledb_backend_ram.c \
+ *       components/nvs_stats/nvs_stats.c -o tabledb_test
+ *   ASAN_OPTIONS=detect_leaks=0 ./tabledb_test    # tests and benchmark, exit 1 on failure
+ *   ./tabledb_test -t                              # tests only
+ *   ./tabledb_test -b -n 2000                      # benchmark only, 2000 records
+ *
+ * tabledb has no deinit, so every table opened here stays allocated until exit.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "host_nvs.h"
+#include "tabledb.h"
+
+typedef struct {
+    uint32_t id;
+    char     name[24];
+    uint16_t used_count;
+    uint32_t last_usage_time;
+} record_t;
+
+typedef struct {
+    const char              *name;
+    char                     tag; // Namespace suffix
+    const tabledb_backend_t *backend;
+    const void              *arg;
+    bool                     faults; // Writes can be made to fail (fake NVS only)
+} backend_case_t;
+
+static char           g_dir[] = "/tmp/tabledb_test_XXXXXX";
+static backend_case_t g_backends[] = {
+    {"nvs", 'n', &tabledb_backend_nvs, NULL, true},
+    {"file", 'f', &tabledb_backend_file, g_dir, false},
+    {"ram", 'r', &tabledb_backend_ram, NULL, false},
+};
+
+static const backend_case_t *g_backend;
+static tabledb_layout_t      g_layout;
+static int                   g_failures = 0;
+
+#define CHECK(cond)                                                                                \
+    do {                                                                                           \
+        if (!(cond)) {                                                                             \
+            printf("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);                               \
+            g_failures++;                                                                          \
+        }                                                                                          \
+    } while (0)
+
+#define CHECK_OK(expr) CHECK((expr) == ESP_OK)
+
+/************ Helpers ************/
+
+static uint32_t record_key(const void *data) {
+    const record_t *record = data;
+    return tabledb_hash_str(record->name, sizeof(record->name));
+}
+
+typedef struct {
+    bool                   cached;
+    bool                   keyed;
+    tabledb_cache_config_t cache;
+} table_options_t;
+
+// Open name for the current backend and layout. Opening the same name again gives a
+// second view of the stored data.
+static tabledb_config_t *table_open(const char *name, const table_options_t *options) {
+    char *ns = malloc(NVS_KEY_NAME_MAX_SIZE);
+    snprintf(ns, NVS_KEY_NAME_MAX_SIZE, "%s_%c%c", name, g_backend->tag,
+             g_layout == TABLEDB_LAYOUT_PAGED ? 'p' : 'l');
+
+    tabledb_config_t init = {
+        .size        = sizeof(record_t),
+        .namespace   = ns,
+        .version     = 1,
+        .layout      = g_layout,
+        .backend     = g_backend->backend,
+        .backend_arg = g_backend->arg,
+    };
+    if (options != NULL && options->cached) {
+        init.cache = options->cache;
+    }
+    if (options != NULL && options->keyed) {
+        init.key_cb = record_key;
+    }
+    tabledb_config_t *config = malloc(sizeof(tabledb_config_t));
+    memcpy(config, &init, sizeof(tabledb_config_t));
+
+    esp_err_t err = tabledb_init(config);
+    if (err != ESP_OK) {
+        printf("  tabledb_init(%s) failed: %s\n", ns, esp_err_to_name(err));
+        g_failures++;
+        free(config);
+        return NULL;
+    }
+    return config;
+}
+
+static record_t make_record(uint32_t id, const char *name) {
+    record_t record = {.id = id};
+    snprintf(record.name, sizeof(record.name), "%s", name);
+    return record;
+}
+
+static esp_err_t insert_range(tabledb_config_t *config, uint32_t first, uint32_t last) {
+    for (uint32_t id = first; id <= last; id++) {
+        char name[16];
+        snprintf(name, sizeof(name), "user%" PRIu32, id);
+        record_t  record = make_record(id, name);
+        esp_err_t err    = tabledb_insert(config, id, &record);
+        if (err != ESP_OK) {
+            return err;
+        }
+    }
+    return ESP_OK;
+}
+
+static size_t table_count(tabledb_config_t *config) {
+    size_t count = 0;
+    CHECK_OK(tabledb_get_count(config, &count));
+    return count;
+}
+
+// Every record in the index must be readable, each ID exactly once.
+static bool table_consistent(tabledb_config_t *config) {
+    record_t record;
+    uint32_t id    = 0;
+    size_t   count = 0;
+    while (tabledb_get_next(config, id, &id, &record) == ESP_OK) {
+        if (record.id != id) {
+            return false;
+        }
+        count++;
+    }
+    return count == table_count(config);
+}
+
+static void bump_usage(void *data, void *arg) {
+    record_t *record = data;
+    record->used_count++;
+    record->last_usage_time = *(uint32_t *) arg;
+}
+
+/************ Tests ************/
+
+static void test_crud(void) {
+    tabledb_config_t *config = table_open("crud", NULL);
+    if (config == NULL) {
+        return;
+    }
+    record_t record = make_record(1, "again");
+
+    CHECK(table_count(config) == 0);
+    CHECK_OK(insert_range(config, 1, 50));
+    CHECK(table_count(config) == 50);
+    CHECK(tabledb_insert(config, 7, &record) != ESP_OK);
+    CHECK(tabledb_get(config, 999, &record) == ESP_ERR_NVS_NOT_FOUND);
+
+    for (uint32_t id = 1; id <= 50; id++) {
+        char name[16];
+        snprintf(name, sizeof(name), "user%" PRIu32, id);
+        CHECK_OK(tabledb_get(config, id, &record));
+        CHECK(record.id == id && strcmp(record.name, name) == 0);
+    }
+
+    record = make_record(10, "renamed");
+    CHECK_OK(tabledb_update(config, 10, &record));
+    CHECK(tabledb_update(config, 999, &record) == ESP_ERR_NVS_NOT_FOUND);
+    for (uint32_t id = 1; id <= 50; id += 2) {
+        CHECK_OK(tabledb_delete(config, id));
+    }
+    CHECK(tabledb_delete(config, 1) == ESP_ERR_NVS_NOT_FOUND);
+    CHECK(table_count(config) == 25);
+    CHECK(tabledb_get(config, 1, &record) == ESP_ERR_NVS_NOT_FOUND);
+
+    // Iteration visits the remaining (even) records once each
+    uint64_t seen = 0;
+    uint32_t id   = 0;
+    while (tabledb_get_next(config, id, &id, &record) == ESP_OK) {
+        CHECK(id % 2 == 0 && !(seen & (1ULL << id)));
+        seen |= 1ULL << id;
+    }
+    CHECK(__builtin_popcountll(seen) == 25);
+
+    // A second open sees the committed state
+    tabledb_config_t *reopened = table_open("crud", NULL);
+    if (reopened != NULL) {
+        CHECK(table_count(reopened) == 25);
+        CHECK_OK(tabledb_get(reopened, 10, &record));
+        CHECK(strcmp(record.name, "renamed") == 0);
+        CHECK(table_consistent(reopened));
+    }
+
+    CHECK_OK(tabledb_drop(config));
+    CHECK(table_count(config) == 0);
+}
+
+static void test_txn(void) {
+    tabledb_config_t *config = table_open("txn", NULL);
+    if (config == NULL) {
+        return;
+    }
+    record_t record;
+
+    CHECK_OK(tabledb_txn_begin(config));
+    CHECK(tabledb_txn_begin(config) == ESP_ERR_INVALID_STATE);
+    CHECK_OK(insert_range(config, 1, 20));
+    CHECK(table_count(config) == 20);
+    CHECK_OK(tabledb_get(config, 3, &record));
+    CHECK_OK(tabledb_txn_abort(config));
+    CHECK(table_count(config) == 0);
+    CHECK(tabledb_get(config, 3, &record) == ESP_ERR_NVS_NOT_FOUND);
+
+    CHECK_OK(tabledb_txn_begin(config));
+    CHECK_OK(insert_range(config, 1, 20));
+    record = make_record(5, "staged");
+    CHECK_OK(tabledb_update(config, 5, &record));
+    CHECK_OK(tabledb_delete(config, 6));
+    CHECK_OK(tabledb_txn_commit(config));
+    CHECK(tabledb_txn_commit(config) == ESP_ERR_INVALID_STATE);
+    CHECK(table_count(config) == 19);
+    CHECK_OK(tabledb_get(config, 5, &record));
+    CHECK(strcmp(record.name, "staged") == 0);
+    CHECK(tabledb_get(config, 6, &record) == ESP_ERR_NVS_NOT_FOUND);
+
+    tabledb_config_t *reopened = table_open("txn", NULL);
+    if (reopened != NULL) {
+        CHECK(table_count(reopened) == 19);
+        CHECK(table_consistent(reopened));
+    }
+
+    if (g_backend->faults) {
+        // A commit failing halfway leaves the index matching what reached storage
+        CHECK_OK(tabledb_txn_begin(config));
+        CHECK_OK(insert_range(config, 21, 30));
+        host_nvs_fail_after(4);
+        CHECK(tabledb_txn_commit(config) != ESP_OK);
+        host_nvs_fail_after(-1);
+        CHECK(table_consistent(config));
+        reopened = table_open("txn", NULL);
+        if (reopened != NULL) {
+            CHECK(table_count(reopened) == table_count(config));
+            CHECK(table_consistent(reopened));
+        }
+
+        // Deleting the head, a middle and the tail record, failing at every write in turn
+        // (the last one is the commit): the stored table must still open after each.
+        tabledb_config_t *relink = table_open("relink", NULL);
+        if (relink == NULL) {
+            return;
+        }
+        CHECK_OK(insert_range(relink, 1, 40));
+        for (int fail = 1; fail <= 8; fail++) {
+            uint32_t ids[40];
+            size_t   count = 0;
+            uint32_t id    = 0;
+            while (count < 40 && tabledb_get_next(relink, id, &id, &record) == ESP_OK) {
+                ids[count++] = id;
+            }
+            CHECK(count > 3);
+            if (count <= 3) {
+                break;
+            }
+            CHECK_OK(tabledb_txn_begin(relink));
+            CHECK_OK(tabledb_delete(relink, ids[0]));
+            CHECK_OK(tabledb_delete(relink, ids[count / 2]));
+            CHECK_OK(tabledb_delete(relink, ids[count - 1]));
+            host_nvs_fail_after(fail);
+            esp_err_t err = tabledb_txn_commit(relink);
+            host_nvs_fail_after(-1);
+            CHECK(err != ESP_OK || table_count(relink) == count - 3);
+            CHECK(table_consistent(relink));
+            reopened = table_open("relink", NULL);
+            if (reopened != NULL) {
+                CHECK(table_count(reopened) == table_count(relink));
+                CHECK(table_consistent(reopened));
+            }
+        }
+    }
+}
+
+static bool even_id(uint32_t id, const void *data, void *arg) {
+    return id % 2 == 0;
+}
+
+static esp_err_t collect_id(uint32_t id, const void *data, void *arg) {
+    uint64_t *seen = arg;
+    if (*seen & (1ULL << id)) {
+        return ESP_ERR_INVALID_STATE; // Returned twice
+    }
+    *seen |= 1ULL << id;
+    return ESP_OK;
+}
+
+typedef struct {
+    uint32_t ids[64];
+    size_t   count;
+} id_list_t;
+
+static esp_err_t append_id(uint32_t id, const void *data, void *arg) {
+    id_list_t *list = arg;
+    if (list->count == sizeof(list->ids) / sizeof(list->ids[0])) {
+        return ESP_ERR_NO_MEM;
+    }
+    list->ids[list->count++] = id;
+    return ESP_OK;
+}
+
+static void test_scan(void) {
+    tabledb_config_t *config = table_open("scan", NULL);
+    if (config == NULL) {
+        return;
+    }
+    CHECK_OK(insert_range(config, 1, 30));
+
+    tabledb_cursor_t cursor;
+    record_t         record;
+    uint32_t         id;
+    size_t           count = 0;
+    CHECK_OK(tabledb_cursor_open(config, &cursor));
+    CHECK_OK(tabledb_delete(config, 30)); // Not seen by the open cursor
+    record = make_record(29, "live");
+    CHECK_OK(tabledb_update(config, 29, &record)); // Payloads are read live
+    while (tabledb_cursor_next(&cursor, &id, &record) == ESP_OK) {
+        CHECK(record.id == id);
+        CHECK(id != 29 || strcmp(record.name, "live") == 0);
+        count++;
+    }
+    tabledb_cursor_close(&cursor);
+    CHECK(count == 29);
+
+    tabledb_scan_t scan  = {.predicate = even_id, .limit = 4};
+    uint64_t       seen  = 0;
+    int            pages = 0;
+    do {
+        CHECK_OK(tabledb_scan(config, &scan, collect_id, &seen));
+        pages++;
+    } while (scan.more && pages < 100);
+    CHECK(__builtin_popcountll(seen) == 14);
+    CHECK(pages == 4);
+
+    // Deleting the last record of a page (and the one after it) does not break the
+    // next page, which starts at the next older record still there.
+    tabledb_config_t *anchor = table_open("anchor", NULL);
+    if (anchor == NULL) {
+        return;
+    }
+    CHECK_OK(insert_range(anchor, 1, 20)); // Listed newest first: 20, 19, ...
+    id_list_t list = {0};
+    scan           = (tabledb_scan_t) {.limit = 5};
+    CHECK_OK(tabledb_scan(anchor, &scan, append_id, &list));
+    CHECK(list.count == 5 && list.ids[4] == 16 && scan.more);
+    CHECK_OK(tabledb_delete(anchor, 16));
+    CHECK_OK(tabledb_delete(anchor, 15));
+    CHECK_OK(insert_range(anchor, 21, 21)); // Newer than the position, not returned
+    CHECK_OK(tabledb_scan(anchor, &scan, append_id, &list));
+    CHECK(list.count == 10 && list.ids[5] == 14);
+    while (scan.more && list.count < 64) {
+        CHECK_OK(tabledb_scan(anchor, &scan, append_id, &list));
+    }
+    CHECK(list.count == 19);
+    for (size_t i = 1; i < list.count; i++) {
+        CHECK(list.ids[i] < list.ids[i - 1]);
+    }
+}
+
+static void test_keys(void) {
+    table_options_t   options = {.keyed = true};
+    tabledb_config_t *config  = table_open("keys", &options);
+    if (config == NULL) {
+        return;
+    }
+    for (uint32_t id = 1; id <= 20; id++) {
+        char name[16];
+        snprintf(name, sizeof(name), "name%" PRIu32, id % 5);
+        record_t record = make_record(id, name);
+        CHECK_OK(tabledb_insert(config, id, &record));
+    }
+
+    uint32_t ids[8];
+    size_t   count;
+    uint32_t key = tabledb_hash_str("name3", 24);
+    CHECK_OK(tabledb_find_by_key(config, key, ids, 8, &count));
+    CHECK(count == 4);
+
+    record_t record = make_record(3, "other");
+    CHECK_OK(tabledb_update(config, 3, &record));
+    CHECK_OK(tabledb_find_by_key(config, key, ids, 8, &count));
+    CHECK(count == 3);
+
+    CHECK_OK(tabledb_txn_begin(config));
+    record = make_record(21, "name3");
+    CHECK_OK(tabledb_insert(config, 21, &record));
+    CHECK_OK(tabledb_delete(config, 8));
+    CHECK_OK(tabledb_find_by_key(config, key, ids, 8, &count));
+    CHECK(count == 3);
+    CHECK_OK(tabledb_txn_commit(config));
+    CHECK_OK(tabledb_find_by_key(config, key, ids, 8, &count));
+    CHECK(count == 3);
+    CHECK_OK(tabledb_find_by_key(config, tabledb_hash_str("nobody", 24), ids, 8, &count));
+    CHECK(count == 0);
+}
+
+typedef struct {
+    int      changes[4];
+    uint32_t last_generation;
+    bool     generation_decreased;
+} change_log_t;
+
+static void on_change(tabledb_config_t *config, const tabledb_change_t *change, void *arg) {
+    change_log_t *log = arg;
+    log->changes[change->op]++;
+    if (change->generation < log->last_generation) {
+        log->generation_decreased = true;
+    }
+    log->last_generation = change->generation;
+}
+
+static void test_subscribe(void) {
+    tabledb_config_t *config = table_open("sub", NULL);
+    if (config == NULL) {
+        return;
+    }
+    change_log_t log = {0};
+    CHECK_OK(tabledb_subscribe(config, on_change, &log));
+
+    record_t record = make_record(1, "a");
+    CHECK_OK(tabledb_insert(config, 1, &record));
+    CHECK_OK(tabledb_update(config, 1, &record));
+    CHECK_OK(tabledb_delete(config, 1));
+    CHECK(log.changes[TABLEDB_CHANGE_INSERT] == 1 && log.changes[TABLEDB_CHANGE_UPDATE] == 1 &&
+          log.changes[TABLEDB_CHANGE_DELETE] == 1);
+
+    // A transaction reports its records once committed, under one generation
+    uint32_t before = tabledb_get_generation(config);
+    CHECK_OK(tabledb_txn_begin(config));
+    CHECK_OK(insert_range(config, 1, 3));
+    CHECK(log.changes[TABLEDB_CHANGE_INSERT] == 1);
+    CHECK_OK(tabledb_txn_commit(config));
+    CHECK(log.changes[TABLEDB_CHANGE_INSERT] == 4);
+    CHECK(tabledb_get_generation(config) == before + 1);
+
+    CHECK_OK(tabledb_drop(config));
+    CHECK(log.changes[TABLEDB_CHANGE_DROP] == 1);
+    CHECK(!log.generation_decreased);
+    CHECK_OK(tabledb_unsubscribe(config, on_change, &log));
+}
+
+// Stored (flushed) view of a record through a fresh, uncached open
+static record_t stored_record(const char *name, uint32_t id) {
+    record_t          record = {0};
+    tabledb_config_t *config = table_open(name, NULL);
+    if (config != NULL) {
+        CHECK_OK(tabledb_get(config, id, &record));
+    }
+    return record;
+}
+
+static void test_deferred(void) {
+    // Timers long enough that only tabledb_flush() writes
+    table_options_t   options = {.cached = true, .cache = {.flush_interval_ms = 3600000, .max_dirty = 16}};
+    tabledb_config_t *config  = table_open("defer", &options);
+    if (config == NULL) {
+        return;
+    }
+    record_t            record;
+    uint32_t            now = 1000;
+    host_nvs_counters_t before, after;
+
+    CHECK_OK(insert_range(config, 1, 5));
+
+    // Deferred updates are visible at once and reach storage on flush only
+    host_nvs_get_counters(&before);
+    for (int i = 0; i < 3; i++) {
+        CHECK_OK(tabledb_update_deferred_fn(config, 1, bump_usage, &now));
+    }
+    host_nvs_get_counters(&after);
+    CHECK(after.sets == before.sets && after.commits == before.commits);
+    CHECK_OK(tabledb_get(config, 1, &record));
+    CHECK(record.used_count == 3 && record.last_usage_time == now);
+    CHECK(stored_record("defer", 1).used_count == 0);
+    CHECK_OK(tabledb_flush(config));
+    CHECK(stored_record("defer", 1).used_count == 3);
+    CHECK(tabledb_update_deferred_fn(config, 999, bump_usage, &now) == ESP_ERR_NVS_NOT_FOUND);
+
+    // Replacing a missing record caches nothing and tells no one
+    uint32_t generation = tabledb_get_generation(config);
+    record              = make_record(999, "ghost");
+    CHECK(tabledb_update_deferred(config, 999, &record) == ESP_ERR_NVS_NOT_FOUND);
+    CHECK(tabledb_get_generation(config) == generation);
+    CHECK(tabledb_get(config, 999, &record) == ESP_ERR_NVS_NOT_FOUND);
+    CHECK_OK(tabledb_delete(config, 5));
+    record = make_record(5, "ghost");
+    CHECK(tabledb_update_deferred(config, 5, &record) == ESP_ERR_NVS_NOT_FOUND);
+    CHECK_OK(tabledb_flush(config));
+    CHECK(table_count(config) == 4 && tabledb_get(config, 5, &record) == ESP_ERR_NVS_NOT_FOUND);
+    CHECK_OK(tabledb_txn_begin(config));
+    record = make_record(6, "staged");
+    CHECK_OK(tabledb_insert(config, 6, &record));
+    CHECK_OK(tabledb_update_deferred(config, 6, &record)); // Exists in the open transaction
+    CHECK_OK(tabledb_delete(config, 4));
+    CHECK(tabledb_update_deferred(config, 4, &record) == ESP_ERR_NVS_NOT_FOUND);
+    CHECK_OK(tabledb_txn_abort(config));
+    CHECK_OK(insert_range(config, 5, 5));
+    record = make_record(1, "replaced");
+    CHECK_OK(tabledb_update_deferred(config, 1, &record)); // Clean, checked under the table lock
+    CHECK_OK(tabledb_update_deferred(config, 1, &record)); // Dirty now, cache lock only
+    CHECK_OK(tabledb_get(config, 1, &record));
+    CHECK(strcmp(record.name, "replaced") == 0);
+
+    // The mutation applies to the current record, so direct edits are kept
+    record = make_record(5, "edited");
+    CHECK_OK(tabledb_update(config, 5, &record));
+    CHECK_OK(tabledb_update_deferred_fn(config, 5, bump_usage, &now));
+    CHECK_OK(tabledb_get(config, 5, &record));
+    CHECK(strcmp(record.name, "edited") == 0 && record.used_count == 1);
+
+    // An aborted transaction leaves a pending deferred update in place
+    CHECK_OK(tabledb_update_deferred_fn(config, 2, bump_usage, &now));
+    CHECK_OK(tabledb_txn_begin(config));
+    record = make_record(2, "direct");
+    CHECK_OK(tabledb_update(config, 2, &record));
+    CHECK_OK(tabledb_get(config, 2, &record));
+    CHECK(strcmp(record.name, "direct") == 0);
+    CHECK_OK(tabledb_txn_abort(config));
+    CHECK_OK(tabledb_get(config, 2, &record));
+    CHECK(strcmp(record.name, "user2") == 0 && record.used_count == 1);
+
+    // A committed direct update supersedes it
+    CHECK_OK(tabledb_update_deferred_fn(config, 3, bump_usage, &now));
+    CHECK_OK(tabledb_txn_begin(config));
+    record = make_record(3, "direct");
+    CHECK_OK(tabledb_update(config, 3, &record));
+    CHECK_OK(tabledb_txn_commit(config));
+    CHECK_OK(tabledb_flush(config));
+    record = stored_record("defer", 3);
+    CHECK(strcmp(record.name, "direct") == 0 && record.used_count == 0);
+    CHECK(stored_record("defer", 2).used_count == 1);
+
+    if (g_backend->faults) {
+        // A failed direct write does not drop the deferred update either
+        CHECK_OK(tabledb_update_deferred_fn(config, 4, bump_usage, &now));
+        record = make_record(4, "lost");
+        host_nvs_fail_after(1);
+        CHECK(tabledb_update(config, 4, &record) != ESP_OK);
+        host_nvs_fail_after(-1);
+        CHECK_OK(tabledb_get(config, 4, &record));
+        CHECK(strcmp(record.name, "user4") == 0 && record.used_count == 1);
+
+        // Nor does a failed flush
+        host_nvs_fail_after(1);
+        CHECK(tabledb_flush(config) != ESP_OK);
+        host_nvs_fail_after(-1);
+        CHECK_OK(tabledb_flush(config));
+        CHECK(stored_record("defer", 4).used_count == 1);
+    }
+
+    // A record deleted before the flush is skipped
+    CHECK_OK(tabledb_update_deferred_fn(config, 1, bump_usage, &now));
+    CHECK_OK(tabledb_delete(config, 1));
+    CHECK_OK(tabledb_flush(config));
+    CHECK(tabledb_get(config, 1, &record) == ESP_ERR_NVS_NOT_FOUND);
+    CHECK(table_consistent(config));
+}
+
+// Many updates of a few records; the file backend compacts its log on commit.
+static void test_compact(void) {
+    tabledb_config_t *config = table_open("compact", NULL);
+    if (config == NULL) {
+        return;
+    }
+    record_t record;
+    CHECK_OK(insert_range(config, 1, 10));
+    for (uint16_t i = 0; i < 500; i++) {
+        uint32_t id = 1 + i % 10;
+        CHECK_OK(tabledb_get(config, id, &record));
+        record.used_count++;
+        CHECK_OK(tabledb_update(config, id, &record));
+    }
+
+    tabledb_config_t *reopened = table_open("compact", NULL);
+    if (reopened != NULL) {
+        for (uint32_t id = 1; id <= 10; id++) {
+            CHECK_OK(tabledb_get(reopened, id, &record));
+            CHECK(record.id == id && record.used_count == 50);
+        }
+        CHECK(table_consistent(reopened));
+    }
+
+    if (g_backend->backend == &tabledb_backend_file) {
+        // Without compaction the log would hold all 500 updates
+        char        path[96];
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s.tdb", g_dir, config->namespace);
+        CHECK(stat(path, &st) == 0 && st.st_size < 500 * (off_t) sizeof(record_t));
+    }
+}
+
+typedef struct {
+    const char *name;
+    void (*fn)(void);
+    bool list_only; // Needs one of the few write-behind cache slots
+} test_case_t;
+
+static const test_case_t g_cases[] = {
+    {"crud", test_crud, false},
+    {"txn", test_txn, false},
+    {"scan", test_scan, false},
+    {"keys", test_keys, false},
+    {"subscribe", test_subscribe, false},
+    {"deferred", test_deferred, true},
+    {"compact", test_compact, false},
+};
+
+static void run_tests(void) {
+    for (size_t b = 0; b < sizeof(g_backends) / sizeof(g_backends[0]); b++) {
+        for (int layout = TABLEDB_LAYOUT_LIST; layout <= TABLEDB_LAYOUT_PAGED; layout++) {
+            g_backend = &g_backends[b];
+            g_layout  = layout;
+            for (size_t i = 0; i < sizeof(g_cases) / sizeof(g_cases[0]); i++) {
+                if (g_cases[i].list_only && layout != TABLEDB_LAYOUT_LIST) {
+                    continue;
+                }
+                int before = g_failures;
+                printf("%-5s %-5s %s\n", g_backend->name, layout == TABLEDB_LAYOUT_PAGED ? "paged" : "list",
+                       g_cases[i].name);
+                g_cases[i].fn();
+                if (g_failures != before) {
+                    printf("  -> failed\n");
+                }
+            }
+        }
+    }
+}
+
+/************ Benchmark ************/
+
+typedef struct {
+    int64_t             start_us;
+    host_nvs_counters_t nvs;
+} bench_mark_t;
+
+static void bench_start(bench_mark_t *mark) {
+    host_nvs_get_counters(&mark->nvs);
+    mark->start_us = esp_timer_get_time();
+}
+
+static void bench_report(const char *op, const bench_mark_t *mark, size_t ops) {
+    int64_t             us = esp_timer_get_time() - mark->start_us;
+    host_nvs_counters_t nvs;
+    host_nvs_get_counters(&nvs);
+    printf("%-5s %-5s %-11s %9.2f us/op", g_backend->name, g_layout == TABLEDB_LAYOUT_PAGED ? "paged" : "list",
+           op, (double) us / ops);
+    if (g_backend->backend == &tabledb_backend_nvs) {
+        printf("  %6.2f sets %5.2f commits per op", (double) (nvs.sets - mark->nvs.sets) / ops,
+               (double) (nvs.commits - mark->nvs.commits) / ops);
+    }
+    printf("\n");
+}
+
+static void run_benchmark(uint32_t count) {
+    for (size_t b = 0; b < sizeof(g_backends) / sizeof(g_backends[0]); b++) {
+        for (int layout = TABLEDB_LAYOUT_LIST; layout <= TABLEDB_LAYOUT_PAGED; layout++) {
+            g_backend = &g_backends[b];
+            g_layout  = layout;
+            tabledb_config_t *config = table_open("bench", NULL);
+            tabledb_config_t *txn    = table_open("benchtx", NULL);
+            if (config == NULL || txn == NULL) {
+                continue;
+            }
+            bench_mark_t mark;
+            record_t     record;
+            uint32_t     id;
+
+            bench_start(&mark);
+            CHECK_OK(insert_range(config, 1, count));
+            bench_report("insert", &mark, count);
+
+            bench_start(&mark);
+            CHECK_OK(tabledb_txn_begin(txn));
+            CHECK_OK(insert_range(txn, 1, count));
+            CHECK_OK(tabledb_txn_commit(txn));
+            bench_report("txn insert", &mark, count);
+
+            srand(1);
+            bench_start(&mark);
+            for (uint32_t i = 0; i < count; i++) {
+                CHECK_OK(tabledb_get(config, 1 + rand() % count, &record));
+            }
+            bench_report("get", &mark, count);
+
+            bench_start(&mark);
+            for (uint32_t i = 0; i < count; i++) {
+                id = 1 + rand() % count;
+                CHECK_OK(tabledb_get(config, id, &record));
+                record.used_count++;
+                CHECK_OK(tabledb_update(config, id, &record));
+            }
+            bench_report("update", &mark, count);
+
+            bench_start(&mark);
+            id = 0;
+            while (tabledb_get_next(config, id, &id, &record) == ESP_OK) {
+            }
+            bench_report("iterate", &mark, count);
+
+            bench_start(&mark);
+            for (uint32_t i = 1; i <= count; i++) {
+                CHECK_OK(tabledb_delete(config, i));
+            }
+            bench_report("delete", &mark, count);
+
+            CHECK_OK(tabledb_drop(txn));
+        }
+    }
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-t | -b] [-n records] [-v]\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    bool     tests = true, bench = true;
+    uint32_t count = 500;
+    int      opt;
+    while ((opt = getopt(argc, argv, "tbn:vh")) != -1) {
+        switch (opt) {
+        case 't':
+            bench = false;
+            break;
+        case 'b':
+            tests = false;
+            break;
+        case 'n':
+            count = (uint32_t) atoi(optarg);
+            break;
+        case 'v':
+            host_log_level = 4;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (count == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (mkdtemp(g_dir) == NULL) {
+        perror("mkdtemp");
+        return 2;
+    }
+    if (tests) {
+        run_tests();
+        printf("\n%s\n\n", g_failures ? "FAIL" : "PASS");
+    }
+    if (bench) {
+        run_benchmark(count);
+    }
+    return g_failures ? 1 : 0;
+}